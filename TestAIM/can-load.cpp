@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "csv-to-arduino.h"
+#include "serial-link.h"
+#include "can-synth.h"
+#include "output_frame.h"
+#include "link_stats.h"
+
+// synthetic CAN load for car_end: every adapter (a canWrite.ino) gets its own thread
+// that puts the frames of the shared signal table on its bus at a set rate, with
+// jitter and bursts on top. with -d the consoles of the cars under test are read too:
+// car_end's stats frames (link_stats.h) count the frames it read and the ones its TWAI
+// RX queue had no room for, and whatever it didn't read between the first frame and
+// the last is counted as dropped.
+
+#define DUT_BAUD 115200                 // car_end's Serial.begin
+
+struct load_config {
+    double rate;                        // frames/s per device
+    double jitter;                      // 0..1, fraction of the frame gap added or taken off
+    int burst_frames;                   // extra frames sent back to back ...
+    int burst_period_ms;                // ... this often (0 = no bursts)
+    double duration_s;
+    int baud;
+};
+
+struct device {
+    const char *port;
+    serial_link link;
+    std::thread thread;
+    uint64_t frames;                    // frames handed to the adapter
+    double secs;
+    int ok;
+};
+
+struct dut {
+    const char *port;
+    int fd;
+    std::thread thread;
+    std::atomic<bool> have;             // a stats frame came in, first is set
+    uint32_t first[CS_COUNTERS];        // counters never reset, so the run is last - first
+    uint32_t last[CS_COUNTERS];
+    std::atomic<uint64_t> frames;       // CS_CAN_FRAMES during the run
+    std::atomic<uint64_t> missed;       // CS_TWAI_MISSED during the run
+};
+
+static std::atomic<bool> stop_duts(false);
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t due_us)
+{
+    struct timespec ts;
+    ts.tv_sec = due_us / 1000000;
+    ts.tv_nsec = (due_us % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+// adapter thread: frames at cfg->rate with jitter, plus a burst every burst_period_ms
+static void device_main(device *d, int index, const load_config *cfg, const can_id_map *map)
+{
+    std::mt19937 rng(index + 1);
+    std::uniform_real_distribution<double> jitter(-cfg->jitter, cfg->jitter);
+    double gap_us = 1e6 / cfg->rate;
+
+    unsigned char batch[LINK_HDR_LEN + BATCH_MAX_FRAMES * FRAME_LEN];
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)(cfg->duration_s * 1e6);
+    double next_us = start;
+    uint64_t next_burst = start + (uint64_t)cfg->burst_period_ms * 1000;
+    uint64_t n = 0;
+
+    while(now_us() < end)
+    {
+        sleep_until_us((uint64_t)next_us);
+        uint64_t now = now_us();
+
+        // everything due goes out in one batch
+        int count = 0;
+        while(count < BATCH_MAX_FRAMES && next_us <= now)
+        {
+            build_frame(map, n % map->num_ids, n / map->num_ids, batch + LINK_HDR_LEN + count * FRAME_LEN);
+            count++;
+            n++;
+            next_us += gap_us * (1.0 + jitter(rng));
+        }
+        if(cfg->burst_period_ms && now >= next_burst)
+        {
+            for(int b = 0; b < cfg->burst_frames && count < BATCH_MAX_FRAMES; b++)
+            {
+                build_frame(map, n % map->num_ids, n / map->num_ids, batch + LINK_HDR_LEN + count * FRAME_LEN);
+                count++;
+                n++;
+            }
+            next_burst += (uint64_t)cfg->burst_period_ms * 1000;
+        }
+        if(count == 0)
+            continue;
+
+        batch[0] = BATCH_MAGIC;
+        batch[1] = count;
+        if(link_send(&d->link, batch, LINK_HDR_LEN + count * FRAME_LEN) < 0)
+        {
+            d->ok = 0;
+            break;
+        }
+        d->frames += count;
+    }
+    link_drain(&d->link);
+    d->secs = (now_us() - start) / 1e6;
+}
+
+static void dut_frame(dut *d, const out_stats *s)
+{
+    if(s->source != STATS_SRC_CAR || s->count < CS_COUNTERS)
+        return;
+    if(!d->have)
+        memcpy(d->first, s->v, sizeof(d->first));
+    memcpy(d->last, s->v, sizeof(d->last));
+    // uint32 differences, so a counter that wrapped during the run still comes out right
+    d->frames = (uint32_t)(d->last[CS_CAN_FRAMES] - d->first[CS_CAN_FRAMES]);
+    d->missed = (uint32_t)(d->last[CS_TWAI_MISSED] - d->first[CS_TWAI_MISSED]);
+    d->have = true;
+}
+
+// console of a car under test: the counters out of its stats frames
+static void dut_main(dut *d)
+{
+    unsigned char buf[BUFFER_SIZE];
+    unsigned char frame[OUT_MAX_FRAME_LEN];
+    int frame_len = 0;
+    struct pollfd p = { d->fd, POLLIN, 0 };
+
+    while(!stop_duts)
+    {
+        if(poll(&p, 1, 200) <= 0)
+            continue;
+        ssize_t n = read(d->fd, buf, sizeof(buf));
+        if(n <= 0)
+            break;
+        for(ssize_t i = 0; i < n; i++)
+        {
+            if(buf[i] != 0)
+            {
+                // boot text and LOG_EVENTS lines end up in here too and just don't decode
+                if(frame_len < OUT_MAX_FRAME_LEN)
+                    frame[frame_len] = buf[i];
+                frame_len++;
+                continue;
+            }
+            unsigned char raw[OUT_MAX_RAW_LEN];
+            out_stats s;
+            int len = frame_len <= OUT_MAX_FRAME_LEN ? cobs_decode(frame, frame_len, raw, sizeof(raw)) : -1;
+            if(len > 0 && parse_stats_record(raw, len, &s))
+                dut_frame(d, &s);
+            frame_len = 0;
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-r rate] [-j jitter] [-B frames -P period_ms] [-t seconds] [-b baud] [-d dut_port]... port...\n", prog);
+    fprintf(stderr, "  -r rate     frames/s per adapter (default 1000)\n");
+    fprintf(stderr, "  -j jitter   random change of every frame gap, 0..1 of the gap (default 0)\n");
+    fprintf(stderr, "  -B frames   extra frames per burst\n");
+    fprintf(stderr, "  -P ms       time between bursts (default 0, no bursts)\n");
+    fprintf(stderr, "  -t seconds  how long to run (default 10)\n");
+    fprintf(stderr, "  -b baud     adapter baud rate (default %d)\n", BAUD);
+    fprintf(stderr, "  -d port     console of a car under test, in the same order as the adapters\n");
+}
+
+int main(int argc, char* argv[])
+{
+    load_config cfg = { 1000, 0, 0, 0, 10, BAUD };
+    std::vector<const char *> dut_ports;
+    int opt;
+    while((opt = getopt(argc, argv, "r:j:B:P:t:b:d:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'j': cfg.jitter = atof(optarg); break;
+        case 'B': cfg.burst_frames = atoi(optarg); break;
+        case 'P': cfg.burst_period_ms = atoi(optarg); break;
+        case 't': cfg.duration_s = atof(optarg); break;
+        case 'b': cfg.baud = atoi(optarg); break;
+        case 'd': dut_ports.push_back(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(optind >= argc || cfg.rate <= 0 || cfg.jitter < 0 || cfg.jitter >= 1 || cfg.duration_s <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    can_id_map map;
+    build_id_map(&map);
+
+    std::vector<device> devices(argc - optind);
+    std::vector<dut> duts(dut_ports.size());
+    for(size_t i = 0; i < devices.size(); i++)
+    {
+        device &d = devices[i];
+        d.port = argv[optind + i];
+        d.frames = 0;
+        d.secs = 0;
+        d.ok = 1;
+        int fd = serial_open(d.port, cfg.baud);
+        if(fd == -1)
+            return -1;
+        link_start(&d.link, fd, FLOW_WINDOW);
+    }
+    for(size_t i = 0; i < duts.size(); i++)
+    {
+        dut &d = duts[i];
+        d.port = dut_ports[i];
+        d.have = false;
+        d.frames = 0;
+        d.missed = 0;
+        d.fd = serial_open(d.port, DUT_BAUD);
+        if(d.fd == -1)
+            return -1;
+        d.thread = std::thread(dut_main, &d);
+    }
+
+    // the counters have to be read once before the load starts, a few stats periods at most
+    for(int t = 0; t < 3 * STATS_INTERVAL_MS / 100; t++)
+    {
+        bool all = true;
+        for(dut &d : duts)
+            all &= d.have;
+        if(all)
+            break;
+        usleep(100000);
+    }
+
+    printf("%zu adapters at %.0f frames/s over %d CAN ids for %.0f s\n", devices.size(), cfg.rate, map.num_ids, cfg.duration_s);
+    for(size_t i = 0; i < devices.size(); i++)
+        devices[i].thread = std::thread(device_main, &devices[i], (int)i, &cfg, &map);
+    for(device &d : devices)
+        d.thread.join();
+
+    // the cars' next stats frames have the last of the frames in them
+    usleep((STATS_INTERVAL_MS + 1000) * 1000);
+    stop_duts = true;
+    for(dut &d : duts)
+        d.thread.join();
+
+    uint64_t total = 0;
+    for(size_t i = 0; i < devices.size(); i++)
+    {
+        device &d = devices[i];
+        total += d.frames;
+        printf("%s: %llu frames in %.1f s (%.0f frames/s), %llu batches lost, %llu bad%s\n", d.port,
+               (unsigned long long)d.frames, d.secs, d.frames / (d.secs > 0 ? d.secs : 1),
+               (unsigned long long)d.link.lost, (unsigned long long)d.link.bad, d.ok ? "" : ", port failed");
+        link_stop(&d.link);
+    }
+
+    // with one car per adapter the drops can be matched up, otherwise only the totals
+    uint64_t seen = 0;
+    for(size_t i = 0; i < duts.size(); i++)
+    {
+        dut &d = duts[i];
+        close(d.fd);
+        if(!d.have)
+        {
+            printf("%s: no stats frames\n", d.port);
+            continue;
+        }
+        seen += d.frames;
+        if(duts.size() == devices.size())
+        {
+            long long dropped = (long long)devices[i].frames - (long long)d.frames;
+            printf("%s: read %llu frames, dropped %lld (%llu by the TWAI RX queue)\n", d.port,
+                   (unsigned long long)d.frames, dropped, (unsigned long long)d.missed);
+        }
+    }
+    if(!duts.empty() && duts.size() != devices.size())
+        printf("cars read %llu of %llu frames, dropped %lld\n", (unsigned long long)seen, (unsigned long long)total, (long long)total - (long long)seen);
+    return 0;
+}
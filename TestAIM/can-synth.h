@@ -0,0 +1,74 @@
+#ifndef __CAN_SYNTH_H__
+#define __CAN_SYNTH_H__
+#include <stdint.h>
+#include <string.h>
+#include "csv-to-arduino.h"
+#include "signal_table.h"
+
+// synthetic CAN frames built from the car firmware's signal table (main_code/signal_table.h)
+// in the canWrite.ino layout, shared by canload and hilbench
+
+#define MAX_IDS 16
+
+// the CAN ids of the signal table, in order
+struct can_id_map {
+    int num_ids;
+    uint16_t ids[MAX_IDS];
+};
+
+static inline void build_id_map(can_id_map *map)
+{
+    map->num_ids = 0;
+    for(int i = 0; i < NUM_SIGNALS; i++)
+    {
+        if(map->num_ids == 0 || map->ids[map->num_ids - 1] != SIGNALS[i].can_id)
+            map->ids[map->num_ids++] = SIGNALS[i].can_id;
+    }
+}
+
+// a value that keeps changing but stays inside the channel's alarm limits
+static inline uint16_t synth_value(int ch, uint64_t n)
+{
+    const channel_policy &p = CHANNEL_POLICY[ch];
+    uint32_t span = (uint32_t)p.alarm_hi - p.alarm_lo + 1;
+    return (uint16_t)(p.alarm_lo + (n * (ch + 1)) % span);
+}
+
+// put v into channel ch of a frame, if the frame carries it (CAN data is big-endian like car_end reads it)
+// returns 0 if it doesn't
+static inline int set_channel(unsigned char *frame, int ch, uint16_t v)
+{
+    uint16_t id = frame[0] | (frame[1] << 8);
+    for(int i = 0; i < NUM_SIGNALS; i++)
+    {
+        const can_signal &sig = SIGNALS[i];
+        // canWrite.ino only carries data bytes 0-3
+        if(sig.can_id != id || sig.slot != ch || sig.offset + sig.width > FRAME_LEN - 2)
+            continue;
+        if(sig.width == 2)
+        {
+            frame[2 + sig.offset] = v >> 8;
+            frame[3 + sig.offset] = v & 0xFF;
+        }
+        else
+            frame[2 + sig.offset] = v & 0xFF;
+        return 1;
+    }
+    return 0;
+}
+
+// frame for can id map->ids[k] with the n-th synthetic value of every channel it carries
+static inline void build_frame(const can_id_map *map, int k, uint64_t n, unsigned char *out)
+{
+    uint16_t id = map->ids[k];
+    memset(out, 0, FRAME_LEN);
+    out[0] = id & 0xFF;
+    out[1] = id >> 8;
+    for(int i = 0; i < NUM_SIGNALS; i++)
+    {
+        if(SIGNALS[i].can_id == id)
+            set_channel(out, SIGNALS[i].slot, synth_value(SIGNALS[i].slot, n));
+    }
+}
+
+#endif
@@ -18,13 +18,21 @@
 
 //static uint32_t const CAN_ID = 0x20;
 
+// batch framing, has to match csv-to-arduino.h
+// [BATCH_MAGIC][frame count][count * 6 bytes: id low, id high, 4 data bytes]
+static uint8_t const BATCH_MAGIC = 0xB5;
+static uint8_t const BATCH_MAX_FRAMES = 32;
+static uint8_t const FRAME_LEN = 6;
+static uint8_t const CREDIT_OK = 0x06;
+static uint8_t const CREDIT_BAD = 0x15;
+
 /**************************************************************************************
  * SETUP/LOOP
  **************************************************************************************/
 
 void setup()
 {
-  Serial.begin(115200);
+  Serial.begin(921600);
   while (!Serial) { }
 
   if (!CAN.begin(CanBitRate::BR_1000k))
@@ -34,57 +42,60 @@ void setup()
   }
 }
 
-static uint32_t msg_cnt = 0;
+static uint8_t batch[2 + BATCH_MAX_FRAMES * FRAME_LEN];
+static int have = 0;          // bytes of the current batch received so far
+static int need = 2;          // bytes the current batch has in total, known once the count is in
+
+// put one frame on the bus, the transmit mailboxes fill up at full replay rate so retry for a bit
+// (nothing gets printed on failure, anything but credits on the serial link would confuse the host)
+static void send_frame(const unsigned char *frame)
+{
+  // note:
+  // being sent such that
+  // byte 0 is lower byte
+  // byte 1 is higher byte
+  uint32_t canid = (frame[1] << 8) | frame[0];
+  if (canid == 0) return;
+
+  uint8_t msg_data[8] = { frame[2], frame[3], frame[4], frame[5], 0, 0, 0, 0 };
+  CanMsg const msg(CanStandardId(canid), sizeof(msg_data), msg_data);
+  uint32_t start = micros();
+  while (CAN.write(msg) < 0)
+  {
+    if (micros() - start > 2000) return;
+  }
+}
 
 void loop()
 {
-  /* Assemble a CAN message with the format of
-   * 0xCA 0xFE 0x00 0x00 [4 byte message counter]
-   */
-    //uint8_t const msg_data[] = {0xCA,0xFE,0,0,0,0,0,0};
-    if(Serial.available() > 0)
-    {
-      // note:
-      // being sent such that 
-      // byte 0 is lower byte
-      // byte 1 is higher byte
-
-        unsigned char buffer[6];
-        int n = Serial.readBytes(buffer, 6);
-        uint32_t canid = (buffer[1] << 8) | buffer[0];
-        char buf[20];
-
-        unsigned char msg_data[8];
-        //memcpy(msg_data, buffer + 2, 4 * sizeof(unsigned char));
-        msg_data[0] = buffer[2];
-        msg_data[1] = buffer[3];
-        msg_data[2] = buffer[4];
-        msg_data[3] = buffer[5];
-        if(canid != 0)
-        {
-            CanMsg const msg(CanStandardId(canid), sizeof(msg_data), (uint8_t*)&msg_data);
-            if (int const rc = CAN.write(msg); rc < 0)
-            {
-              Serial.println("CAN.begin(...) failed.");
-              Serial.println(rc);
-                for (;;) { }
-            }
-            else{
-              sprintf(buf, "%d", *msg_data);
-              Serial.println(buf);
-            }
-            
-        }
-        
-        
-    }
-  
+  while (Serial.available() > 0)
+  {
+    uint8_t b = Serial.read();
 
-  /* Transmit the CAN message, capture and display an
-   * error core in case of failure.
-   */
-  
+    // anything before a magic byte is left over from a batch we lost track of
+    if (have == 0 && b != BATCH_MAGIC) continue;
+    batch[have++] = b;
 
-  /* Only send one message per second. */
+    if (have == 2)
+    {
+      if (b == 0 || b > BATCH_MAX_FRAMES)
+      {
+        have = 0;
+        Serial.write(CREDIT_BAD);
+        continue;
+      }
+      need = 2 + b * FRAME_LEN;
+    }
 
+    // the credit goes back once the whole batch is on the bus, that is the host's flow control
+    if (have >= 2 && have == need)
+    {
+      for (int i = 0; i < batch[1]; i++)
+      {
+        send_frame(batch + 2 + i * FRAME_LEN);
+      }
+      have = 0;
+      Serial.write(CREDIT_OK);
+    }
+  }
 }
@@ -1,143 +1,327 @@
-
 #include <stdlib.h>
 #include <stdio.h>
-#include <iostream>
 #include <string>
 #include <unistd.h>
 #include <stdint.h>
 #include <fcntl.h>
-#include <termios.h>
 #include <errno.h>
-#include <sys/ioctl.h>
-#include "serial-to-can.h"
-#include <fstream>
-#include <sstream>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "csv-to-arduino.h"
+#include "serial-link.h"
+#include <vector>
+#include <charconv>
 #include <cstdio>
 #include <cstring>
 
-char *portname = "ttyACM0";
-char oldbuf[BUFFER_SIZE] = "temp";
+/*
+    csv columns, two per CAN frame starting at 0x600
+    0 -> time
+    1 -> bms disch en
+    2 -> pack voltage
+    3 -> pack current
+    4 -> pack temp
+    5 -> state of charge
+    6 -> min cell voltage
+    7 -> bms lv ibnput
+    8 -> powertrain
+    9 -> torque feedback
+    10 -> rpm
+    11 -> flux feeback
+    12 -> inline acc
+    13 -> lat acc
+    14 ->  vert acc
+    15 -> roll rate
+    16 -> pitch rate
+    17 -> yawrate
+*/
 
-int main(int argc, char* argv[])
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// parse one number starting at p, returns where it ended (p if there was no number)
+static const char *parse_field(const char *p, const char *end, int col, uint16_t *raw, uint32_t *time_ms)
 {
-    int fd;
-    // open file descriptor in non-blocking mode
-    fd = open("/dev/ttyACM0", O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if (fd == -1)
+    if(col == 0)
     {
-        perror("open_port: Unable to open /dev/ttyACMO ");
-        return -1;
+        double t;
+        std::from_chars_result r = std::from_chars(p, end, t);
+        if(r.ec != std::errc())
+            return p;
+        *raw = t * 100 + 0.5;
+        *time_ms = t * 1000 + 0.5;
+        return r.ptr;
     }
-    printf("fd opened\n");
-
-    usleep(3500000); // arduino reboot
-    //printf("\n");
-    serialPortFlush(fd);
-    // set up control struct 
-    struct termios toptions;
-
-    // get currently set options for the tty
-    tcgetattr(fd, &toptions);
-
-    // set to 115200 baud rate
-    cfsetispeed(&toptions, BAUD);
-    cfsetospeed(&toptions, BAUD);
-    // 8 bit no parity no stop bits
-    toptions.c_cflag &= ~PARENB;
-    toptions.c_cflag &= ~CSTOPB;
-    toptions.c_cflag &= ~CSIZE;
-    toptions.c_cflag |= CS8;
-    // cannonical mode
-    toptions.c_lflag |= ICANON;
-    // commit the serial port settings
-    tcsetattr(fd, TCSANOW, &toptions);
-    /*
-        0 -> time
-        1 -> bms disch en
-        2 -> pack voltage
-        3 -> pack current 
-        4 -> pack temp
-        5 -> state of charge
-        6 -> min cell voltage
-        7 -> bms lv ibnput
-        8 -> powertrain
-        9 -> torque feedback
-        10 -> rpm 
-        11 -> flux feeback  
-        12 -> inline acc
-        13 -> lat acc
-        14 ->  vert acc
-        15 -> roll rate 
-        16 -> pitch rate 
-        17 -> yawrate  
-    */
-    
-    std::ifstream src("./data1.csv");
-    if(!src)
+    int v;
+    std::from_chars_result r = std::from_chars(p, end, v);
+    if(r.ec != std::errc())
+        return p;
+    *raw = v;
+    return r.ptr;
+}
+
+// mmap the csv and parse it straight into columns sized from the line count
+// nothing is allocated per row, a row without all CSV_COLUMNS numbers is skipped
+static int load_csv(const char *path, csv_log &log)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
     {
         perror("failed to open data file");
         return -1;
     }
-    uint16_t id = 0x600;
-    std::string line, word;
-    std::getline(src, line); // skip first 
-    while(std::getline(src, line))
+    struct stat st;
+    fstat(fd, &st);
+    log.rows = 0;
+    if(st.st_size == 0)
     {
-        int i = 0;
-        id = 0x600;
-
-        std::stringstream s(line);
-        std::string word;
-        unsigned char packet[6];
-        std::memcpy(packet, &id, 2 * sizeof(unsigned char));
-        while(getline(s, word, ',')){
-            uint16_t temp;
-            if(i == 0)
-            {
-                float tmp = std::stof(word);
-                temp = tmp * 100;
-            }
-            else
-                temp = std::stoi(word);
-            if((i%2) == 0)
-            {
-                std::memcpy(packet + 2, &temp, 2 * sizeof(unsigned char));
-                
-            }
-            else
-            {
-                std::memcpy(packet + 4, &temp, 2 * sizeof(unsigned char));
-                
-                for (int i = 0; i < 6; ++i) {
-                    printf("%x ", packet[i]);
-                }
-                int v = write(fd, packet, 6);
-                int yes = 1;
-                while(yes)
-                {
-                    int n = read(fd, oldbuf, 64);
-                    // insert terminating zero in the string 
-                    oldbuf[n] = 0;
-                    if(n != -1 && n!= 0)
-                    {
-                        std::cout << "from arduino: " << oldbuf << std::endl;
-                        yes = 0;
-                    }
-                }
-                id += 1;
-                std::cout << "i: " << i/2 << std::endl;
-                std::cout << "CAN ID: " << std::hex << id << std::endl;
-                std::memcpy(packet, &id, 2 * sizeof(unsigned char));
-                usleep(500000);
-            }
-            i++;
-            std::cout << std::endl;
+        close(fd);
+        return 0;
+    }
+    const char *data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    const char *end = data + st.st_size;
+
+    size_t lines = 1;
+    for(const char *p = data; (p = (const char *)memchr(p, '\n', end - p)) != NULL; p++)
+        lines++;
+    log.time_ms.resize(lines);
+    for(int c = 0; c < CSV_COLUMNS; c++)
+        log.cols[c].resize(lines);
+
+    // skip first
+    const char *p = (const char *)memchr(data, '\n', end - data);
+    p = p ? p + 1 : end;
+    size_t bad = 0;
+    while(p < end)
+    {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if(!eol)
+            eol = end;
+
+        size_t r = log.rows;
+        int c = 0;
+        while(c < CSV_COLUMNS)
+        {
+            while(p < eol && *p == ' ')
+                p++;
+            const char *q = parse_field(p, eol, c, &log.cols[c][r], &log.time_ms[r]);
+            if(q == p)
+                break;
+            c++;
+            p = q;
+            if(p < eol && *p == ',')
+                p++;
         }
+        if(c == CSV_COLUMNS)
+            log.rows++;
+        else if(p < eol && *p != '\r')
+            bad++;
+        p = eol + 1;
+    }
+    munmap((void *)data, st.st_size);
+
+    if(bad)
+        fprintf(stderr, "%zu malformed rows skipped\n", bad);
+    return 0;
+}
+
+// the cache is only good for the exact csv it was made from
+static int load_cache(const char *cache_path, const struct stat &src, csv_log &log)
+{
+    int fd = open(cache_path, O_RDONLY);
+    if(fd == -1)
+        return -1;
+    cache_header h;
+    int ok = read(fd, &h, sizeof(h)) == sizeof(h)
+        && h.magic == CACHE_MAGIC && h.version == CACHE_VERSION
+        && h.src_size == (uint64_t)src.st_size && h.src_mtime == (int64_t)src.st_mtime;
+    if(ok)
+    {
+        log.rows = h.rows;
+        log.time_ms.resize(h.rows);
+        ssize_t want = h.rows * sizeof(uint32_t);
+        ok = read(fd, log.time_ms.data(), want) == want;
+        for(int c = 0; ok && c < CSV_COLUMNS; c++)
+        {
+            log.cols[c].resize(h.rows);
+            want = h.rows * sizeof(uint16_t);
+            ok = read(fd, log.cols[c].data(), want) == want;
+        }
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static void save_cache(const char *cache_path, const struct stat &src, const csv_log &log)
+{
+    int fd = open(cache_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+    {
+        perror("can't write cache");
+        return;
+    }
+    cache_header h = { CACHE_MAGIC, CACHE_VERSION, log.rows, (uint64_t)src.st_size, (int64_t)src.st_mtime };
+    int ok = write(fd, &h, sizeof(h)) == sizeof(h)
+        && write(fd, log.time_ms.data(), log.rows * sizeof(uint32_t)) == (ssize_t)(log.rows * sizeof(uint32_t));
+    for(int c = 0; ok && c < CSV_COLUMNS; c++)
+        ok = write(fd, log.cols[c].data(), log.rows * sizeof(uint16_t)) == (ssize_t)(log.rows * sizeof(uint16_t));
+    close(fd);
+    if(!ok)
+    {
+        perror("can't write cache");
+        unlink(cache_path);
+    }
+}
+
+// parsed log from the cache if it is still valid, otherwise from the csv (and refresh the cache)
+static int load_log(const char *path, int use_cache, csv_log &log)
+{
+    struct stat src;
+    if(stat(path, &src) == -1)
+    {
+        perror("failed to open data file");
+        return -1;
     }
+    std::string cache_path = std::string(path) + CACHE_SUFFIX;
+    if(use_cache && load_cache(cache_path.c_str(), src, log) == 0)
+    {
+        printf("using %s\n", cache_path.c_str());
+        return 0;
+    }
+    if(load_csv(path, log) < 0)
+        return -1;
+    if(use_cache)
+        save_cache(cache_path.c_str(), src, log);
+    return 0;
+}
+
+// frame i of the replay: row i / FRAMES_PER_ROW, CAN id 0x600 + i % FRAMES_PER_ROW
+static void frame_at(const csv_log &log, size_t i, unsigned char *out)
+{
+    size_t row = i / FRAMES_PER_ROW;
+    int k = i % FRAMES_PER_ROW;
+    uint16_t id = 0x600 + k;
+    std::memcpy(out, &id, 2);
+    std::memcpy(out + 2, &log.cols[2 * k][row], 2);
+    std::memcpy(out + 4, &log.cols[2 * k + 1][row], 2);
 }
 
-int serialPortFlush(int fd)
+// sleep until due_ms on the now_ms() clock
+static void sleep_until_ms(uint64_t due_ms)
 {
-    sleep(2); 
-    return tcflush(fd, TCIOFLUSH);
-}
\ No newline at end of file
+    struct timespec ts;
+    ts.tv_sec = due_ms / 1000;
+    ts.tv_nsec = (due_ms % 1000) * 1000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p port] [-b baud] [-x speed | -a] [-n] [data.csv]\n", prog);
+    fprintf(stderr, "  -p port   serial port of canWrite.ino (default " SERIAL_PORT ")\n");
+    fprintf(stderr, "  -b baud   115200, 230400, 460800 or 921600 (default %d)\n", BAUD);
+    fprintf(stderr, "  -x speed  replay at speed times the CSV Time column (default 1, real time)\n");
+    fprintf(stderr, "  -a        as fast as the serial link and CAN bus allow\n");
+    fprintf(stderr, "  -n        parse the csv even if there is a cache of it, and don't write one\n");
+}
+
+int main(int argc, char* argv[])
+{
+    // replay timing
+    double speed = 1.0;
+    int fast = 0;
+    int use_cache = 1;
+    const char *port = SERIAL_PORT;
+    int baud = BAUD;
+    int opt;
+    while((opt = getopt(argc, argv, "p:b:x:an")) != -1)
+    {
+        if(opt == 'p')
+            port = optarg;
+        else if(opt == 'b')
+            baud = atoi(optarg);
+        else if(opt == 'x')
+            speed = atof(optarg);
+        else if(opt == 'a')
+            fast = 1;
+        else if(opt == 'n')
+            use_cache = 0;
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(!fast && speed <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    const char *path = optind < argc ? argv[optind] : "./data1.csv";
+
+    csv_log log;
+    if(load_log(path, use_cache, log) < 0)
+        return -1;
+    size_t num_frames = log.rows * FRAMES_PER_ROW;
+    printf("%zu frames loaded from %s\n", num_frames, path);
+    if(num_frames == 0)
+        return 0;
+
+    int fd = serial_open(port, baud);
+    if(fd == -1)
+        return -1;
+    printf("%s opened at %d baud\n", port, baud);
+
+    // frames go out in batches of up to BATCH_MAX_FRAMES, with up to FLOW_WINDOW
+    // batches waiting in the Arduino at once instead of an echo per frame
+    // this thread writes, the link's reader thread collects the credits
+    serial_link link;
+    link_start(&link, fd, FLOW_WINDOW);
+
+    unsigned char batch[LINK_HDR_LEN + BATCH_MAX_FRAMES * FRAME_LEN];
+    size_t next = 0;
+    uint64_t start_ms = now_ms();
+    uint32_t first_ms = log.time_ms[0];
+
+    while(next < num_frames)
+    {
+        // everything that is due goes in one batch, in real time that is a CSV row
+        uint64_t row_due = start_ms + (uint64_t)((log.time_ms[next / FRAMES_PER_ROW] - first_ms) / speed);
+        if(!fast)
+            sleep_until_ms(row_due);
+        uint64_t now = now_ms();
+        int n = 0;
+        while(next + n < num_frames && n < BATCH_MAX_FRAMES)
+        {
+            uint64_t due = start_ms + (uint64_t)((log.time_ms[(next + n) / FRAMES_PER_ROW] - first_ms) / speed);
+            if(!fast && due > now)
+                break;
+            frame_at(log, next + n, batch + LINK_HDR_LEN + n * FRAME_LEN);
+            n++;
+        }
+        batch[0] = BATCH_MAGIC;
+        batch[1] = n;
+        if(link_send(&link, batch, LINK_HDR_LEN + n * FRAME_LEN) < 0)
+            break;
+        next += n;
+    }
+    link_drain(&link);
+    link_stop(&link);
+
+    double secs = (now_ms() - start_ms) / 1000.0;
+    printf("%zu frames in %.1f s (%.0f frames/s), %llu batches, %llu bad, %llu lost\n", next, secs, next / (secs > 0 ? secs : 1),
+           (unsigned long long)link.sent, (unsigned long long)link.bad, (unsigned long long)link.lost);
+    return 0;
+}
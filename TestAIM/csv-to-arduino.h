@@ -1,9 +1,50 @@
 #ifndef __CSV_TO_ARDUINO_H__
 #define __CSV_TO_ARDUINO_H__
-#define SERIAL_PORT ttyACM0
-#define BAUD B115200
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define SERIAL_PORT "/dev/ttyACM0"
+#define BAUD 921600
 #define BUFFER_SIZE 256
 
+// one CAN frame on the serial link: id (2 bytes, low byte first) and 4 data bytes
+#define FRAME_LEN 6
+#define FRAMES_PER_ROW 9            // 0x600 - 0x608, two channels each
+
+// batches to canWrite.ino: [BATCH_MAGIC][frame count][count * FRAME_LEN bytes]
+// canWrite.ino answers every batch with one credit byte once it is on the bus
+#define BATCH_MAGIC 0xB5
+#define BATCH_MAX_FRAMES 32
+#define LINK_HDR_LEN 2
+#define CREDIT_OK 0x06
+#define CREDIT_BAD 0x15             // bad frame count, the batch was thrown away
+#define FLOW_WINDOW 2               // batches in flight, has to fit in the Arduino's serial buffer
+#define CREDIT_TIMEOUT_MS 2000
+
+#define CSV_COLUMNS (2 * FRAMES_PER_ROW)
+
+// binary cache of the parsed csv, written next to it as <csv>.cache
+#define CACHE_MAGIC 0x43494D41      // "AIMC"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".cache"
+
+// the parsed log, one array per csv column so replaying it is just indexing
+struct csv_log {
+    size_t rows;
+    std::vector<uint32_t> time_ms;  // Time column in ms, for replay timing
+    std::vector<uint16_t> cols[CSV_COLUMNS];    // raw values as sent, Time in 1/100 s
+};
+
+// start of the binary cache file, followed by time_ms and then every column
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rows;
+    uint64_t src_size;              // the csv it was made from, a changed csv means a stale cache
+    int64_t  src_mtime;
+};
+
 int serialPortFlush(int fd);
 
-#endif
\ No newline at end of file
+#endif
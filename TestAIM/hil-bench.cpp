@@ -0,0 +1,440 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "csv-to-arduino.h"
+#include "serial-link.h"
+#include "can-synth.h"
+#include "output_frame.h"
+#include "link_stats.h"
+
+// hardware in the loop benchmark: canWrite.ino -> car_end -> LoRa -> user_end -> host
+//
+// the injected frames carry a marker (a counter) in the Time channel. when a record
+// from user_end's binary output (OUTPUT_BINARY) shows a marker for the first time,
+// CAN-in to serial-out latency is the host time now minus when the marker was handed
+// to the adapter. both ends are timed on this host, so no clocks need syncing. the
+// stats frames on the car's console (link_stats.h) give the ARQ side: packets queued,
+// sends, retries and packets that failed after MAX_RETRIES, as the difference between
+// the first and last frame of the run.
+//
+// every run appends one row to a results csv under a label for the firmware
+// configuration (SF, BATCH_SIZE, WINDOW_SIZE are compile time), and -c compares it
+// against an earlier label and exits 1 on a regression.
+
+#define CONSOLE_BAUD 115200             // car_end's Serial.begin
+#define MARKER_CH CH_TIME
+#define NUM_MARKERS 65536
+#define RATE_TOLERANCE 0.01             // retry and loss rates may go up by this much before it counts
+#define RESULTS_HEADER "label,duration_s,inject_fps,records,records_per_s,fresh_per_s,p50_ms,p99_ms,max_ms,queued,sends,retries,retry_rate,failed,loss_rate,bad_frames"
+
+struct bench_result {
+    std::string label;
+    double duration_s;
+    double inject_fps;
+    uint64_t records;                   // output records from user_end for our car
+    double records_per_s;
+    double fresh_per_s;                 // records carrying a marker not seen before (goodput)
+    double p50_ms;
+    double p99_ms;
+    double max_ms;
+    uint64_t queued;                    // packets the car put in its ARQ window
+    uint64_t sends;                     // transmissions, first tries and retries
+    uint64_t retries;
+    double retry_rate;
+    uint64_t failed;                    // packets given up after MAX_RETRIES
+    double loss_rate;
+    uint64_t bad_frames;                // output frames with a bad COBS or CRC
+};
+
+static std::atomic<uint64_t> sent_us[NUM_MARKERS];     // when each marker went to the adapter, 0 = not yet
+static std::atomic<bool> stop(false);
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t due_us)
+{
+    struct timespec ts;
+    ts.tv_sec = due_us / 1000000;
+    ts.tv_nsec = (due_us % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+// base station side: decode user_end's records and time every new marker
+struct capture {
+    int fd;
+    int car;
+    uint64_t records;
+    uint64_t bad;
+    std::vector<double> latency_ms;
+};
+
+static void capture_main(capture *c)
+{
+    unsigned char buf[4096];
+    unsigned char frame[OUT_MAX_FRAME_LEN];
+    int frame_len = 0;
+    std::vector<uint64_t> seen_us(NUM_MARKERS, 0);      // sent_us of the marker when we last timed it
+    struct pollfd p = { c->fd, POLLIN, 0 };
+
+    while(!stop)
+    {
+        if(poll(&p, 1, 200) <= 0)
+            continue;
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if(n <= 0)
+            break;
+        uint64_t now = now_us();
+        for(ssize_t i = 0; i < n; i++)
+        {
+            if(buf[i] != 0)
+            {
+                // too long to be a record, wait for the next delimiter
+                if(frame_len < OUT_MAX_FRAME_LEN)
+                    frame[frame_len] = buf[i];
+                frame_len++;
+                continue;
+            }
+            unsigned char raw[OUT_MAX_RAW_LEN];
+            out_telemetry r;
+            int len = frame_len <= OUT_MAX_FRAME_LEN ? cobs_decode(frame, frame_len, raw, sizeof(raw)) : -1;
+            int ok = len > 0 && parse_telemetry_record(raw, len, &r);
+            // an empty frame is just the stream starting mid-record, user_end's stats aren't wanted here
+            if(!ok && frame_len > 0 && (len <= 0 || raw[OUT_STATS_TYPE] != OUT_REC_STATS))
+                c->bad++;
+            frame_len = 0;
+            if(!ok || r.car_id != c->car || r.type != OUT_REC_TELEMETRY)
+                continue;
+
+            c->records++;
+            uint16_t marker = r.data.ch[MARKER_CH];
+            uint64_t sent = sent_us[marker];
+            if(sent && seen_us[marker] != sent)
+            {
+                seen_us[marker] = sent;
+                c->latency_ms.push_back((now - sent) / 1000.0);
+            }
+        }
+    }
+}
+
+// car side: ARQ counters from the stats frames on car_end's console
+struct console {
+    int fd;
+    bool have;
+    uint32_t first[CS_COUNTERS];        // the first frame of the run, counters never reset
+    uint32_t last[CS_COUNTERS];
+    uint64_t queued;
+    uint64_t sends;
+    uint64_t retries;
+    uint64_t failed;
+};
+
+static void console_frame(console *c, const out_stats *s)
+{
+    if(s->source != STATS_SRC_CAR || s->count < CS_COUNTERS)
+        return;
+    if(!c->have)
+        memcpy(c->first, s->v, sizeof(c->first));
+    memcpy(c->last, s->v, sizeof(c->last));
+    c->have = true;
+    // uint32 differences, so a counter that wrapped during the run still comes out right
+    c->queued = c->last[CS_QUEUED] - c->first[CS_QUEUED];
+    c->sends = c->last[CS_SENDS] - c->first[CS_SENDS];
+    c->retries = c->last[CS_RETRIES] - c->first[CS_RETRIES];
+    c->failed = c->last[CS_FAILED] - c->first[CS_FAILED];
+}
+
+static void console_main(console *c)
+{
+    unsigned char buf[BUFFER_SIZE];
+    unsigned char frame[OUT_MAX_FRAME_LEN];
+    int frame_len = 0;
+    struct pollfd p = { c->fd, POLLIN, 0 };
+
+    while(!stop)
+    {
+        if(poll(&p, 1, 200) <= 0)
+            continue;
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if(n <= 0)
+            break;
+        for(ssize_t i = 0; i < n; i++)
+        {
+            if(buf[i] != 0)
+            {
+                // boot text and LOG_EVENTS lines end up in here too and just don't decode
+                if(frame_len < OUT_MAX_FRAME_LEN)
+                    frame[frame_len] = buf[i];
+                frame_len++;
+                continue;
+            }
+            unsigned char raw[OUT_MAX_RAW_LEN];
+            out_stats s;
+            int len = frame_len <= OUT_MAX_FRAME_LEN ? cobs_decode(frame, frame_len, raw, sizeof(raw)) : -1;
+            if(len > 0 && parse_stats_record(raw, len, &s))
+                console_frame(c, &s);
+            frame_len = 0;
+        }
+    }
+}
+
+// adapter side: frames at rate with a new marker in every frame that carries MARKER_CH
+static double inject(serial_link *link, double rate, double duration_s)
+{
+    can_id_map map;
+    build_id_map(&map);
+    unsigned char batch[LINK_HDR_LEN + BATCH_MAX_FRAMES * FRAME_LEN];
+    double gap_us = 1e6 / rate;
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)(duration_s * 1e6);
+    double next_us = start;
+    uint64_t n = 0;
+    uint16_t marker = 1;
+
+    while(now_us() < end)
+    {
+        sleep_until_us((uint64_t)next_us);
+        uint64_t now = now_us();
+        int count = 0;
+        while(count < BATCH_MAX_FRAMES && next_us <= now)
+        {
+            unsigned char *f = batch + LINK_HDR_LEN + count * FRAME_LEN;
+            build_frame(&map, n % map.num_ids, n / map.num_ids, f);
+            if(set_channel(f, MARKER_CH, marker))
+            {
+                sent_us[marker] = now;
+                marker = marker == NUM_MARKERS - 1 ? 1 : marker + 1;
+            }
+            count++;
+            n++;
+            next_us += gap_us;
+        }
+        if(count == 0)
+            continue;
+        batch[0] = BATCH_MAGIC;
+        batch[1] = count;
+        if(link_send(link, batch, LINK_HDR_LEN + count * FRAME_LEN) < 0)
+            break;
+    }
+    link_drain(link);
+    return n / ((now_us() - start) / 1e6);
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+    if(v.empty())
+        return 0;
+    size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void append_result(const char *path, const bench_result &r)
+{
+    FILE *f = fopen(path, "a+");
+    if(!f)
+    {
+        perror("can't open results file");
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    if(ftell(f) == 0)
+        fprintf(f, RESULTS_HEADER "\n");
+    fprintf(f, "%s,%.1f,%.0f,%llu,%.2f,%.2f,%.1f,%.1f,%.1f,%llu,%llu,%llu,%.4f,%llu,%.4f,%llu\n",
+            r.label.c_str(), r.duration_s, r.inject_fps, (unsigned long long)r.records, r.records_per_s, r.fresh_per_s,
+            r.p50_ms, r.p99_ms, r.max_ms, (unsigned long long)r.queued, (unsigned long long)r.sends,
+            (unsigned long long)r.retries, r.retry_rate, (unsigned long long)r.failed, r.loss_rate,
+            (unsigned long long)r.bad_frames);
+    fclose(f);
+}
+
+// the newest row for label, 0 if there is none
+static int find_result(const char *path, const char *label, bench_result *r)
+{
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return 0;
+    char line[512];
+    int found = 0;
+    while(fgets(line, sizeof(line), f))
+    {
+        char *comma = strchr(line, ',');
+        if(!comma || (size_t)(comma - line) != strlen(label) || strncmp(line, label, comma - line) != 0)
+            continue;
+        unsigned long long records, queued, sends, retries, failed, bad;
+        if(sscanf(comma + 1, "%lf,%lf,%llu,%lf,%lf,%lf,%lf,%lf,%llu,%llu,%llu,%lf,%llu,%lf,%llu",
+                  &r->duration_s, &r->inject_fps, &records, &r->records_per_s, &r->fresh_per_s,
+                  &r->p50_ms, &r->p99_ms, &r->max_ms, &queued, &sends, &retries, &r->retry_rate,
+                  &failed, &r->loss_rate, &bad) == 15)
+        {
+            r->label = label;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// worse by more than tolerance (a fraction), lower_is_better picks the direction
+static int regressed(const char *what, double base, double now, double tolerance, int lower_is_better)
+{
+    double limit = lower_is_better ? base * (1 + tolerance) : base * (1 - tolerance);
+    int bad = lower_is_better ? now > limit : now < limit;
+    printf("  %-12s %10.3f -> %10.3f %s\n", what, base, now, bad ? "REGRESSION" : "ok");
+    return bad;
+}
+
+// rates like the retry rate can be 0 in the baseline, so they get an absolute tolerance
+static int rate_regressed(const char *what, double base, double now)
+{
+    int bad = now > base + RATE_TOLERANCE;
+    printf("  %-12s %10.4f -> %10.4f %s\n", what, base, now, bad ? "REGRESSION" : "ok");
+    return bad;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -a adapter -u user_end [-k car_console] [-i car] [-r rate] [-t seconds] [-l label] [-o results.csv] [-c baseline_label [-T tolerance]]\n", prog);
+    fprintf(stderr, "  -a port   canWrite.ino adapter on the car's CAN bus\n");
+    fprintf(stderr, "  -u port   user_end (binary output, %d baud)\n", OUTPUT_BAUD);
+    fprintf(stderr, "  -k port   car_end's console for retry and loss counts\n");
+    fprintf(stderr, "  -i car    MY_ID of the car (default 0)\n");
+    fprintf(stderr, "  -r rate   CAN frames/s to inject (default 1000)\n");
+    fprintf(stderr, "  -t secs   how long to inject (default 60)\n");
+    fprintf(stderr, "  -l label  name of the firmware configuration under test (default \"run\")\n");
+    fprintf(stderr, "  -o file   results csv to append to (default bench_results.csv)\n");
+    fprintf(stderr, "  -c label  compare against the newest result with this label, exit 1 on a regression\n");
+    fprintf(stderr, "  -T frac   how much worse counts as a regression (default 0.1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char *adapter = NULL, *user = NULL, *car_console = NULL;
+    const char *label = "run", *results = "bench_results.csv", *baseline = NULL;
+    int car = 0;
+    double rate = 1000, duration = 60, tolerance = 0.1;
+    int opt;
+    while((opt = getopt(argc, argv, "a:u:k:i:r:t:l:o:c:T:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'a': adapter = optarg; break;
+        case 'u': user = optarg; break;
+        case 'k': car_console = optarg; break;
+        case 'i': car = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'l': label = optarg; break;
+        case 'o': results = optarg; break;
+        case 'c': baseline = optarg; break;
+        case 'T': tolerance = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(!adapter || !user || rate <= 0 || duration <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    capture cap = { -1, car, 0, 0, {} };
+    console con = { -1, false, {}, {}, 0, 0, 0, 0 };
+    cap.fd = serial_open(user, OUTPUT_BAUD);
+    if(cap.fd == -1)
+        return -1;
+    if(car_console && (con.fd = serial_open(car_console, CONSOLE_BAUD)) == -1)
+        return -1;
+    int fd = serial_open(adapter, BAUD);
+    if(fd == -1)
+        return -1;
+
+    std::thread cap_thread(capture_main, &cap);
+    std::thread con_thread;
+    if(con.fd != -1)
+        con_thread = std::thread(console_main, &con);
+
+    serial_link link;
+    link_start(&link, fd, FLOW_WINDOW);
+    printf("%s: injecting %.0f frames/s for %.0f s\n", label, rate, duration);
+    double inject_fps = inject(&link, rate, duration);
+    link_stop(&link);
+
+    // whatever is still in the car's window gets a few seconds to come through
+    sleep(5);
+    stop = true;
+    cap_thread.join();
+    if(con_thread.joinable())
+        con_thread.join();
+    close(cap.fd);
+    if(con.fd != -1)
+        close(con.fd);
+
+    bench_result r;
+    r.label = label;
+    r.duration_s = duration;
+    r.inject_fps = inject_fps;
+    r.records = cap.records;
+    r.records_per_s = cap.records / duration;
+    r.fresh_per_s = cap.latency_ms.size() / duration;
+    r.p50_ms = percentile(cap.latency_ms, 0.50);
+    r.p99_ms = percentile(cap.latency_ms, 0.99);
+    r.max_ms = cap.latency_ms.empty() ? 0 : *std::max_element(cap.latency_ms.begin(), cap.latency_ms.end());
+    r.queued = con.queued;
+    r.sends = con.sends;
+    r.retries = con.retries;
+    r.retry_rate = con.sends ? (double)con.retries / con.sends : 0;
+    r.failed = con.failed;
+    r.loss_rate = con.queued ? (double)con.failed / con.queued : 0;
+    r.bad_frames = cap.bad;
+
+    printf("records %llu (%.1f/s), fresh %.1f/s, latency p50 %.1f ms p99 %.1f ms max %.1f ms\n",
+           (unsigned long long)r.records, r.records_per_s, r.fresh_per_s, r.p50_ms, r.p99_ms, r.max_ms);
+    if(con.fd != -1)
+        printf("packets %llu, sends %llu, retry rate %.2f%%, failed %llu (%.2f%%)\n", (unsigned long long)r.queued,
+               (unsigned long long)r.sends, 100 * r.retry_rate, (unsigned long long)r.failed, 100 * r.loss_rate);
+    if(r.bad_frames)
+        printf("%llu bad output frames\n", (unsigned long long)r.bad_frames);
+
+    // compare before appending so a label can be compared against its own last run
+    int bad = 0;
+    if(baseline)
+    {
+        bench_result base;
+        if(!find_result(results, baseline, &base))
+        {
+            fprintf(stderr, "no result labelled %s in %s\n", baseline, results);
+            bad = 1;
+        }
+        else
+        {
+            printf("against %s:\n", baseline);
+            bad |= regressed("p50_ms", base.p50_ms, r.p50_ms, tolerance, 1);
+            bad |= regressed("p99_ms", base.p99_ms, r.p99_ms, tolerance, 1);
+            bad |= regressed("fresh_per_s", base.fresh_per_s, r.fresh_per_s, tolerance, 0);
+            if(con.fd != -1)
+            {
+                bad |= rate_regressed("retry_rate", base.retry_rate, r.retry_rate);
+                bad |= rate_regressed("loss_rate", base.loss_rate, r.loss_rate);
+            }
+        }
+    }
+    append_result(results, r);
+    return bad;
+}
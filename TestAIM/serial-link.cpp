@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+#include <chrono>
+#include "serial-link.h"
+#include "csv-to-arduino.h"
+
+static speed_t baud_const(int baud)
+{
+    switch(baud)
+    {
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default:     return 0;
+    }
+}
+
+int serial_open(const char *port, int baud)
+{
+    speed_t speed = baud_const(baud);
+    if(!speed)
+    {
+        fprintf(stderr, "unsupported baud rate %d\n", baud);
+        return -1;
+    }
+
+    // blocking, the reader only reads once poll() says there is something
+    int fd = open(port, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        fprintf(stderr, "open_port: Unable to open %s: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    usleep(3500000); // arduino reboot
+    serialPortFlush(fd);
+
+    // binary batches, so no line editing or newline translation either way
+    struct termios toptions;
+    tcgetattr(fd, &toptions);
+    cfmakeraw(&toptions);
+    toptions.c_cflag |= CLOCAL | CREAD;
+    toptions.c_cc[VMIN] = 1;
+    toptions.c_cc[VTIME] = 0;
+    cfsetispeed(&toptions, speed);
+    cfsetospeed(&toptions, speed);
+    if(tcsetattr(fd, TCSANOW, &toptions) == -1)
+    {
+        perror("tcsetattr");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serialPortFlush(int fd)
+{
+    sleep(2);
+    return tcflush(fd, TCIOFLUSH);
+}
+
+// reader thread: credits from the Arduino back to the writer
+static void reader_main(serial_link *l)
+{
+    unsigned char buf[BUFFER_SIZE];
+    struct pollfd p = { l->fd, POLLIN, 0 };
+
+    for(;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(l->m);
+            if(l->stop)
+                return;
+        }
+        // wake up now and then to notice stop
+        int r = poll(&p, 1, 200);
+        if(r < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return;
+        }
+        if(r <= 0)
+            continue;
+        if(p.revents & (POLLERR | POLLHUP))
+        {
+            fprintf(stderr, "serial port closed\n");
+            return;
+        }
+
+        ssize_t n = read(l->fd, buf, sizeof(buf));
+        int credits = 0;
+        int bad = 0;
+        for(ssize_t i = 0; i < n; i++)
+        {
+            if(buf[i] == CREDIT_OK)
+                credits++;
+            else if(buf[i] == CREDIT_BAD)
+            {
+                credits++;
+                bad++;
+            }
+        }
+        if(credits)
+        {
+            std::lock_guard<std::mutex> lock(l->m);
+            l->in_flight = l->in_flight > credits ? l->in_flight - credits : 0;
+            l->bad += bad;
+            l->cv.notify_all();
+        }
+    }
+}
+
+int link_start(serial_link *l, int fd, int window)
+{
+    l->fd = fd;
+    l->window = window;
+    l->in_flight = 0;
+    l->sent = 0;
+    l->bad = 0;
+    l->lost = 0;
+    l->stop = false;
+    l->reader = std::thread(reader_main, l);
+    return 0;
+}
+
+// wait (with the lock held) until at most limit batches are in flight
+// a window that gets no credit for CREDIT_TIMEOUT_MS is written off as lost
+static void wait_in_flight(serial_link *l, std::unique_lock<std::mutex> &lock, int limit)
+{
+    while(l->in_flight > limit)
+    {
+        if(!l->cv.wait_for(lock, std::chrono::milliseconds(CREDIT_TIMEOUT_MS), [&] { return l->in_flight <= limit; }))
+        {
+            fprintf(stderr, "no credit from the Arduino for %d ms, %d batches lost\n", CREDIT_TIMEOUT_MS, l->in_flight);
+            l->lost += l->in_flight;
+            l->in_flight = 0;
+        }
+    }
+}
+
+int link_send(serial_link *l, const unsigned char *batch, size_t len)
+{
+    {
+        std::unique_lock<std::mutex> lock(l->m);
+        wait_in_flight(l, lock, l->window - 1);
+        l->in_flight++;
+        l->sent++;
+    }
+    while(len > 0)
+    {
+        ssize_t n = write(l->fd, batch, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+        {
+            perror("write");
+            return -1;
+        }
+        batch += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void link_drain(serial_link *l)
+{
+    std::unique_lock<std::mutex> lock(l->m);
+    wait_in_flight(l, lock, 0);
+}
+
+void link_stop(serial_link *l)
+{
+    {
+        std::lock_guard<std::mutex> lock(l->m);
+        l->stop = true;
+    }
+    if(l->reader.joinable())
+        l->reader.join();
+    close(l->fd);
+}
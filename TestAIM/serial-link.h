@@ -0,0 +1,38 @@
+#ifndef __SERIAL_LINK_H__
+#define __SERIAL_LINK_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// raw serial link to canWrite.ino with credit based flow control
+//
+// the writer (whoever calls link_send) blocks while window batches are waiting in
+// the Arduino, a reader thread sleeps in poll() on the port and hands every credit
+// byte back to it. nothing spins, so the host sits idle while the link is saturated.
+
+struct serial_link {
+    int fd;
+    int window;                     // batches allowed in flight
+    std::thread reader;
+    std::mutex m;
+    std::condition_variable cv;
+    int in_flight;                  // batches written and not credited yet
+    uint64_t sent;                  // batches written
+    uint64_t bad;                   // batches the Arduino threw away (CREDIT_BAD)
+    uint64_t lost;                  // batches never credited before CREDIT_TIMEOUT_MS
+    bool stop;
+};
+
+// open the port in raw 8N1 at baud (waits for the Arduino to reboot), returns the fd or -1
+int serial_open(const char *port, int baud);
+
+int link_start(serial_link *l, int fd, int window);
+// write one batch once the window has room, returns -1 if the port failed
+int link_send(serial_link *l, const unsigned char *batch, size_t len);
+// wait until everything written is credited (or CREDIT_TIMEOUT_MS passes without a credit)
+void link_drain(serial_link *l);
+void link_stop(serial_link *l);
+
+#endif
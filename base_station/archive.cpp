@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "archive.h"
+#include "telemetry_codec.h"
+
+static size_t pad8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static bool header_ok(const archive_header *h)
+{
+    return h->magic == ARCHIVE_MAGIC && h->version == ARCHIVE_VERSION && h->num_channels == NUM_CHANNELS;
+}
+
+static bool chunk_ok(const chunk_header *c, size_t space)
+{
+    return space >= sizeof(chunk_header) && c->magic == CHUNK_MAGIC && c->len <= space
+        && c->records > 0 && c->records <= ARCHIVE_CHUNK_RECORDS && c->len % 8 == 0
+        && sizeof(chunk_header) + c->records * (8 + 4 + 4) <= c->len;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int archive_create(archive_writer *w, const char *path, int car, uint32_t flags)
+{
+    w->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(w->fd == -1)
+    {
+        fprintf(stderr, "archive_create: Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    w->flags = flags;
+    w->chunks = 0;
+    w->host_us.clear();
+    w->recs.clear();
+    w->host_us.reserve(ARCHIVE_CHUNK_RECORDS);
+    w->recs.reserve(ARCHIVE_CHUNK_RECORDS);
+
+    struct stat st;
+    fstat(w->fd, &st);
+    if(st.st_size == 0)
+    {
+        archive_header h;
+        memset(&h, 0, sizeof(h));
+        h.magic = ARCHIVE_MAGIC;
+        h.version = ARCHIVE_VERSION;
+        h.num_channels = NUM_CHANNELS;
+        h.flags = flags;
+        h.car = car;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h.created_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        for(int i = 0; i < NUM_CHANNELS; i++)
+            strncpy(h.names[i], CHANNEL_NAMES[i], ARCHIVE_NAME_LEN - 1);
+        if(write_all(w->fd, (const uint8_t *)&h, sizeof(h)) == -1)
+        {
+            perror("write");
+            close(w->fd);
+            return -1;
+        }
+        return 0;
+    }
+
+    // appending: walk the index blocks to the end of the last complete chunk
+    archive_header h;
+    if(pread(w->fd, &h, sizeof(h), 0) != sizeof(h) || !header_ok(&h) || h.car != car)
+    {
+        fprintf(stderr, "archive_create: %s is not an archive of car %d from this build\n", path, car);
+        close(w->fd);
+        return -1;
+    }
+    off_t end = sizeof(h);
+    chunk_header c;
+    while(pread(w->fd, &c, sizeof(c), end) == sizeof(c) && chunk_ok(&c, st.st_size - end))
+        end += c.len;
+    if(end != st.st_size)
+    {
+        fprintf(stderr, "%s: dropping %lld bytes of an incomplete chunk\n", path, (long long)(st.st_size - end));
+        if(ftruncate(w->fd, end) == -1)
+        {
+            perror("ftruncate");
+            close(w->fd);
+            return -1;
+        }
+    }
+    lseek(w->fd, end, SEEK_SET);
+    return 0;
+}
+
+int archive_append(archive_writer *w, uint64_t host_us, const out_telemetry *r)
+{
+    w->host_us.push_back(host_us);
+    w->recs.push_back(*r);
+    if(w->recs.size() >= ARCHIVE_CHUNK_RECORDS)
+        return archive_flush(w);
+    return 0;
+}
+
+int archive_flush(archive_writer *w)
+{
+    size_t n = w->recs.size();
+    if(n == 0)
+        return 0;
+
+    // worst case every channel is raw
+    size_t fixed = pad8(sizeof(chunk_header) + n * (8 + 4 + 4));
+    w->buf.assign(fixed + NUM_CHANNELS * pad8(2 * n), 0);
+    uint8_t *base = w->buf.data();
+    chunk_header *c = (chunk_header *)base;
+    c->magic = CHUNK_MAGIC;
+    c->records = n;
+    c->host_first_us = w->host_us.front();
+    c->host_last_us = w->host_us.back();
+    c->car_min_ms = UINT32_MAX;
+    c->car_max_ms = 0;
+
+    uint64_t *host = (uint64_t *)(c + 1);
+    uint32_t *car = (uint32_t *)(host + n);
+    uint8_t *bytes = (uint8_t *)(car + n);
+    for(size_t i = 0; i < n; i++)
+    {
+        const out_telemetry &r = w->recs[i];
+        host[i] = w->host_us[i];
+        car[i] = r.car_time_ms;
+        c->car_min_ms = std::min(c->car_min_ms, r.car_time_ms);
+        c->car_max_ms = std::max(c->car_max_ms, r.car_time_ms);
+        bytes[i] = r.seq;
+        bytes[n + i] = (uint8_t)r.rssi_dbm;
+        bytes[2 * n + i] = (uint8_t)r.snr_q4;
+        bytes[3 * n + i] = r.type;
+    }
+
+    size_t off = fixed;
+    uint8_t tmp[ARCHIVE_CHUNK_RECORDS * 3];
+    for(int ch = 0; ch < NUM_CHANNELS; ch++)
+    {
+        uint16_t lo = UINT16_MAX, hi = 0, prev = 0;
+        size_t len = 0;
+        for(size_t i = 0; i < n; i++)
+        {
+            uint16_t v = w->recs[i].data.ch[ch];
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+            len += put_varint(tmp + len, zigzag16((int16_t)(v - prev)));
+            prev = v;
+        }
+        c->min[ch] = lo;
+        c->max[ch] = hi;
+        c->col_off[ch] = off;
+        if((w->flags & ARCHIVE_F_DELTA) && len < 2 * n)
+        {
+            c->delta_mask |= (uint32_t)1 << ch;
+            memcpy(base + off, tmp, len);
+        }
+        else
+        {
+            len = 2 * n;
+            uint16_t *raw = (uint16_t *)(base + off);
+            for(size_t i = 0; i < n; i++)
+                raw[i] = w->recs[i].data.ch[ch];
+        }
+        c->col_len[ch] = len;
+        off += pad8(len);
+    }
+    c->len = off;
+
+    w->host_us.clear();
+    w->recs.clear();
+    if(write_all(w->fd, base, off) == -1)
+        return -1;
+    w->chunks++;
+    return 0;
+}
+
+int archive_close(archive_writer *w)
+{
+    int ret = archive_flush(w);
+    close(w->fd);
+    return ret;
+}
+
+
+int archive_open(archive_reader *a, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        fprintf(stderr, "archive_open: Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if(st.st_size < (off_t)sizeof(archive_header))
+    {
+        fprintf(stderr, "archive_open: %s is not an archive of this build\n", path);
+        close(fd);
+        return -1;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    a->base = (const uint8_t *)m;
+    a->size = st.st_size;
+    a->hdr = (const archive_header *)m;
+    if(!header_ok(a->hdr))
+    {
+        fprintf(stderr, "archive_open: %s is not an archive of this build\n", path);
+        archive_unmap(a);
+        return -1;
+    }
+
+    // a torn chunk at the end (ingestd still writing it, or a crash) is left out
+    a->chunks.clear();
+    size_t off = sizeof(archive_header);
+    while(off < a->size)
+    {
+        const chunk_header *c = (const chunk_header *)(a->base + off);
+        if(!chunk_ok(c, a->size - off))
+            break;
+        a->chunks.push_back(c);
+        off += c->len;
+    }
+    return 0;
+}
+
+void archive_unmap(archive_reader *a)
+{
+    munmap((void *)a->base, a->size);
+    a->base = NULL;
+    a->chunks.clear();
+}
+
+int chunk_channel(const chunk_header *c, int ch, uint16_t *out)
+{
+    const uint8_t *col = (const uint8_t *)c + c->col_off[ch];
+    int len = c->col_len[ch];
+    if(c->col_off[ch] + (uint64_t)len > c->len)
+        return -1;
+    if(!(c->delta_mask & ((uint32_t)1 << ch)))
+    {
+        if(len != 2 * (int)c->records)
+            return -1;
+        memcpy(out, col, len);
+        return 0;
+    }
+    uint16_t prev = 0;
+    int used = 0;
+    for(uint32_t i = 0; i < c->records; i++)
+    {
+        uint16_t z;
+        int k = get_varint(col + used, len - used, &z);
+        if(k < 0)
+            return -1;
+        used += k;
+        prev = (uint16_t)(prev + unzigzag16(z));
+        out[i] = prev;
+    }
+    return used == len ? 0 : -1;
+}
+
+size_t archive_range(const archive_reader *a, int ch, uint64_t from_us, uint64_t to_us,
+                     std::vector<uint64_t> &t, std::vector<uint16_t> &v)
+{
+    size_t added = 0;
+    uint16_t vals[ARCHIVE_CHUNK_RECORDS];
+    for(const chunk_header *c : a->chunks)
+    {
+        if(c->host_last_us < from_us || c->host_first_us > to_us)
+            continue;
+        if(chunk_channel(c, ch, vals) == -1)
+            continue;
+        // the host time column is sorted, so only the ends need a search
+        const uint64_t *host = chunk_host_us(c);
+        size_t lo = std::lower_bound(host, host + c->records, from_us) - host;
+        size_t hi = std::upper_bound(host, host + c->records, to_us) - host;
+        t.insert(t.end(), host + lo, host + hi);
+        v.insert(v.end(), vals + lo, vals + hi);
+        added += hi - lo;
+    }
+    return added;
+}
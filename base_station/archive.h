@@ -0,0 +1,114 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "output_frame.h"
+
+// columnar telemetry archive, car<N>.tlm
+//
+// an archive_header and then chunks of up to ARCHIVE_CHUNK_RECORDS records, each
+// one an index block (chunk_header: time range, min/max of every channel, where
+// its columns are) followed by the columns themselves. the time columns are plain
+// arrays so they can be searched straight out of the mmap, each channel column is
+// either raw uint16 or, with ARCHIVE_F_DELTA, the zigzag varint deltas of
+// telemetry_codec.h when that is shorter. reading one channel over one lap only
+// touches the index blocks and that column of the chunks the lap overlaps.
+//
+// chunks are only ever appended, each with one write(). a chunk cut short by a
+// crash is shorter than its len says and gets dropped (and cut off on the next append).
+
+#define ARCHIVE_MAGIC           0x314D4C54      // "TLM1"
+#define ARCHIVE_VERSION         1
+#define CHUNK_MAGIC             0x4B4E4843      // "CHNK"
+#define ARCHIVE_CHUNK_RECORDS   1024
+#define ARCHIVE_NAME_LEN        24
+
+#define ARCHIVE_F_DELTA         0x01            // delta encode channel columns where it pays
+
+struct archive_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_channels;
+    uint32_t flags;                             // ARCHIVE_F_*
+    int32_t  car;
+    uint64_t created_us;                        // CLOCK_REALTIME
+    char     names[NUM_CHANNELS][ARCHIVE_NAME_LEN];     // CHANNEL_NAMES when it was written
+};
+
+// the columns follow back to back: host_us[records] uint64, car_ms[records] uint32,
+// then seq, rssi_dbm, snr_q4 and type [records] uint8 each. channel i is at
+// col_off[i] from the start of the chunk, col_len[i] bytes, starting on 8 bytes
+struct chunk_header {
+    uint32_t magic;
+    uint32_t len;                               // whole chunk with this header, multiple of 8
+    uint32_t records;
+    uint32_t delta_mask;                        // bit i: channel i is deltas, not raw
+    uint64_t host_first_us;                     // records are in arrival order, so first/last is the range
+    uint64_t host_last_us;
+    uint32_t car_min_ms;                        // backfill comes in late, so car time is min/max
+    uint32_t car_max_ms;
+    uint32_t col_off[NUM_CHANNELS];
+    uint32_t col_len[NUM_CHANNELS];
+    uint16_t min[NUM_CHANNELS];
+    uint16_t max[NUM_CHANNELS];
+};
+
+static_assert(sizeof(archive_header) % 8 == 0 && sizeof(chunk_header) % 8 == 0, "archive blocks must keep columns 8 byte aligned");
+
+struct archive_writer {
+    int fd;
+    uint32_t flags;
+    uint64_t chunks;                            // written since archive_create
+    std::vector<uint64_t> host_us;              // the chunk being filled
+    std::vector<out_telemetry> recs;
+    std::vector<uint8_t> buf;                   // the chunk as it goes to disk
+};
+
+// create path, or carry on appending to it if it is an archive of this build.
+// returns -1 if it can't be opened or is something else
+int archive_create(archive_writer *w, const char *path, int car, uint32_t flags);
+// add one record, writes the chunk out once it is full. returns -1 if a write failed
+int archive_append(archive_writer *w, uint64_t host_us, const out_telemetry *r);
+// write out what there is of the current chunk (no fsync), returns -1 if that failed
+int archive_flush(archive_writer *w);
+// archive_flush and close
+int archive_close(archive_writer *w);
+
+
+struct archive_reader {
+    const uint8_t *base;
+    size_t size;
+    const archive_header *hdr;
+    std::vector<const chunk_header *> chunks;   // every complete chunk, in file order
+};
+
+// mmap path read only and walk its index blocks, returns -1 if it isn't an archive of this build
+int archive_open(archive_reader *a, const char *path);
+void archive_unmap(archive_reader *a);
+
+static inline const uint64_t *chunk_host_us(const chunk_header *c)
+{
+    return (const uint64_t *)(c + 1);
+}
+
+static inline const uint32_t *chunk_car_ms(const chunk_header *c)
+{
+    return (const uint32_t *)(chunk_host_us(c) + c->records);
+}
+
+// column of the uint8 fields: 0 seq, 1 rssi_dbm, 2 snr_q4, 3 type
+static inline const uint8_t *chunk_byte_col(const chunk_header *c, int which)
+{
+    return (const uint8_t *)(chunk_car_ms(c) + c->records) + which * c->records;
+}
+
+// channel ch of the whole chunk into out[c->records], returns -1 if the column is corrupt
+int chunk_channel(const chunk_header *c, int ch, uint16_t *out);
+
+// channel ch of every record with host_us in [from_us, to_us]. only chunks whose
+// range overlaps are decoded, returns the number of records added to t and v
+size_t archive_range(const archive_reader *a, int ch, uint64_t from_us, uint64_t to_us,
+                     std::vector<uint64_t> &t, std::vector<uint16_t> &v);
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include "ingest.h"
+
+latest_table *latest_map(const char *path, bool create)
+{
+    if(!path)
+    {
+        latest_table *t = new latest_table();
+        t->num_cars = NUM_CARS;
+        t->num_channels = NUM_CHANNELS;
+        t->magic = LATEST_MAGIC;
+        return t;
+    }
+
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if(fd == -1)
+    {
+        fprintf(stderr, "latest_map: Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if(create && ftruncate(fd, sizeof(latest_table)) == -1)
+    {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(latest_table))
+    {
+        fprintf(stderr, "latest_map: %s is not a latest table of this build\n", path);
+        close(fd);
+        return NULL;
+    }
+    // readers map it read only, the seqlock never needs them to write
+    void *m = mmap(NULL, sizeof(latest_table), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+    latest_table *t = (latest_table *)m;
+    if(create)
+    {
+        // the file is all zeros after ftruncate, which is an empty table already
+        t->num_cars = NUM_CARS;
+        t->num_channels = NUM_CHANNELS;
+        std::atomic_thread_fence(std::memory_order_release);
+        t->magic = LATEST_MAGIC;
+    }
+    else if(t->magic != LATEST_MAGIC || t->num_cars != NUM_CARS || t->num_channels != NUM_CHANNELS)
+    {
+        fprintf(stderr, "latest_map: %s is not a latest table of this build\n", path);
+        munmap(m, sizeof(latest_table));
+        return NULL;
+    }
+    return t;
+}
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int writer_open(car_writer *w, const char *dir, int car, int inputs, int fsync_ms, bool use_archive)
+{
+    w->car = car;
+    w->fsync_ms = fsync_ms;
+    w->use_archive = use_archive;
+    w->written.store(0, std::memory_order_relaxed);
+    w->syncs.store(0, std::memory_order_relaxed);
+    w->failed = false;
+    w->last_us = 0;
+    w->inputs = inputs;
+    for(int i = 0; i < inputs; i++)
+        queue_init(&w->queues[i]);
+
+    std::string path = std::string(dir) + "/car" + std::to_string(car) + (use_archive ? ".tlm" : ".csv");
+    if(use_archive)
+    {
+        if(archive_create(&w->archive, path.c_str(), car, ARCHIVE_F_DELTA) == -1)
+            return -1;
+        w->fd = w->archive.fd;
+        return 0;
+    }
+    w->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(w->fd == -1)
+    {
+        fprintf(stderr, "writer_open: Unable to open %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    // a new file gets the header, an existing one is carried on
+    struct stat st;
+    if(fstat(w->fd, &st) == 0 && st.st_size == 0)
+    {
+        std::string header = "Host_Time_us,SEQ,RSSI,SNR,Car_Time,Backfill";
+        for(int i = 0; i < NUM_CHANNELS; i++)
+            header += std::string(",") + CHANNEL_NAMES[i];
+        header += "\n";
+        if(write(w->fd, header.data(), header.size()) != (ssize_t)header.size())
+        {
+            perror("write");
+            close(w->fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t writer_drops(const car_writer *w)
+{
+    uint64_t drops = 0;
+    for(int i = 0; i < w->inputs; i++)
+        drops += w->queues[i].drops.load(std::memory_order_relaxed);
+    return drops;
+}
+
+static void write_failed(car_writer *w)
+{
+    fprintf(stderr, "car %d: write failed: %s, not writing its file any more\n", w->car, strerror(errno));
+    w->failed = true;
+}
+
+static void write_all(car_writer *w, const char *buf, size_t len)
+{
+    while(len > 0 && !w->failed)
+    {
+        ssize_t n = write(w->fd, buf, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            write_failed(w);
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// one csv row, returns its length
+static int format_row(const ingest_record *r, char *out)
+{
+    const out_telemetry &t = r->rec;
+    int len = sprintf(out, "%llu,%u,%d,%.2f,%lu,%d", (unsigned long long)r->host_us, t.seq, t.rssi_dbm,
+                      t.snr_q4 / 4.0, (unsigned long)t.car_time_ms, t.type == OUT_REC_BACKFILL);
+    for(int i = 0; i < NUM_CHANNELS; i++)
+        len += sprintf(out + len, ",%u", t.data.ch[i]);
+    out[len++] = '\n';
+    return len;
+}
+
+// the queue with the oldest record in front, -1 if they are all empty
+static int oldest_queue(car_writer *w)
+{
+    int best = -1;
+    uint64_t best_us = 0;
+    for(int i = 0; i < w->inputs; i++)
+    {
+        const ingest_record *r = queue_peek(&w->queues[i]);
+        if(r && (best < 0 || r->host_us < best_us))
+        {
+            best = i;
+            best_us = r->host_us;
+        }
+    }
+    return best;
+}
+
+static void writer_main(car_writer *w, const std::atomic<bool> *stop)
+{
+    // longest row: 20 digit time, the fixed fields and 6 characters per channel
+    const int max_row = 64 + 6 * NUM_CHANNELS;
+    static_assert(INGEST_WRITE_BUF > 64 + 6 * NUM_CHANNELS, "INGEST_WRITE_BUF smaller than a row");
+    std::string buf(INGEST_WRITE_BUF, '\0');
+    size_t used = 0;
+    bool dirty = false;
+    uint64_t last_sync = monotonic_ms();
+
+    for(;;)
+    {
+        // stop is checked before the queue, so whatever was pushed before it is written
+        bool stopping = stop->load(std::memory_order_acquire);
+        ingest_record r;
+        int got = 0;
+        int q;
+        while((q = oldest_queue(w)) >= 0)
+        {
+            queue_pop(&w->queues[q], &r);
+            // the file stays in host time order (the archive's time index needs it): a record
+            // another reader stamped just before the last one written gets that one's time
+            if(r.host_us < w->last_us)
+                r.host_us = w->last_us;
+            w->last_us = r.host_us;
+            if(w->use_archive)
+            {
+                // the archive writes whole chunks itself
+                if(!w->failed && archive_append(&w->archive, r.host_us, &r.rec) == -1)
+                    write_failed(w);
+                dirty = true;
+                w->written.fetch_add(1, std::memory_order_relaxed);
+                got++;
+                continue;
+            }
+            if(used + max_row > buf.size())
+            {
+                write_all(w, buf.data(), used);
+                used = 0;
+                dirty = true;
+            }
+            used += format_row(&r, &buf[used]);
+            w->written.fetch_add(1, std::memory_order_relaxed);
+            got++;
+        }
+
+        uint64_t now = monotonic_ms();
+        if(stopping || now - last_sync >= (uint64_t)w->fsync_ms)
+        {
+            if(used)
+            {
+                write_all(w, buf.data(), used);
+                used = 0;
+                dirty = true;
+            }
+            if(w->use_archive && dirty && !w->failed && archive_flush(&w->archive) == -1)
+                write_failed(w);
+            if(dirty && !w->failed)
+            {
+                fdatasync(w->fd);
+                w->syncs.fetch_add(1, std::memory_order_relaxed);
+            }
+            dirty = false;
+            last_sync = now;
+        }
+        if(stopping)
+            break;
+        if(!got)
+            usleep(INGEST_IDLE_MS * 1000);
+    }
+    close(w->fd);
+}
+
+void writer_start(car_writer *w, const std::atomic<bool> *stop)
+{
+    w->thread = std::thread(writer_main, w, stop);
+}
+
+void writer_join(car_writer *w)
+{
+    if(w->thread.joinable())
+        w->thread.join();
+}
@@ -0,0 +1,242 @@
+#ifndef __INGEST_H__
+#define __INGEST_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include "shared_defs.h"
+#include "output_frame.h"
+#include "link_stats.h"
+#include "archive.h"
+
+// ingestd: reads the binary output of user_end (main_code/output_frame.h), splits it
+// by car and writes one time series file per car, with a live latest-value table
+//
+// one reader thread per receiver (user_end board, main_code/freq_plan.h) owns its
+// serial port and never waits on anything: it decodes every record, stores it in the
+// latest table and pushes it onto its own queue of the record's car. one writer thread
+// per car merges its queues by host time into the car's file. if a writer falls so far
+// behind that a queue fills up, records of that car are dropped and counted rather
+// than holding up the port.
+
+#define INGEST_QUEUE_LEN    4096                // records per car, a few seconds at full rate
+#define INGEST_WRITE_BUF    65536               // bytes a writer collects before it write()s
+#define INGEST_IDLE_MS      5                   // writer sleep while its queue is empty
+#define INGEST_FSYNC_MS     1000                // default time between fdatasync()s of every file
+#define INGEST_MAX_INPUTS   8                   // receivers one ingestd reads, as many as FREQ_CHANNELS has room for
+
+#if (INGEST_QUEUE_LEN & (INGEST_QUEUE_LEN - 1)) != 0
+#error "INGEST_QUEUE_LEN must be a power of two"
+#endif
+
+struct ingest_record {
+    uint64_t host_us;                           // CLOCK_REALTIME when the read() returned it
+    out_telemetry rec;
+};
+
+// lock-free single producer / single consumer queue, same scheme as snapshot_ring.h.
+// head and tail sit on their own cache lines so the two threads don't share one
+struct record_queue {
+    alignas(64) std::atomic<uint32_t> head;     // next slot to write, reader only
+    alignas(64) std::atomic<uint32_t> tail;     // next slot to read, writer only
+    alignas(64) std::atomic<uint64_t> drops;    // records lost to a full queue, counted by the reader
+    ingest_record slots[INGEST_QUEUE_LEN];
+};
+
+static inline void queue_init(record_queue *q)
+{
+    q->head.store(0, std::memory_order_relaxed);
+    q->tail.store(0, std::memory_order_relaxed);
+    q->drops.store(0, std::memory_order_relaxed);
+}
+
+// reader side, returns 0 (and counts a drop) if the writer is too far behind
+static inline int queue_push(record_queue *q, const ingest_record *r)
+{
+    uint32_t head = q->head.load(std::memory_order_relaxed);
+    uint32_t tail = q->tail.load(std::memory_order_acquire);
+    if((head - tail) >= INGEST_QUEUE_LEN)
+    {
+        q->drops.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    q->slots[head & (INGEST_QUEUE_LEN - 1)] = *r;
+    q->head.store(head + 1, std::memory_order_release);
+    return 1;
+}
+
+// writer side, the next record without taking it, NULL if there is nothing to read
+static inline const ingest_record *queue_peek(record_queue *q)
+{
+    uint32_t tail = q->tail.load(std::memory_order_relaxed);
+    uint32_t head = q->head.load(std::memory_order_acquire);
+    if(head == tail)
+        return NULL;
+    return &q->slots[tail & (INGEST_QUEUE_LEN - 1)];
+}
+
+// writer side, returns 0 if there is nothing to read
+static inline int queue_pop(record_queue *q, ingest_record *out)
+{
+    uint32_t tail = q->tail.load(std::memory_order_relaxed);
+    uint32_t head = q->head.load(std::memory_order_acquire);
+    if(head == tail)
+        return 0;
+    *out = q->slots[tail & (INGEST_QUEUE_LEN - 1)];
+    q->tail.store(tail + 1, std::memory_order_release);
+    return 1;
+}
+
+
+// latest-value table: the newest record of every car and the newest stats of every user_end.
+// every entry is a seqlock so a reader never waits for whoever is looking. a stats entry
+// only ever has its own input's reader writing it, a car entry may get records from more
+// than one, so those are claimed by turning version odd with a CAS first. ingestd -t puts the table in a shared file (e.g.
+// /dev/shm/telemetry) that any other process can latest_map() and latest_load() from
+// while ingestd runs
+#define LATEST_MAGIC        0x3454414C          // "LAT4", bumped with every change to base_stats or the layout
+
+struct latest_entry {
+    std::atomic<uint32_t> version;              // odd while a reader is writing the entry
+    uint32_t pad;
+    uint64_t host_us;
+    uint64_t records;                           // of this car since ingestd started
+    out_telemetry rec;
+};
+
+// user_end sends its stats as several records (link_stats.h), each one fills in its part
+struct latest_stats {
+    std::atomic<uint32_t> version;
+    uint32_t uptime_ms;                         // user_end's millis() in the newest stats record
+    uint64_t host_us;
+    uint64_t frames;
+    uint32_t receiver;                          // its RECEIVER_ID
+    uint32_t pad;
+    base_stats s;
+};
+
+struct latest_table {
+    uint32_t magic;                             // set once the table is ready
+    uint16_t num_cars;                          // NUM_CARS and NUM_CHANNELS of the ingestd that made it
+    uint16_t num_channels;
+    latest_entry cars[NUM_CARS];
+    latest_stats base[INGEST_MAX_INPUTS];       // per input of ingestd, in the order they were given
+};
+
+static inline void latest_store(latest_entry *e, const ingest_record *r)
+{
+    // another reader is in it, its store only takes a moment
+    uint32_t v = e->version.load(std::memory_order_relaxed);
+    while((v & 1) || !e->version.compare_exchange_weak(v, v + 1, std::memory_order_relaxed))
+        v = e->version.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e->host_us = r->host_us;
+    e->records++;
+    e->rec = r->rec;
+    e->version.store(v + 2, std::memory_order_release);
+}
+
+// copy an entry out, returns 0 if the car hasn't sent anything yet
+static inline int latest_load(const latest_entry *e, uint64_t *host_us, uint64_t *records, out_telemetry *rec)
+{
+    for(;;)
+    {
+        uint32_t v = e->version.load(std::memory_order_acquire);
+        if(v & 1)
+            continue;
+        *host_us = e->host_us;
+        *records = e->records;
+        memcpy(rec, &e->rec, sizeof(*rec));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(e->version.load(std::memory_order_relaxed) == v)
+            return *records != 0;
+    }
+}
+
+// store one stats record of user_end, returns 0 if it isn't one
+static inline int latest_stats_store(latest_stats *e, uint64_t host_us, const out_stats *st)
+{
+    uint32_t *dst;
+    size_t n;
+    if(st->source == STATS_SRC_BASE)
+    {
+        dst = (uint32_t *)&e->s;
+        n = BS_COUNTERS + BH_HISTS * STAT_HIST_BINS;
+    }
+    else if(st->source == STATS_SRC_BASE_CAR && st->id < NUM_CARS)
+    {
+        dst = e->s.car[st->id];
+        n = BC_COUNTERS;
+    }
+    else
+        return 0;
+    // a user_end of a different build sends more or fewer values, the rest stays 0
+    if(st->count < n)
+        n = st->count;
+
+    uint32_t v = e->version.load(std::memory_order_relaxed);
+    e->version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e->uptime_ms = st->uptime_ms;
+    e->host_us = host_us;
+    e->frames++;
+    if(st->source == STATS_SRC_BASE)
+        e->receiver = st->id;
+    memcpy(dst, st->v, 4 * n);
+    e->version.store(v + 2, std::memory_order_release);
+    return 1;
+}
+
+// copy the stats out, returns 0 if there were none yet
+static inline int latest_stats_load(const latest_stats *e, uint64_t *host_us, uint32_t *uptime_ms, uint32_t *receiver, base_stats *s)
+{
+    for(;;)
+    {
+        uint32_t v = e->version.load(std::memory_order_acquire);
+        if(v & 1)
+            continue;
+        *host_us = e->host_us;
+        *uptime_ms = e->uptime_ms;
+        *receiver = e->receiver;
+        uint64_t frames = e->frames;
+        memcpy(s, &e->s, sizeof(*s));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(e->version.load(std::memory_order_relaxed) == v)
+            return frames != 0;
+    }
+}
+
+// path NULL makes a private table, otherwise the file is created (create) or
+// opened and checked against this build. returns NULL on failure
+latest_table *latest_map(const char *path, bool create);
+
+
+// per car time series, <dir>/car<N>.csv (or .tlm, archive.h), appended to. rows
+// reach the kernel in INGEST_WRITE_BUF sized write()s (or one per archive chunk)
+// and the disk with one fdatasync() per fsync_ms, so a crash loses at most that
+// much and the reader's rate never depends on the disk
+struct car_writer {
+    int car;
+    int fd;
+    int fsync_ms;
+    bool use_archive;
+    archive_writer archive;                     // every sync ends the chunk so far
+    uint64_t last_us;                           // host time of the last record written
+    int inputs;
+    record_queue queues[INGEST_MAX_INPUTS];     // one per reader, the writer merges them
+    std::atomic<uint64_t> written;              // rows handed to the kernel
+    std::atomic<uint64_t> syncs;
+    bool failed;                                // a write failed, the rest is only counted
+    std::thread thread;
+};
+
+// open (or create) the car's file, returns -1 if it can't
+int writer_open(car_writer *w, const char *dir, int car, int inputs, int fsync_ms, bool use_archive);
+// records of the car lost to full queues, over every input
+uint64_t writer_drops(const car_writer *w);
+// starts the writer thread, which empties the queue until stop is set and it is empty
+void writer_start(car_writer *w, const std::atomic<bool> *stop);
+void writer_join(car_writer *w);
+
+#endif
@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "serial-link.h"
+#include "ingest.h"
+
+// ingestd: base station host daemon, see ingest.h
+
+#define DEFAULT_PORT "/dev/ttyACM0"            // same as serial_rx.py
+
+static std::atomic<bool> stop(false);           // signal or end of every input, the readers stop
+static std::atomic<bool> drained(false);        // the readers are out, writers finish their queues
+static std::atomic<int> readers_left(0);
+
+static void on_signal(int)
+{
+    stop = true;
+}
+
+static uint64_t realtime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// one per receiver (-p or -i)
+struct reader {
+    int input;                                  // its latest_table.base entry and its queue in every car_writer
+    int fd;
+    latest_table *table;
+    car_writer *writers;
+    std::atomic<uint64_t> records;
+    std::atomic<uint64_t> bad;                  // frames that didn't decode or had a car id out of range
+    std::atomic<uint64_t> stats;                // user_end stats records, they only go in the table
+};
+
+static void reader_main(reader *rd)
+{
+    unsigned char buf[65536];
+    unsigned char frame[OUT_MAX_FRAME_LEN];
+    int frame_len = 0;
+    struct pollfd p = { rd->fd, POLLIN, 0 };
+
+    while(!stop)
+    {
+        if(poll(&p, 1, 200) <= 0)
+            continue;
+        ssize_t n = read(rd->fd, buf, sizeof(buf));
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        // everything that came in with one read() gets the same time
+        uint64_t now = realtime_us();
+        for(ssize_t i = 0; i < n; i++)
+        {
+            if(buf[i] != 0)
+            {
+                // too long to be a record, wait for the next delimiter
+                if(frame_len < OUT_MAX_FRAME_LEN)
+                    frame[frame_len] = buf[i];
+                frame_len++;
+                continue;
+            }
+            unsigned char raw[OUT_MAX_RAW_LEN];
+            ingest_record r;
+            out_stats st;
+            int len = frame_len <= OUT_MAX_FRAME_LEN ? cobs_decode(frame, frame_len, raw, sizeof(raw)) : -1;
+            if(len > 0 && parse_stats_record(raw, len, &st) && latest_stats_store(&rd->table->base[rd->input], now, &st))
+            {
+                rd->stats.fetch_add(1, std::memory_order_relaxed);
+                frame_len = 0;
+                continue;
+            }
+            int ok = len > 0 && parse_telemetry_record(raw, len, &r.rec) && r.rec.car_id < NUM_CARS;
+            // an empty frame is just the stream starting mid-record
+            if(!ok && frame_len > 0)
+                rd->bad.fetch_add(1, std::memory_order_relaxed);
+            frame_len = 0;
+            if(!ok)
+                continue;
+
+            r.host_us = now;
+            latest_store(&rd->table->cars[r.rec.car_id], &r);
+            queue_push(&rd->writers[r.rec.car_id].queues[rd->input], &r);
+            rd->records.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    // end of a captured stream or the port went away, once that goes for every input we are done
+    if(--readers_left == 0)
+        stop = true;
+}
+
+// a receiver only sends the counters of its own cars, the others stay 0
+static void print_base_cars(const base_stats *s)
+{
+    for(int c = 0; c < NUM_CARS; c++)
+    {
+        const uint32_t *v = s->car[c];
+        bool heard = false;
+        for(int k = 0; k < BC_COUNTERS; k++)
+            heard |= v[k] != 0;
+        if(!heard)
+            continue;
+        printf("    car %d: %lu packets (%lu rebuilt), %lu records, %lu duplicates, %lu bad length, %lu no ref, %lu CRC errors, %lu skipped",
+               c, (unsigned long)v[BC_PACKETS], (unsigned long)v[BC_FEC_REBUILT], (unsigned long)v[BC_RECORDS],
+               (unsigned long)v[BC_DUPLICATES], (unsigned long)v[BC_BAD_LEN], (unsigned long)v[BC_NO_REF],
+               (unsigned long)v[BC_CRC_ERRORS], (unsigned long)v[BC_SKIPPED]);
+        if(v[BC_RSSI_N])
+            printf(", RSSI mean %.1f worst -%lu", -(double)v[BC_RSSI_SUM] / v[BC_RSSI_N], (unsigned long)v[BC_RSSI_WORST]);
+        printf("\n");
+    }
+}
+
+// ingestd -r: what a running ingestd has in its table right now
+static int print_table(const char *path)
+{
+    latest_table *t = latest_map(path, false);
+    if(!t)
+        return -1;
+    uint64_t now = realtime_us();
+    for(int c = 0; c < NUM_CARS; c++)
+    {
+        uint64_t host_us, records;
+        out_telemetry r;
+        if(!latest_load(&t->cars[c], &host_us, &records, &r))
+        {
+            printf("car %d: nothing yet\n", c);
+            continue;
+        }
+        printf("car %d: %llu records, newest %.1f s ago, seq %u, RSSI %d, SNR %.2f, Car_Time %lu%s\n", c,
+               (unsigned long long)records, (now - host_us) / 1e6, r.seq, r.rssi_dbm, r.snr_q4 / 4.0,
+               (unsigned long)r.car_time_ms, r.type == OUT_REC_BACKFILL ? " (backfill)" : "");
+        for(int i = 0; i < NUM_CHANNELS; i++)
+            printf("    %s=0x%04X\n", CHANNEL_NAMES[i], r.data.ch[i]);
+    }
+
+    int receivers = 0;
+    for(int i = 0; i < INGEST_MAX_INPUTS; i++)
+    {
+        uint64_t host_us;
+        uint32_t uptime_ms, receiver;
+        base_stats s;
+        if(!latest_stats_load(&t->base[i], &host_us, &uptime_ms, &receiver, &s))
+            continue;
+        receivers++;
+        printf("user_end %u: up %.1f s, stats %.1f s ago, %lu packets, %lu RX queue drops, %lu beacons, %lu bytes out\n",
+               receiver, uptime_ms / 1e3, (now - host_us) / 1e6, (unsigned long)s.v[BS_PACKETS], (unsigned long)s.v[BS_RX_DROPS],
+               (unsigned long)s.v[BS_BEACONS], (unsigned long)s.v[BS_OUT_BYTES]);
+        print_base_cars(&s);
+    }
+    if(!receivers)
+        printf("user_end: no stats yet\n");
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p port | -i file]... [-b baud] [-o dir] [-a] [-f ms] [-t table] [-s secs]\n", prog);
+    fprintf(stderr, "       %s -r table\n", prog);
+    fprintf(stderr, "  -p port   user_end (binary output, default %s), once per receiver (FREQ_RECEIVERS), up to %d\n",
+            DEFAULT_PORT, INGEST_MAX_INPUTS);
+    fprintf(stderr, "  -i file   read a captured stream instead, - for stdin, also once per receiver\n");
+    fprintf(stderr, "  -b baud   default %d (OUTPUT_BAUD)\n", OUTPUT_BAUD);
+    fprintf(stderr, "  -o dir    where car<N>.csv go (default .)\n");
+    fprintf(stderr, "  -a        write columnar car<N>.tlm archives instead (archive.h, read them with tlmdump)\n");
+    fprintf(stderr, "  -f ms     time between fdatasync()s (default %d)\n", INGEST_FSYNC_MS);
+    fprintf(stderr, "  -t file   keep the latest-value table in this file, e.g. /dev/shm/telemetry\n");
+    fprintf(stderr, "  -s secs   print counts this often (default 10, 0 = never)\n");
+    fprintf(stderr, "  -r file   print the latest-value table of a running ingestd and exit\n");
+}
+
+struct input {
+    const char *name;
+    bool file;                                  // -i, otherwise a serial port
+};
+
+int main(int argc, char* argv[])
+{
+    const char *dir = ".", *table_path = NULL;
+    std::vector<input> inputs;
+    int baud = OUTPUT_BAUD, fsync_ms = INGEST_FSYNC_MS, stats_s = 10;
+    bool use_archive = false;
+    int opt;
+    while((opt = getopt(argc, argv, "p:i:b:o:af:t:s:r:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p': inputs.push_back({ optarg, false }); break;
+        case 'i': inputs.push_back({ optarg, true }); break;
+        case 'b': baud = atoi(optarg); break;
+        case 'o': dir = optarg; break;
+        case 'a': use_archive = true; break;
+        case 'f': fsync_ms = atoi(optarg); break;
+        case 't': table_path = optarg; break;
+        case 's': stats_s = atoi(optarg); break;
+        case 'r': return print_table(optarg);
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(inputs.empty())
+        inputs.push_back({ DEFAULT_PORT, false });
+    if(fsync_ms < 1 || stats_s < 0 || (int)inputs.size() > INGEST_MAX_INPUTS)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    int n = (int)inputs.size();
+    latest_table *table = latest_map(table_path, true);
+    if(!table)
+        return -1;
+    std::unique_ptr<car_writer[]> writers(new car_writer[NUM_CARS]);
+    std::unique_ptr<reader[]> readers(new reader[n]);
+    for(int i = 0; i < n; i++)
+    {
+        reader *rd = &readers[i];
+        if(inputs[i].file)
+            rd->fd = strcmp(inputs[i].name, "-") == 0 ? 0 : open(inputs[i].name, O_RDONLY | O_CLOEXEC);
+        else
+            rd->fd = serial_open(inputs[i].name, baud);
+        if(rd->fd == -1)
+        {
+            if(inputs[i].file)
+                fprintf(stderr, "Unable to open %s: %s\n", inputs[i].name, strerror(errno));
+            return -1;
+        }
+        rd->input = i;
+        rd->table = table;
+        rd->writers = writers.get();
+        rd->records = 0;
+        rd->bad = 0;
+        rd->stats = 0;
+    }
+    for(int c = 0; c < NUM_CARS; c++)
+    {
+        if(writer_open(&writers[c], dir, c, n, fsync_ms, use_archive) == -1)
+            return -1;
+        writer_start(&writers[c], &drained);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    readers_left = n;
+    std::vector<std::thread> reader_threads;
+    for(int i = 0; i < n; i++)
+        reader_threads.emplace_back(reader_main, &readers[i]);
+    uint64_t last[NUM_CARS] = {};
+    int ticks = 0;
+    while(!stop)
+    {
+        usleep(100000);
+        if(!stats_s || ++ticks < stats_s * 10)
+            continue;
+        ticks = 0;
+        uint64_t records = 0, bad = 0, stats = 0;
+        for(int i = 0; i < n; i++)
+        {
+            records += readers[i].records.load(std::memory_order_relaxed);
+            bad += readers[i].bad.load(std::memory_order_relaxed);
+            stats += readers[i].stats.load(std::memory_order_relaxed);
+        }
+        fprintf(stderr, "%llu records, %llu bad frames, %llu stats |", (unsigned long long)records,
+                (unsigned long long)bad, (unsigned long long)stats);
+        for(int c = 0; c < NUM_CARS; c++)
+        {
+            uint64_t written = writers[c].written.load(std::memory_order_relaxed);
+            fprintf(stderr, " car %d %.1f/s, %llu dropped", c, (double)(written - last[c]) / stats_s,
+                    (unsigned long long)writer_drops(&writers[c]));
+            last[c] = written;
+        }
+        fprintf(stderr, "\n");
+    }
+
+    // the readers are out first, then every writer empties its queues and syncs once more
+    for(std::thread &t : reader_threads)
+        t.join();
+    drained = true;
+    uint64_t records = 0, bad = 0, stats = 0, written = 0, dropped = 0;
+    for(int i = 0; i < n; i++)
+    {
+        records += readers[i].records;
+        bad += readers[i].bad;
+        stats += readers[i].stats;
+    }
+    for(int c = 0; c < NUM_CARS; c++)
+    {
+        writer_join(&writers[c]);
+        written += writers[c].written;
+        dropped += writer_drops(&writers[c]);
+    }
+    fprintf(stderr, "%llu records, %llu written, %llu dropped, %llu bad frames, %llu stats\n",
+            (unsigned long long)records, (unsigned long long)written,
+            (unsigned long long)dropped, (unsigned long long)bad, (unsigned long long)stats);
+    return 0;
+}
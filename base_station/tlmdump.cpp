@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "archive.h"
+
+// tlmdump: what is in a car<N>.tlm archive of ingestd, or some of its channels as csv
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// everything here comes from the index blocks, no column is read
+static void summary(const archive_reader &a, const char *path)
+{
+    uint64_t records = 0;
+    size_t raw = 0;
+    uint16_t lo[NUM_CHANNELS], hi[NUM_CHANNELS];
+    for(int ch = 0; ch < NUM_CHANNELS; ch++)
+    {
+        lo[ch] = UINT16_MAX;
+        hi[ch] = 0;
+    }
+    for(const chunk_header *c : a.chunks)
+    {
+        records += c->records;
+        for(int ch = 0; ch < NUM_CHANNELS; ch++)
+        {
+            raw += 2 * c->records;
+            lo[ch] = c->min[ch] < lo[ch] ? c->min[ch] : lo[ch];
+            hi[ch] = c->max[ch] > hi[ch] ? c->max[ch] : hi[ch];
+        }
+    }
+    printf("%s: car %d, %llu records in %zu chunks, %zu bytes\n", path, a.hdr->car,
+           (unsigned long long)records, a.chunks.size(), a.size);
+    if(a.chunks.empty())
+        return;
+    size_t cols = 0;
+    for(const chunk_header *c : a.chunks)
+        for(int ch = 0; ch < NUM_CHANNELS; ch++)
+            cols += c->col_len[ch];
+    printf("%.1f s from %llu us, channel columns %zu bytes (%.0f%% of raw)\n",
+           (a.chunks.back()->host_last_us - a.chunks.front()->host_first_us) / 1e6,
+           (unsigned long long)a.chunks.front()->host_first_us, cols, 100.0 * cols / raw);
+    for(int ch = 0; ch < NUM_CHANNELS; ch++)
+        printf("    %-*s min %5u max %5u\n", ARCHIVE_NAME_LEN, a.hdr->names[ch], lo[ch], hi[ch]);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c channel[,channel...]] [-f from] [-t to] file.tlm\n", prog);
+    fprintf(stderr, "  without -c: records, time span and min/max of every channel\n");
+    fprintf(stderr, "  -c names  print these channels as csv instead\n");
+    fprintf(stderr, "  -f secs   from this many seconds after the first record (default 0)\n");
+    fprintf(stderr, "  -t secs   up to this many seconds after the first record (default the end)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char *channels = NULL;
+    double from_s = 0, to_s = -1;
+    int opt;
+    while((opt = getopt(argc, argv, "c:f:t:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c': channels = optarg; break;
+        case 'f': from_s = atof(optarg); break;
+        case 't': to_s = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    const char *path = argv[optind];
+
+    double start = now_ms();
+    archive_reader a;
+    if(archive_open(&a, path) == -1)
+        return -1;
+    if(!channels)
+    {
+        summary(a, path);
+        archive_unmap(&a);
+        return 0;
+    }
+
+    // names are looked up in the archive's own copy of CHANNEL_NAMES
+    std::vector<int> chs;
+    std::string list = channels;
+    size_t pos = 0;
+    while(pos <= list.size())
+    {
+        size_t end = list.find(',', pos);
+        if(end == std::string::npos)
+            end = list.size();
+        std::string name = list.substr(pos, end - pos);
+        int found = -1;
+        for(int ch = 0; ch < NUM_CHANNELS; ch++)
+            if(name == a.hdr->names[ch])
+                found = ch;
+        if(found < 0)
+        {
+            fprintf(stderr, "%s has no channel %s\n", path, name.c_str());
+            return -1;
+        }
+        chs.push_back(found);
+        pos = end + 1;
+    }
+
+    uint64_t first = a.chunks.empty() ? 0 : a.chunks.front()->host_first_us;
+    uint64_t from_us = first + (uint64_t)(from_s * 1e6);
+    uint64_t to_us = to_s < 0 ? UINT64_MAX : first + (uint64_t)(to_s * 1e6);
+    std::vector<uint64_t> t;
+    std::vector<std::vector<uint16_t>> v(chs.size());
+    for(size_t i = 0; i < chs.size(); i++)
+    {
+        t.clear();
+        archive_range(&a, chs[i], from_us, to_us, t, v[i]);
+    }
+    double took = now_ms() - start;
+
+    printf("Host_Time_us");
+    for(int ch : chs)
+        printf(",%s", a.hdr->names[ch]);
+    printf("\n");
+    for(size_t r = 0; r < t.size(); r++)
+    {
+        printf("%llu", (unsigned long long)t[r]);
+        for(size_t i = 0; i < chs.size(); i++)
+            printf(",%u", v[i][r]);
+        printf("\n");
+    }
+    fprintf(stderr, "%zu records of %zu channels in %.2f ms\n", t.size(), chs.size(), took);
+    archive_unmap(&a);
+    return 0;
+}
@@ -0,0 +1,160 @@
+// adaptive data rate shared between car_end and user_end
+//
+// user_end keeps a smoothed RSSI/SNR per car and picks the fastest rate from
+// ADR_RATES that still leaves ADR_MARGIN_DB of link margin. the pick goes back to
+// the car in every ACK and into the car's slot of the next beacon, and both ends
+// switch to it when that slot opens. beacons themselves always go out at the
+// beacon rate so a car that is on the wrong rate can still find its way back.
+#pragma once
+
+#include <stdint.h>
+#include "shared_defs.h"
+
+struct data_rate {
+    uint8_t sf;
+    float   bw_khz;
+    uint8_t cr;                 // 4/cr
+    uint8_t slot_scale;         // TDMA slot length in units of TDMA_SLOT_MS
+    int16_t min_snr_q4;         // demodulation floor, SNR * 4
+    int16_t sens_q4;            // SX1262 sensitivity, dBm * 4
+    int16_t noise_q4;           // extra noise against BW125 (10 log(bw / 125)) * 4
+};
+
+// slowest first, the index is what goes over the air
+static constexpr data_rate ADR_RATES[] = {
+    { 9, 125.0, 7, 4, -50, -516,  0 },     // far end of the track
+    { 8, 125.0, 7, 2, -40, -504,  0 },
+    { 7, 125.0, 7, 1, -30, -492,  0 },     // what both ends always used before
+    { 7, 250.0, 7, 1, -30, -480, 12 },
+    { 6, 250.0, 7, 1, -20, -468, 12 },
+    { 5, 500.0, 7, 1, -10, -444, 24 },     // next to the pits
+};
+static constexpr uint8_t ADR_NUM_RATES = sizeof(ADR_RATES) / sizeof(ADR_RATES[0]);
+
+static_assert(ADR_DEFAULT_DR < ADR_NUM_RATES && ADR_BEACON_DR < ADR_NUM_RATES, "data rate outside ADR_RATES");
+static_assert(!ADR_ENABLED || TDMA_ENABLED, "ADR needs TDMA so the base station knows who is on which rate");
+
+// rate the beacons use
+static inline uint8_t adr_beacon_dr() {
+    return ADR_ENABLED ? ADR_BEACON_DR : ADR_DEFAULT_DR;
+}
+
+
+// time on air in ms (Semtech AN1200.13, explicit header, CRC on, 8 symbol preamble)
+static inline uint32_t adr_airtime_ms(uint8_t dr, int len) {
+    const data_rate &r = ADR_RATES[dr];
+    uint32_t sym_us = (uint32_t)((1u << r.sf) * 1000 / r.bw_khz);
+    int de = sym_us > 16000 ? 1 : 0;        // low data rate optimisation
+
+    int num = 8 * len - 4 * r.sf + 28 + 16;
+    int den = 4 * (r.sf - 2 * de);
+    int payload_sym = 8 + (num > 0 ? (num + den - 1) / den * r.cr : 0);
+
+    // preamble is 8 + 4.25 symbols
+    return (sym_us * (4 * 8 + 17) / 4 + sym_us * payload_sym + 999) / 1000;
+}
+
+// slot time that has to stay free after the last packet so its ACK fits
+static inline uint32_t adr_ack_reserve_ms(uint8_t dr) {
+    return adr_airtime_ms(dr, ACK_LEN) + TDMA_ACK_RESERVE_MS;
+}
+
+// longest packet that fits in a slot of slot_ms at this rate, 0 if none does
+// car_end checks every packet against what is left of its slot (rounding the airtime
+// up by 1 ms) and only notices the slot opened a little late, so this keeps another
+// guard time spare. otherwise a packet of exactly this length could never go out and
+// would hold up the window behind it for good.
+static inline int adr_max_len(uint8_t dr, uint32_t slot_ms) {
+    uint32_t reserve = adr_ack_reserve_ms(dr) + 2 * TDMA_GUARD_MS + 1;
+    for (int len = MAX_PCK_LEN; len > HEADER_LEN; len--) {
+        if (adr_airtime_ms(dr, len) + reserve <= slot_ms) return len;
+    }
+    return 0;
+}
+
+// packets of len bytes that go out back to back in one slot of slot_ms, at least 1
+static inline int adr_slot_packets(uint8_t dr, uint32_t slot_ms, int len) {
+    uint32_t reserve = adr_ack_reserve_ms(dr) + 2 * TDMA_GUARD_MS + 1;
+    int n = slot_ms > reserve ? (int)((slot_ms - reserve) / (adr_airtime_ms(dr, len) + 1)) : 0;
+    return n > 1 ? n : 1;
+}
+
+
+/* ---------------------------------- base station side ---------------------------------- */
+
+struct adr_state {
+    uint8_t dr;                 // rate the car is on this superframe
+    uint8_t next_dr;            // rate for its next slot (sent in ACKs and the next beacon)
+    uint8_t samples;            // packets heard at dr
+    uint8_t silent;             // superframes in a row we heard nothing from it
+    uint8_t heard;              // heard anything this superframe
+    int16_t snr_q4;             // smoothed SNR * 4
+    int16_t rssi_q4;            // smoothed RSSI * 4
+};
+
+static inline void adr_init(adr_state *a) {
+    a->dr = ADR_DEFAULT_DR;
+    a->next_dr = ADR_DEFAULT_DR;
+    a->samples = 0;
+    a->silent = 0;
+    a->heard = 0;
+    a->snr_q4 = 0;
+    a->rssi_q4 = 0;
+}
+
+// margin left at rate c for a link measured at rate a->dr, in dB * 4
+static inline int adr_margin_q4(const adr_state *a, uint8_t c) {
+    const data_rate &r = ADR_RATES[c];
+    int snr = a->snr_q4 - (r.noise_q4 - ADR_RATES[a->dr].noise_q4);
+    int snr_margin = snr - r.min_snr_q4;
+    int rssi_margin = a->rssi_q4 - r.sens_q4;
+    return snr_margin < rssi_margin ? snr_margin : rssi_margin;
+}
+
+// feed one received packet, updates next_dr
+static inline void adr_update(adr_state *a, int16_t rssi_q4, int16_t snr_q4) {
+    if (a->samples == 0) {
+        a->snr_q4 = snr_q4;
+        a->rssi_q4 = rssi_q4;
+    } else {
+        a->snr_q4 = (int16_t)(a->snr_q4 + (snr_q4 - a->snr_q4) / 4);
+        a->rssi_q4 = (int16_t)(a->rssi_q4 + (rssi_q4 - a->rssi_q4) / 4);
+    }
+    if (a->samples < 0xFF) a->samples++;
+    a->heard = 1;
+
+    if (!ADR_ENABLED) return;
+
+    // fastest rate with enough margin
+    uint8_t best = 0;
+    for (uint8_t c = 0; c < ADR_NUM_RATES; c++) {
+        if (adr_margin_q4(a, c) >= ADR_MARGIN_DB * 4) best = c;
+    }
+
+    // drop straight away, but only step up one rate at a time once the average has settled
+    if (best < a->dr) {
+        a->next_dr = best;
+    } else if (best > a->dr && a->samples >= ADR_MIN_SAMPLES) {
+        a->next_dr = (uint8_t)(a->dr + 1);
+    } else {
+        a->next_dr = a->dr;
+    }
+}
+
+// called for every car when a new superframe starts, returns the rate for its slot
+// a car we keep missing gets stepped down in case it lost the link at its rate
+static inline uint8_t adr_new_superframe(adr_state *a) {
+    if (a->heard) {
+        a->silent = 0;
+    } else if (ADR_ENABLED && ++a->silent >= ADR_LOST_FRAMES) {
+        a->silent = 0;
+        if (a->next_dr > 0) a->next_dr--;
+    }
+    a->heard = 0;
+
+    if (a->next_dr != a->dr) {
+        a->dr = a->next_dr;
+        a->samples = 0;
+    }
+    return a->dr;
+}
@@ -0,0 +1,364 @@
+// sliding window selective-repeat ARQ shared between car_end and user_end
+//
+// byte 1 of every data packet holds a 7 bit sequence number, the top bit is the
+// poll flag that asks the receiver to answer with an ACK. the car sends a burst of
+// packets back to back and only polls on the last one, so the half-duplex radio
+// is never transmitting two things at once. the ACK carries a cumulative sequence
+// number plus a bitmap of what arrived after it, so one ACK clears the whole burst.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+
+#define SEQ_SPACE       (SEQ_MASK + 1)
+
+// the ACK layout and status codes are in wire_schema.h
+#define ACK_BASE_LEN    WIRE_LEN(ACK)
+
+#if WINDOW_SIZE > 8 || WINDOW_SIZE > (SEQ_SPACE / 2)
+#error "WINDOW_SIZE must fit in the 8 bit ACK bitmap"
+#endif
+
+
+// forward distance from one sequence number to another
+static inline uint8_t seq_dist(uint8_t from, uint8_t to) {
+    return (uint8_t)((to - from) & SEQ_MASK);
+}
+
+// make a packet given the sequence number and the actual data (at most MAX_PCK_LEN - HEADER_LEN)
+static inline void make_packet(uint8_t sender_id, uint8_t seq, const uint8_t *data, uint8_t data_len, uint8_t out_packet[MAX_PCK_LEN]) {
+    wire_put(out_packet, PKT_ID, sender_id);
+    wire_put(out_packet, PKT_SEQ, seq & SEQ_MASK);
+    memcpy(out_packet + HEADER_LEN, data, data_len);
+}
+
+
+// what the optional ACK fields said, anything not sent is left at 0
+struct ack_ext {
+    uint8_t has_link;
+    uint8_t has_loss;
+    uint8_t has_backfill;
+    int8_t  rssi_dbm;
+    int8_t  snr_q4;
+    uint8_t lost;
+    uint32_t backfill_from;
+};
+
+// append the optional fields chosen by flags (ACK_F_*) after the base fields, returns the ACK length
+static inline int ack_put_ext(uint8_t *ack, uint8_t flags, const ack_ext *ext) {
+    int n = ACK_BASE_LEN;
+    wire_put(ack, ACK_VER_FLAGS, (ACK_VERSION << 4) | (flags & 0x0F));
+    if (flags & ACK_F_LINK) {
+        wire_put(ack + n, ACK_LINK_RSSI, ext->rssi_dbm);
+        wire_put(ack + n, ACK_LINK_SNR, ext->snr_q4);
+        n += WIRE_LEN(ACK_LINK);
+    }
+    if (flags & ACK_F_LOSS) {
+        wire_put(ack + n, ACK_LOSS_LOST, ext->lost);
+        n += WIRE_LEN(ACK_LOSS);
+    }
+    if (flags & ACK_F_BACKFILL) {
+        wire_put(ack + n, ACK_BACKFILL_INDEX, ext->backfill_from);
+        n += WIRE_LEN(ACK_BACKFILL);
+    }
+    return n;
+}
+
+// read the optional fields, returns 0 if the ACK is shorter than the base fields
+// a newer version keeps the base fields but its optional fields are skipped
+static inline int ack_get_ext(const uint8_t *ack, int len, ack_ext *ext) {
+    memset(ext, 0, sizeof(*ext));
+    if (len < ACK_BASE_LEN) return 0;
+    if ((ack[ACK_VER_FLAGS] >> 4) != ACK_VERSION) return 1;
+
+    uint8_t flags = ack[ACK_VER_FLAGS] & 0x0F;
+    int n = ACK_BASE_LEN;
+    if ((flags & ACK_F_LINK) && n + WIRE_LEN(ACK_LINK) <= len) {
+        ext->has_link = 1;
+        ext->rssi_dbm = wire_get(ack + n, ACK_LINK_RSSI);
+        ext->snr_q4 = wire_get(ack + n, ACK_LINK_SNR);
+        n += WIRE_LEN(ACK_LINK);
+    }
+    if ((flags & ACK_F_LOSS) && n + WIRE_LEN(ACK_LOSS) <= len) {
+        ext->has_loss = 1;
+        ext->lost = wire_get(ack + n, ACK_LOSS_LOST);
+        n += WIRE_LEN(ACK_LOSS);
+    }
+    if ((flags & ACK_F_BACKFILL) && n + WIRE_LEN(ACK_BACKFILL) <= len) {
+        ext->has_backfill = 1;
+        ext->backfill_from = wire_get(ack + n, ACK_BACKFILL_INDEX);
+        n += WIRE_LEN(ACK_BACKFILL);
+    }
+    return 1;
+}
+
+
+/* ---------------------------------- retransmit timer ---------------------------------- */
+
+// Jacobson/Karels smoothed RTT (RFC 6298), the car keeps one per data rate
+// srtt is kept * 8 and rttvar * 4 so the gains are shifts
+struct rtt_estimator {
+    uint8_t  valid;             // at least one sample
+    uint32_t srtt_x8;
+    uint32_t rttvar_x4;
+    uint32_t rto_ms;
+};
+
+static inline uint32_t rtt_clamp(uint32_t ms) {
+    return ms < RTO_MIN_MS ? RTO_MIN_MS : (ms > RTO_MAX_MS ? RTO_MAX_MS : ms);
+}
+
+// initial_ms is used until the first sample comes in
+static inline void rtt_init(rtt_estimator *r, uint32_t initial_ms) {
+    r->valid = 0;
+    r->srtt_x8 = 0;
+    r->rttvar_x4 = 0;
+    r->rto_ms = rtt_clamp(initial_ms);
+}
+
+// one round trip (poll off the air -> ACK received) of a packet that was only sent once
+static inline void rtt_sample(rtt_estimator *r, uint32_t rtt_ms) {
+    if (!r->valid) {
+        r->srtt_x8 = rtt_ms << 3;
+        r->rttvar_x4 = rtt_ms << 1;
+        r->valid = 1;
+    } else {
+        int32_t err = (int32_t)rtt_ms - (int32_t)(r->srtt_x8 >> 3);
+        uint32_t abs_err = err < 0 ? (uint32_t)-err : (uint32_t)err;
+        r->srtt_x8 = (uint32_t)((int32_t)r->srtt_x8 + err);                    // srtt += err / 8
+        r->rttvar_x4 = r->rttvar_x4 - (r->rttvar_x4 >> 2) + abs_err;            // rttvar += (|err| - rttvar) / 4
+    }
+    r->rto_ms = rtt_clamp((r->srtt_x8 >> 3) + r->rttvar_x4);
+}
+
+// timeout for the given attempt (1 = first transmission), doubled on every retry
+static inline uint16_t rtt_timeout(const rtt_estimator *r, uint8_t attempt) {
+    uint32_t ms = r->rto_ms;
+    for (uint8_t i = 1; i < attempt && ms < RTO_MAX_MS; i++) {
+        ms <<= 1;
+    }
+    return (uint16_t)rtt_clamp(ms);
+}
+
+
+/* ---------------------------------- transmit side ---------------------------------- */
+
+// one in-flight packet and its retransmit timer
+struct tx_slot {
+    uint8_t  in_use;
+    uint8_t  seq;
+    uint8_t  attempts;          // number of times it has been put on air
+    uint8_t  len;               // packet length including the header
+    uint16_t rto_ms;            // retransmit timeout of the last transmission
+    uint32_t sent_ms;           // time of the last transmission
+    uint8_t  packet[MAX_PCK_LEN];
+};
+
+struct tx_window {
+    uint8_t next_seq;
+    tx_slot slots[WINDOW_SIZE];
+};
+
+static inline void tx_window_init(tx_window *w) {
+    memset(w, 0, sizeof(*w));
+}
+
+// number of packets still waiting on an ACK
+static inline int tx_outstanding(const tx_window *w) {
+    int n = 0;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        if (w->slots[i].in_use) n++;
+    }
+    return n;
+}
+
+// the oldest unacknowledged packet, NULL if nothing is in flight
+static inline tx_slot *tx_oldest(tx_window *w) {
+    tx_slot *oldest = NULL;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (!s->in_use) continue;
+        if (oldest == NULL || seq_dist(s->seq, oldest->seq) < SEQ_SPACE / 2) oldest = s;
+    }
+    return oldest;
+}
+
+// a new packet may only be queued while every in-flight seq stays inside one
+// window of the oldest, otherwise the receiver would slide past the oldest
+static inline int tx_can_queue(tx_window *w) {
+    tx_slot *oldest = tx_oldest(w);
+    if (oldest == NULL) return 1;
+    return seq_dist(oldest->seq, w->next_seq) < WINDOW_SIZE;
+}
+
+// put a new packet into a free slot and give it the next sequence number
+// returns NULL if the window is full
+static inline tx_slot *tx_queue(tx_window *w, uint8_t sender_id, const uint8_t *data, uint8_t data_len) {
+    if (!tx_can_queue(w)) return NULL;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (s->in_use) continue;
+        s->in_use = 1;
+        s->seq = w->next_seq;
+        s->attempts = 0;
+        s->rto_ms = 0;
+        s->sent_ms = 0;
+        s->len = (uint8_t)(HEADER_LEN + data_len);
+        make_packet(sender_id, s->seq, data, data_len, s->packet);
+        w->next_seq = (uint8_t)((w->next_seq + 1) & SEQ_MASK);
+        return s;
+    }
+    return NULL;
+}
+
+// the next packet that has to go on air: never sent yet, or its timer ran out
+// packets that already used up MAX_RETRIES are left for tx_drop_expired()
+static inline tx_slot *tx_next_due(tx_window *w, uint32_t now) {
+    tx_slot *due = NULL;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (!s->in_use) continue;
+        if (s->attempts > 0 && (now - s->sent_ms) < s->rto_ms) continue;
+        if (s->attempts >= MAX_RETRIES) continue;
+        // oldest first so the receiver window can slide
+        if (due == NULL || seq_dist(s->seq, due->seq) < SEQ_SPACE / 2) due = s;
+    }
+    return due;
+}
+
+// give an in-flight packet new contents, it keeps its seq and retry count
+static inline void tx_replace(tx_slot *s, uint8_t sender_id, const uint8_t *data, uint8_t data_len) {
+    make_packet(sender_id, s->seq, data, data_len, s->packet);
+    s->len = (uint8_t)(HEADER_LEN + data_len);
+}
+
+// the timer for this attempt comes from the RTT estimate of the rate it goes out on
+static inline void tx_mark_sent(tx_slot *s, uint32_t now, const rtt_estimator *r) {
+    s->attempts++;
+    s->rto_ms = rtt_timeout(r, s->attempts);
+    s->sent_ms = now;
+}
+
+// the ACK only comes after the poll, so restart the timers of the whole burst when the poll is off the air
+static inline void tx_start_timers(tx_window *w, uint32_t burst_start, uint32_t now) {
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (s->in_use && s->attempts > 0 && (int32_t)(s->sent_ms - burst_start) >= 0) s->sent_ms = now;
+    }
+}
+
+// free packets that timed out on their last attempt, calls on_drop for each one
+// returns how many were dropped
+static inline int tx_drop_expired(tx_window *w, uint32_t now, void (*on_drop)(const tx_slot *)) {
+    int dropped = 0;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (!s->in_use || s->attempts < MAX_RETRIES) continue;
+        if ((now - s->sent_ms) < s->rto_ms) continue;
+        if (on_drop) on_drop(s);
+        s->in_use = 0;
+        dropped++;
+    }
+    return dropped;
+}
+
+// free every packet covered by a cumulative seq + bitmap, calls on_ack for each one
+// returns how many were acknowledged
+static inline int tx_apply_ack(tx_window *w, uint8_t cum, uint8_t bitmap, void (*on_ack)(const tx_slot *)) {
+    int acked = 0;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (!s->in_use) continue;
+        uint8_t d = seq_dist(cum, s->seq);
+        // anything behind cum has been received
+        int got = d >= SEQ_SPACE / 2;
+        if (d >= 1 && d <= 8 && (bitmap & (1u << (d - 1)))) got = 1;
+        if (!got) continue;
+        if (on_ack) on_ack(s);
+        s->in_use = 0;
+        acked++;
+    }
+    return acked;
+}
+
+// make every in-flight packet due right away (the receiver told us it lost something)
+static inline void tx_expire_all(tx_window *w, uint32_t now) {
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        tx_slot *s = &w->slots[i];
+        if (s->in_use && s->attempts > 0) s->sent_ms = now - s->rto_ms;
+    }
+}
+
+
+/* ---------------------------------- receive side ---------------------------------- */
+
+#define RX_NEW          0
+#define RX_DUPLICATE    1
+
+struct rx_window {
+    int16_t  base;              // next expected seq, -1 until the first packet
+    uint16_t mask;              // bit i set -> seq (base + i) has been received
+    uint8_t  lost;              // wrapping count of seqs the window slid past without receiving
+};
+
+static inline void rx_window_init(rx_window *w) {
+    w->base = -1;
+    w->mask = 0;
+    w->lost = 0;
+}
+
+// record a received seq, returns RX_NEW the first time a seq is seen
+static inline int rx_accept(rx_window *w, uint8_t seq) {
+    seq &= SEQ_MASK;
+    if (w->base < 0) {
+        w->base = seq;
+        w->mask = 0;
+    }
+
+    uint8_t d = seq_dist((uint8_t)w->base, seq);
+
+    // behind the window, already delivered
+    if (d >= SEQ_SPACE - WINDOW_SIZE) return RX_DUPLICATE;
+
+    // ahead of the window, the sender gave up on the oldest ones so slide up to it
+    if (d >= WINDOW_SIZE) {
+        uint8_t shift = d - (WINDOW_SIZE - 1);
+        for (uint8_t k = 0; k < shift; k++) {
+            if (k >= 16 || (w->mask & (1u << k)) == 0) w->lost++;
+        }
+        w->mask = shift >= 16 ? 0 : (uint16_t)(w->mask >> shift);
+        w->base = (int16_t)((w->base + shift) & SEQ_MASK);
+        d = WINDOW_SIZE - 1;
+    }
+
+    if (w->mask & (1u << d)) return RX_DUPLICATE;
+    w->mask |= (uint16_t)(1u << d);
+
+    // slide past everything received in order
+    while (w->mask & 1u) {
+        w->mask >>= 1;
+        w->base = (int16_t)((w->base + 1) & SEQ_MASK);
+    }
+    return RX_NEW;
+}
+
+// what rx_accept would return, without recording anything
+static inline int rx_seen(const rx_window *w, uint8_t seq) {
+    if (w->base < 0) return RX_NEW;
+    uint8_t d = seq_dist((uint8_t)w->base, (uint8_t)(seq & SEQ_MASK));
+    if (d >= SEQ_SPACE - WINDOW_SIZE) return RX_DUPLICATE;
+    if (d >= WINDOW_SIZE) return RX_NEW;
+    return (w->mask & (1u << d)) ? RX_DUPLICATE : RX_NEW;
+}
+
+// something after the next expected seq has arrived, so the next expected one is missing
+static inline int rx_has_gap(const rx_window *w) {
+    return w->base >= 0 && (w->mask >> 1) != 0;
+}
+
+// cumulative seq and bitmap for the ACK
+static inline void rx_ack_fields(const rx_window *w, uint8_t *cum, uint8_t *bitmap) {
+    *cum = (uint8_t)(w->base < 0 ? 0 : w->base);
+    *bitmap = (uint8_t)((w->mask >> 1) & 0xFF);
+}
@@ -0,0 +1,118 @@
+// several timestamped snapshots in one LoRa packet
+//
+// a batch packet has BATCH_FLAG set in byte 0 (next to the sender_id), then the BATCH
+// header and every record with its BATCH_REC header (wire_schema.h). a record is a
+// keyframe (DATA_BYTES long) or a delta.
+// one ACK covers the whole batch so the packet and ACK overhead is paid once per BATCH_SIZE samples
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+
+static_assert(MAX_PCK_LEN <= 255, "batch does not fit in one SX1262 packet");
+static_assert(NUM_CARS <= SENDER_MASK, "sender_id has to leave room for BATCH_FLAG");
+
+struct batch_builder {
+    uint8_t  count;
+    uint8_t  len;                       // bytes used in buf
+    uint32_t base_ms;
+    uint16_t gen;                       // generation of the last record
+    uint8_t  buf[MAX_PCK_LEN - HEADER_LEN];
+};
+
+struct batch_record {
+    uint32_t       time_ms;
+    const uint8_t *data;
+    uint8_t        len;
+};
+
+static inline void batch_init(batch_builder *b) {
+    b->count = 0;
+    b->len = BATCH_HDR_LEN;
+    b->base_ms = 0;
+    b->gen = 0;
+}
+
+// add one record, returns 0 if it doesn't fit (flush and try again)
+static inline int batch_add(batch_builder *b, uint32_t time_ms, uint16_t gen, const uint8_t *data, uint8_t len) {
+    if (b->count >= BATCH_SIZE || b->len + BATCH_REC_HDR_LEN + len > (int)sizeof(b->buf)) {
+        return 0;
+    }
+    if (b->count == 0) {
+        b->base_ms = time_ms;
+    }
+    uint32_t dt = time_ms - b->base_ms;
+    if (dt > 0xFFFF) {
+        return 0;
+    }
+
+    uint8_t *rec = b->buf + b->len;
+    wire_put(rec, BATCH_REC_DT_MS, dt);
+    wire_put(rec, BATCH_REC_LEN, len);
+    memcpy(rec + BATCH_REC_HDR_LEN, data, len);
+    b->len = (uint8_t)(b->len + BATCH_REC_HDR_LEN + len);
+    b->count++;
+    b->gen = gen;
+
+    // keep the batch header up to date so buf can be sent as is
+    wire_put(b->buf, BATCH_COUNT, b->count);
+    wire_put(b->buf, BATCH_BASE_MS, b->base_ms);
+    wire_put(b->buf, BATCH_GEN, b->gen);
+    return 1;
+}
+
+// walk the records of a received batch, pos starts at 0
+// returns 1 for every record, 0 at the end, -1 if the batch is malformed
+static inline int batch_next(const uint8_t *payload, int len, int *pos, batch_record *rec) {
+    if (len < BATCH_HDR_LEN) {
+        return -1;
+    }
+    if (*pos == 0) {
+        *pos = BATCH_HDR_LEN;
+    }
+    if (*pos == len) {
+        return 0;
+    }
+    if (*pos + BATCH_REC_HDR_LEN > len) {
+        return -1;
+    }
+
+    const uint8_t *r = payload + *pos;
+    rec->time_ms = wire_get(payload, BATCH_BASE_MS) + wire_get(r, BATCH_REC_DT_MS);
+    rec->len = wire_get(r, BATCH_REC_LEN);
+    rec->data = r + BATCH_REC_HDR_LEN;
+    if (rec->len == 0 || rec->len > DATA_BYTES || *pos + BATCH_REC_HDR_LEN + rec->len > len) {
+        return -1;
+    }
+    *pos += BATCH_REC_HDR_LEN + rec->len;
+    return 1;
+}
+
+static inline int batch_count(const uint8_t *payload) {
+    return wire_get(payload, BATCH_COUNT);
+}
+
+static inline uint16_t batch_gen(const uint8_t *payload) {
+    return wire_get(payload, BATCH_GEN);
+}
+
+// the records of a queued batch after the first *done into b, as many as fit in a packet of
+// max_len, to send the batch again in parts at a slower rate. records carry no generation
+// of their own, so a part gets the batch's less the records behind it.
+// returns how many went in, 0 at the end or if the next record doesn't fit on its own
+static inline int batch_take(const uint8_t *payload, int len, int *done, int max_len, batch_builder *b) {
+    batch_init(b);
+    batch_record rec;
+    int pos = 0;
+    int i = 0;
+    while (batch_next(payload, len, &pos, &rec) > 0) {
+        if (i++ < *done) continue;
+        if (HEADER_LEN + b->len + BATCH_REC_HDR_LEN + rec.len > max_len) break;
+        if (!batch_add(b, rec.time_ms, 0, rec.data, rec.len)) break;
+    }
+    *done += b->count;
+    b->gen = (uint16_t)(batch_gen(payload) - (batch_count(payload) - *done));
+    wire_put(b->buf, BATCH_GEN, b->gen);
+    return b->count;
+}
@@ -3,8 +3,24 @@
 #include <XPowersLib.h>
 #include <cstdint>
 #include <ESP32-TWAI-CAN.hpp>
+#include <LittleFS.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
 #include "utilities.h"
 #include <shared_defs.h>
+#include <arq.h>
+#include <signal_table.h>
+#include <snapshot_ring.h>
+#include <telemetry_codec.h>
+#include <batch.h>
+#include <tdma.h>
+#include <adr.h>
+#include <freq_plan.h>
+#include <signal_priority.h>
+#include <signal_summary.h>
+#include <flash_log.h>
+#include <link_stats.h>
+#include <fec.h>
 
 XPowersAXP2101 PMU;
 SX1262 radio = new Module(LORA_CS, LORA_DIO1, LORA_RST, LORA_BUSY);
@@ -12,99 +28,164 @@ SX1262 radio = new Module(LORA_CS, LORA_DIO1, LORA_RST, LORA_BUSY);
 // car ID **** NEEDS TO BE CHANGED FOR EACH CAR AND STARTS AT 0 ****
 #define MY_ID           0
 
+// the TWAI RX queue holds everything the filter lets through while the CAN task can't
+// run, never more than the bus can carry (8 byte frames are ~130 bits with stuffing)
+static constexpr uint32_t CAN_BUS_MAX_FPS = 1000000 / 130;
+static constexpr uint32_t CAN_RX_FPS = CAN_HW_FILTER && CAN_FILTER_IDS * CAN_ID_RATE_HZ < CAN_BUS_MAX_FPS
+                                     ? CAN_FILTER_IDS * CAN_ID_RATE_HZ : CAN_BUS_MAX_FPS;
+static constexpr uint32_t CAN_RX_QUEUE_LEN = CAN_RX_FPS * CAN_STALL_MS / 1000;
 
-// CAN IDs
-#define TIME_ID 0x600
-#define BMS_DISCH_EN_ID 0x600
-#define PACK_VOLT_ID 0x601
-#define PACK_CURR_ID 0x601
-#define PACK_TEMP_ID 0x602
-#define STATE_CHRG_ID 0x602
-#define MIN_CELL_VOLT_ID 0x603
-#define BMS_LV_ID 0x603
-#define PWRTRAIN_ID 0x604
-#define TORQUE_ID 0x604
-#define RPM_ID 0x605
-#define FLUX_ID 0x605
-#define INLINE_ID 0x606
-#define LAT_ID 0x606
-#define VERT_ID 0x607
-#define ROLL_ID 0X607
-#define PITCH_ID 0x608
-#define YAW_ID 0x608
-
-CanFrame rxFrame;
-
-// CAN data --> Ex: Time = 0x1001 --> Time1 = 0x10, Time0 = 0x01
-uint8_t Time0 = 0x00;
-uint8_t BMS_Disch_Enable0 = 0x00;
-uint8_t Pack_Voltage0 = 0x02;
-uint8_t Pack_Current0 = 0x01;
-uint8_t Pack_Temp0 = 0x01;
-uint8_t State_of_Charge0 = 0x00;
-uint8_t Min_Cell_Voltage0 = 0x00;  
-uint8_t BMS_LV_Input0 = 0x00;
-uint8_t Torque_Feedback0 = 0x00; 
-uint8_t RPM0 = 0x00;
-uint8_t Flux_Feedback0 = 0x00;
-uint8_t InlineAcc0 = 0x00;
-uint8_t LateralAcc0 = 0x00; 
-uint8_t VerticalAcc0 = 0x00;
-uint8_t RollRate0 = 0x00; 
-uint8_t PitchRate0 = 0x00;
-uint8_t YawRate0 = 0x00;
-
-uint8_t Time1 = 0x00;
-uint8_t BMS_Disch_Enable1 = 0x00;
-uint8_t Pack_Voltage1 = 0x00;
-uint8_t Pack_Current1 = 0x00;
-uint8_t Pack_Temp1 = 0x00;
-uint8_t State_of_Charge1 = 0x00;
-uint8_t Min_Cell_Voltage1 = 0x00; 
-uint8_t BMS_LV_Input1 = 0x00;
-uint8_t Torque_Feedback1 = 0x00; 
-uint8_t RPM1 = 0x00;
-uint8_t Flux_Feedback1 = 0x00;
-uint8_t InlineAcc1 = 0x00;
-uint8_t LateralAcc1 = 0x00; 
-uint8_t VerticalAcc1 = 0x00;
-uint8_t RollRate1 = 0x00; 
-uint8_t PitchRate1 = 0x00;
-uint8_t YawRate1 = 0x00;
-
-
-// make a packet given the abp and the actual data
-static void make_packet(uint8_t sender_id, uint8_t abp, const uint8_t data[DATA_BYTES], uint8_t out_packet[DATA_PCK_LEN]) {
-    out_packet[0] = (uint8_t)(sender_id & 0xFF);
-    out_packet[1] = (uint8_t)(abp & 0xFF);
-    memcpy(out_packet + 2, data, DATA_BYTES);
-}
-
-// wait for ACK (the dest_id, abp num, status) for the expected abp num
-// return 1 if received, 0 if timeout
-static int wait_for_ack(uint8_t expected_abp, uint8_t *status_out) {
-    uint32_t start = millis();      // start recording the time
-    uint8_t ack[ACK_LEN];
+#if LOW_POWER && !PRIORITY_SCHEDULING
+#error "LOW_POWER needs PRIORITY_SCHEDULING, without it every CAN read publishes a snapshot"
+#endif
+
+
+static tx_window window;
+static delta_encoder encoder;
+static batch_builder batch;             // snapshots waiting to go out together
+static snapshot_ring snapshots;          // CAN task -> radio task
+static TaskHandle_t radio_task_handle;
+static volatile bool car_off = false;   // CAN task: no frame for PARK_IDLE_MS (LOW_POWER)
+static bool radio_asleep = false;       // radio task only
+static uint32_t woke_ms = 0;            // end of the last park
+static tdma_schedule schedule;          // learned from the base station's beacons
+static uint32_t slot_end_ms;            // nothing may be on air after this (TDMA only)
+static uint8_t radio_dr = ADR_DEFAULT_DR;   // rate the radio is set to right now
+static uint8_t radio_ch = freq_home_channel(freq_receiver(MY_ID));  // channel of FREQ_CHANNELS it is on
+static uint8_t slot_dr = ADR_DEFAULT_DR;    // rate of our slot, from the base station's ACKs and beacons
+static int max_pck_len = MAX_PCK_LEN;   // longest packet that fits in a slot at slot_dr
+static int last_len = MAX_PCK_LEN;      // of the last packet queued
+static int slot_packets = WINDOW_SIZE;  // TX_LATEST: most packets in the window, what one slot carries
+static ack_ext link;                    // what the base station last told us about our link
+static rtt_estimator rtt[ADR_NUM_RATES];    // the round trip depends a lot on the data rate
+#if FEC_PARITY
+static fec_encoder fec;                 // the group the packets going out for the first time belong to
+#endif
+
+// per window slot (same index as window.slots): newest snapshot generation in the
+// packet, when its oldest snapshot was taken, and whether a retry replaced its contents (TX_LATEST)
+static uint16_t slot_gen[WINDOW_SIZE];
+static uint32_t slot_ms[WINDOW_SIZE];
+static bool slot_refreshed[WINDOW_SIZE];
+static bool slot_backfill[WINDOW_SIZE];     // carries flash log records instead of live data
+static uint8_t last_lost = 0;           // link.lost at the previous ACK
+static uint32_t counter = 0;
+static car_stats stats;                 // every counter has one task that writes it, the stats task sends them
+
+// per-event text costs UART time on the hot path, the stats frame replaces it
+#if LOG_EVENTS
+#define log_printf(...) Serial.printf(__VA_ARGS__)
+#else
+#define log_printf(...) do {} while (0)
+#endif
+
+// backfill state, radio task only
+static bool bf_requested = false;       // the last ACK asked for flash log records
+static uint32_t bf_cursor = 0;          // next log index to send
+static int bf_in_flight = 0;            // backfill packets in the window
+
+#if FLASH_LOG
+static snapshot_ring log_queue;         // CAN task -> log task, every decoded frame
+static File log_file;
+static SemaphoreHandle_t log_lock;      // the log task writes while the radio task reads back
+static volatile uint32_t log_head = 0;  // log index the next record gets
+static bool log_ok = false;
+#endif
+
+
+// the radio draws ~1 uA asleep instead of ~0.6 mA in standby, it keeps its configuration
+// (warm start) so waking it is just the standby command
+static void radio_sleep() {
+#if LOW_POWER
+    if (!radio_asleep) {
+        radio.sleep();
+        radio_asleep = true;
+    }
+#endif
+}
+
+static void radio_wake() {
+    if (radio_asleep) {
+        radio.standby();
+        radio_asleep = false;
+    }
+}
+
+// switch the radio to one of the rates in ADR_RATES
+static void set_data_rate(uint8_t dr) {
+    radio_wake();
+    if (dr == radio_dr) return;
+    const data_rate &r = ADR_RATES[dr];
+    radio.setSpreadingFactor(r.sf);
+    radio.setBandwidth(r.bw_khz);
+    radio.setCodingRate(r.cr);
+    radio_dr = dr;
+}
+
+// every channel is in the band begin() calibrated the image rejection for, so no calibration
+static void set_channel(uint8_t ch) {
+    radio_wake();
+    if (ch == radio_ch) return;
+    radio.setFrequency(FREQ_CHANNELS[ch], true);
+    radio_ch = ch;
+}
+
+// packets like the last one queued that go out in one slot
+static void plan_slot_packets() {
+#if TDMA_ENABLED
+    int len = last_len < max_pck_len ? last_len : max_pck_len;
+    slot_packets = adr_slot_packets(slot_dr, (uint32_t)schedule.slot_ms * ADR_RATES[slot_dr].slot_scale, len);
+#endif
+}
+
+// the rate for our next slot is known, size the packets built from now on for it
+static void plan_slot_rate(uint8_t dr) {
+#if TDMA_ENABLED
+    if (dr != slot_dr) {
+        log_printf("Switching to DR%u (SF%u BW%.0f)\n", dr, ADR_RATES[dr].sf, ADR_RATES[dr].bw_khz);
+    }
+    slot_dr = dr;
+    max_pck_len = adr_max_len(dr, (uint32_t)schedule.slot_ms * ADR_RATES[dr].slot_scale);
+    plan_slot_packets();
+#endif
+}
+
+// another packet can be queued. with TX_LATEST no more than one slot carries, the rest
+// would only go stale in the window, the snapshots wait in the ring for the next slot
+static bool window_has_room() {
+#if TX_POLICY == TX_LATEST
+    if (tx_outstanding(&window) >= slot_packets) return false;
+#endif
+    return tx_can_queue(&window);
+}
+
+
+// wait for the ACK that answers a poll (see arq.h for the layout)
+// one receive window that closes exactly at the timeout, it is only reopened
+// for whatever is left if something that isn't our ACK comes in
+// return its length if received, 0 if timeout
+static int wait_for_ack(uint8_t ack[ACK_LEN], uint32_t timeout_ms) {
+    uint32_t deadline = millis() + timeout_ms;
 
-    while ( ( millis() - start ) < ACK_TIMEOUT_MS ) {
-        int16_t st = radio.receive(ack, ACK_LEN, 100);
+    for (;;) {
+        int32_t left = (int32_t)(deadline - millis());
+        if (left <= 0) break;
+        int16_t st = radio.receive(ack, ACK_LEN, left);
 
         // check that it was received properly
         if (st == RADIOLIB_ERR_NONE) {
             // ignore acks that are not intended for this transmitter
-            if (ack[0] != MY_ID) {
+            int len = radio.getPacketLength();
+            if (len < ACK_BASE_LEN || ack[ACK_SENDER] != MY_ID) {
                 continue;
             }
-            // make sure it's the right abp
-            if (ack[1] == (expected_abp & 0xFF)) {
-                // set the status of the ack
-                *status_out = ack[2];
-                return 1;
-            }
-        // otherwise wrong sequence so ignore
+            return len > ACK_LEN ? ACK_LEN : len;
+        }
+        // the window closed
+        else if (st == RADIOLIB_ERR_RX_TIMEOUT) {
+            break;
         }
-        // keep waiting until timeout
-        else if (st == RADIOLIB_ERR_RX_TIMEOUT) {}
+        // corrupted, keep listening for what's left
         else {}
     }
     // failed so return 0
@@ -113,58 +194,391 @@ static int wait_for_ack(uint8_t expected_abp, uint8_t *status_out) {
 }
 
 
-// send data with retries if not successful
-// return 1 if delivered else 0
-static int send_with_retries(uint8_t abp, const uint8_t packet[DATA_PCK_LEN]) {
+static void on_acked(const tx_slot *s) {
+    log_printf("Sent SUCCESSFULLY SEQ=%u attempts %u/%u\n", s->seq, s->attempts, MAX_RETRIES);
+    counter++;
+    hist_add(&stats.h[CH_ATTEMPTS], s->attempts);
+
+    // log records, nothing in them is a reference for the encoder
+    if (slot_backfill[s - window.slots]) {
+        bf_in_flight--;
+        return;
+    }
+
+    // the receiver may have kept the version from before the refresh, so neither
+    // keyframe can be trusted as a reference
+    if (slot_refreshed[s - window.slots]) {
+        return;
+    }
+
+    // full length records are keyframes, once one is ACKed deltas can use it
+    if (s->packet[PKT_ID] & BATCH_FLAG) {
+        // the last keyframe in a batch is the one the receiver keeps for this seq
+        const uint8_t *key = NULL;
+        batch_record rec;
+        int pos = 0;
+        while (batch_next(s->packet + HEADER_LEN, s->len - HEADER_LEN, &pos, &rec) > 0) {
+            if (rec.len == DATA_BYTES) key = rec.data;
+        }
+        if (key != NULL) {
+            encoder_key_acked(&encoder, s->seq, key);
+        }
+    }
+    else if (s->len == DATA_PCK_LEN) {
+        encoder_key_acked(&encoder, s->seq, s->packet + HEADER_LEN);
+    }
+}
+
+static void on_dropped(const tx_slot *s) {
+    log_printf("SEQ=%u FAILED after %u retries\n", s->seq, MAX_RETRIES);
+    stats.v[CS_FAILED]++;
+    // the base station's next ACK still points at what it is missing, so it gets sent again
+    if (slot_backfill[s - window.slots]) {
+        bf_in_flight--;
+    }
+}
+
+
+// with TDMA a packet (and the ACK after it) has to fit in what's left of our slot
+// when it goes on air at start_ms
+static bool fits_in_slot(int len, uint32_t start_ms) {
+#if TDMA_ENABLED
+    uint32_t air_ms = adr_airtime_ms(radio_dr, len) + 1;
+    return (int32_t)(slot_end_ms - (start_ms + air_ms + adr_ack_reserve_ms(radio_dr))) >= 0;
+#else
+    return true;
+#endif
+}
+
+#if TX_POLICY == TX_LATEST
+// a retry carries the newest snapshots instead of the ones that got lost, as many as fit
+// everything older still waiting in the ring or the batch is superseded by them,
+// and so is what the packet had if it never went out
+static void refresh_retry(tx_slot *s) {
+    can_snapshot newest[BATCH_SIZE];    // the last BATCH_SIZE popped, the newest at (n - 1) % BATCH_SIZE
+    int n = 0;
+    while (ring_pop(&snapshots, &newest[n % BATCH_SIZE])) {
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+    stats.v[CS_STALE] += batch.count;
+    batch_init(&batch);
+    if (s->attempts == 0) {
+        stats.v[CS_STALE] += BATCH_SIZE > 1 ? batch_count(s->packet + HEADER_LEN) : 1;
+    }
+
+    // newest first until the slot is full, they go into the packet oldest first
+    uint8_t payload[BATCH_SIZE][DATA_BYTES];
+    int len[BATCH_SIZE];
+    int k = 0;
+    int total = HEADER_LEN + BATCH_HDR_LEN;
+    while (k < n && k < BATCH_SIZE) {
+        len[k] = encoder_encode(&encoder, &newest[(n - 1 - k) % BATCH_SIZE].data, payload[k]);
+        if (k > 0 && total + BATCH_REC_HDR_LEN + len[k] > max_pck_len) break;
+        total += BATCH_REC_HDR_LEN + len[k];
+        k++;
+    }
+    stats.v[CS_STALE] += n - k;
+
+    int i = s - window.slots;
+    const can_snapshot *last = &newest[(n - 1) % BATCH_SIZE];
+#if BATCH_SIZE > 1
+    batch_builder b;
+    batch_init(&b);
+    for (int j = k - 1; j >= 0; j--) {
+        const can_snapshot *snap = &newest[(n - 1 - j) % BATCH_SIZE];
+        if (!batch_add(&b, snap->time_ms, snap->gen, payload[j], len[j])) stats.v[CS_STALE]++;
+    }
+    tx_replace(s, MY_ID | BATCH_FLAG, b.buf, b.len);
+    slot_ms[i] = b.base_ms;
+#else
+    tx_replace(s, MY_ID, payload[0], len[0]);
+    slot_ms[i] = last->time_ms;
+#endif
+    slot_gen[i] = last->gen;
+    // the base station may have the old contents under this seq already if it went out
+    slot_refreshed[i] = slot_refreshed[i] || s->attempts > 0;
+    log_printf("SEQ=%u refreshed to snapshot %u, %d records (%lu stale)\n", s->seq, last->gen, k, (unsigned long)stats.v[CS_STALE]);
+}
+#endif
+
+// built for a faster rate than we are on now, so it would never go out as it is. with
+// TX_LATEST its records are seconds old by then and it takes the newest snapshots like a
+// retry does. otherwise the batch goes out again in parts: the first keeps the seq and the
+// retry count, the others are queued behind it while the window has room. what is left
+// is lost to the rate change, not failed. log records are asked for again anyway
+static void repack(tx_slot *s) {
+    int i = s - window.slots;
+    stats.v[CS_TOO_LONG]++;
+#if TX_POLICY == TX_LATEST
+    if (!slot_backfill[i]) {
+        refresh_retry(s);
+        if (s->len <= max_pck_len) return;
+    }
+#elif BATCH_SIZE > 1
+    if (!slot_backfill[i]) {
+        uint8_t data[MAX_PCK_LEN];
+        int len = s->len - HEADER_LEN;
+        memcpy(data, s->packet + HEADER_LEN, len);
+        int total = batch_count(data);
+        int done = 0;
+        batch_builder b;
+        if (batch_take(data, len, &done, max_pck_len, &b) > 0) {
+            tx_replace(s, MY_ID | BATCH_FLAG, b.buf, b.len);
+            slot_gen[i] = b.gen;
+            slot_ms[i] = b.base_ms;
+            // a retry may have made it already, so like a refresh its keyframe is no reference
+            slot_refreshed[i] = slot_refreshed[i] || s->attempts > 0;
+            while (tx_can_queue(&window) && batch_take(data, len, &done, max_pck_len, &b) > 0) {
+                tx_slot *part = tx_queue(&window, MY_ID | BATCH_FLAG, b.buf, b.len);
+                slot_gen[part - window.slots] = b.gen;
+                slot_ms[part - window.slots] = b.base_ms;
+                slot_refreshed[part - window.slots] = false;
+                slot_backfill[part - window.slots] = false;
+                stats.v[CS_QUEUED]++;
+            }
+            stats.v[CS_RESIZE_LOST] += total - done;
+            log_printf("SEQ=%u split for max length %d, %d of %d records lost\n", s->seq, max_pck_len, total - done, total);
+            return;
+        }
+    }
+#endif
+    log_printf("SEQ=%u too long for max length %d, dropped\n", s->seq, max_pck_len);
+    if (slot_backfill[i]) {
+        bf_in_flight--;
+    } else {
+#if BATCH_SIZE > 1
+        stats.v[CS_RESIZE_LOST] += batch_count(s->packet + HEADER_LEN);
+#else
+        stats.v[CS_RESIZE_LOST]++;
+#endif
+    }
+    s->in_use = 0;
+}
+
+// the next packet to put on air at start_ms, NULL if nothing is due or it won't fit in the slot
+static tx_slot *next_to_send(uint32_t start_ms) {
+    tx_slot *s;
+    while ((s = tx_next_due(&window, millis())) != NULL && s->len > max_pck_len) {
+        repack(s);
+    }
+#if TX_POLICY == TX_LATEST
+    // old log records are the whole point of a backfill packet, it is resent as it is.
+    // live data is refreshed for a retry, and for a first try that waited past MAX_AGE_MS
+    if (s != NULL && !slot_backfill[s - window.slots]
+        && (s->attempts > 0 || (millis() - slot_ms[s - window.slots]) > MAX_AGE_MS)) {
+        refresh_retry(s);
+    }
+#endif
+    if (s != NULL && !fits_in_slot(s->len, start_ms)) {
+        return NULL;
+    }
+    return s;
+}
+
+
+#if FEC_PARITY
+// a group is complete with the packet that is off the air at start_ms, its parity goes
+// right after it if the slot has room for all of it. returns when the burst goes on
+static uint32_t plan_parity(uint32_t start_ms) {
+    uint32_t air_ms = adr_airtime_ms(radio_dr, fec_parity_len(&fec)) + 1;
+    if (!fits_in_slot(fec_parity_len(&fec), start_ms + (FEC_PARITY - 1) * air_ms)) {
+        fec_drop_parity(&fec);
+        return start_ms;
+    }
+    return start_ms + FEC_PARITY * air_ms;
+}
+
+// the parity of the group that was just sent, the last one carries the poll if the burst ends here
+static void send_parity(int poll) {
+    uint8_t pck[FEC_MAX_LEN];
+    int len;
+    while ((len = fec_next_parity(&fec, MY_ID, poll && fec_parity_left(&fec) == 1, pck)) > 0) {
+        int16_t st = radio.transmit(pck, len);
+        stats.v[CS_SENDS]++;
+        stats.v[CS_PARITY]++;
+        if (st != RADIOLIB_ERR_NONE) {
+            stats.v[CS_TX_ERRORS]++;
+            log_printf("Parity of SEQ=%u transmit error %d\n", pck[FEC_FIRST] & SEQ_MASK, st);
+        }
+        else {
+            stats.v[CS_AIR_MS] += adr_airtime_ms(radio_dr, len);
+        }
+    }
+}
+#endif
+
+
+// put every packet that is due on air (new ones and the ones whose timer ran out)
+// the last packet of the burst carries the poll bit and then we wait for the ACK
+// with FEC the parity of a group goes right after it and the last parity packet polls
+static void service_window() {
+    tx_drop_expired(&window, millis(), on_dropped);
+
+    uint32_t burst_start = millis();
+    bool polled = false;
+    uint32_t poll_ms = 0;
+    uint32_t ack_timeout = 0;
+    uint8_t poll_first_try = 0;
+    tx_slot *s = next_to_send(millis());
+    while (s != NULL) {
+        int retry = s->attempts > 0;
+        tx_mark_sent(s, millis(), &rtt[radio_dr]);
+        uint32_t after_ms = millis() + adr_airtime_ms(radio_dr, s->len) + 1;
+#if FEC_PARITY
+        if (!retry && fec_add(&fec, s->packet, s->len)) {
+            after_ms = plan_parity(after_ms);
+        }
+#endif
+        // the next one is picked before this one goes on air, so it has to fit after it
+        tx_slot *next = next_to_send(after_ms);
 
-    for (int attempt = 1; attempt <= MAX_RETRIES; attempt++ ) {
-        int16_t st = radio.transmit((uint8_t*)packet, DATA_PCK_LEN);
+        // poll at the end of a burst: nothing else is due and either this is a retry,
+        // the window can't take another packet, or there is no more CAN data waiting
+        // with TDMA every burst is the last one in the slot so it always polls
+        int poll = (next == NULL) && (TDMA_ENABLED || retry || !window_has_room() || ring_empty(&snapshots));
+#if FEC_PARITY
+        s->packet[PKT_SEQ] = (uint8_t)(s->seq | (poll && !fec_parity_left(&fec) ? POLL_BIT : 0));
+#else
+        s->packet[PKT_SEQ] = (uint8_t)(s->seq | (poll ? POLL_BIT : 0));
+#endif
+
+        radio_wake();
+        int16_t st = radio.transmit(s->packet, s->len);
+        // retransmit timers start once it's off the air, nothing in the burst can time out
+        // before the poll (a long one with parity would otherwise resend its own start)
+        tx_start_timers(&window, burst_start, millis());
+        stats.v[CS_SENDS]++;
+        if (retry) stats.v[CS_RETRIES]++;
 
         // check if successfully sent
         if (st != RADIOLIB_ERR_NONE) {
             // a transmit error occured
-            Serial.printf("ABP=%u transmit error %d (attempt %u/%u)\n", abp, st, attempt, MAX_RETRIES);
+            stats.v[CS_TX_ERRORS]++;
+            log_printf("SEQ=%u transmit error %d (attempt %u/%u)\n", s->seq, st, s->attempts, MAX_RETRIES);
         }
         else {
             // successfully transmitted
-            Serial.printf("Sent ABP=%u attempt %u/%u\n", abp, attempt, MAX_RETRIES);
+            stats.v[CS_AIR_MS] += adr_airtime_ms(radio_dr, s->len);
+            log_printf("Sent SEQ=%u attempt %u/%u%s\n", s->seq, s->attempts, MAX_RETRIES, poll ? " (poll)" : "");
         }
+#if FEC_PARITY
+        send_parity(poll);
+#endif
 
-        // wait for ack
-        uint8_t ack_status = 0xFF;
-        int got_ack = wait_for_ack(abp, &ack_status);
-        if (!got_ack) {
-            // timeout
-            Serial.printf("ABP=%u ACK timeout -> retry %u/%u\n", abp, attempt, MAX_RETRIES);
-            continue;
+        // the poll may be freed by the ACK so keep what the RTT sample and the wait need,
+        // parity only ever follows a first try
+        if (poll) {
+            polled = true;
+            poll_ms = millis();
+            poll_first_try = s->attempts == 1;
+            ack_timeout = s->rto_ms;
         }
+        s = next;
+    }
 
-        // otherwise we got an ack so check the status
-        if (ack_status == 0) {
-            Serial.printf("Sent SUCCESSFULLY ABP=%u\n", abp);
-            return 1;
-        }
+    if (!polled) {
+        return;
+    }
 
-        else if (ack_status == 1) {
-            Serial.printf("ABP=%u receiver says DUPLICATE\n", abp);
-            return 1;
-        }
+    // everything in the burst is timed from the poll, the ACK can't come before it
+    tx_start_timers(&window, burst_start, poll_ms);
+
+    // wait for ack as long as the retransmit timer of the poll, with TDMA never past the end of our slot
+#if TDMA_ENABLED
+    int32_t slot_left = (int32_t)(slot_end_ms - millis());
+    ack_timeout = slot_left <= 0 ? 1 : ((uint32_t)slot_left < ack_timeout ? slot_left : ack_timeout);
+#endif
+    uint8_t ack[ACK_LEN];
+    int ack_len = wait_for_ack(ack, ack_timeout);
+    if (!ack_len) {
+        // timeout, the per-packet timers will resend whatever is still in flight
+        stats.v[CS_ACK_TIMEOUTS]++;
+        log_printf("ACK timeout, %d packets in flight\n", tx_outstanding(&window));
+        return;
+    }
+    stats.v[CS_ACKS]++;
 
+    // only a poll that went out once gives an unambiguous round trip (Karn's rule)
+    if (poll_first_try) {
+        rtt_sample(&rtt[radio_dr], millis() - poll_ms);
+        hist_add(&stats.h[CH_RTT_MS], millis() - poll_ms);
+    }
+
+    // otherwise we got an ack so clear everything it covers
+    tx_apply_ack(&window, ack[ACK_CUM], ack[ACK_BITMAP], on_acked);
+
+    // the base station's pick for our next slot, the beacon confirms it
+    if (ack[ACK_DR] < ADR_NUM_RATES) {
+        plan_slot_rate(ack[ACK_DR]);
+    }
+
+    // link report from the base station
+    ack_get_ext(ack, ack_len, &link);
+    if (link.has_loss && link.lost != last_lost) {
+        log_printf("Base station lost %u packets (RSSI=%d SNR=%.2f)\n", (uint8_t)(link.lost - last_lost), link.rssi_dbm, link.snr_q4 / 4.0);
+        last_lost = link.lost;
+    }
+
+    // the base station asks for backfill while we are close enough for its fastest rate,
+    // it only ever moves forward unless nothing is in flight (what we sent got lost)
+    bf_requested = link.has_backfill;
+    if (link.has_backfill && (link.backfill_from > bf_cursor || bf_in_flight == 0)) {
+        bf_cursor = link.backfill_from;
+    }
+
+    if (ack[ACK_STATUS] == ACK_DUPLICATE) {
+        log_printf("SEQ=%u receiver says DUPLICATE\n", ack[ACK_SEQ]);
+    }
+    else if (ack[ACK_STATUS] == ACK_BAD_LEN) {
+        // the receiver got garbage so resend the rest right away
+        stats.v[CS_NACKS]++;
+        log_printf("SEQ=%u receiver says BAD_LEN\n", ack[ACK_SEQ]);
+        tx_expire_all(&window, millis());
+    }
+    else if (ack[ACK_STATUS] == ACK_NACK) {
+        // something we sent is missing or arrived corrupted, resend what the ACK didn't cover
+        stats.v[CS_NACKS]++;
+        log_printf("SEQ=%u receiver says NACK\n", ack[ACK_SEQ]);
+        tx_expire_all(&window, millis());
+    }
+    else if (ack[ACK_STATUS] == ACK_NO_REF) {
+        // the receiver doesn't have our keyframe (it probably rebooted)
+        stats.v[CS_NACKS]++;
+        log_printf("SEQ=%u receiver says NO_REF, sending a keyframe\n", ack[ACK_SEQ]);
+        encoder_reset(&encoder);
     }
-    // otherwise failed within all these attempts
-    Serial.printf("ABP=%u FAILED after %u retries\n", abp, MAX_RETRIES);
-    return 0;
 }
 
 
 
 // handles all the t-beam power and radio nonsense
 void power_up_tbeam() {
+    // a whole stats frame fits, so sending one never waits on the UART
+    Serial.setTxBufferSize(1024);
     Serial.begin(115200);
     
     // power chip config
     Wire.begin(I2C_SDA, I2C_SCL);
     PMU.begin(Wire, AXP2101_SLAVE_ADDRESS, I2C_SDA, I2C_SCL);
+#if LOW_POWER
+    // only DCDC1 (the ESP32) and the rails below stay on, the PMU's ADCs and charge LED go off too
+    PMU.disableDC2();
+    PMU.disableDC3();
+    PMU.disableDC4();
+    PMU.disableDC5();
+    PMU.disableALDO1();
+    PMU.disableALDO4();
+    PMU.disableBLDO1();
+    PMU.disableBLDO2();
+    PMU.disableDLDO2();
+    PMU.disableVbusVoltageMeasure();
+    PMU.disableSystemVoltageMeasure();
+    PMU.disableTemperatureMeasure();
+    PMU.setChargingLedMode(XPOWERS_CHG_LED_OFF);
+#endif
     PMU.setALDO2Voltage(3300); // lora power
     PMU.enableALDO2();
     PMU.setALDO3Voltage(1800); // clock power
@@ -174,8 +588,9 @@ void power_up_tbeam() {
 
     // radio config
     SPI.begin(LORA_SCK, LORA_MISO, LORA_MOSI, LORA_CS);
-    // 915.0 frequency, 125.0 bandwidth, 1.8v tcxo
-    int state = radio.begin(915.0, 125.0, 7, 7, 0x12, 17, 8, 1.8, true);
+    // our receiver's home channel, default data rate, 1.8v tcxo
+    const data_rate &dr = ADR_RATES[ADR_DEFAULT_DR];
+    int state = radio.begin(FREQ_CHANNELS[radio_ch], dr.bw_khz, dr.sf, dr.cr, 0x12, 17, 8, 1.8, true);
     
     if (state == RADIOLIB_ERR_NONE) {
         radio.setTCXO(1.8); 
@@ -188,132 +603,503 @@ void power_up_tbeam() {
 }
 
 
+// CAN reader task: drains the TWAI queue as fast as frames arrive and publishes
+// a snapshot whenever the channel scheduler says so (or once a second with no CAN traffic)
+// it never waits on the radio so nothing piles up in the TWAI queue during retries
+// with EDGE_SUMMARY the scheduler sees the window summaries instead of the raw values
+static void can_task(void *arg) {
+    CanFrame rxFrame;
+    can_snapshot snap;
+    telemetry current = {};         // latest value of every channel
+    uint16_t gen = 0;
+    channel_scheduler sched;
+    sched_init(&sched);
+#if EDGE_SUMMARY
+    summary_stage summary;
+    summary_init(&summary, millis());
+    const telemetry *source = &summary.view;
+#else
+    const telemetry *source = &current;
+#endif
+    uint32_t last_frame_ms = millis();
+
+    for (;;) {
+        int got_frame = ESP32Can.readFrame(rxFrame, car_off ? PARK_POLL_MS : 1000);
+
+        // decode the frame through the signal table
+        if (got_frame) {
+            last_frame_ms = millis();
+            log_printf("Received frame: %03X   \r\n", rxFrame.identifier);
+            uint32_t cycles = ESP.getCycleCount();
+            int decoded = decode_frame(rxFrame.identifier, rxFrame.data, rxFrame.data_length_code, &current);
+            hist_add(&stats.h[CH_DECODE_CYCLES], ESP.getCycleCount() - cycles);
+            stats.v[CS_CAN_FRAMES]++;
+            if (!decoded) stats.v[CS_CAN_FOREIGN]++;
+#if EDGE_SUMMARY
+            summary_add_frame(&summary, rxFrame.identifier, &current);
+#endif
+
+#if FLASH_LOG
+            // the flash log gets every frame, whatever the scheduler does with it
+            snap.time_ms = millis();
+            snap.data = current;
+            if (log_ok) ring_push(&log_queue, &snap);
+#endif
+        }
+
+#if EDGE_SUMMARY
+        // close the windows that ran out, without the scheduler that is when a snapshot goes out
+        if (!summary_tick(&summary, millis()) && !PRIORITY_SCHEDULING) {
+            continue;
+        }
+#endif
+
+#if LOW_POWER
+        // a silent bus means the car is off: nothing changes, a heartbeat now and then is enough
+        car_off = (millis() - last_frame_ms) >= PARK_IDLE_MS;
+        sched.heartbeat_ms = car_off ? PARK_HEARTBEAT_MS : SCHED_HEARTBEAT_MS;
+#endif
+
+        // critical channels go out on every change, the rest at their own rate
+#if PRIORITY_SCHEDULING
+        int action = sched_update(&sched, source, millis());
+        if (action == SCHED_NONE) {
+            continue;
+        }
+        snap.data = sched.view;
+        snap.urgent = action == SCHED_URGENT;
+#else
+        snap.data = *source;
+        snap.urgent = 0;
+#endif
+
+        // if the radio task is too far behind the snapshot is dropped (and counted),
+        // current still holds the data so the next snapshot carries it
+        snap.time_ms = millis();
+        snap.gen = gen++;
+        if (ring_push(&snapshots, &snap)) {
+            xTaskNotifyGive(radio_task_handle);
+        }
+    }
+}
+
+
+// listen for the base station's beacon for up to timeout_ms, it is always on our receiver's home channel
+static void listen_for_beacon(uint32_t timeout_ms) {
+    uint8_t buf[BEACON_MAX_LEN];
+    set_channel(freq_home_channel(freq_receiver(MY_ID)));
+    int16_t st = radio.receive(buf, BEACON_MAX_LEN, timeout_ms);
+    if (st != RADIOLIB_ERR_NONE) {
+        return;
+    }
+    if (tdma_parse_beacon(&schedule, buf, radio.getPacketLength(), millis())) {
+        stats.v[CS_BEACONS]++;
+        log_printf("Beacon %u: %u slots of %u ms\n", schedule.beacon_seq, schedule.num_slots, schedule.slot_ms);
+    }
+}
+
+// block (listening for beacons) until our TDMA slot is open, then set slot_end_ms
+// and switch to the slot's data rate and channel
+static void wait_for_slot() {
+    for (;;) {
+        uint32_t now = millis();
+        uint32_t start, end;
+        uint8_t dr;
+        if (!tdma_next_slot(&schedule, MY_ID, now, &start, &end, &dr)) {
+            // not synced yet (or lost the beacons), only listen until we hear one
+            set_data_rate(adr_beacon_dr());
+            listen_for_beacon(tdma_superframe_ms(&schedule) ? tdma_superframe_ms(&schedule) : 1000);
+            continue;
+        }
+        if ((int32_t)(now - start) >= 0) {
+            slot_end_ms = end - TDMA_GUARD_MS;
+            set_data_rate(dr);
+            set_channel(freq_slot_channel(freq_receiver(MY_ID), tdma_frame_seq(&schedule, start)));
+            plan_slot_rate(dr);
+            return;
+        }
+#if LOW_POWER
+        // the only thing to hear before our slot is the beacon, the radio sleeps until
+        // shortly before the next one is due and listens just around it. a beacon ends
+        // a superframe plus its own airtime after the one before (beacon_ms is its end)
+        uint32_t air = tdma_beacon_air_ms(&schedule);
+        uint32_t period = tdma_period_ms(&schedule);
+        uint32_t due = schedule.beacon_ms + ((now - schedule.beacon_ms) / period) * period;
+        uint32_t open = due + period - air - LP_BEACON_EARLY_MS;
+        uint32_t until = start;
+        if (due != schedule.beacon_ms && (int32_t)(due + LP_BEACON_EARLY_MS - now) > 0) {
+            // this superframe's beacon hasn't come (yet), it may still be on its way
+            if ((int32_t)(due + LP_BEACON_EARLY_MS - start) < 0) until = due + LP_BEACON_EARLY_MS;
+        }
+        else if ((int32_t)(open - now) > 0) {
+            // heard it or too late for it, nothing until the next one
+            if ((int32_t)(open - start) < 0) until = open;
+            radio_sleep();
+            vTaskDelay(pdMS_TO_TICKS(until - now));
+            continue;
+        }
+        else if ((int32_t)(due + period + LP_BEACON_EARLY_MS - start) < 0) {
+            until = due + period + LP_BEACON_EARLY_MS;
+        }
+        set_data_rate(adr_beacon_dr());
+        listen_for_beacon(until - now);
+#else
+        set_data_rate(adr_beacon_dr());
+        listen_for_beacon(start - now);
+#endif
+    }
+}
+
+
+// move the pending batch into the ARQ window as one packet
+// with BATCH_SIZE 1 the single record goes out as a plain packet
+static void flush_batch() {
+    tx_slot *slot;
+#if BATCH_SIZE > 1
+    slot = tx_queue(&window, MY_ID | BATCH_FLAG, batch.buf, batch.len);
+#else
+    slot = tx_queue(&window, MY_ID, batch.buf + BATCH_HDR_LEN + BATCH_REC_HDR_LEN, batch.len - BATCH_HDR_LEN - BATCH_REC_HDR_LEN);
+#endif
+    slot_gen[slot - window.slots] = batch.gen;
+    slot_ms[slot - window.slots] = batch.base_ms;
+    slot_refreshed[slot - window.slots] = false;
+    slot_backfill[slot - window.slots] = false;
+    stats.v[CS_QUEUED]++;
+    log_printf("\nQueued frame counter=%lu seq=%u records=%u len=%u\n", (unsigned long)counter, slot->seq, batch.count, slot->len);
+    last_len = slot->len;
+    plan_slot_packets();
+    batch_init(&batch);
+}
+
+
+// the batch with one more record of len bytes still has to fit in our slot. at the slow
+// rates that is fewer than BATCH_SIZE records, the batch then goes out as it is and the
+// record starts the next one
+static bool batch_has_room(int len) {
+    return batch.count == 0 || HEADER_LEN + batch.len + BATCH_REC_HDR_LEN + len <= max_pck_len;
+}
+
+
+#if FLASH_LOG
+// mount LittleFS and find where the log left off before the last power cycle
+// reads the whole ring once, so it takes a moment at boot
+static void log_open() {
+    if (!LittleFS.begin(true)) {
+        Serial.println("flash log: mounting LittleFS failed");
+        return;
+    }
+    log_file = LittleFS.open(LOG_FILE, LittleFS.exists(LOG_FILE) ? "r+" : "w+");
+    if (!log_file) {
+        Serial.println("flash log: can't open " LOG_FILE);
+        return;
+    }
+
+    // the record with the highest index is the newest, the file grows until it has LOG_RECORDS
+    uint8_t buf[LOG_REC_LEN];
+    log_record rec;
+    uint32_t head = 0;
+    while (log_file.read(buf, LOG_REC_LEN) == LOG_REC_LEN) {
+        if (log_unpack(buf, &rec) && rec.index >= head) head = rec.index + 1;
+    }
+    log_head = head;
+    log_ok = true;
+    Serial.printf("flash log: %lu records logged so far\n", (unsigned long)head);
+}
+
+// read back one record, 0 if it is damaged or has been overwritten by a newer one
+static int log_read(uint32_t index, log_record *rec) {
+    uint8_t buf[LOG_REC_LEN];
+    xSemaphoreTake(log_lock, portMAX_DELAY);
+    int got = log_file.seek((index % LOG_RECORDS) * LOG_REC_LEN) && log_file.read(buf, LOG_REC_LEN) == LOG_REC_LEN;
+    xSemaphoreGive(log_lock);
+    return got && log_unpack(buf, rec) && rec->index == index;
+}
+
+// log task: writes what the CAN task decoded into the flash ring, flushing every LOG_FLUSH_MS
+static void log_task(void *arg) {
+    can_snapshot snap;
+    uint8_t buf[LOG_REC_LEN];
+    uint32_t flushed_ms = millis();
+
+    for (;;) {
+        if (ring_pop(&log_queue, &snap)) {
+            log_record rec = { log_head, snap.time_ms, snap.data };
+            log_pack(&rec, buf);
+            // records go in index order, so the seek never lands past the end of the file
+            xSemaphoreTake(log_lock, portMAX_DELAY);
+            log_file.seek((rec.index % LOG_RECORDS) * LOG_REC_LEN);
+            log_file.write(buf, LOG_REC_LEN);
+            xSemaphoreGive(log_lock);
+            log_head = rec.index + 1;
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(5));
+        }
+
+        if (millis() - flushed_ms >= LOG_FLUSH_MS) {
+            xSemaphoreTake(log_lock, portMAX_DELAY);
+            log_file.flush();
+            xSemaphoreGive(log_lock);
+            flushed_ms = millis();
+            if (log_queue.overflows) {
+                log_printf("flash log: %lu frames not logged, flash too slow\n", (unsigned long)log_queue.overflows);
+            }
+        }
+    }
+}
+
+// queue one packet of log records from bf_cursor on, if the base station wants them
+// half the window stays free for live data
+static void queue_backfill() {
+    if (!log_ok || !bf_requested || !window_has_room() || tx_outstanding(&window) >= WINDOW_SIZE / 2) {
+        return;
+    }
+
+    // whatever the ring already overwrote is gone, tell the base station to stop waiting for it
+    uint32_t head = log_head;
+    uint32_t oldest = head > LOG_RECORDS ? head - LOG_RECORDS : 0;
+    bool jump = false;
+    if (bf_cursor < oldest) {
+        bf_cursor = oldest;
+        jump = true;
+    }
+
+    int room = (max_pck_len - HEADER_LEN - BACKFILL_HDR_LEN) / BACKFILL_REC_LEN;
+    if (room > BACKFILL_RECORDS) room = BACKFILL_RECORDS;
+
+    log_record recs[BACKFILL_RECORDS];
+    int n = 0;
+    while (n < room && bf_cursor + n < head) {
+        if (log_read(bf_cursor + n, &recs[n])) {
+            n++;
+        } else if (n == 0) {
+            // damaged (or overwritten since we looked at the head), skip it
+            bf_cursor++;
+            jump = true;
+        } else {
+            break;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+
+    uint8_t payload[MAX_PCK_LEN - HEADER_LEN];
+    int len = backfill_build(payload, jump, recs, n);
+    tx_slot *slot = tx_queue(&window, MY_ID | BATCH_FLAG, payload, len);
+    slot_refreshed[slot - window.slots] = false;
+    slot_backfill[slot - window.slots] = true;
+    bf_in_flight++;
+    stats.v[CS_QUEUED]++;
+    log_printf("Queued backfill seq=%u log %lu-%lu\n", slot->seq, (unsigned long)bf_cursor, (unsigned long)(bf_cursor + n - 1));
+    bf_cursor += n;
+}
+#endif
+
+
+// stats task: every STATS_INTERVAL_MS all the counters go out on the console as one
+// binary frame, after copying in the ones the TWAI driver and the ring keep themselves
+static void stats_task(void *arg) {
+    uint8_t frame[OUT_MAX_FRAME_LEN];
+    TickType_t last = xTaskGetTickCount();
+
+    // ends whatever text the boot printed, so the first frame decodes
+    Serial.write((uint8_t)0);
+    for (;;) {
+        vTaskDelayUntil(&last, pdMS_TO_TICKS(STATS_INTERVAL_MS));
+        twai_status_info_t info;
+        if (twai_get_status_info(&info) == ESP_OK) {
+            stats.v[CS_TWAI_MISSED] = info.rx_missed_count;
+        }
+        stats.v[CS_RING_DROPS] = snapshots.overflows;
+        int len = build_stats_frame(STATS_SRC_CAR, MY_ID, millis(), (const uint32_t *)&stats, sizeof(stats) / 4, frame);
+        Serial.write(frame, len);
+    }
+}
+
+
+#if LOW_POWER
+// the car is off and everything it had is delivered
+static bool can_park() {
+    return car_off && ring_empty(&snapshots) && batch.count == 0 && tx_outstanding(&window) == 0
+        && !bf_requested && (millis() - woke_ms) >= PARK_SETTLE_MS;
+}
+
+// light sleep until CAN traffic (the RX pin going dominant) or the next heartbeat is due.
+// the TWAI controller is clocked off in light sleep, so the frame that wakes us is lost,
+// the ones after it are read as usual. tasks carry on where they were, millis() keeps counting.
+static void park() {
+    radio_sleep();
+    PMU.disableDLDO1();         // the RF switch has nothing to switch
+    Serial.flush();
+
+    gpio_wakeup_enable((gpio_num_t)CAN_RX_PIN, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    esp_sleep_enable_timer_wakeup((uint64_t)PARK_HEARTBEAT_MS * 1000);
+    uint32_t start = millis();
+    esp_light_sleep_start();
+    gpio_wakeup_disable((gpio_num_t)CAN_RX_PIN);
+
+    PMU.enableDLDO1();
+    woke_ms = millis();
+    stats.v[CS_PARKS]++;
+    stats.v[CS_PARKED_MS] += woke_ms - start;
+    log_printf("Parked for %lu ms, woken by %s\n", (unsigned long)(woke_ms - start),
+               esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO ? "CAN" : "the timer");
+}
+#endif
+
+
+// radio task: batches snapshots into packets for the ARQ window and runs the window
+static void radio_task(void *arg) {
+    can_snapshot snap;
+
+    for (;;) {
+#if LOW_POWER
+        // with TDMA the schedule is most likely gone after a park, wait_for_slot picks it up again
+        if (can_park()) {
+            park();
+        }
+#endif
+#if TDMA_ENABLED
+        // the radio belongs to the beacon until our slot opens, snapshots wait in the ring
+        wait_for_slot();
+        if ((ring_empty(&snapshots) || !window_has_room()) && tx_next_due(&window, millis()) == NULL) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(5));
+        }
+#else
+        // sleep until the CAN task publishes something, but wake up often enough
+        // to service the retransmit timers and the batch timeout. with the window full
+        // the snapshots have to wait for an ACK or a timer anyway
+        if (ring_empty(&snapshots) || !window_has_room()) {
+            TickType_t wait = (tx_outstanding(&window) || batch.count || bf_requested) ? pdMS_TO_TICKS(5) : portMAX_DELAY;
+#if LOW_POWER
+            // nothing to send or wait for, the radio can sleep. while the car is off
+            // the wait has to end for the next park
+            if (wait == portMAX_DELAY) {
+                radio_sleep();
+                if (car_off) wait = pdMS_TO_TICKS(PARK_SETTLE_MS);
+            }
+#endif
+            ulTaskNotifyTake(pdTRUE, wait);
+        }
+#endif
+
+        // pack snapshots into the batch, sending each batch once it's full, as long as the window has room.
+        // with the window full the batch waits as it is and the snapshots wait in the ring, which
+        // counts what it has no room for
+        for (;;) {
+            if (batch.count && !window_has_room()) break;
+            if (batch.count >= BATCH_SIZE) flush_batch();
+            if (!ring_pop(&snapshots, &snap)) break;
+#if TX_POLICY == TX_LATEST
+            // not worth the airtime when something newer is already waiting
+            if (!snap.urgent && (millis() - snap.time_ms) > MAX_AGE_MS && !ring_empty(&snapshots)) {
+                stats.v[CS_STALE]++;
+                continue;
+            }
+#endif
+
+            uint8_t payload[DATA_BYTES];
+#if PAYLOAD_COMPRESSION
+            int len = encoder_encode(&encoder, &snap.data, payload);
+#else
+            int len = DATA_BYTES;
+            memcpy(payload, &snap.data, DATA_BYTES);
+#endif
+            // the old batch goes out on its own if it would get too long for our slot
+            // or the time offset overflows
+            if (!batch_has_room(len) || !batch_add(&batch, snap.time_ms, snap.gen, payload, len)) {
+                flush_batch();
+                batch_add(&batch, snap.time_ms, snap.gen, payload, len);
+            }
+
+            // an alarm goes out in the next packet instead of waiting for the batch to fill
+            if (snap.urgent && window_has_room()) {
+                log_printf("Alarm in snapshot %u, sending now\n", snap.gen);
+                flush_batch();
+            }
+        }
+
+        // don't hold a partial batch for longer than BATCH_TIMEOUT_MS
+        if (batch.count && (millis() - batch.base_ms) >= BATCH_TIMEOUT_MS && window_has_room()) {
+            flush_batch();
+        }
+
+#if FLASH_LOG
+        // live data always goes first, the log only gets the airtime it leaves over
+        if (ring_empty(&snapshots) && batch.count == 0) {
+            queue_backfill();
+        }
+#endif
+
+        // send whatever is due and collect ACKs
+        service_window();
+    }
+}
+
+
 void setup() {
+#if LOW_POWER
+    setCpuFrequencyMhz(LP_CPU_MHZ);
+#endif
     power_up_tbeam();
     delay(200);
     pinMode(USER_BUTTON, INPUT_PULLUP);
 
-    // CAN interface setup
-    ESP32Can.setPins(CAN_TX_PIN, CAN_RX_PIN); // configure CAN pins
-    ESP32Can.setSpeed(TWAI_SPEED_1000KBPS); // set CAN speed to 1Mbps
-  
-    ESP32Can.setRxQueueSize(5);
-    if (ESP32Can.begin())
-    Serial.println("CAN set up");
+    // CAN interface setup, 1Mbps, the rest of the bus's traffic is dropped by the controller
+    twai_filter_config_t filter = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+#if CAN_HW_FILTER
+    filter.acceptance_code = CAN_FILTER_CODE;
+    filter.acceptance_mask = CAN_FILTER_MASK;
+    filter.single_filter = false;
+#endif
+    if (ESP32Can.begin(TWAI_SPEED_1000KBPS, CAN_TX_PIN, CAN_RX_PIN, 0xFFFF, CAN_RX_QUEUE_LEN, &filter))
+    Serial.printf("CAN set up, RX queue %lu\n", (unsigned long)CAN_RX_QUEUE_LEN);
 
     pinMode(BOARD_LED, OUTPUT);
     pinMode(BUTTON_PIN, INPUT);
-}
 
-static uint32_t counter = 0;
+    tx_window_init(&window);
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        slot_backfill[i] = false;
+    }
+    encoder_init(&encoder);
+#if FEC_PARITY
+    fec_encoder_init(&fec);
+#endif
+    batch_init(&batch);
+    tdma_init(&schedule);
+    ring_init(&snapshots);
+    car_stats_init(&stats);
 
-void loop() {
-    
-    // setting each byte of data from CAN into variables 
-    if(ESP32Can.readFrame(rxFrame,1000))
-    {
-      Serial.printf("Received frame: %03X   \r\n", rxFrame.identifier);
-      switch(rxFrame.identifier)
-      {
-        case 0x600:
-          Time0 = rxFrame.data[1]; 
-          Time1 = rxFrame.data[0];
-          BMS_Disch_Enable0 = rxFrame.data[3];
-          BMS_Disch_Enable1 = rxFrame.data[2];
-          break;
-        case 0x601:
-          Pack_Voltage0 = rxFrame.data[1];
-          Pack_Voltage1 = rxFrame.data[0];
-          Pack_Current0 = rxFrame.data[3];
-          Pack_Current0 = rxFrame.data[2];
-          break;
-        case 0x602:
-          Pack_Temp0 = rxFrame.data[1];
-          Pack_Temp1 = rxFrame.data[0];
-          State_of_Charge0 = rxFrame.data[3];
-          State_of_Charge1 = rxFrame.data[2];
-          break;
-        case 0x603:
-          Min_Cell_Voltage0 = rxFrame.data[1];
-          Min_Cell_Voltage1 = rxFrame.data[0];
-          BMS_LV_Input0 = rxFrame.data[3];
-          BMS_LV_Input1 = rxFrame.data[2];
-          break;
-        case 0x604:
-          Torque_Feedback0 = rxFrame.data[3];
-          Torque_Feedback1 = rxFrame.data[2];
-          break;
-        case 0x605:
-		  RPM0 = rxFrame.data[1];
-          RPM1 = rxFrame.data[0];
-          Flux_Feedback0 = rxFrame.data[3];
-          Flux_Feedback1 = rxFrame.data[2];
-
-          break;
-        case 0x606:
-          InlineAcc0 = rxFrame.data[1];
-          InlineAcc1 = rxFrame.data[0];
-          LateralAcc0 = rxFrame.data[3];
-          LateralAcc1 = rxFrame.data[2];
-
-          break;
-        case 0x607:
-          VerticalAcc0 = rxFrame.data[1];
-          VerticalAcc1 = rxFrame.data[0];
-          RollRate0 = rxFrame.data[3];
-          RollRate1 = rxFrame.data[2];
-
-          break;
-        case 0x608:
-          PitchRate0 = rxFrame.data[1];
-          PitchRate1 = rxFrame.data[0];
-          YawRate0 = rxFrame.data[3];
-          YawRate1 = rxFrame.data[2];
-          break;
-      }
-    }
-
-
-    // initialize abp, sender_id, and the overall packet that will be sent
-    static uint8_t abp = 0;
-    static uint8_t sender_id = MY_ID;
-    uint8_t packet[DATA_PCK_LEN];
-
-    // CAN data is put into array called payload
-    uint8_t payload[DATA_BYTES] = {
-        Time0, Time1,
-        BMS_Disch_Enable0, BMS_Disch_Enable1,
-        Pack_Voltage0, Pack_Voltage1,
-        Pack_Current0, Pack_Current1,
-        Pack_Temp0, Pack_Temp1,
-        State_of_Charge0, State_of_Charge1,
-        Min_Cell_Voltage0, Min_Cell_Voltage1, 
-        BMS_LV_Input0, BMS_LV_Input1,
-        Torque_Feedback0, Torque_Feedback1,
-        RPM0, RPM1,
-        Flux_Feedback0, Flux_Feedback1,
-        InlineAcc0, InlineAcc1,
-        LateralAcc0, LateralAcc1,
-        VerticalAcc0, VerticalAcc1,
-        RollRate0, RollRate1,
-        PitchRate0, PitchRate1,
-        YawRate0, YawRate1
-    };
-
-    // make the packet with the id, abp, and payload
-    // put into array packet
-    make_packet(sender_id, abp, payload, packet);
-
-    Serial.printf("\nSending frame counter=%lu seq=%u\n", (unsigned long)counter, abp);
-
-    // send the packet 
-    int ok = send_with_retries(abp, packet);
-    if (ok) {
-        counter++;
-        abp ^= 1;           // alternate the bit 
-    } else {
-        Serial.println("Giving up on this frame (will try again next loop)");
+    // before any round trip is measured, guess from the ACK airtime at each rate
+    for (uint8_t d = 0; d < ADR_NUM_RATES; d++) {
+        rtt_init(&rtt[d], 2 * (adr_airtime_ms(d, ACK_LEN) + RTT_TURNAROUND_MS));
     }
+#if TDMA_ENABLED
+    // until the first beacon says otherwise we are on the default rate
+    max_pck_len = adr_max_len(ADR_DEFAULT_DR, TDMA_SLOT_MS);
+#endif
 
-    
+#if FLASH_LOG
+    log_lock = xSemaphoreCreateMutex();
+    ring_init(&log_queue);
+    log_open();
+#endif
+
+    // CAN ingestion and LoRa transmission run on separate cores
+    xTaskCreatePinnedToCore(radio_task, "radio", 8192, NULL, 1, &radio_task_handle, RADIO_TASK_CORE);
+    xTaskCreatePinnedToCore(can_task, "can", 4096, NULL, 2, NULL, CAN_TASK_CORE);
+    xTaskCreatePinnedToCore(stats_task, "stats", 3072, NULL, 1, NULL, CAN_TASK_CORE);
+#if FLASH_LOG
+    // flash writes can stall for a while, so the log task only runs when the CAN task is waiting
+    if (log_ok) {
+        xTaskCreatePinnedToCore(log_task, "log", 4096, NULL, 1, NULL, CAN_TASK_CORE);
+    }
+#endif
+}
+
+void loop() {
+    // all of the work happens in can_task and radio_task
+    vTaskDelete(NULL);
 }
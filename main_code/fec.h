@@ -0,0 +1,312 @@
+// packet level erasure coding on top of the ARQ (FEC_PARITY > 0)
+//
+// experimental: in the link simulator it has not delivered more than FEC_PARITY 0 at any loss
+// rate so far, the parity airtime costs about as much as the retries it saves. off by default.
+//
+// every FEC_GROUP packets in a row by seq (seq / FEC_GROUP is the group) are followed
+// on air by FEC_PARITY parity packets, a systematic Reed-Solomon code over GF(256)
+// built from a Cauchy matrix, so the base station rebuilds any FEC_PARITY missing
+// packets of a group without waiting for a retry. parity packets have no seq of their
+// own and are never resent or ACKed, whatever still can't be rebuilt is left to the ARQ
+// as before. the last parity packet carries the poll, so the ACK of the burst already
+// covers what was rebuilt. a parity packet is the FEC header (wire_schema.h), the CRC-8
+// of every packet of the group as it was coded and the parity of the symbols, as long as
+// the longest one. the symbol of a packet is its data length, byte 0 and its data (byte 1
+// holds the poll bit, which changes between tries, the seq follows from the position).
+// shorter symbols are padded with zeros. only first tries are coded, TX_LATEST can refresh a
+// retry, so the base station checks every packet against its CRC before using it.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+#include "arq.h"
+#include "batch.h"
+
+#define FEC_CRC         WIRE_LEN(FEC)   // where the CRCs start
+#define FEC_HDR_LEN     (FEC_CRC + FEC_GROUP)
+#define FEC_SYM_MAX     MAX_PCK_LEN     // data length byte, byte 0 and the data
+#define FEC_MAX_LEN     (FEC_HDR_LEN + FEC_SYM_MAX)
+
+static_assert(NUM_CARS < FEC_FLAG, "sender_id has to leave room for FEC_FLAG");
+static_assert(FEC_GROUP >= 2 && FEC_GROUP <= 15 && SEQ_SPACE % FEC_GROUP == 0, "FEC_GROUP has to divide the seq space");
+static_assert(FEC_PARITY >= 0 && FEC_PARITY <= 4, "FEC_PARITY is 0 (off) to 4");
+static_assert(FEC_MAX_LEN <= 255, "parity packet does not fit in one SX1262 packet");
+
+// the group a seq belongs to, as the seq of its first packet
+static inline uint8_t fec_group_of(uint8_t seq) {
+    return (uint8_t)(seq - seq % FEC_GROUP);
+}
+
+
+/* ---------------------------------- GF(256) ---------------------------------- */
+
+// polynomial 0x11D, shift and add is fast enough for a few hundred bytes per packet
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint8_t r = 0;
+    while (b) {
+        if (b & 1) r ^= a;
+        a = (uint8_t)((a << 1) ^ (a & 0x80 ? 0x1D : 0));
+        b >>= 1;
+    }
+    return r;
+}
+
+// a^254, a must not be 0
+static inline uint8_t gf_inv(uint8_t a) {
+    uint8_t r = 1;
+    for (int e = 254; e; e >>= 1) {
+        if (e & 1) r = gf_mul(r, a);
+        a = gf_mul(a, a);
+    }
+    return r;
+}
+
+// Cauchy matrix 1 / (x_j + y_i) with x_j = FEC_GROUP + j and y_i = i, every square
+// submatrix of it can be inverted so any FEC_PARITY losses can be rebuilt
+static inline uint8_t fec_coef(int parity, int member) {
+    return gf_inv((uint8_t)((FEC_GROUP + parity) ^ member));
+}
+
+// out[0..len) += c * in[0..len)
+static inline void gf_mul_add(uint8_t *out, const uint8_t *in, uint8_t c, int len) {
+    if (c == 1) {
+        for (int i = 0; i < len; i++) out[i] ^= in[i];
+        return;
+    }
+    for (int i = 0; i < len; i++) out[i] ^= gf_mul(in[i], c);
+}
+
+static inline void fec_swap(uint8_t *a, uint8_t *b, int len) {
+    for (int i = 0; i < len; i++) {
+        uint8_t t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+}
+
+// CRC-8 (polynomial 0x07) of a symbol
+static inline uint8_t fec_crc8(const uint8_t *p, int len) {
+    uint8_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++) crc = (uint8_t)(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+    return crc;
+}
+
+// the symbol of a packet, returns its length
+static inline int fec_symbol(const uint8_t *packet, int len, uint8_t sym[FEC_SYM_MAX]) {
+    sym[0] = (uint8_t)(len - HEADER_LEN);
+    sym[1] = packet[PKT_ID];
+    memcpy(sym + 2, packet + HEADER_LEN, len - HEADER_LEN);
+    return len;
+}
+
+
+/* ---------------------------------- car_end ---------------------------------- */
+
+struct fec_encoder {
+    uint8_t group;                      // first seq of the group being coded
+    uint8_t count;                      // packets coded so far, 0xFF = a packet was missed, wait for the next group
+    uint8_t sent;                       // parity packets built once count reached FEC_GROUP
+    uint8_t len;                        // longest symbol
+    uint8_t crc[FEC_GROUP];
+    uint8_t parity[FEC_PARITY > 0 ? FEC_PARITY : 1][FEC_SYM_MAX];
+};
+
+static inline void fec_encoder_init(fec_encoder *e) {
+    e->group = 0;
+    e->count = 0xFF;
+    e->sent = FEC_PARITY;
+    e->len = 0;
+}
+
+// a packet goes on air for the first time, they come in seq order
+// returns 1 if it completed its group, the parity is ready to go right after it
+static inline int fec_add(fec_encoder *e, const uint8_t *packet, int len) {
+    uint8_t seq = packet[PKT_SEQ] & SEQ_MASK;
+    int i = seq % FEC_GROUP;
+    if (i == 0) {
+        e->group = seq;
+        e->count = 0;
+        e->sent = FEC_PARITY;
+        e->len = 0;
+        memset(e->parity, 0, sizeof(e->parity));
+    }
+    // one dropped before its first try (too long for the slot rate) and the group is lost
+    if (e->count != i || fec_group_of(seq) != e->group) {
+        e->count = 0xFF;
+        return 0;
+    }
+
+    uint8_t sym[FEC_SYM_MAX];
+    int n = fec_symbol(packet, len, sym);
+    e->crc[i] = fec_crc8(sym, n);
+    if (n > e->len) e->len = (uint8_t)n;
+    for (int j = 0; j < FEC_PARITY; j++) {
+        gf_mul_add(e->parity[j], sym, fec_coef(j, i), n);
+    }
+    if (++e->count < FEC_GROUP) return 0;
+    e->sent = 0;
+    return 1;
+}
+
+static inline int fec_parity_left(const fec_encoder *e) {
+    return FEC_PARITY - e->sent;
+}
+
+static inline int fec_parity_len(const fec_encoder *e) {
+    return FEC_HDR_LEN + e->len;
+}
+
+// the next parity packet of a completed group, returns its length or 0 if there is none
+static inline int fec_next_parity(fec_encoder *e, uint8_t sender_id, int poll, uint8_t out[FEC_MAX_LEN]) {
+    if (fec_parity_left(e) <= 0) return 0;
+    int j = e->sent++;
+    wire_put(out, FEC_ID, sender_id | FEC_FLAG);
+    wire_put(out, FEC_FIRST, e->group | (poll ? POLL_BIT : 0));
+    wire_put(out, FEC_CODE, (FEC_GROUP << 4) | j);
+    memcpy(out + FEC_CRC, e->crc, FEC_GROUP);
+    memcpy(out + FEC_HDR_LEN, e->parity[j], e->len);
+    return FEC_HDR_LEN + e->len;
+}
+
+// the slot has no room for the parity, the group goes without
+static inline void fec_drop_parity(fec_encoder *e) {
+    e->sent = FEC_PARITY;
+}
+
+
+/* ---------------------------------- user_end ---------------------------------- */
+
+#define FEC_SYMS    (FEC_GROUP + (FEC_PARITY > 0 ? FEC_PARITY : 1))
+
+// the newest group heard from one car, packets of an older one are not kept
+struct fec_decoder {
+    bool     active;
+    bool     done;                      // every packet of the group is in or rebuilt
+    bool     have_crc;                  // a parity packet came in, crc is valid
+    uint8_t  group;
+    uint32_t have;                      // bit i: sym[i] is stored, parity j is sym[FEC_GROUP + j]
+    uint8_t  len;                       // coded length, from the parity
+    uint8_t  crc[FEC_GROUP];
+    uint8_t  sym[FEC_SYMS][FEC_SYM_MAX];
+};
+
+static inline void fec_decoder_init(fec_decoder *d) {
+    d->active = false;
+}
+
+// the slot for group, false if it is older than the one being collected
+static inline bool fec_select(fec_decoder *d, uint8_t group) {
+    if (d->active && d->group == group) return !d->done;
+    if (d->active && seq_dist(d->group, group) >= SEQ_SPACE / 2) return false;
+    d->active = true;
+    d->done = false;
+    d->have_crc = false;
+    d->group = group;
+    d->have = 0;
+    d->len = 0;
+    return true;
+}
+
+// a packet that passed the length checks came in, new or a duplicate
+static inline void fec_store_data(fec_decoder *d, const uint8_t *pck, int len) {
+    uint8_t seq = pck[PKT_SEQ] & SEQ_MASK;
+    int i = seq % FEC_GROUP;
+    if (!fec_select(d, fec_group_of(seq)) || (d->have & (1u << i))) return;
+    memset(d->sym[i], 0, FEC_SYM_MAX);
+    fec_symbol(pck, len, d->sym[i]);
+    d->have |= 1u << i;
+}
+
+// returns false if it isn't a parity packet this build can use
+static inline bool fec_store_parity(fec_decoder *d, const uint8_t *pck, int len) {
+    int j = pck[FEC_CODE] & 0x0F;
+    if (len <= FEC_HDR_LEN || len > FEC_MAX_LEN || (pck[FEC_CODE] >> 4) != FEC_GROUP || j >= FEC_PARITY) return false;
+    uint8_t group = pck[FEC_FIRST] & SEQ_MASK;
+    if (group % FEC_GROUP) return false;
+    if (!fec_select(d, group) || (d->have & (1u << (FEC_GROUP + j)))) return true;
+    if (d->have_crc && (memcmp(d->crc, pck + FEC_CRC, FEC_GROUP) || d->len != len - FEC_HDR_LEN)) {
+        // parity of another coding of the same seqs (the car rebooted), the CRCs sort out the packets
+        d->have &= (1u << FEC_GROUP) - 1;
+    }
+    memcpy(d->crc, pck + FEC_CRC, FEC_GROUP);
+    d->have_crc = true;
+    d->len = (uint8_t)(len - FEC_HDR_LEN);
+    memset(d->sym[FEC_GROUP + j], 0, FEC_SYM_MAX);
+    memcpy(d->sym[FEC_GROUP + j], pck + FEC_HDR_LEN, d->len);
+    d->have |= 1u << (FEC_GROUP + j);
+    return true;
+}
+
+// rebuild the missing packets of the group if enough parity is in, each one goes to
+// out[] as a packet with seq and no poll. returns how many, 0 if nothing could be done
+static inline int fec_rebuild(fec_decoder *d, uint8_t out[][MAX_PCK_LEN], int out_len[]) {
+    if (!d->active || d->done || !d->have_crc) return 0;
+
+    // a stored packet that isn't what was coded (a refreshed retry) counts as missing
+    int missing[FEC_GROUP], parity[FEC_GROUP];
+    int m = 0, p = 0;
+    for (int i = 0; i < FEC_GROUP; i++) {
+        bool ok = (d->have & (1u << i)) && d->sym[i][0] + 2 <= d->len
+               && fec_crc8(d->sym[i], d->sym[i][0] + 2) == d->crc[i];
+        if (!ok) missing[m++] = i;
+    }
+    for (int j = 0; j < FEC_PARITY && p < m; j++) {
+        if (d->have & (1u << (FEC_GROUP + j))) parity[p++] = j;
+    }
+    if (m == 0) {
+        d->done = true;
+        return 0;
+    }
+    if (p < m) return 0;
+
+    // take what was received out of the parity, then invert the Cauchy submatrix of
+    // the missing packets (Gauss-Jordan) and apply it to what is left
+    uint8_t a[FEC_GROUP][FEC_GROUP];
+    uint8_t r[FEC_GROUP][FEC_SYM_MAX];
+    for (int k = 0; k < m; k++) {
+        memcpy(r[k], d->sym[FEC_GROUP + parity[k]], d->len);
+        for (int i = 0, x = 0; i < FEC_GROUP; i++) {
+            if (x < m && missing[x] == i) {
+                a[k][x++] = fec_coef(parity[k], i);
+                continue;
+            }
+            gf_mul_add(r[k], d->sym[i], fec_coef(parity[k], i), d->len);
+        }
+    }
+    for (int c = 0; c < m; c++) {
+        int pivot = c;
+        while (pivot < m - 1 && a[pivot][c] == 0) pivot++;
+        if (pivot != c) {
+            fec_swap(a[c], a[pivot], m);
+            fec_swap(r[c], r[pivot], d->len);
+        }
+        uint8_t inv = gf_inv(a[c][c]);
+        for (int x = 0; x < m; x++) a[c][x] = gf_mul(a[c][x], inv);
+        for (int b = 0; b < d->len; b++) r[c][b] = gf_mul(r[c][b], inv);
+        for (int k = 0; k < m; k++) {
+            uint8_t f = a[k][c];
+            if (k == c || f == 0) continue;
+            gf_mul_add(a[k], a[c], f, m);
+            gf_mul_add(r[k], r[c], f, d->len);
+        }
+    }
+
+    int n = 0;
+    for (int k = 0; k < m; k++) {
+        const uint8_t *sym = r[k];
+        int len = sym[0] + HEADER_LEN;
+        if (sym[0] + 2 > d->len || fec_crc8(sym, sym[0] + 2) != d->crc[missing[k]]) continue;
+        memcpy(d->sym[missing[k]], sym, d->len);
+        d->have |= 1u << missing[k];
+        wire_put(out[n], PKT_ID, sym[1]);
+        wire_put(out[n], PKT_SEQ, (d->group + missing[k]) & SEQ_MASK);
+        memcpy(out[n] + HEADER_LEN, sym + 2, sym[0]);
+        out_len[n++] = len;
+    }
+    d->done = true;
+    return n;
+}
@@ -0,0 +1,98 @@
+// flash log record format and backfill packets
+//
+// car_end appends every decoded CAN snapshot to a ring of LOG_RECORDS fixed size
+// records in flash. records are numbered with a log index that only ever goes up,
+// record i lives at slot i % LOG_RECORDS. a record on flash:
+//   bytes 0-3   log index, little-endian
+//   bytes 4-7   car millis(), little-endian
+//   bytes 8-    telemetry (DATA_BYTES)
+//   last 2      CRC-16/CCITT of everything before it
+//
+// when the base station asks for it (ACK_F_BACKFILL) the car sends old records as a
+// batch packet whose count byte has BACKFILL_FLAG set, see BACKFILL in wire_schema.h
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+#include "signal_table.h"
+#include "output_frame.h"
+
+#define LOG_REC_LEN         (4 + 4 + DATA_BYTES + 2)
+
+#define BACKFILL_HDR_LEN    WIRE_LEN(BACKFILL)
+#define BACKFILL_REC_LEN    (WIRE_LEN(BACKFILL_REC) + DATA_BYTES)
+
+static_assert(BATCH_SIZE <= BACKFILL_COUNT_MASK, "batch count would collide with the backfill flags");
+static_assert(MAX_PCK_LEN >= HEADER_LEN + BACKFILL_HDR_LEN + BACKFILL_REC_LEN, "a backfill record has to fit in a packet");
+
+struct log_record {
+    uint32_t  index;
+    uint32_t  time_ms;
+    telemetry data;
+};
+
+static inline void put_le32(uint8_t *out, uint32_t v) {
+    out[0] = (uint8_t)(v & 0xFF);
+    out[1] = (uint8_t)((v >> 8) & 0xFF);
+    out[2] = (uint8_t)((v >> 16) & 0xFF);
+    out[3] = (uint8_t)((v >> 24) & 0xFF);
+}
+
+static inline uint32_t get_le32(const uint8_t *in) {
+    return in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static inline void log_pack(const log_record *rec, uint8_t out[LOG_REC_LEN]) {
+    put_le32(out, rec->index);
+    put_le32(out + 4, rec->time_ms);
+    memcpy(out + 8, &rec->data, DATA_BYTES);
+    uint16_t crc = crc16_ccitt(out, LOG_REC_LEN - 2);
+    out[LOG_REC_LEN - 2] = (uint8_t)(crc & 0xFF);
+    out[LOG_REC_LEN - 1] = (uint8_t)(crc >> 8);
+}
+
+// returns 0 if the record is blank or damaged
+static inline int log_unpack(const uint8_t in[LOG_REC_LEN], log_record *rec) {
+    uint16_t crc = (uint16_t)(in[LOG_REC_LEN - 2] | (in[LOG_REC_LEN - 1] << 8));
+    if (crc != crc16_ccitt(in, LOG_REC_LEN - 2)) return 0;
+    rec->index = get_le32(in);
+    rec->time_ms = get_le32(in + 4);
+    memcpy(&rec->data, in + 8, DATA_BYTES);
+    return 1;
+}
+
+
+// batch payload that is really a backfill packet
+static inline bool is_backfill(const uint8_t *payload, int len) {
+    return len > 0 && (payload[BACKFILL_COUNT] & BACKFILL_FLAG);
+}
+
+// n consecutive records starting at recs[0].index, returns the payload length
+static inline int backfill_build(uint8_t *out, bool jump, const log_record *recs, int n) {
+    wire_put(out, BACKFILL_COUNT, BACKFILL_FLAG | (jump ? BACKFILL_JUMP : 0) | (n & BACKFILL_COUNT_MASK));
+    wire_put(out, BACKFILL_FIRST, recs[0].index);
+    uint8_t *rec = out + BACKFILL_HDR_LEN;
+    for (int i = 0; i < n; i++) {
+        wire_put(rec, BACKFILL_REC_TIME_MS, recs[i].time_ms);
+        memcpy(rec + WIRE_LEN(BACKFILL_REC), &recs[i].data, DATA_BYTES);
+        rec += BACKFILL_REC_LEN;
+    }
+    return BACKFILL_HDR_LEN + n * BACKFILL_REC_LEN;
+}
+
+// returns the number of records, -1 if the length doesn't match
+static inline int backfill_parse(const uint8_t *payload, int len, uint32_t *first, bool *jump) {
+    if (len < BACKFILL_HDR_LEN || !is_backfill(payload, len)) return -1;
+    int n = payload[BACKFILL_COUNT] & BACKFILL_COUNT_MASK;
+    if (n == 0 || len != BACKFILL_HDR_LEN + n * BACKFILL_REC_LEN) return -1;
+    *first = wire_get(payload, BACKFILL_FIRST);
+    *jump = (payload[BACKFILL_COUNT] & BACKFILL_JUMP) != 0;
+    return n;
+}
+
+static inline void backfill_record(const uint8_t *payload, int i, uint32_t *time_ms, telemetry *out) {
+    const uint8_t *rec = payload + BACKFILL_HDR_LEN + i * BACKFILL_REC_LEN;
+    *time_ms = wire_get(rec, BACKFILL_REC_TIME_MS);
+    memcpy(out, rec + WIRE_LEN(BACKFILL_REC), DATA_BYTES);
+}
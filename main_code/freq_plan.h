@@ -0,0 +1,42 @@
+// frequency plan shared between car_end and user_end
+//
+// the fleet is shared out over FREQ_RECEIVERS base station receivers: user_end boards
+// with RECEIVER_ID 0 .. FREQ_RECEIVERS - 1, or the channels of one multi-channel
+// gateway. car id c belongs to receiver c % FREQ_RECEIVERS, and every receiver runs its
+// own TDMA superframe (tdma.h) with only its cars in the beacon, so each receiver added
+// shortens everybody's superframe instead of splitting one channel further.
+// a receiver has FREQ_HOPS channels of FREQ_CHANNELS, every FREQ_RECEIVERS-th one from
+// its id on, so no two receivers ever share a channel and they need no common clock.
+// its beacons always go out on the first of them (the home channel), where a car that
+// lost the schedule listens. the slots of the superframe opened by beacon b are on
+// channel b % FREQ_HOPS of the set, so a retry in the next superframe goes out on
+// another channel and no channel carries more than its share of the airtime.
+#pragma once
+
+#include <stdint.h>
+#include "shared_defs.h"
+
+// MHz, 1.6 MHz apart so not even the BW500 rates of ADR_RATES overlap.
+// channel 0 is the 915.0 both ends always used before
+static constexpr float FREQ_CHANNELS[] = { 915.0, 913.4, 911.8, 910.2, 908.6, 907.0, 905.4, 903.8 };
+static constexpr uint8_t FREQ_NUM_CHANNELS = sizeof(FREQ_CHANNELS) / sizeof(FREQ_CHANNELS[0]);
+
+static_assert(FREQ_RECEIVERS >= 1 && FREQ_HOPS >= 1, "at least one receiver on at least one channel");
+static_assert(FREQ_RECEIVERS * FREQ_HOPS <= FREQ_NUM_CHANNELS, "not enough FREQ_CHANNELS for every receiver's hop set");
+static_assert(256 % FREQ_HOPS == 0, "FREQ_HOPS has to divide 256 so the hops carry on over beacon_seq wrapping");
+static_assert(FREQ_HOPS == 1 || TDMA_ENABLED, "the hops follow the TDMA superframes");
+
+// the receiver a car's packets go to
+static inline uint8_t freq_receiver(uint8_t car) {
+    return (uint8_t)(car % FREQ_RECEIVERS);
+}
+
+// where the receiver's beacons are, and everything without TDMA
+static inline uint8_t freq_home_channel(uint8_t receiver) {
+    return receiver;
+}
+
+// channel of the slots (and their ACKs) in the superframe that beacon frame_seq opened
+static inline uint8_t freq_slot_channel(uint8_t receiver, uint8_t frame_seq) {
+    return (uint8_t)(receiver + FREQ_RECEIVERS * (frame_seq % FREQ_HOPS));
+}
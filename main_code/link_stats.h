@@ -0,0 +1,128 @@
+// fixed size counters and histograms on both ends of the link
+//
+// every counter is a plain uint32 that only one task ever writes, so counting is an
+// increment and nothing on the hot path prints or waits. every STATS_INTERVAL_MS the
+// whole set goes out as one binary stats frame (output_frame.h, OUT_REC_STATS):
+// car_end on its console, user_end in its record stream. values only ever go up, the
+// host works out rates from two frames, so a lost frame only costs resolution.
+// the struct is sent as its array of uint32 as it is, the enums are the layout.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+#include "output_frame.h"
+
+#define STAT_HIST_BINS      20          // bin 0 counts zeros, bin k [2^(k-1), 2^k), the last one everything above
+
+#define STATS_SRC_CAR       0           // car_end, id is MY_ID
+#define STATS_SRC_BASE      1           // user_end as a whole
+#define STATS_SRC_BASE_CAR  2           // user_end's counters for one car, id is the car
+
+struct stat_hist {
+    uint32_t bin[STAT_HIST_BINS];
+};
+
+static inline void hist_add(stat_hist *h, uint32_t v) {
+    int b = v ? 32 - __builtin_clz(v) : 0;
+    h->bin[b < STAT_HIST_BINS ? b : STAT_HIST_BINS - 1]++;
+}
+
+
+/* ---------------------------------- car_end ---------------------------------- */
+
+enum {
+    CS_CAN_FRAMES,                      // read from TWAI (CAN task)
+    CS_TWAI_MISSED,                     // frames the TWAI RX queue had no room for, from the driver (CAN_RX_QUEUE_LEN too short)
+    CS_RING_DROPS,                      // snapshots the radio task was too far behind for
+    CS_STALE,                           // TX_LATEST: skipped for age or superseded by a refresh
+    CS_QUEUED,                          // packets put in the ARQ window
+    CS_SENDS,                           // transmissions, retries included
+    CS_RETRIES,
+    CS_TX_ERRORS,
+    CS_FAILED,                          // given up after MAX_RETRIES
+    CS_ACKS,
+    CS_ACK_TIMEOUTS,
+    CS_NACKS,                           // ACKs with NACK, BAD_LEN or NO_REF
+    CS_AIR_MS,                          // own time on air
+    CS_BEACONS,
+    CS_PARKS,                           // light sleeps with the car off (LOW_POWER)
+    CS_PARKED_MS,                       // time spent in them
+    CS_CAN_FOREIGN,                     // read but not in SIGNALS, what the acceptance filter let through anyway
+    CS_PARITY,                          // FEC parity packets, also in CS_SENDS
+    CS_TOO_LONG,                        // queued packets a slower rate left too long for the slot, refreshed, split or dropped
+    CS_RESIZE_LOST,                     // snapshots lost that way, not in CS_FAILED
+    CS_COUNTERS
+};
+
+enum {
+    CH_ATTEMPTS,                        // transmissions per ACKed packet
+    CH_RTT_MS,                          // poll -> ACK, first tries only
+    CH_DECODE_CYCLES,                   // CPU cycles per CAN frame through the signal table
+    CH_HISTS
+};
+
+struct car_stats {
+    uint32_t v[CS_COUNTERS];
+    stat_hist h[CH_HISTS];
+};
+
+
+/* ---------------------------------- user_end ---------------------------------- */
+
+enum {
+    BS_PACKETS,                         // anything that passed the radio CRC
+    BS_RX_DROPS,                        // ACKed packets the decode queue had no room for
+    BS_BEACONS,
+    BS_OUT_BYTES,                       // written to the host
+    BS_COUNTERS
+};
+
+enum {
+    BH_PROCESS_CYCLES,                  // CPU cycles to decode and output one packet
+    BH_HISTS
+};
+
+enum {
+    BC_PACKETS,                         // new packets from the car
+    BC_RECORDS,                         // snapshots decoded and sent to the host, the goodput
+    BC_DATA_BYTES,                      // payload of the new packets
+    BC_DUPLICATES,
+    BC_BAD_LEN,
+    BC_NO_REF,
+    BC_CRC_ERRORS,                      // in the car's slot (TDMA only)
+    BC_SKIPPED,                         // snapshots the car never sent
+    BC_RSSI_N,                          // packets in the RSSI sum
+    BC_RSSI_SUM,                        // sum of -RSSI in dBm, the mean is BC_RSSI_SUM / BC_RSSI_N
+    BC_RSSI_WORST,                      // highest -RSSI so far
+    BC_FEC_REBUILT,                     // new packets rebuilt from parity instead of waiting for a retry
+    BC_COUNTERS
+};
+
+struct base_stats {
+    uint32_t v[BS_COUNTERS];
+    stat_hist h[BH_HISTS];
+    uint32_t car[NUM_CARS][BC_COUNTERS];
+};
+
+static_assert(sizeof(car_stats) == 4 * (CS_COUNTERS + CH_HISTS * STAT_HIST_BINS), "car_stats must be a plain uint32 array");
+static_assert(sizeof(base_stats) == 4 * (BS_COUNTERS + BH_HISTS * STAT_HIST_BINS + NUM_CARS * BC_COUNTERS), "base_stats must be a plain uint32 array");
+
+// user_end sends its own part and every car's counters as separate records
+static_assert(sizeof(car_stats) / 4 <= OUT_STATS_MAX && BS_COUNTERS + BH_HISTS * STAT_HIST_BINS <= OUT_STATS_MAX, "stats don't fit in a stats record");
+
+static inline void car_stats_init(car_stats *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+static inline void base_stats_init(base_stats *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+static inline void base_stats_rssi(base_stats *s, uint8_t car, int8_t rssi_dbm) {
+    uint32_t *c = s->car[car];
+    uint32_t neg = rssi_dbm < 0 ? (uint32_t)(-(int)rssi_dbm) : 0;
+    c[BC_RSSI_N]++;
+    c[BC_RSSI_SUM] += neg;
+    if (neg > c[BC_RSSI_WORST]) c[BC_RSSI_WORST] = neg;
+}
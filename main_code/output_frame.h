@@ -0,0 +1,181 @@
+// binary serial output from user_end (and car_end's stats) to the host
+//
+// every record is COBS encoded and ends with a 0x00 byte, so the host can always
+// find the start of the next record even if it joins mid-stream or loses bytes.
+// decoded, a record is OUT_TELEM (wire_schema.h), NUM_CHANNELS raw uint16 channels and a
+// CRC-16/CCITT of everything before it. a stats record (link_stats.h) in the same stream,
+// or on car_end's console, is OUT_STATS, its uint32 values and the CRC
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "signal_table.h"
+
+#define OUT_TELEM_HDR_LEN   WIRE_LEN(OUT_TELEM)
+#define OUT_TELEM_LEN       (OUT_TELEM_HDR_LEN + 2 * NUM_CHANNELS + 2)
+#define OUT_STATS_HDR_LEN   WIRE_LEN(OUT_STATS)
+#define OUT_STATS_MAX       100                 // values in one stats record
+#define OUT_MAX_RAW_LEN     (OUT_STATS_HDR_LEN + 4 * OUT_STATS_MAX + 2)
+#define OUT_MAX_FRAME_LEN   (OUT_MAX_RAW_LEN + OUT_MAX_RAW_LEN / 254 + 2)
+
+static_assert(OUT_TELEM_LEN <= OUT_MAX_RAW_LEN, "telemetry record too big for the output buffer");
+
+
+static inline uint16_t crc16_ccitt(const uint8_t *data, int len) {
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// COBS encode in into out and add the 0x00 delimiter, returns the frame length
+static inline int cobs_encode(const uint8_t *in, int len, uint8_t *out) {
+    int code_pos = 0;
+    int o = 1;
+    uint8_t code = 1;
+    for (int i = 0; i < len; i++) {
+        if (in[i] == 0) {
+            out[code_pos] = code;
+            code_pos = o++;
+            code = 1;
+            continue;
+        }
+        out[o++] = in[i];
+        if (++code == 0xFF) {
+            out[code_pos] = code;
+            code_pos = o++;
+            code = 1;
+        }
+    }
+    out[code_pos] = code;
+    out[o++] = 0x00;
+    return o;
+}
+
+// decode one frame (without its 0x00 delimiter), returns the decoded length or -1
+static inline int cobs_decode(const uint8_t *in, int len, uint8_t *out, int out_max) {
+    int o = 0;
+    int i = 0;
+    while (i < len) {
+        uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > len) return -1;
+        for (int k = 1; k < code; k++) {
+            if (o >= out_max) return -1;
+            out[o++] = in[i++];
+        }
+        if (code != 0xFF && i < len) {
+            if (o >= out_max) return -1;
+            out[o++] = 0;
+        }
+    }
+    return o;
+}
+
+
+struct out_telemetry {
+    uint8_t   type;                     // OUT_REC_*
+    uint8_t   car_id;
+    uint8_t   seq;
+    int8_t    rssi_dbm;
+    int8_t    snr_q4;                   // SNR * 4
+    uint32_t  car_time_ms;
+    telemetry data;
+};
+
+// build the framed record, returns the frame length
+static inline int build_telemetry_frame(const out_telemetry *r, uint8_t out[OUT_MAX_FRAME_LEN]) {
+    uint8_t raw[OUT_TELEM_LEN];
+    wire_put(raw, OUT_TELEM_TYPE, r->type);
+    wire_put(raw, OUT_TELEM_CAR, r->car_id);
+    wire_put(raw, OUT_TELEM_SEQ, r->seq);
+    wire_put(raw, OUT_TELEM_RSSI, r->rssi_dbm);
+    wire_put(raw, OUT_TELEM_SNR, r->snr_q4);
+    wire_put(raw, OUT_TELEM_CAR_TIME, r->car_time_ms);
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        raw[OUT_TELEM_HDR_LEN + 2 * i] = (uint8_t)(r->data.ch[i] & 0xFF);
+        raw[OUT_TELEM_HDR_LEN + 2 * i + 1] = (uint8_t)(r->data.ch[i] >> 8);
+    }
+    uint16_t crc = crc16_ccitt(raw, OUT_TELEM_LEN - 2);
+    raw[OUT_TELEM_LEN - 2] = (uint8_t)(crc & 0xFF);
+    raw[OUT_TELEM_LEN - 1] = (uint8_t)(crc >> 8);
+    return cobs_encode(raw, OUT_TELEM_LEN, out);
+}
+
+// parse a decoded (un-COBSed) telemetry record, returns 0 on a bad type, length or CRC
+static inline int parse_telemetry_record(const uint8_t *raw, int len, out_telemetry *r) {
+    if (len != OUT_TELEM_LEN || (raw[OUT_TELEM_TYPE] != OUT_REC_TELEMETRY && raw[OUT_TELEM_TYPE] != OUT_REC_BACKFILL)) return 0;
+    uint16_t crc = (uint16_t)(raw[len - 2] | (raw[len - 1] << 8));
+    if (crc != crc16_ccitt(raw, len - 2)) return 0;
+
+    r->type = wire_get(raw, OUT_TELEM_TYPE);
+    r->car_id = wire_get(raw, OUT_TELEM_CAR);
+    r->seq = wire_get(raw, OUT_TELEM_SEQ);
+    r->rssi_dbm = wire_get(raw, OUT_TELEM_RSSI);
+    r->snr_q4 = wire_get(raw, OUT_TELEM_SNR);
+    r->car_time_ms = wire_get(raw, OUT_TELEM_CAR_TIME);
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        r->data.ch[i] = (uint16_t)(raw[OUT_TELEM_HDR_LEN + 2 * i] | (raw[OUT_TELEM_HDR_LEN + 2 * i + 1] << 8));
+    }
+    return 1;
+}
+
+
+struct out_stats {
+    uint8_t  source;                    // STATS_SRC_*
+    uint8_t  id;
+    uint8_t  count;
+    uint32_t uptime_ms;
+    uint32_t v[OUT_STATS_MAX];
+};
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)((v >> 8) & 0xFF);
+    p[2] = (uint8_t)((v >> 16) & 0xFF);
+    p[3] = (uint8_t)((v >> 24) & 0xFF);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// frame count uint32 values (a stats struct of link_stats.h), returns the frame length
+static inline int build_stats_frame(uint8_t source, uint8_t id, uint32_t uptime_ms, const uint32_t *v, int count, uint8_t out[OUT_MAX_FRAME_LEN]) {
+    uint8_t raw[OUT_MAX_RAW_LEN];
+    if (count > OUT_STATS_MAX) count = OUT_STATS_MAX;
+    wire_put(raw, OUT_STATS_TYPE, OUT_REC_STATS);
+    wire_put(raw, OUT_STATS_SOURCE, source);
+    wire_put(raw, OUT_STATS_ID, id);
+    wire_put(raw, OUT_STATS_COUNT, count);
+    wire_put(raw, OUT_STATS_UPTIME, uptime_ms);
+    for (int i = 0; i < count; i++) {
+        put_u32(raw + OUT_STATS_HDR_LEN + 4 * i, v[i]);
+    }
+    int len = OUT_STATS_HDR_LEN + 4 * count;
+    uint16_t crc = crc16_ccitt(raw, len);
+    raw[len++] = (uint8_t)(crc & 0xFF);
+    raw[len++] = (uint8_t)(crc >> 8);
+    return cobs_encode(raw, len, out);
+}
+
+// parse a decoded stats record, returns 0 if it isn't one or the CRC is wrong
+static inline int parse_stats_record(const uint8_t *raw, int len, out_stats *s) {
+    if (len < OUT_STATS_HDR_LEN + 2 || raw[OUT_STATS_TYPE] != OUT_REC_STATS) return 0;
+    int count = wire_get(raw, OUT_STATS_COUNT);
+    if (count > OUT_STATS_MAX || len != OUT_STATS_HDR_LEN + 4 * count + 2) return 0;
+    uint16_t crc = (uint16_t)(raw[len - 2] | (raw[len - 1] << 8));
+    if (crc != crc16_ccitt(raw, len - 2)) return 0;
+
+    s->source = wire_get(raw, OUT_STATS_SOURCE);
+    s->id = wire_get(raw, OUT_STATS_ID);
+    s->count = (uint8_t)count;
+    s->uptime_ms = wire_get(raw, OUT_STATS_UPTIME);
+    for (int i = 0; i < count; i++) {
+        s->v[i] = get_u32(raw + OUT_STATS_HDR_LEN + 4 * i);
+    }
+    return 1;
+}
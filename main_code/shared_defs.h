@@ -1,4 +1,7 @@
 // shared definitions for easy changing between user_end and car_end
+#pragma once
+
+#include "wire.h"                                       // the packet and record layouts (wire_schema.h)
 
 // hardware pins
 #define I2C_SDA 21
@@ -14,17 +17,114 @@
 
 
 // constants for data sending
-#define DATA_PCK_LEN    36
-#define HEADER_LEN      2                               // sender_id & abp
-#define DATA_BYTES      (DATA_PCK_LEN - HEADER_LEN)     
-#define ACK_LEN         3
+#define HEADER_LEN      WIRE_LEN(PKT)                   // sender_id & seq/poll
+#define DATA_BYTES      (2 * WIRE_NUM_CHANNELS)         // a keyframe, one uint16 per channel
+#define DATA_PCK_LEN    (HEADER_LEN + DATA_BYTES)
+#define ACK_LEN         (WIRE_LEN(ACK) + WIRE_LEN(ACK_LINK) + WIRE_LEN(ACK_LOSS) + WIRE_LEN(ACK_BACKFILL))   // longest ACK: base fields and every optional field
+#define ACK_FIELDS      0x03                            // optional ACK fields user_end sends, ACK_F_* in arq.h
 
+// settings in #ifndef can also come from the compiler command line (simulation/linksweep)
+#ifndef MAX_RETRIES
 #define MAX_RETRIES     5
-#define ACK_TIMEOUT_MS  500
+#endif
+#ifndef RTO_MIN_MS
+#define RTO_MIN_MS      30                              // retransmit timeout limits, the timeout itself comes from the measured RTT
+#endif
+#ifndef RTO_MAX_MS
+#define RTO_MAX_MS      3000
+#endif
+#define RTT_TURNAROUND_MS   20                          // first guess at user_end's time from poll to ACK, before any RTT sample
+#ifndef WINDOW_SIZE
+#define WINDOW_SIZE     8                               // max packets in flight (1 = stop and wait)
+#endif
+
+#define TX_RELIABLE     0                               // every snapshot is delivered (or dropped after MAX_RETRIES)
+#define TX_LATEST       1                               // retries carry the newest snapshot instead, older ones are dropped
+#define TX_POLICY       TX_LATEST
+#define MAX_AGE_MS      1000                            // TX_LATEST: snapshots older than this are dropped, and packets refreshed, when a newer one is waiting
+
+#define PAYLOAD_COMPRESSION 1                           // send deltas against the last ACKed keyframe
+#define KEYFRAME_INTERVAL   32                          // deltas in a row before a forced keyframe
+
+#ifndef BATCH_SIZE
+#define BATCH_SIZE          4                           // snapshots per packet (1 = one snapshot per packet)
+#endif
+#ifndef BATCH_TIMEOUT_MS
+#define BATCH_TIMEOUT_MS    50                          // max time the first snapshot waits for the batch to fill
+#endif
+#define BATCH_HDR_LEN       WIRE_LEN(BATCH)             // record count, base time & generation
+#define BATCH_REC_HDR_LEN   WIRE_LEN(BATCH_REC)         // time offset & record length
+#define MAX_PCK_LEN         (HEADER_LEN + BATCH_HDR_LEN + BATCH_SIZE * (BATCH_REC_HDR_LEN + DATA_BYTES))
+
+#ifndef FEC_PARITY
+#define FEC_PARITY          0                           // parity packets after every FEC_GROUP packets, the base station rebuilds that many losses without a retry (0 = off, experimental, it has not beaten the plain ARQ yet, see fec.h)
+#endif
+#ifndef FEC_GROUP
+#define FEC_GROUP           4                           // packets per parity group, has to divide 128
+#endif
+
+#define TDMA_ENABLED        1                           // cars only transmit in their beacon scheduled slot
+#define TDMA_SLOT_MS        300                         // slot length per car
+#define TDMA_GUARD_MS       10                          // gap after the beacon and at the end of each slot
+#define TDMA_ACK_RESERVE_MS 25                          // slot time kept free on top of the ACK airtime after the last packet
+#define TDMA_MAX_MISSED     4                           // superframes a car keeps its slot without hearing a beacon
+
+#define ADR_ENABLED         1                           // base station picks every car's data rate from its link (needs TDMA)
+#define ADR_DEFAULT_DR      2                           // SF7 BW125, index into ADR_RATES in adr.h
+#define ADR_BEACON_DR       0                           // beacons go out at the slowest rate so every car hears them
+#define ADR_MARGIN_DB       5                           // link margin kept above the demodulation floor
+#define ADR_MIN_SAMPLES     8                           // packets at the current rate before stepping up
+#define ADR_LOST_FRAMES     2                           // superframes without hearing a car before stepping it down
+
+#ifndef FREQ_RECEIVERS
+#define FREQ_RECEIVERS      1                           // base station receivers, each with its own cars, channels and superframe (freq_plan.h)
+#endif
+#ifndef FREQ_HOPS
+#define FREQ_HOPS           1                           // channels each receiver's slots hop over, one per superframe (1 = a fixed channel)
+#endif
+
+
+// car_end task pipeline
+#define SNAPSHOT_RING_LEN   32                          // CAN snapshots buffered between the CAN and radio tasks
+#define CAN_HW_FILTER       1                           // TWAI acceptance filter from SIGNALS, only our ids reach the RX queue
+#define CAN_ID_RATE_HZ      500                         // fastest any one of our ids is sent on the bus
+#define CAN_STALL_MS        50                          // longest the CAN task can be held off (flash writes stop the cache on both cores)
+#define CAN_TASK_CORE       0
+#define RADIO_TASK_CORE     1
+#define PRIORITY_SCHEDULING 1                           // per-channel rates and alarms from CHANNEL_POLICY (0 = snapshot every CAN frame)
+#define SCHED_HEARTBEAT_MS  1000                        // publish at least this often even if nothing changed
+#define EDGE_SUMMARY        1                           // send a min/max/mean per window (CHANNEL_POLICY agg) instead of the latest sample
+#define SUMMARY_WINDOW_MS   50                          // shortest summary window, a channel's period_ms stretches it
+
+
+// car_end flash log and backfill (flash_log.h)
+#define FLASH_LOG           1                           // log every decoded CAN frame to LittleFS and backfill it when asked
+#define LOG_RECORDS         16384                       // records kept in flash (~720 KB), oldest overwritten first
+#define LOG_FLUSH_MS        500                         // how much logging a power cut can lose
+#define LOG_FILE            "/can_log.bin"
+#define BACKFILL_RECORDS    3                           // log records per backfill packet (fewer if the slot is short)
+
+
+// car_end power management
+#define LOW_POWER           1                           // radio sleeps when idle, the ESP32 light sleeps while the car is off (needs PRIORITY_SCHEDULING)
+#define LP_CPU_MHZ          80                          // CAN decode and the radio task don't need 240
+#define LP_BEACON_EARLY_MS  15                          // TDMA: wake the radio this long before a beacon is due, for clock drift
+#define PARK_IDLE_MS        30000                       // no CAN frame for this long means the car is off
+#define PARK_HEARTBEAT_MS   10000                       // car off: one snapshot this often, the ESP32 sleeps in between
+#define PARK_POLL_MS        10                          // car off: how long a CAN read waits, so a heartbeat goes out right after a wake
+#define PARK_SETTLE_MS      200                         // after a wake, stay up at least this long for the heartbeat to go out
+
+
+// counters of both ends (link_stats.h)
+#define STATS_INTERVAL_MS   1000                        // how often each end sends its stats frame
+#define LOG_EVENTS          0                           // car_end also prints every event on its console (debugging, mixes in with the stats frames)
 
 
 // constants for data receiving
-#define NUM_CARS        3
+#define NUM_CARS        3                               // all receivers together, car ids 0 .. NUM_CARS - 1
+#define RX_QUEUE_LEN    16                              // received packets waiting to be decoded and printed
+#define OUTPUT_BINARY   1                               // COBS framed records to the host (0 = readable text for debugging)
+#define OUTPUT_BAUD     921600                          // serial baud of user_end, the text mode needs at least 115200
 
 // CAN interface pins
 #define CAN_TX_PIN 13
@@ -0,0 +1,65 @@
+// per-channel rate / priority scheduling on the car, driven by CHANNEL_POLICY
+//
+// the CAN task keeps the latest raw value of every channel, this decides which of
+// those the base station gets to see and when. critical channels are always
+// current, the rest only take a new value once per period, and a snapshot is only
+// published when something it carries actually changed (or as a heartbeat).
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+#include "signal_table.h"
+
+#define SCHED_NONE      0
+#define SCHED_PUBLISH   1               // publish a snapshot of the scheduled view
+#define SCHED_URGENT    2               // same, and send it without waiting for the batch to fill
+
+struct channel_scheduler {
+    telemetry view;                     // what gets published
+    uint32_t  taken_ms[NUM_CHANNELS];   // when each channel last took a new value
+    uint8_t   in_alarm[NUM_CHANNELS];
+    uint32_t  published_ms;
+    uint32_t  heartbeat_ms;             // SCHED_HEARTBEAT_MS, longer while the car is off (LOW_POWER)
+};
+
+static inline void sched_init(channel_scheduler *s) {
+    memset(s, 0, sizeof(*s));
+    s->heartbeat_ms = SCHED_HEARTBEAT_MS;
+}
+
+static inline bool sched_alarm(const channel_policy &p, uint16_t v) {
+    return v < p.alarm_lo || v > p.alarm_hi;
+}
+
+// fold the latest CAN values into the view, returns what to do with it
+static inline int sched_update(channel_scheduler *s, const telemetry *current, uint32_t now) {
+    int action = SCHED_NONE;
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        const channel_policy &p = CHANNEL_POLICY[i];
+        uint16_t v = current->ch[i];
+        if (v == s->view.ch[i]) continue;
+        if (p.period_ms && (now - s->taken_ms[i]) < p.period_ms) continue;
+
+        s->view.ch[i] = v;
+        s->taken_ms[i] = now;
+        if (action == SCHED_NONE) action = SCHED_PUBLISH;
+
+        // entering or leaving an alarm can't wait for the batch
+        uint8_t alarm = sched_alarm(p, v);
+        if (p.prio == PRIO_CRITICAL && alarm != s->in_alarm[i]) {
+            s->in_alarm[i] = alarm;
+            action = SCHED_URGENT;
+        }
+    }
+
+    // nothing changed for a while, publish anyway so the base station knows we're alive
+    if (action == SCHED_NONE && (now - s->published_ms) >= s->heartbeat_ms) {
+        action = SCHED_PUBLISH;
+    }
+    if (action != SCHED_NONE) {
+        s->published_ms = now;
+    }
+    return action;
+}
@@ -0,0 +1,106 @@
+// on-car summaries of every channel over a window (EDGE_SUMMARY)
+//
+// the CAN bus delivers far more samples than LoRa can carry, so instead of whatever
+// sample happens to be current the car sends one value per channel per window that
+// stands for all of them, picked by the agg field of CHANNEL_POLICY: the peak of
+// Pack_Current, the sag of Pack_Voltage, the mean of the IMU. min, max, sum and last
+// are all kept with an O(1) update for every sample decoded. AGG_LAST channels
+// (the critical ones) skip the window so their alarms aren't delayed.
+//
+// a channel's window is SUMMARY_WINDOW_MS, or its period_ms if that is longer so a
+// subsampled channel summarises everything since the value the scheduler last took.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+#include "signal_table.h"
+
+// keeps sum inside an int32 even at the full CAN rate
+static_assert(SUMMARY_WINDOW_MS <= 10000, "SUMMARY_WINDOW_MS too long");
+
+struct channel_stats {
+    uint16_t min;               // order keys (see stat_key), not raw values
+    uint16_t max;
+    uint16_t last;
+    uint32_t count;
+    int32_t  sum;
+    uint32_t start_ms;          // when the current window started
+};
+
+struct summary_stage {
+    channel_stats stats[NUM_CHANNELS];
+    telemetry view;             // the latest summary of every channel
+};
+
+// raw value -> key that compares the right way as an unsigned number
+static inline uint16_t stat_key(uint8_t agg, uint16_t v) {
+    return (agg & AGG_SIGNED) ? (uint16_t)(v ^ 0x8000) : v;
+}
+
+static inline uint32_t summary_window_ms(uint8_t ch) {
+#if PRIORITY_SCHEDULING
+    return CHANNEL_POLICY[ch].period_ms > SUMMARY_WINDOW_MS ? CHANNEL_POLICY[ch].period_ms : SUMMARY_WINDOW_MS;
+#else
+    return SUMMARY_WINDOW_MS;
+#endif
+}
+
+static inline void summary_init(summary_stage *s, uint32_t now) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        s->stats[i].start_ms = now;
+    }
+}
+
+// one new sample of channel ch
+static inline void summary_add(summary_stage *s, uint8_t ch, uint16_t v) {
+    uint8_t agg = CHANNEL_POLICY[ch].agg;
+    channel_stats *st = &s->stats[ch];
+    uint16_t key = stat_key(agg, v);
+
+    if (st->count == 0 || key < st->min) st->min = key;
+    if (st->count == 0 || key > st->max) st->max = key;
+    st->sum += (agg & AGG_SIGNED) ? (int32_t)(int16_t)v : (int32_t)v;
+    st->count++;
+    st->last = v;
+
+    if ((agg & AGG_KIND) == AGG_LAST) {
+        s->view.ch[ch] = v;
+    }
+}
+
+// feed the channels a decoded CAN frame just updated in current
+static inline void summary_add_frame(summary_stage *s, uint32_t can_id, const telemetry *current) {
+    for (uint8_t i = 0; i < NUM_SIGNALS && SIGNALS[i].can_id <= can_id; i++) {
+        if (SIGNALS[i].can_id == can_id) {
+            summary_add(s, SIGNALS[i].slot, current->ch[SIGNALS[i].slot]);
+        }
+    }
+}
+
+// close every window that has run out, returns the number of channels with a new summary
+// a window with no samples in it just keeps the previous summary
+static inline int summary_tick(summary_stage *s, uint32_t now) {
+    int closed = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        channel_stats *st = &s->stats[i];
+        if ((now - st->start_ms) < summary_window_ms(i)) continue;
+        st->start_ms = now;
+        if (st->count == 0) continue;
+
+        uint8_t agg = CHANNEL_POLICY[i].agg;
+        uint16_t v;
+        switch (agg & AGG_KIND) {
+        case AGG_MIN:  v = stat_key(agg, st->min); break;
+        case AGG_MAX:  v = stat_key(agg, st->max); break;
+        case AGG_MEAN: v = (uint16_t)(st->sum / (int32_t)st->count); break;
+        default:       v = st->last; break;
+        }
+        s->view.ch[i] = v;
+        closed++;
+        st->count = 0;
+        st->sum = 0;
+    }
+    return closed;
+}
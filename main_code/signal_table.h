@@ -0,0 +1,180 @@
+// CAN signal table: which bytes of which CAN frame go into which telemetry channel
+//
+// adding a signal = adding a channel to WIRE_CHANNELS (wire_schema.h) and one row to SIGNALS.
+// CAN data is big-endian (data[offset] is the high byte), the telemetry struct is
+// sent as-is so every channel goes out little-endian like it always has.
+#pragma once
+
+#include <stdint.h>
+#include "shared_defs.h"
+
+#define CHANNEL_ENUM(name, csv)     name,
+#define CHANNEL_NAME(name, csv)     csv,
+
+// payload channels, in wire order
+enum channel : uint8_t {
+    WIRE_CHANNELS(CHANNEL_ENUM)
+    NUM_CHANNELS
+};
+
+// headers for the type of data, indexed by channel
+static const char *const CHANNEL_NAMES[NUM_CHANNELS] = {
+    WIRE_CHANNELS(CHANNEL_NAME)
+};
+
+// the decoded CAN data, this is also exactly the DATA part of a packet
+struct __attribute__((packed)) telemetry {
+    uint16_t ch[NUM_CHANNELS];
+};
+
+static_assert(sizeof(telemetry) == DATA_BYTES, "telemetry must match DATA_BYTES");
+
+// how urgently each channel has to reach the base station, see signal_priority.h
+enum priority : uint8_t {
+    PRIO_CRITICAL,              // every change goes out, crossing an alarm limit goes out right away
+    PRIO_NORMAL,
+    PRIO_BULK,                  // subsampled hard, the IMU produces far more than LoRa can carry
+};
+
+// what one value stands for when EDGE_SUMMARY folds all the samples of a window into it, see signal_summary.h
+enum summary_kind : uint8_t {
+    AGG_LAST,                   // newest sample, passed straight through
+    AGG_MIN,
+    AGG_MAX,
+    AGG_MEAN,
+};
+#define AGG_SIGNED  0x80        // raw value is a two's complement int16 (or it with the kind)
+#define AGG_KIND    0x7F
+
+struct channel_policy {
+    uint8_t  prio;
+    uint16_t period_ms;         // at most one new value per period (0 = every change)
+    uint16_t alarm_lo;          // alarm while the raw value is below alarm_lo or above alarm_hi
+    uint16_t alarm_hi;
+    uint8_t  agg;               // summary_kind, optionally | AGG_SIGNED
+};
+
+#define NO_ALARM 0, 0xFFFF
+
+// indexed by channel, limits are in raw CAN units
+static constexpr channel_policy CHANNEL_POLICY[NUM_CHANNELS] = {
+    { PRIO_NORMAL,    50, NO_ALARM, AGG_LAST },             // Time
+    { PRIO_CRITICAL,   0, 1, 0xFFFF, AGG_LAST },            // BMS_Disch_Enable, 0 = the BMS opened the contactors
+    { PRIO_NORMAL,    50, NO_ALARM, AGG_MIN },              // Pack_Voltage
+    { PRIO_NORMAL,    50, NO_ALARM, AGG_MAX | AGG_SIGNED }, // Pack_Current
+    { PRIO_CRITICAL,   0, 0, 55, AGG_LAST },                // Pack_Temp
+    { PRIO_NORMAL,   500, NO_ALARM, AGG_LAST },             // State_of_Charge
+    { PRIO_CRITICAL,   0, 30000, 0xFFFF, AGG_LAST },        // Min_Cell_Voltage
+    { PRIO_NORMAL,   500, NO_ALARM, AGG_MIN },              // BMS_LV_Input
+    { PRIO_NORMAL,    50, NO_ALARM, AGG_MEAN | AGG_SIGNED },// Torque_Feedback
+    { PRIO_NORMAL,    50, NO_ALARM, AGG_MAX },              // RPM
+    { PRIO_NORMAL,   100, NO_ALARM, AGG_MEAN | AGG_SIGNED },// Flux_Feedback
+    { PRIO_BULK,     200, NO_ALARM, AGG_MEAN | AGG_SIGNED },// InlineAcc
+    { PRIO_BULK,     200, NO_ALARM, AGG_MEAN | AGG_SIGNED },// LateralAcc
+    { PRIO_BULK,     200, NO_ALARM, AGG_MEAN | AGG_SIGNED },// VerticalAcc
+    { PRIO_BULK,     200, NO_ALARM, AGG_MEAN | AGG_SIGNED },// RollRate
+    { PRIO_BULK,     200, NO_ALARM, AGG_MEAN | AGG_SIGNED },// PitchRate
+    { PRIO_BULK,     200, NO_ALARM, AGG_MEAN | AGG_SIGNED },// YawRate
+};
+
+struct can_signal {
+    uint16_t can_id;
+    uint8_t  offset;            // first byte in the CAN frame
+    uint8_t  width;             // 1 or 2 bytes
+    uint8_t  slot;              // destination channel
+};
+
+// rows must stay sorted by can_id
+// 0x604 bytes 0-1 carry the powertrain state, it has no channel in the payload
+static constexpr can_signal SIGNALS[] = {
+    { 0x600, 0, 2, CH_TIME },
+    { 0x600, 2, 2, CH_BMS_DISCH_ENABLE },
+    { 0x601, 0, 2, CH_PACK_VOLTAGE },
+    { 0x601, 2, 2, CH_PACK_CURRENT },
+    { 0x602, 0, 2, CH_PACK_TEMP },
+    { 0x602, 2, 2, CH_STATE_OF_CHARGE },
+    { 0x603, 0, 2, CH_MIN_CELL_VOLTAGE },
+    { 0x603, 2, 2, CH_BMS_LV_INPUT },
+    { 0x604, 2, 2, CH_TORQUE_FEEDBACK },
+    { 0x605, 0, 2, CH_RPM },
+    { 0x605, 2, 2, CH_FLUX_FEEDBACK },
+    { 0x606, 0, 2, CH_INLINE_ACC },
+    { 0x606, 2, 2, CH_LATERAL_ACC },
+    { 0x607, 0, 2, CH_VERTICAL_ACC },
+    { 0x607, 2, 2, CH_ROLL_RATE },
+    { 0x608, 0, 2, CH_PITCH_RATE },
+    { 0x608, 2, 2, CH_YAW_RATE },
+};
+
+static constexpr uint8_t NUM_SIGNALS = sizeof(SIGNALS) / sizeof(SIGNALS[0]);
+static constexpr uint16_t CAN_ID_FIRST = SIGNALS[0].can_id;
+static constexpr uint16_t CAN_ID_LAST = SIGNALS[NUM_SIGNALS - 1].can_id;
+
+// compile time checks on the table
+static constexpr bool signals_sorted(uint8_t i = 1) {
+    return i >= NUM_SIGNALS ? true : (SIGNALS[i - 1].can_id <= SIGNALS[i].can_id && signals_sorted(i + 1));
+}
+static constexpr bool signals_valid(uint8_t i = 0) {
+    return i >= NUM_SIGNALS ? true
+        : ((SIGNALS[i].width == 1 || SIGNALS[i].width == 2)
+           && SIGNALS[i].offset + SIGNALS[i].width <= 8
+           && SIGNALS[i].slot < NUM_CHANNELS
+           && signals_valid(i + 1));
+}
+static_assert(signals_sorted(), "SIGNALS must be sorted by can_id");
+static_assert(signals_valid(), "SIGNALS has a bad offset, width or slot");
+
+
+// TWAI hardware acceptance filter, built from SIGNALS so frames we don't decode never
+// reach the RX queue. dual filter mode gives two code/mask pairs on the 11 bit id, the
+// ids are split in two runs where that lets the fewest other ids through. a mask bit
+// of 1 is don't care, so each run's mask is every bit its ids don't all share
+static constexpr uint16_t filter_span(uint8_t lo, uint8_t hi) {
+    return lo >= hi ? 0 : (uint16_t)((SIGNALS[lo].can_id ^ SIGNALS[hi - 1].can_id) | filter_span(lo + 1, hi));
+}
+static constexpr uint32_t filter_accepts(uint8_t lo, uint8_t hi) {
+    return lo >= hi ? 0 : (uint32_t)1 << __builtin_popcount(filter_span(lo, hi));
+}
+// the second run starts at SIGNALS[split], NUM_SIGNALS = one run does it
+static constexpr uint8_t filter_split(uint8_t k = 1, uint8_t best = NUM_SIGNALS) {
+    return k >= NUM_SIGNALS ? best
+        : filter_split(k + 1, filter_accepts(0, k) + filter_accepts(k, NUM_SIGNALS)
+                              < filter_accepts(0, best) + filter_accepts(best, NUM_SIGNALS) ? k : best);
+}
+static constexpr uint8_t CAN_FILTER_SPLIT = filter_split();
+static constexpr uint8_t CAN_FILTER_LAST = CAN_FILTER_SPLIT < NUM_SIGNALS ? CAN_FILTER_SPLIT : 0;
+
+// ESP32 TWAI dual filter layout for standard frames: filter 1 has the id in bits
+// 31-21, filter 2 in bits 15-5, the RTR bits and data nibbles in between are don't care
+static constexpr uint32_t CAN_FILTER_CODE = ((uint32_t)SIGNALS[0].can_id << 21)
+                                          | ((uint32_t)SIGNALS[CAN_FILTER_LAST].can_id << 5);
+static constexpr uint32_t CAN_FILTER_MASK = ((uint32_t)filter_span(0, CAN_FILTER_SPLIT) << 21)
+                                          | ((uint32_t)filter_span(CAN_FILTER_LAST, NUM_SIGNALS) << 5)
+                                          | 0x001F001F;
+// how many ids get through, to size the RX queue by
+static constexpr uint32_t CAN_FILTER_IDS = filter_accepts(0, CAN_FILTER_SPLIT) + filter_accepts(CAN_FILTER_SPLIT, NUM_SIGNALS);
+
+static_assert(CAN_ID_LAST <= 0x7FF, "the acceptance filter only takes standard (11 bit) ids");
+
+
+// decode one CAN frame straight into the telemetry struct
+// returns the number of channels updated, 0 if the frame isn't one of ours
+static inline int decode_frame(uint32_t can_id, const uint8_t *data, uint8_t len, telemetry *out) {
+    if (can_id < CAN_ID_FIRST || can_id > CAN_ID_LAST) {
+        return 0;
+    }
+
+    int n = 0;
+    for (uint8_t i = 0; i < NUM_SIGNALS && SIGNALS[i].can_id <= can_id; i++) {
+        const can_signal &sig = SIGNALS[i];
+        if (sig.can_id != can_id || sig.offset + sig.width > len) continue;
+
+        uint16_t value = data[sig.offset];
+        if (sig.width == 2) {
+            value = (uint16_t)((value << 8) | data[sig.offset + 1]);
+        }
+        out->ch[sig.slot] = value;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,67 @@
+// lock-free single producer / single consumer ring of CAN snapshots
+//
+// the CAN task on one core pushes, the radio task on the other core pops. each
+// index is only ever written by one side so the only synchronisation needed is
+// release on the write of the index and acquire on the read of the other one.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "shared_defs.h"
+#include "signal_table.h"
+
+#if (SNAPSHOT_RING_LEN & (SNAPSHOT_RING_LEN - 1)) != 0
+#error "SNAPSHOT_RING_LEN must be a power of two"
+#endif
+
+// one decoded copy of every CAN signal
+struct can_snapshot {
+    uint32_t time_ms;               // millis() on the car when it was taken
+    uint16_t gen;                   // counts every snapshot taken, including ones that get dropped
+    uint8_t  urgent;                // a critical channel crossed an alarm limit, don't wait for the batch
+    telemetry data;
+};
+
+struct snapshot_ring {
+    std::atomic<uint32_t> head;     // next slot to write, producer only
+    std::atomic<uint32_t> tail;     // next slot to read, consumer only
+    uint32_t overflows;             // snapshots thrown away because the ring was full, producer only
+    can_snapshot slots[SNAPSHOT_RING_LEN];
+};
+
+static inline void ring_init(snapshot_ring *r) {
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->overflows = 0;
+}
+
+// producer side, returns 0 (and counts an overflow) if the consumer is too far behind
+static inline int ring_push(snapshot_ring *r, const can_snapshot *snap) {
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    uint32_t tail = r->tail.load(std::memory_order_acquire);
+    if ((head - tail) >= SNAPSHOT_RING_LEN) {
+        r->overflows++;
+        return 0;
+    }
+    r->slots[head & (SNAPSHOT_RING_LEN - 1)] = *snap;
+    r->head.store(head + 1, std::memory_order_release);
+    return 1;
+}
+
+// consumer side, returns 0 if there is nothing to read
+static inline int ring_pop(snapshot_ring *r, can_snapshot *out) {
+    uint32_t tail = r->tail.load(std::memory_order_relaxed);
+    uint32_t head = r->head.load(std::memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+    *out = r->slots[tail & (SNAPSHOT_RING_LEN - 1)];
+    r->tail.store(tail + 1, std::memory_order_release);
+    return 1;
+}
+
+// consumer side
+static inline int ring_empty(snapshot_ring *r) {
+    return r->head.load(std::memory_order_acquire) == r->tail.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,159 @@
+// beacon synchronised TDMA schedule shared between car_end and user_end
+//
+// user_end broadcasts a beacon at the start of every superframe. the beacon lists
+// which car owns each slot and at which data rate (adr.h) it runs. slots start
+// TDMA_GUARD_MS after the beacon and are slot_ms times the rate's slot_scale long,
+// so a car on a slow rate still fits its packets in. every car only transmits
+// (and waits for its ACKs) inside its own slot, so cars never collide no matter
+// how many there are. the beacon is BEACON and one BEACON_SLOT per slot (wire_schema.h).
+// with FREQ_RECEIVERS > 1 every receiver has a schedule of its own cars (freq_plan.h).
+// times are taken at the end of the beacon on both sides (transmit() / receive() returning)
+#pragma once
+
+#include <stdint.h>
+#include "shared_defs.h"
+#include "adr.h"
+#include "freq_plan.h"
+
+#define BEACON_HDR_LEN  WIRE_LEN(BEACON)
+#define BEACON_SLOT_LEN WIRE_LEN(BEACON_SLOT)
+#define TDMA_MAX_SLOTS  16
+#define BEACON_MAX_LEN  (BEACON_HDR_LEN + BEACON_SLOT_LEN * TDMA_MAX_SLOTS)
+
+struct tdma_schedule {
+    uint8_t  synced;
+    uint8_t  beacon_seq;
+    uint32_t beacon_ms;                 // local time the last beacon ended
+    uint16_t slot_ms;
+    uint8_t  num_slots;
+    uint8_t  owner[TDMA_MAX_SLOTS];
+    uint8_t  dr[TDMA_MAX_SLOTS];
+};
+
+static inline void tdma_init(tdma_schedule *t) {
+    t->synced = 0;
+    t->beacon_seq = 0;
+    t->beacon_ms = 0;
+    t->slot_ms = 0;
+    t->num_slots = 0;
+}
+
+// one slot per car of the receiver in sender_id order, used by the base station
+static inline void tdma_default_schedule(tdma_schedule *t, uint16_t slot_ms, uint8_t receiver) {
+    tdma_init(t);
+    t->slot_ms = slot_ms;
+    for (uint8_t c = 0; c < NUM_CARS && t->num_slots < TDMA_MAX_SLOTS; c++) {
+        if (freq_receiver(c) != receiver) continue;
+        t->owner[t->num_slots] = c;
+        t->dr[t->num_slots] = ADR_DEFAULT_DR;
+        t->num_slots++;
+    }
+}
+
+static inline uint32_t tdma_slot_len(const tdma_schedule *t, uint8_t i) {
+    return (uint32_t)t->slot_ms * ADR_RATES[t->dr[i]].slot_scale;
+}
+
+static inline uint32_t tdma_superframe_ms(const tdma_schedule *t) {
+    uint32_t ms = TDMA_GUARD_MS;
+    for (uint8_t i = 0; i < t->num_slots; i++) {
+        ms += tdma_slot_len(t, i);
+    }
+    return ms;
+}
+
+static inline uint32_t tdma_beacon_air_ms(const tdma_schedule *t) {
+    return adr_airtime_ms(adr_beacon_dr(), BEACON_HDR_LEN + BEACON_SLOT_LEN * t->num_slots);
+}
+
+// from the end of one beacon to the end of the next: the superframe, then the next beacon on air.
+// what a car counts in while it misses beacons
+static inline uint32_t tdma_period_ms(const tdma_schedule *t) {
+    return tdma_superframe_ms(t) + tdma_beacon_air_ms(t);
+}
+
+// returns the beacon length
+static inline int tdma_build_beacon(const tdma_schedule *t, uint8_t out[BEACON_MAX_LEN]) {
+    wire_put(out, BEACON_KIND, BEACON_ID);
+    wire_put(out, BEACON_SEQ, t->beacon_seq);
+    wire_put(out, BEACON_SLOT_MS, t->slot_ms);
+    wire_put(out, BEACON_SLOTS, t->num_slots);
+    for (uint8_t i = 0; i < t->num_slots; i++) {
+        uint8_t *slot = out + BEACON_HDR_LEN + BEACON_SLOT_LEN * i;
+        wire_put(slot, BEACON_SLOT_OWNER, t->owner[i]);
+        wire_put(slot, BEACON_SLOT_DR, t->dr[i]);
+    }
+    return BEACON_HDR_LEN + BEACON_SLOT_LEN * t->num_slots;
+}
+
+// take a received beacon as the new schedule, returns 0 if it isn't a beacon
+static inline int tdma_parse_beacon(tdma_schedule *t, const uint8_t *in, int len, uint32_t now) {
+    if (len < BEACON_HDR_LEN || in[BEACON_KIND] != BEACON_ID) return 0;
+    uint8_t n = wire_get(in, BEACON_SLOTS);
+    if (n == 0 || n > TDMA_MAX_SLOTS || len != BEACON_HDR_LEN + BEACON_SLOT_LEN * n) return 0;
+    const uint8_t *slots = in + BEACON_HDR_LEN;
+    for (uint8_t i = 0; i < n; i++) {
+        if (wire_get(slots + BEACON_SLOT_LEN * i, BEACON_SLOT_DR) >= ADR_NUM_RATES) return 0;
+    }
+
+    t->beacon_seq = wire_get(in, BEACON_SEQ);
+    t->slot_ms = wire_get(in, BEACON_SLOT_MS);
+    t->num_slots = n;
+    for (uint8_t i = 0; i < n; i++) {
+        t->owner[i] = wire_get(slots + BEACON_SLOT_LEN * i, BEACON_SLOT_OWNER);
+        t->dr[i] = wire_get(slots + BEACON_SLOT_LEN * i, BEACON_SLOT_DR);
+    }
+    t->beacon_ms = now;
+    t->synced = t->slot_ms != 0;
+    return 1;
+}
+
+// the current or next slot owned by id, as [start, end) in local time, and its data rate
+// if beacons go missing the schedule keeps running for TDMA_MAX_MISSED superframes
+// returns 0 if not synced or id owns no slot
+static inline int tdma_next_slot(tdma_schedule *t, uint8_t id, uint32_t now, uint32_t *start, uint32_t *end, uint8_t *dr) {
+    if (!t->synced) return 0;
+
+    uint32_t frame = tdma_period_ms(t);
+    uint32_t age = now - t->beacon_ms;
+    if (age >= frame * TDMA_MAX_MISSED) {
+        t->synced = 0;
+        return 0;
+    }
+
+    uint32_t frame_start = t->beacon_ms + (age / frame) * frame;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t s = frame_start + TDMA_GUARD_MS;
+        for (uint8_t i = 0; i < t->num_slots; i++) {
+            uint32_t e = s + tdma_slot_len(t, i);
+            if (t->owner[i] == id && (int32_t)(e - now) > 0) {
+                *start = s;
+                *end = e;
+                *dr = t->dr[i];
+                return 1;
+            }
+            s = e;
+        }
+        // our slot in this superframe is over, look at the next one
+        frame_start += frame;
+    }
+    return 0;
+}
+
+// beacon_seq of the superframe that is open at local time at (car side, at not before beacon_ms)
+static inline uint8_t tdma_frame_seq(const tdma_schedule *t, uint32_t at) {
+    return (uint8_t)(t->beacon_seq + (at - t->beacon_ms) / tdma_period_ms(t));
+}
+
+// the slot that is open at now on the base station, -1 during the guard time
+static inline int tdma_slot_at(const tdma_schedule *t, uint32_t now) {
+    uint32_t off = now - t->beacon_ms;
+    if (off < TDMA_GUARD_MS) return -1;
+    off -= TDMA_GUARD_MS;
+    for (uint8_t i = 0; i < t->num_slots; i++) {
+        uint32_t len = tdma_slot_len(t, i);
+        if (off < len) return i;
+        off -= len;
+    }
+    return -1;
+}
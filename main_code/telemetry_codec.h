@@ -0,0 +1,186 @@
+// keyframe / delta compression of the telemetry payload
+//
+// a keyframe is the plain DATA_PCK_LEN packet with the raw telemetry struct.
+// a delta frame is shorter, which is how the receiver tells them apart: the DELTA
+// header (wire_schema.h) and one zigzag varint per changed channel, in channel order.
+// deltas are always taken against an ACKed keyframe rather than the previous
+// packet, so a lost delta never breaks the ones after it.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "shared_defs.h"
+#include "signal_table.h"
+#include "arq.h"
+
+#define DELTA_HDR_LEN       WIRE_LEN(DELTA)
+
+static_assert(NUM_CHANNELS <= 8 * wire_size(DELTA_CHANGED), "channel bitmap too small");
+
+
+// signed 16 bit difference -> unsigned so small negative numbers stay small
+static inline uint16_t zigzag16(int16_t v) {
+    return (uint16_t)(((uint16_t)v << 1) ^ (uint16_t)(v >> 15));
+}
+
+static inline int16_t unzigzag16(uint16_t v) {
+    return (int16_t)((v >> 1) ^ (uint16_t)-(int16_t)(v & 1));
+}
+
+// 7 bits per byte, top bit set when another byte follows, returns bytes written
+static inline int put_varint(uint8_t *out, uint16_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+// returns bytes read, or -1 if the input runs out
+static inline int get_varint(const uint8_t *in, int len, uint16_t *v) {
+    uint16_t result = 0;
+    for (int n = 0; n < len && n < 3; n++) {
+        result |= (uint16_t)((in[n] & 0x7F) << (7 * n));
+        if ((in[n] & 0x80) == 0) {
+            *v = result;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+
+// encode cur against the keyframe ref into out
+// returns the length, or 0 if the delta would not be shorter than a keyframe
+static inline int encode_delta(uint8_t key_seq, const telemetry *ref, const telemetry *cur, uint8_t out[DATA_BYTES]) {
+    uint8_t tmp[DELTA_HDR_LEN + NUM_CHANNELS * 3];
+    uint32_t bitmap = 0;
+    int n = DELTA_HDR_LEN;
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        if (cur->ch[i] == ref->ch[i]) continue;
+        bitmap |= (uint32_t)1 << i;
+        n += put_varint(tmp + n, zigzag16((int16_t)(cur->ch[i] - ref->ch[i])));
+    }
+    if (n >= DATA_BYTES) {
+        return 0;
+    }
+
+    wire_put(tmp, DELTA_KEY_SEQ, key_seq);
+    wire_put(tmp, DELTA_CHANGED, bitmap);
+    memcpy(out, tmp, n);
+    return n;
+}
+
+static inline uint8_t delta_key_seq(const uint8_t *in) {
+    return wire_get(in, DELTA_KEY_SEQ);
+}
+
+// rebuild the full telemetry from a delta and its keyframe, returns 0 if malformed
+static inline int decode_delta(const uint8_t *in, int len, const telemetry *ref, telemetry *out) {
+    if (len < DELTA_HDR_LEN) {
+        return 0;
+    }
+    uint32_t bitmap = wire_get(in, DELTA_CHANGED);
+    int n = DELTA_HDR_LEN;
+
+    *out = *ref;
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        if ((bitmap & ((uint32_t)1 << i)) == 0) continue;
+        uint16_t z;
+        int used = get_varint(in + n, len - n, &z);
+        if (used < 0) {
+            return 0;
+        }
+        out->ch[i] = (uint16_t)(ref->ch[i] + unzigzag16(z));
+        n += used;
+    }
+    return n == len;
+}
+
+
+/* ---------------------------------- car side ---------------------------------- */
+
+struct delta_encoder {
+    uint8_t   ref_valid;            // the receiver has ACKed ref
+    uint8_t   ref_seq;
+    uint8_t   since_key;            // packets sent since the last keyframe
+    telemetry ref;
+};
+
+static inline void encoder_init(delta_encoder *e) {
+    memset(e, 0, sizeof(*e));
+}
+
+// fill out with either a delta or the raw keyframe, returns the DATA length
+static inline int encoder_encode(delta_encoder *e, const telemetry *cur, uint8_t out[DATA_BYTES]) {
+    if (e->ref_valid && e->since_key < KEYFRAME_INTERVAL) {
+        int n = encode_delta(e->ref_seq, &e->ref, cur, out);
+        if (n > 0) {
+            e->since_key++;
+            return n;
+        }
+    }
+    e->since_key = 0;
+    memcpy(out, cur, DATA_BYTES);
+    return DATA_BYTES;
+}
+
+// a keyframe got ACKed, use it as the reference if it is newer than the current one
+static inline void encoder_key_acked(delta_encoder *e, uint8_t seq, const uint8_t data[DATA_BYTES]) {
+    if (e->ref_valid && seq_dist(e->ref_seq, seq) >= SEQ_SPACE / 2) return;
+    memcpy(&e->ref, data, DATA_BYTES);
+    e->ref_seq = seq;
+    e->ref_valid = 1;
+}
+
+// the receiver lost our keyframe, send a fresh one next
+static inline void encoder_reset(delta_encoder *e) {
+    e->ref_valid = 0;
+}
+
+
+/* ---------------------------------- receive side ---------------------------------- */
+
+// keyframes the receiver keeps per car. a delta can still be in flight against a reference the
+// car has moved on from, and every keyframe queued from WINDOW_SIZE packets before it to
+// WINDOW_SIZE packets after it can reach us in the meantime, so that many newer ones have to fit
+#define DECODER_KEYS        (2 * WINDOW_SIZE)
+
+// the last DECODER_KEYS keyframes by seq, the oldest goes first
+struct delta_decoder {
+    uint8_t   valid[DECODER_KEYS];
+    uint8_t   seq[DECODER_KEYS];
+    uint8_t   newest;
+    telemetry key[DECODER_KEYS];
+};
+
+static inline void decoder_init(delta_decoder *d) {
+    memset(d, 0, sizeof(*d));
+}
+
+// a batch can carry more than one keyframe under the same seq, the last one wins.
+// one from a seq space ago with the same seq goes, it would be the next to be evicted
+static inline void decoder_store_key(delta_decoder *d, uint8_t seq, const telemetry *key) {
+    if (d->valid[d->newest] && d->seq[d->newest] == seq) {
+        d->key[d->newest] = *key;
+        return;
+    }
+    for (uint8_t j = 0; j < DECODER_KEYS; j++) {
+        if (d->seq[j] == seq) d->valid[j] = 0;
+    }
+    uint8_t i = d->valid[d->newest] ? (uint8_t)((d->newest + 1) % DECODER_KEYS) : d->newest;
+    d->valid[i] = 1;
+    d->seq[i] = seq;
+    d->key[i] = *key;
+    d->newest = i;
+}
+
+static inline const telemetry *decoder_find_key(const delta_decoder *d, uint8_t seq) {
+    for (int i = 0; i < DECODER_KEYS; i++) {
+        if (d->valid[i] && d->seq[i] == seq) return &d->key[i];
+    }
+    return NULL;
+}
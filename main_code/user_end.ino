@@ -2,27 +2,181 @@
 #include <Wire.h>
 #include <XPowersLib.h>
 #include <shared_defs.h>
+#include <arq.h>
+#include <signal_table.h>
+#include <telemetry_codec.h>
+#include <batch.h>
+#include <tdma.h>
+#include <adr.h>
+#include <freq_plan.h>
+#include <output_frame.h>
+#include <flash_log.h>
+#include <link_stats.h>
+#include <fec.h>
 
 XPowersAXP2101 PMU;
 SX1262 radio = new Module(LORA_CS, LORA_DIO1, LORA_RST, LORA_BUSY);
 
-// array index is the sender_id
-static int abp_array[NUM_CARS];
+// receiver ID **** NEEDS TO BE CHANGED FOR EACH RECEIVER (FREQ_RECEIVERS) AND STARTS AT 0 ****
+#define RECEIVER_ID     0
+static_assert(RECEIVER_ID < FREQ_RECEIVERS, "RECEIVER_ID outside FREQ_RECEIVERS");
+static_assert(FREQ_RECEIVERS <= NUM_CARS, "a receiver without cars has an empty beacon");
 
+// receive window and keyframes per car, array index is the sender_id
+static rx_window rx_windows[NUM_CARS];
+static delta_decoder decoders[NUM_CARS];
+static bool need_key[NUM_CARS];         // tell the car on its next ACK that a delta had no keyframe
+static adr_state adr[NUM_CARS];         // link quality and data rate per car
+static uint8_t radio_dr = ADR_DEFAULT_DR;   // rate the radio is set to right now
+static uint8_t radio_ch = freq_home_channel(RECEIVER_ID);  // channel of FREQ_CHANNELS it is on
+static uint8_t crc_errors[NUM_CARS];    // corrupted packets in each car's slot (TDMA only), reported as losses
+static uint16_t last_gen[NUM_CARS];     // snapshot generation of the newest record seen from each car
+static bool have_gen[NUM_CARS];
+static uint32_t backfill_next[NUM_CARS];    // every flash log record before this one has been backfilled
+#if FEC_PARITY
+static fec_decoder fec[NUM_CARS];       // the newest parity group of each car
+#endif
+
+// link quality of the last packet from each car, goes back in its ACK
+static int8_t last_rssi[NUM_CARS];
+static int8_t last_snr_q4[NUM_CARS];
+
+static tdma_schedule schedule;          // slot plan broadcast in every beacon
+static uint32_t next_beacon_ms;
+
+// set from the DIO1 interrupt, the SPI work happens in loop()
+static volatile bool packet_ready = false;
+
+// packets that have been ACKed and are waiting to be decoded and printed
+struct rx_packet {
+    uint8_t sender_id;
+    uint8_t seq;
+    bool    is_batch;
+    int     len;                        // DATA length
+    float   rssi;
+    float   snr;
+    uint8_t data[MAX_PCK_LEN - HEADER_LEN];
+};
+static rx_packet rx_queue[RX_QUEUE_LEN];
+static uint32_t rx_head = 0;            // next slot to fill
+static uint32_t rx_tail = 0;            // next slot to decode
+static base_stats stats;                // everything is counted from loop(), sent every STATS_INTERVAL_MS
+static uint32_t next_stats_ms;
+
+// status messages would corrupt the binary stream, so they only go out in text mode
+#if OUTPUT_BINARY
+#define log_printf(...) do {} while (0)
+#else
+#define log_printf(...) Serial.printf(__VA_ARGS__)
+#endif
+
+
+IRAM_ATTR static void on_dio1() {
+    packet_ready = true;
+}
+
+// every transmit also raises DIO1 (TX done), so forget that and go back to listening.
+// a packet that came in while we were busy is still flagged in the radio, startReceive()
+// would clear that, so leave it for loop() and restart once it has been read
+static void resume_receive() {
+    packet_ready = false;
+    if (radio.getIrqFlags() & RADIOLIB_SX126X_IRQ_RX_DONE) {
+        packet_ready = true;
+        return;
+    }
+    radio.startReceive();
+}
+
+// switch the radio to one of the rates in ADR_RATES and keep listening
+static void set_data_rate(uint8_t dr) {
+    if (dr == radio_dr) return;
+    const data_rate &r = ADR_RATES[dr];
+    radio.standby();
+    radio.setSpreadingFactor(r.sf);
+    radio.setBandwidth(r.bw_khz);
+    radio.setCodingRate(r.cr);
+    radio_dr = dr;
+    resume_receive();
+}
+
+// every channel is in the band begin() calibrated the image rejection for, so no calibration
+static void set_channel(uint8_t ch) {
+    if (ch == radio_ch) return;
+    radio.standby();
+    radio.setFrequency(FREQ_CHANNELS[ch], true);
+    radio_ch = ch;
+    resume_receive();
+}
+
+// the cars of this receiver, the others are on other channels
+static bool our_car(uint8_t sender_id) {
+    return sender_id < NUM_CARS && freq_receiver(sender_id) == RECEIVER_ID;
+}
+
+
+// backfill only runs while the car is close enough for the fastest rate
+static bool want_backfill(uint8_t sender_id) {
+#if FLASH_LOG
+    return !ADR_ENABLED || adr[sender_id].dr == ADR_NUM_RATES - 1;
+#else
+    return false;
+#endif
+}
 
 // send an acknowledgement
-static void send_ack(uint8_t sender_id, uint8_t abp, uint8_t status) {
-    // create a 3 byte acknowledgement and send
+static void send_ack(uint8_t sender_id, uint8_t seq, uint8_t status) {
+    // create an acknowledgement covering everything received so far and send
     uint8_t ack[ACK_LEN];
-    ack[0] = (uint8_t)(sender_id & 0xFF);
-    ack[1] = (uint8_t)(abp & 0xFF);
-    ack[2] = status;
-    radio.transmit(ack, ACK_LEN);  
+    ack[ACK_SENDER] = (uint8_t)(sender_id & 0xFF);
+    ack[ACK_SEQ] = (uint8_t)(seq & SEQ_MASK);
+    if (status == ACK_OK && need_key[sender_id]) {
+        status = ACK_NO_REF;
+        need_key[sender_id] = false;
+    }
+    // a hole in front of the bitmap means the car should resend now instead of waiting for its timer
+    else if (status == ACK_OK && rx_has_gap(&rx_windows[sender_id])) {
+        status = ACK_NACK;
+    }
+    ack[ACK_STATUS] = status;
+    rx_ack_fields(&rx_windows[sender_id], &ack[ACK_CUM], &ack[ACK_BITMAP]);
+    ack[ACK_DR] = adr[sender_id].next_dr;
+
+    ack_ext ext;
+    ext.rssi_dbm = last_rssi[sender_id];
+    ext.snr_q4 = last_snr_q4[sender_id];
+    ext.lost = (uint8_t)(rx_windows[sender_id].lost + crc_errors[sender_id]);
+    ext.backfill_from = backfill_next[sender_id];
+    int len = ack_put_ext(ack, ACK_FIELDS | (want_backfill(sender_id) ? ACK_F_BACKFILL : 0), &ext);
+
+    radio.transmit(ack, len);
+    resume_receive();
+}
+
+
+// broadcast the slot plan, the superframe starts when the beacon is off the air
+// every car's slot gets the rate ADR picked for it during the last superframe
+static void send_beacon() {
+    for (uint8_t i = 0; i < schedule.num_slots; i++) {
+        schedule.dr[i] = adr_new_superframe(&adr[schedule.owner[i]]);
+    }
+
+    uint8_t beacon[BEACON_MAX_LEN];
+    int len = tdma_build_beacon(&schedule, beacon);
+    set_data_rate(adr_beacon_dr());
+    set_channel(freq_home_channel(RECEIVER_ID));
+    radio.transmit(beacon, len);
+    stats.v[BS_BEACONS]++;
+    resume_receive();
+    schedule.beacon_ms = millis();
+    schedule.beacon_seq++;
+    next_beacon_ms = schedule.beacon_ms + tdma_superframe_ms(&schedule);
 }
 
 
 void power_up_tbeam() {
-    Serial.begin(115200);
+    // big enough for a whole record so printing never waits on the UART
+    Serial.setTxBufferSize(1024);
+    Serial.begin(OUTPUT_BAUD);
     
     Wire.begin(I2C_SDA, I2C_SCL);
     PMU.begin(Wire, AXP2101_SLAVE_ADDRESS, I2C_SDA, I2C_SCL);
@@ -34,15 +188,17 @@ void power_up_tbeam() {
     PMU.enableDLDO1();
 
     SPI.begin(LORA_SCK, LORA_MISO, LORA_MOSI, LORA_CS);
-    int state = radio.begin(915.0, 125.0, 7, 7, 0x12, 17, 8, 1.8, true);
+    const data_rate &dr = ADR_RATES[ADR_DEFAULT_DR];
+    int state = radio.begin(FREQ_CHANNELS[freq_home_channel(RECEIVER_ID)], dr.bw_khz, dr.sf, dr.cr, 0x12, 17, 8, 1.8, true);
     
     if (state == RADIOLIB_ERR_NONE) {
         radio.setTCXO(1.8); 
         radio.setDio2AsRfSwitch();
+        radio.setPacketReceivedAction(on_dio1);
         radio.startReceive(); // start listening immediately
-        Serial.println("receiver ready");
+        log_printf("receiver ready\n");
     } else {
-        Serial.println("radio failed");
+        log_printf("radio failed\n");
         while(1);
     }
 }
@@ -51,85 +207,405 @@ void power_up_tbeam() {
 void setup() {
     power_up_tbeam();
     
-    // initialize all elements in abp array to be -1 
+    // nothing received from any car yet
     for (int i = 0; i < NUM_CARS; i++) {
-        abp_array[i] = -1;
+        rx_window_init(&rx_windows[i]);
+        decoder_init(&decoders[i]);
+        need_key[i] = false;
+        adr_init(&adr[i]);
+        crc_errors[i] = 0;
+        have_gen[i] = false;
+        backfill_next[i] = 0;
+        last_rssi[i] = 0;
+        last_snr_q4[i] = 0;
+#if FEC_PARITY
+        fec_decoder_init(&fec[i]);
+#endif
     }
+
+    base_stats_init(&stats);
+    next_stats_ms = millis() + STATS_INTERVAL_MS;
+
+    // one slot per car of ours, first beacon goes out right away
+    tdma_default_schedule(&schedule, TDMA_SLOT_MS, RECEIVER_ID);
+    next_beacon_ms = millis();
 }
 
-void loop() {
-    uint8_t pck[DATA_PCK_LEN];
-    int16_t st = radio.receive(pck, DATA_PCK_LEN);
-    delay(100);
+// rebuild the car's telemetry struct from one record (keyframe or delta)
+// return true if decoded, false if it is a delta for a keyframe we don't have
+static bool decode_record(uint8_t sender_id, uint8_t seq, const uint8_t *data, int data_len, telemetry *out) {
+    if (data_len == DATA_BYTES) {
+        // keyframe, the data part is the struct itself (channels are little-endian)
+        memcpy(out, data, DATA_BYTES);
+        decoder_store_key(&decoders[sender_id], seq, out);
+        return true;
+    }
+
+    const telemetry *key = decoder_find_key(&decoders[sender_id], delta_key_seq(data));
+    if (key != NULL && decode_delta(data, data_len, key, out)) {
+        return true;
+    }
+    stats.car[sender_id][BC_NO_REF]++;
+    log_printf("NO_REF SEQ=%u key=%u\n", seq, delta_key_seq(data));
+    need_key[sender_id] = true;
+    return false;
+}
+
+
+// print to serial monitor 
+/* Outputs something similar to the following
+    Car_ID=1
+    SEQ=0
+    Car_Time=12345
+    Time=0x00A3
+    BMS_Disch_Enable=0x0001
+    Pack_Voltage=0x10B2
+*/
+static void print_record(uint8_t sender_id, uint8_t seq, bool backfill, bool has_time, uint32_t time_ms, const telemetry *data) {
+    Serial.printf("Car_ID=%u\n", sender_id);
+    Serial.printf("SEQ=%u\n", seq);
+    if (backfill) {
+        Serial.printf("Backfill=1\n");
+    }
+    if (has_time) {
+        Serial.printf("Car_Time=%lu\n", (unsigned long)time_ms);
+    }
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        Serial.printf("%s=0x%04X\n", CHANNEL_NAMES[i], data->ch[i]);
+    }
+    Serial.printf("\n");
+}
+
+
+static int8_t clamp_i8(float v) {
+    if (v < -128) return -128;
+    if (v > 127) return 127;
+    return (int8_t)v;
+}
+
+// one COBS framed record (see output_frame.h), about 47 bytes instead of ~400 of text
+static void write_record(const rx_packet *p, uint8_t type, uint32_t time_ms, const telemetry *data) {
+    out_telemetry r;
+    r.type = type;
+    r.car_id = p->sender_id;
+    r.seq = p->seq;
+    r.rssi_dbm = clamp_i8(p->rssi);
+    r.snr_q4 = clamp_i8(p->snr * 4);
+    r.car_time_ms = time_ms;
+    r.data = *data;
+
+    uint8_t frame[OUT_MAX_FRAME_LEN];
+    int len = build_telemetry_frame(&r, frame);
+    Serial.write(frame, len);
+    stats.v[BS_OUT_BYTES] += len;
+}
+
+// the base's own counters, then one record per car of ours (they don't all fit in one)
+static void send_stats() {
+    uint8_t frame[OUT_MAX_FRAME_LEN];
+    int len = build_stats_frame(STATS_SRC_BASE, RECEIVER_ID, millis(), (const uint32_t *)&stats, BS_COUNTERS + BH_HISTS * STAT_HIST_BINS, frame);
+    Serial.write(frame, len);
+    for (int c = 0; c < NUM_CARS; c++) {
+        if (!our_car(c)) continue;
+        len = build_stats_frame(STATS_SRC_BASE_CAR, c, millis(), stats.car[c], BC_COUNTERS, frame);
+        Serial.write(frame, len);
+    }
+}
+
+static void output_record(const rx_packet *p, uint8_t type, bool has_time, uint32_t time_ms, const telemetry *data) {
+    stats.car[p->sender_id][BC_RECORDS]++;
+#if OUTPUT_BINARY
+    write_record(p, type, has_time ? time_ms : 0, data);
+#else
+    print_record(p->sender_id, p->seq, type == OUT_REC_BACKFILL, has_time, time_ms, data);
+#endif
+}
+
+
+// link quality of anything a car sent, it goes into ADR and the next ACK
+static void heard_from(uint8_t sender_id, float rssi, float snr) {
+    adr_update(&adr[sender_id], (int16_t)(rssi * 4), (int16_t)(snr * 4));
+    last_rssi[sender_id] = clamp_i8(rssi);
+    last_snr_q4[sender_id] = clamp_i8(snr * 4);
+    base_stats_rssi(&stats, sender_id, clamp_i8(rssi));
+}
+
+// bad length: a single record is a full length keyframe or a shorter delta,
+// a batch has to parse all the way to the end
+static bool length_ok(const uint8_t *pck, int pck_len) {
+    const uint8_t *data = pck + HEADER_LEN;
+    int data_len = pck_len - HEADER_LEN;
+    bool is_batch = (pck[PKT_ID] & BATCH_FLAG) != 0;
+    if (pck_len > MAX_PCK_LEN) {
+        return false;
+    }
+    if (is_batch && is_backfill(data, data_len)) {
+        uint32_t first;
+        bool jump;
+        return backfill_parse(data, data_len, &first, &jump) >= 0;
+    }
+    if (is_batch) {
+        batch_record rec;
+        int pos = 0;
+        int r;
+        while ((r = batch_next(data, data_len, &pos, &rec)) > 0) {}
+        return r == 0;
+    }
+    return pck_len <= DATA_PCK_LEN && pck_len >= HEADER_LEN + DELTA_HDR_LEN;
+}
+
+// backfill moves on as soon as the records are in so the ACK already asks for the next ones
+// out of order packets don't count unless the car said it has nothing older
+static void backfill_progress(const uint8_t *pck, int pck_len) {
+    const uint8_t *data = pck + HEADER_LEN;
+    int data_len = pck_len - HEADER_LEN;
+    uint8_t sender_id = pck[PKT_ID] & SENDER_MASK;
+    if ((pck[PKT_ID] & BATCH_FLAG) && is_backfill(data, data_len)) {
+        uint32_t first;
+        bool jump;
+        int n = backfill_parse(data, data_len, &first, &jump);
+        if ((jump || first <= backfill_next[sender_id]) && first + n > backfill_next[sender_id]) {
+            backfill_next[sender_id] = first + n;
+        }
+    }
+}
+
+// room for this many more packets before loop() decodes the next one
+static uint32_t rx_queue_room() {
+    return RX_QUEUE_LEN - (rx_head - rx_tail);
+}
+
+// no room for a new packet: it is counted but not accepted, so the ACK doesn't cover
+// it and the car sends it again instead of freeing it
+static void rx_queue_full(uint8_t seq) {
+    stats.v[BS_RX_DROPS]++;
+    log_printf("RX queue full, dropped SEQ=%u (%lu total)\n", seq, (unsigned long)stats.v[BS_RX_DROPS]);
+}
+
+// a new packet waits for loop() to decode it, the caller made sure there is room
+static void queue_packet(const uint8_t *pck, int pck_len, float rssi, float snr) {
+    uint8_t sender_id = pck[PKT_ID] & SENDER_MASK;
+    uint8_t seq = pck[PKT_SEQ] & SEQ_MASK;
+    int data_len = pck_len - HEADER_LEN;
+    stats.car[sender_id][BC_PACKETS]++;
+    stats.car[sender_id][BC_DATA_BYTES] += data_len;
+
+    rx_packet *q = &rx_queue[rx_head % RX_QUEUE_LEN];
+    q->sender_id = sender_id;
+    q->seq = seq;
+    q->is_batch = (pck[PKT_ID] & BATCH_FLAG) != 0;
+    q->len = data_len;
+    q->rssi = rssi;
+    q->snr = snr;
+    memcpy(q->data, pck + HEADER_LEN, data_len);
+    rx_head++;
+}
+
+#if FEC_PARITY
+// what a parity packet rebuilds goes through the same checks as a packet that came in,
+// the ACK for the poll on the last one of a group already covers it
+static void handle_parity(const uint8_t *pck, int pck_len, float rssi, float snr) {
+    uint8_t sender_id = pck[FEC_ID] & SENDER_MASK & ~FEC_FLAG;
+    heard_from(sender_id, rssi, snr);
+    bool poll = (pck[FEC_FIRST] & POLL_BIT) != 0;
+
+    uint8_t rebuilt[FEC_PARITY][MAX_PCK_LEN];
+    int rebuilt_len[FEC_PARITY];
+    bool is_new[FEC_PARITY];
+    int n = 0;
+    if (fec_store_parity(&fec[sender_id], pck, pck_len)) {
+        n = fec_rebuild(&fec[sender_id], rebuilt, rebuilt_len);
+    }
+    uint32_t room = rx_queue_room();
+    for (int k = 0; k < n; k++) {
+        is_new[k] = (rebuilt[k][PKT_ID] & SENDER_MASK) == sender_id && length_ok(rebuilt[k], rebuilt_len[k])
+                 && rx_seen(&rx_windows[sender_id], rebuilt[k][PKT_SEQ]) == RX_NEW;
+        if (!is_new[k]) continue;
+        if (room == 0) {
+            rx_queue_full(rebuilt[k][PKT_SEQ] & SEQ_MASK);
+            is_new[k] = false;
+            continue;
+        }
+        room--;
+        rx_accept(&rx_windows[sender_id], rebuilt[k][PKT_SEQ]);
+        backfill_progress(rebuilt[k], rebuilt_len[k]);
+    }
+
+    // the poll stands for the last packet of the group
+    if (poll) send_ack(sender_id, (uint8_t)(pck[FEC_FIRST] + FEC_GROUP - 1), ACK_OK);
+    else resume_receive();
+    for (int k = 0; k < n; k++) {
+        if (!is_new[k]) continue;
+        stats.car[sender_id][BC_FEC_REBUILT]++;
+        log_printf("Rebuilt SEQ=%u from parity\n", rebuilt[k][PKT_SEQ]);
+        queue_packet(rebuilt[k], rebuilt_len[k], rssi, snr);
+    }
+}
+#endif
+
+// called as soon as DIO1 says a packet is in: read it, check it, ACK it right away
+// and queue it, decoding and printing wait until the radio is idle
+static void handle_packet() {
+    uint8_t pck[FEC_MAX_LEN];
+    int pck_len = radio.getPacketLength();
+    int16_t st = radio.readData(pck, pck_len < FEC_MAX_LEN ? pck_len : FEC_MAX_LEN);
+    packet_ready = false;
+    float rssi = radio.getRSSI();
+    float snr = radio.getSNR();
     
+#if TDMA_ENABLED
+    // a corrupted packet in a car's slot: its header can't be trusted but the slot
+    // says who sent it, the car hears about it in the loss count of its next ACK
+    if (st == RADIOLIB_ERR_CRC_MISMATCH) {
+        int slot = tdma_slot_at(&schedule, millis());
+        if (slot >= 0 && our_car(schedule.owner[slot])) {
+            crc_errors[schedule.owner[slot]]++;
+            stats.car[schedule.owner[slot]][BC_CRC_ERRORS]++;
+            log_printf("CRC error in car %u's slot\n", schedule.owner[slot]);
+        }
+    }
+#endif
+
     // make sure receive is properly receieved
     if (st != RADIOLIB_ERR_NONE) {
+        resume_receive();
         return;
     }
+    stats.v[BS_PACKETS]++;
 
-    // get the packet's length
-    int pck_len = radio.getPacketLength();
-    // if at least one packet arrived get the sender_id and abp
-    uint8_t sender_id;
-    uint8_t abp;
-    if (pck_len >= 2) { 
-        sender_id = pck[0];
-        abp = pck[1];
+#if FEC_PARITY
+    if (pck_len >= HEADER_LEN && (pck[FEC_ID] & FEC_FLAG) && our_car(pck[FEC_ID] & SENDER_MASK & ~FEC_FLAG)) {
+        handle_parity(pck, pck_len, rssi, snr);
+        return;
+    }
+#endif
+
+    // need at least the header to know who sent it
+    if (pck_len < HEADER_LEN || !our_car(pck[PKT_ID] & SENDER_MASK)) {
+        log_printf("Bad header length=%d\n", pck_len);
+        resume_receive();
+        return;
     }
-    else { abp = 0; }
+    uint8_t sender_id = pck[PKT_ID] & SENDER_MASK;
+    heard_from(sender_id, rssi, snr);
+    uint8_t seq = pck[PKT_SEQ] & SEQ_MASK;
+    bool poll = (pck[PKT_SEQ] & POLL_BIT) != 0;
 
-    // bad length
-    if (pck_len != DATA_PCK_LEN) {
-        Serial.printf("Bad length=%d -> ACK(BAD_LEN) ABP=%u\n", pck_len, abp);
-        send_ack(sender_id, abp, 2);
+    if (!length_ok(pck, pck_len)) {
+        stats.car[sender_id][BC_BAD_LEN]++;
+        log_printf("Bad length=%d -> ACK(BAD_LEN) SEQ=%u\n", pck_len, seq);
+        send_ack(sender_id, seq, ACK_BAD_LEN);
         return;
     }
+#if FEC_PARITY
+    fec_store_data(&fec[sender_id], pck, pck_len);
+#endif
 
-    // get the actual 30 byte data
-    const uint8_t* data = pck + 2;
+    // duplicate (a retry whose ACK got lost)
+    if (rx_seen(&rx_windows[sender_id], seq) == RX_DUPLICATE) {
+        if (poll) send_ack(sender_id, seq, ACK_DUPLICATE);
+        else resume_receive();
+        stats.car[sender_id][BC_DUPLICATES]++;
+        log_printf("DUPLICATE SEQ=%u -> ACK(DUPLICATE)\n", seq);
+        return;
+    }
 
-    // duplicate
-    if (abp_array[sender_id] == (int)abp) {
-        Serial.printf("DUPLICATE ABP=%u -> ACK(DUPLICATE)\n", abp);
-        send_ack(sender_id, abp, 1);
+    // the ACK still frees whatever else got here, just not this one
+    if (rx_queue_room() == 0) {
+        rx_queue_full(seq);
+        if (poll) send_ack(sender_id, seq, ACK_OK);
+        else resume_receive();
         return;
     }
+    rx_accept(&rx_windows[sender_id], seq);
+
+    backfill_progress(pck, pck_len);
+
+    // it is a new packet, the car only wants an ACK at the end of a burst
+    if (poll) send_ack(sender_id, seq, ACK_OK);
+    else resume_receive();
+    queue_packet(pck, pck_len, rssi, snr);
+}
+
+
+// decode every record in one queued packet and print them
+static void process_packet(const rx_packet *p) {
+    telemetry record;
+    if (p->is_batch && is_backfill(p->data, p->len)) {
+        // raw records out of the car's flash log, no keyframes or deltas involved
+        uint32_t first;
+        bool jump;
+        int n = backfill_parse(p->data, p->len, &first, &jump);
+        for (int i = 0; i < n; i++) {
+            uint32_t time_ms;
+            backfill_record(p->data, i, &time_ms, &record);
+            output_record(p, OUT_REC_BACKFILL, true, time_ms, &record);
+        }
+    }
+    else if (p->is_batch) {
+        // a jump in generation past the records in this batch is snapshots that never made it
+        // (retries and refreshed packets can arrive out of order, so only count forward jumps)
+        uint16_t gen = batch_gen(p->data);
+        int16_t jump = (int16_t)(gen - last_gen[p->sender_id]);
+        if (!have_gen[p->sender_id] || jump > 0) {
+            if (have_gen[p->sender_id] && jump > batch_count(p->data)) {
+                stats.car[p->sender_id][BC_SKIPPED] += jump - batch_count(p->data);
+                log_printf("Car %u skipped %d snapshots (%lu total)\n", p->sender_id, jump - batch_count(p->data), (unsigned long)stats.car[p->sender_id][BC_SKIPPED]);
+            }
+            last_gen[p->sender_id] = gen;
+            have_gen[p->sender_id] = true;
+        }
 
-    // otherwise it is a new packet so update the abp in the array and send the packet
-    abp_array[sender_id] = (int)abp;
+        batch_record rec;
+        int pos = 0;
+        while (batch_next(p->data, p->len, &pos, &rec) > 0) {
+            if (decode_record(p->sender_id, p->seq, rec.data, rec.len, &record)) {
+                output_record(p, OUT_REC_TELEMETRY, true, rec.time_ms, &record);
+            }
+        }
+    }
+    else if (decode_record(p->sender_id, p->seq, p->data, p->len, &record)) {
+        output_record(p, OUT_REC_TELEMETRY, false, 0, &record);
+    }
+}
 
-    // send acknowledgement of correct data
-    send_ack(sender_id, abp, 0);
 
-    // grab the 16 bit data and put into array 
-    uint16_t actual_data[17];
-    for (int i = 0; i < 17; i++) {
-        actual_data[i] = ((uint16_t)pck[2*i + 3] << 8) | pck[2*i + 2];
+void loop() {
+    // a waiting packet always goes first so its ACK isn't held up
+    if (packet_ready) {
+        handle_packet();
+        return;
+    }
+
+#if TDMA_ENABLED
+    // the beacon opens every superframe
+    if ((int32_t)(millis() - next_beacon_ms) >= 0) {
+        send_beacon();
+        return;
     }
 
-    // headers for the type of data
-    char *headers[17] = { "Time", "BMS_Disch_Enable",
-    "Pack_Voltage", "Pack_Current",
-    "Pack_Temp", "State_of_Charge",
-    "Min_Cell_Voltage", "BMS_LV_Input",
-    "Torque_Feedback", "RPM",
-    "Flux_Feedback", "InlineAcc",
-    "LateralAcc", "VerticalAcc",
-    "RollRate", "PitchRate", "YawRate"};
+    // listen at the rate of whichever car's slot is open, on this superframe's channel
+    // (beacon_seq already counts the next beacon)
+    int slot = tdma_slot_at(&schedule, millis());
+    if (slot >= 0) {
+        set_data_rate(schedule.dr[slot]);
+        set_channel(freq_slot_channel(RECEIVER_ID, (uint8_t)(schedule.beacon_seq - 1)));
+    }
+#endif
 
+#if OUTPUT_BINARY
+    if ((int32_t)(millis() - next_stats_ms) >= 0) {
+        send_stats();
+        next_stats_ms += STATS_INTERVAL_MS;
+        return;
+    }
+#endif
 
-    // print to serial monitor 
-    /* Outputs something similar to the following
-        Car_ID=1
-        ABP=0
-        Time=0x00A3
-        BMS_Disch_Enable=0x0001
-        Pack_Voltage=0x10B2
-    */
-    Serial.printf("Car_ID=%u\n", sender_id);
-    Serial.printf("ABP=%u\n", abp);
-    for (int i = 0; i < 17; i++) {
-        Serial.printf("%s=0x%04X\n", headers[i], actual_data[i]);
+    // radio is listening on its own, decode and output one packet at a time
+    if (rx_tail != rx_head) {
+        uint32_t cycles = ESP.getCycleCount();
+        process_packet(&rx_queue[rx_tail % RX_QUEUE_LEN]);
+        hist_add(&stats.h[BH_PROCESS_CYCLES], ESP.getCycleCount() - cycles);
+        rx_tail++;
     }
-    Serial.printf("\n");
 }
@@ -0,0 +1,108 @@
+// C++ codecs of the layouts in wire_schema.h
+//
+// every F(MSG, FIELD, type) of the schema becomes a constexpr MSG_FIELD. where an index is
+// wanted it is just the field's byte offset (ack[ACK_STATUS]), and it carries the field's
+// type and width for wire_get() / wire_put(). those are unrolled at compile time into one
+// load or store per byte, no loops, no branches, and work on the packet buffer in place.
+// WIRE_LEN(MSG) is the length of a message's fixed fields.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "wire_schema.h"
+
+// value type and bytes on the wire of every schema type
+#define WIRE_C_U8       uint8_t
+#define WIRE_C_I8       int8_t
+#define WIRE_C_U16      uint16_t
+#define WIRE_C_U24      uint32_t
+#define WIRE_C_U32      uint32_t
+#define WIRE_N_U8       1
+#define WIRE_N_I8       1
+#define WIRE_N_U16      2
+#define WIRE_N_U24      3
+#define WIRE_N_U32      4
+
+#define WIRE_COUNT(name, csv)   + 1
+#define WIRE_NUM_CHANNELS       (0 WIRE_CHANNELS(WIRE_COUNT))
+
+template <typename T, uint8_t N>
+struct wire_field {
+    uint8_t off;
+    constexpr operator uint8_t() const { return off; }
+};
+
+template <typename T, uint8_t N>
+static constexpr uint8_t wire_size(wire_field<T, N>) {
+    return N;
+}
+
+// little-endian, N is the number of bytes
+template <uint8_t N>
+struct wire_le {
+    static constexpr uint32_t get(const uint8_t *p) {
+        return ((uint32_t)p[N - 1] << (8 * (N - 1))) | wire_le<N - 1>::get(p);
+    }
+    static inline void put(uint8_t *p, uint32_t v) {
+        p[N - 1] = (uint8_t)(v >> (8 * (N - 1)));
+        wire_le<N - 1>::put(p, v);
+    }
+};
+
+template <>
+struct wire_le<0> {
+    static constexpr uint32_t get(const uint8_t *) { return 0; }
+    static inline void put(uint8_t *, uint32_t) {}
+};
+
+// keeps v out of template argument deduction, so an int goes into a uint8_t field like an assignment would
+template <typename T>
+struct wire_value {
+    typedef T type;
+};
+
+// msg points at the start of the message, not at the field
+template <typename T, uint8_t N>
+static constexpr T wire_get(const uint8_t *msg, wire_field<T, N> f) {
+    return (T)wire_le<N>::get(msg + f.off);
+}
+
+template <typename T, uint8_t N>
+static inline void wire_put(uint8_t *msg, wire_field<T, N> f, typename wire_value<T>::type v) {
+    wire_le<N>::put(msg + f.off, (uint32_t)v);
+}
+
+
+// a byte array per field gives the offsets through offsetof, nothing is ever accessed through the struct
+#define WIRE_MEMBER(msg, name, type)    uint8_t f_##name[WIRE_N_##type];
+#define WIRE_FIELD(msg, name, type) \
+    static constexpr wire_field<WIRE_C_##type, WIRE_N_##type> msg##_##name = { offsetof(wire_##msg, f_##name) };
+#define WIRE_MESSAGE(msg) \
+    struct wire_##msg { WIRE_##msg(WIRE_MEMBER) }; \
+    WIRE_##msg(WIRE_FIELD)
+
+#define WIRE_LEN(msg)   ((int)sizeof(wire_##msg))
+
+WIRE_MESSAGE(DELTA)
+WIRE_MESSAGE(PKT)
+WIRE_MESSAGE(BATCH)
+WIRE_MESSAGE(BATCH_REC)
+WIRE_MESSAGE(BACKFILL)
+WIRE_MESSAGE(BACKFILL_REC)
+WIRE_MESSAGE(FEC)
+WIRE_MESSAGE(ACK)
+WIRE_MESSAGE(ACK_LINK)
+WIRE_MESSAGE(ACK_LOSS)
+WIRE_MESSAGE(ACK_BACKFILL)
+WIRE_MESSAGE(BEACON)
+WIRE_MESSAGE(BEACON_SLOT)
+WIRE_MESSAGE(OUT_TELEM)
+WIRE_MESSAGE(OUT_STATS)
+WIRE_MESSAGE(ABP)
+WIRE_MESSAGE(ABP_FIRST)
+WIRE_MESSAGE(ABP_ACK)
+
+// a backfill packet is a batch packet as far as byte 0 goes
+static_assert(BACKFILL_COUNT == BATCH_COUNT, "the backfill flags have to sit in the batch count byte");
+static_assert(BEACON_KIND == PKT_ID, "a beacon has to be told apart from data by byte 0");
+static_assert(FEC_ID == PKT_ID && FEC_FIRST == PKT_SEQ, "a parity packet has to start like a data packet");
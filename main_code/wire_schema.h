@@ -0,0 +1,178 @@
+// the wire format: every byte layout that goes over the radio or out of user_end's serial port
+//
+// this is the one place a layout is written down. wire.h turns it into constexpr offsets,
+// lengths and fixed size get/put functions for the firmware, the simulator and the base
+// station. simulation/wire.py reads this file as it is and builds the same codecs for the
+// python tools, so a layout changed here changes on every end. keep to what wire.py reads:
+//   #define NAME value         a constant both ends need, value is a plain number
+//   WIRE_<MSG>(F) lists        the fixed fields of a message, one F(MSG, FIELD, type) per
+//                              field in wire order. types are U8, I8, U16, U24 and U32, all
+//                              little-endian. whatever follows the fixed fields (records,
+//                              channel values, parity) is described next to the list
+//   WIRE_CHANNELS(C)           the telemetry channels, C(enum name, csv name) in wire order
+#pragma once
+
+
+/* ---------------------------------- telemetry ---------------------------------- */
+
+// a keyframe is one raw uint16 per channel in this order (the telemetry struct of signal_table.h)
+#define WIRE_CHANNELS(C) \
+    C(CH_TIME,              "Time") \
+    C(CH_BMS_DISCH_ENABLE,  "BMS_Disch_Enable") \
+    C(CH_PACK_VOLTAGE,      "Pack_Voltage") \
+    C(CH_PACK_CURRENT,      "Pack_Current") \
+    C(CH_PACK_TEMP,         "Pack_Temp") \
+    C(CH_STATE_OF_CHARGE,   "State_of_Charge") \
+    C(CH_MIN_CELL_VOLTAGE,  "Min_Cell_Voltage") \
+    C(CH_BMS_LV_INPUT,      "BMS_LV_Input") \
+    C(CH_TORQUE_FEEDBACK,   "Torque_Feedback") \
+    C(CH_RPM,               "RPM") \
+    C(CH_FLUX_FEEDBACK,     "Flux_Feedback") \
+    C(CH_INLINE_ACC,        "InlineAcc") \
+    C(CH_LATERAL_ACC,       "LateralAcc") \
+    C(CH_VERTICAL_ACC,      "VerticalAcc") \
+    C(CH_ROLL_RATE,         "RollRate") \
+    C(CH_PITCH_RATE,        "PitchRate") \
+    C(CH_YAW_RATE,          "YawRate")
+
+// a delta (telemetry_codec.h) is shorter than a keyframe, which is how they are told apart.
+// after the fixed fields: one zigzag varint per changed channel, in channel order
+#define WIRE_DELTA(F) \
+    F(DELTA, KEY_SEQ,       U8)     /* seq of the ACKed keyframe it is relative to */ \
+    F(DELTA, CHANGED,       U24)    /* bit i set -> channel i differs from that keyframe */
+
+
+/* ---------------------------------- radio, car -> base station ---------------------------------- */
+
+// every data packet, then one keyframe or delta, or a batch when BATCH_FLAG is set
+#define WIRE_PKT(F) \
+    F(PKT, ID,              U8)     /* sender_id | BATCH_FLAG */ \
+    F(PKT, SEQ,             U8)     /* 7 bit sequence number | POLL_BIT */
+
+#define BATCH_FLAG      0x80            // PKT_ID: the packet carries a batch (batch.h)
+#define SENDER_MASK     0x7F
+#define SEQ_MASK        0x7F
+#define POLL_BIT        0x80            // PKT_SEQ: answer with an ACK (arq.h)
+
+// several timestamped snapshots in one packet, then per record BATCH_REC and the record
+// itself, a keyframe or a delta
+#define WIRE_BATCH(F) \
+    F(BATCH, COUNT,         U8)     /* number of records */ \
+    F(BATCH, BASE_MS,       U32)    /* car millis() of the first record */ \
+    F(BATCH, GEN,           U16)    /* generation (snapshot counter) of the last record */
+
+#define WIRE_BATCH_REC(F) \
+    F(BATCH_REC, DT_MS,     U16)    /* ms after the first record */ \
+    F(BATCH_REC, LEN,       U8)     /* record length */
+
+// old records out of the car's flash log (flash_log.h), a batch packet whose count byte has
+// BACKFILL_FLAG set. then per record BACKFILL_REC and the telemetry, indexes are consecutive
+#define WIRE_BACKFILL(F) \
+    F(BACKFILL, COUNT,      U8)     /* BACKFILL_FLAG, BACKFILL_JUMP and the number of records */ \
+    F(BACKFILL, FIRST,      U32)    /* log index of the first record */
+
+#define WIRE_BACKFILL_REC(F) \
+    F(BACKFILL_REC, TIME_MS, U32)   /* car millis() of the record */
+
+#define BACKFILL_FLAG       0x80
+#define BACKFILL_JUMP       0x40        // the car no longer has anything before the first record
+#define BACKFILL_COUNT_MASK 0x3F
+
+// a parity packet (fec.h), then a CRC-8 of every packet of the group (FEC_GROUP bytes)
+// and the parity of their symbols
+#define WIRE_FEC(F) \
+    F(FEC, ID,              U8)     /* sender_id | FEC_FLAG */ \
+    F(FEC, FIRST,           U8)     /* seq of the first packet of the group | POLL_BIT */ \
+    F(FEC, CODE,            U8)     /* FEC_GROUP in the top 4 bits, parity index in the low 4 */
+
+#define FEC_FLAG        0x40            // FEC_ID, next to the sender_id
+
+
+/* ---------------------------------- radio, base station -> car ---------------------------------- */
+
+// one ACK per poll (arq.h), the optional fields follow in the order below when their flag is set
+#define WIRE_ACK(F) \
+    F(ACK, SENDER,          U8) \
+    F(ACK, SEQ,             U8)     /* seq of the packet that asked for the ack */ \
+    F(ACK, STATUS,          U8) \
+    F(ACK, CUM,             U8)     /* every seq before this one has been received */ \
+    F(ACK, BITMAP,          U8)     /* bit i set -> seq (cum + 1 + i) has been received */ \
+    F(ACK, DR,              U8)     /* data rate the car uses from its next slot, see adr.h */ \
+    F(ACK, VER_FLAGS,       U8)     /* ACK_VERSION in the top 4 bits, which optional fields follow in the low 4 */
+
+#define WIRE_ACK_LINK(F) \
+    F(ACK_LINK, RSSI,       I8)     /* dBm, of the packet that polled */ \
+    F(ACK_LINK, SNR,        I8)     /* dB * 4 */
+
+#define WIRE_ACK_LOSS(F) \
+    F(ACK_LOSS, LOST,       U8)     /* wrapping count of packets from this car the receiver never got */
+
+#define WIRE_ACK_BACKFILL(F) \
+    F(ACK_BACKFILL, INDEX,  U32)    /* send flash log records from this log index on */
+
+#define ACK_VERSION     1
+#define ACK_F_LINK      0x01
+#define ACK_F_LOSS      0x02
+#define ACK_F_BACKFILL  0x04
+
+// ACK status codes
+#define ACK_OK          0
+#define ACK_DUPLICATE   1
+#define ACK_BAD_LEN     2
+#define ACK_NO_REF      3               // a delta arrived for a keyframe the receiver doesn't have
+#define ACK_NACK        4               // something the bitmap doesn't cover is lost, resend it now
+
+// the TDMA beacon at the start of every superframe (tdma.h), then one BEACON_SLOT per slot
+#define WIRE_BEACON(F) \
+    F(BEACON, KIND,         U8)     /* BEACON_ID */ \
+    F(BEACON, SEQ,          U8)     /* beacon sequence number */ \
+    F(BEACON, SLOT_MS,      U16)    /* slot length in ms */ \
+    F(BEACON, SLOTS,        U8)     /* number of slots */
+
+#define WIRE_BEACON_SLOT(F) \
+    F(BEACON_SLOT, OWNER,   U8)     /* sender_id */ \
+    F(BEACON_SLOT, DR,      U8)     /* data rate, index into ADR_RATES */
+
+#define BEACON_ID       0xFE            // never a valid sender_id
+
+
+/* ---------------------------------- serial, user_end -> host ---------------------------------- */
+
+// every record is COBS framed (output_frame.h) and ends in a CRC-16/CCITT of everything before it.
+// a telemetry record, then NUM_CHANNELS raw uint16 channels and the CRC
+#define WIRE_OUT_TELEM(F) \
+    F(OUT_TELEM, TYPE,      U8)     /* OUT_REC_TELEMETRY or OUT_REC_BACKFILL */ \
+    F(OUT_TELEM, CAR,       U8) \
+    F(OUT_TELEM, SEQ,       U8) \
+    F(OUT_TELEM, RSSI,      I8)     /* dBm, RSSI and SNR are of the packet that carried it */ \
+    F(OUT_TELEM, SNR,       I8)     /* 0.25 dB */ \
+    F(OUT_TELEM, CAR_TIME,  U32)    /* car millis() of the snapshot, 0 if the packet didn't carry one */
+
+// a stats record (link_stats.h), in the same stream or on car_end's console. then n uint32 values and the CRC
+#define WIRE_OUT_STATS(F) \
+    F(OUT_STATS, TYPE,      U8)     /* OUT_REC_STATS */ \
+    F(OUT_STATS, SOURCE,    U8)     /* STATS_SRC_* */ \
+    F(OUT_STATS, ID,        U8)     /* car id */ \
+    F(OUT_STATS, COUNT,     U8)     /* number of values n */ \
+    F(OUT_STATS, UPTIME,    U32)    /* millis() of the sender */
+
+#define OUT_REC_TELEMETRY   0x01
+#define OUT_REC_BACKFILL    0x02        // sent again later out of the car's flash log
+#define OUT_REC_STATS       0x03
+
+
+/* ---------------------------------- first prototype ---------------------------------- */
+
+// the stop and wait file transfer of simulation/tx.py and rx.py: ABP, then ABP_DATA_BYTES of
+// the file. the first packet's data starts with ABP_FIRST
+#define WIRE_ABP(F) \
+    F(ABP, NUM,             U8)     /* alternating packet number */
+
+#define WIRE_ABP_FIRST(F) \
+    F(ABP_FIRST, FILE_LEN,  U32)    /* length of the whole file */
+
+#define WIRE_ABP_ACK(F) \
+    F(ABP_ACK, NUM,         U8) \
+    F(ABP_ACK, STATUS,      U8)     /* ACK_OK, ACK_DUPLICATE, ACK_BAD_LEN or ACK_NO_REF */
+
+#define ABP_DATA_BYTES  31
@@ -0,0 +1,1199 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+#include "link-sim.h"
+#include "shared_defs.h"
+#include "arq.h"
+#include "signal_table.h"
+#include "snapshot_ring.h"
+#include "telemetry_codec.h"
+#include "batch.h"
+#include "tdma.h"
+#include "adr.h"
+#include "freq_plan.h"
+#include "fec.h"
+
+// the handlers below follow car_end.ino and user_end.ino function by function, so
+// a change to the firmware's glue has an obvious place to go here too. what the sim
+// leaves out: the CAN task's scheduler (snapshots come at a fixed rate), the flash log
+// and backfill, and the receive queue on user_end (records are decoded on arrival).
+
+static_assert(ADR_NUM_RATES <= 8, "sim_stats.dr_air_ms too small");
+static_assert(SIM_MAX_CARS <= FEC_FLAG, "SIM_MAX_CARS too big for a sender_id");
+static_assert(BEACON_MAX_LEN <= MAX_PCK_LEN && ACK_LEN <= MAX_PCK_LEN, "transmission buffer too small");
+
+#define BASE                -1          // transmitter index of the base station
+#define NOISE_FLOOR_DBM     -117.0      // thermal noise in 125 kHz plus the SX1262's noise figure
+#define NUM_GENS            65536       // can_snapshot.gen wraps here
+#define TWO_PI              6.283185307179586
+
+enum event_type : uint8_t {
+    EV_CAR_WAKE,
+    EV_ACK_TIMEOUT,
+    EV_TX_END,
+    EV_BEACON,
+    EV_ACK_START,
+};
+
+struct event {
+    uint64_t t;
+    uint64_t order;                     // same time events run in the order they were made, so runs repeat
+    uint8_t  type;
+    int      who;                       // car, or transmission for EV_TX_END
+    uint32_t token;                     // car events that were overtaken by something else are ignored
+};
+
+struct event_later {
+    bool operator()(const event &a, const event &b) const {
+        return a.t != b.t ? a.t > b.t : a.order > b.order;
+    }
+};
+
+enum tx_kind : uint8_t {
+    TX_DATA,
+    TX_ACK,
+    TX_BEACON,
+};
+
+struct transmission {
+    int      from;                      // car or BASE
+    int      to;                        // car an ACK is for
+    uint8_t  kind;
+    uint8_t  dr;
+    uint8_t  len;
+    int      base;                      // receiver that sends it, or that a car's packet is for
+    uint8_t  ch;                        // index into FREQ_CHANNELS
+    uint8_t  collided;                  // overlapped another transmission at the same rate on the same channel
+    uint8_t  base_deaf;                 // the base station was transmitting or listening at another rate or channel
+    uint8_t  car_listening;             // ACK: the car was waiting for it when it started
+    uint64_t start;
+    uint8_t  data[FEC_MAX_LEN];
+};
+
+enum car_state : uint8_t {
+    CAR_IDLE,                           // in the radio task loop, or waiting for its slot
+    CAR_TX,                             // radio.transmit()
+    CAR_ACK_WAIT,                       // wait_for_ack()
+};
+
+struct sim_car {
+    int id;
+    uint8_t receiver;                   // freq_receiver(id)
+
+    // car_end.ino
+    tx_window window;
+    delta_encoder encoder;
+    batch_builder batch;
+    snapshot_ring snapshots;
+    tdma_schedule schedule;
+    uint32_t slot_end_ms;
+    uint8_t radio_dr;
+    uint8_t radio_ch;
+    uint8_t slot_dr;
+    int max_pck_len;
+    int slot_packets;               // TX_LATEST: most packets in the window, what one slot carries
+    int last_len;                   // of the last packet queued
+    ack_ext link;
+    rtt_estimator rtt[ADR_NUM_RATES];
+    uint16_t slot_gen[WINDOW_SIZE];
+    uint32_t slot_ms[WINDOW_SIZE];
+    bool slot_refreshed[WINDOW_SIZE];
+    uint32_t stale_drops;
+    uint8_t last_lost;
+    fec_encoder fec;
+
+    // where service_window() is while the radio is busy
+    uint8_t state;
+    uint32_t token;
+    uint32_t burst_start;
+    tx_slot *sending;
+    bool sending_poll;
+    tx_slot *next;                      // picked before the packet on air, like service_window does
+    bool polled;
+    uint32_t poll_ms;
+    uint8_t poll_first_try;
+    uint32_t poll_rto;
+    uint64_t ack_deadline;
+    bool ack_incoming;                  // an ACK for us is on air and started before the deadline
+    bool beacon_deaf;                   // transmitted while the current beacon was on air
+
+    // the CAN task
+    double next_snap_ms;
+    uint16_t gen;
+    telemetry current;
+    double phase;                       // where on the track the car started, in laps
+
+    // ground truth for the stats, indexed by snapshot generation
+    uint32_t gen_time[NUM_GENS];        // when it was taken
+    uint32_t seen[NUM_GENS];            // gen_time + 1 once the base station decoded it
+};
+
+// user_end.ino, one per receiver (RECEIVER_ID)
+struct sim_base {
+    int id;
+    int cars;                           // cars it has slots for, one without any stays quiet
+    rx_window rx_windows[SIM_MAX_CARS];
+    delta_decoder decoders[SIM_MAX_CARS];
+    bool need_key[SIM_MAX_CARS];
+    adr_state adr[SIM_MAX_CARS];
+    uint8_t crc_errors[SIM_MAX_CARS];
+    int8_t last_rssi[SIM_MAX_CARS];
+    int8_t last_snr_q4[SIM_MAX_CARS];
+    fec_decoder fec[SIM_MAX_CARS];
+    tdma_schedule schedule;
+    uint8_t listen_dr;
+    uint8_t listen_ch;
+    bool beacon_on_air;
+    uint64_t busy_until;                // end of what it is transmitting
+    uint8_t ack[SIM_MAX_CARS][ACK_LEN]; // built in handle_packet, on air after the turnaround
+    int ack_len[SIM_MAX_CARS];
+};
+
+struct sim {
+    const sim_params *p;
+    sim_stats *st;
+    uint64_t now;
+    uint64_t end;
+    uint64_t order;
+    std::priority_queue<event, std::vector<event>, event_later> events;
+    std::vector<transmission> tx;
+    std::vector<int> free_tx;
+    std::vector<int> on_air;
+    std::unique_ptr<sim_car[]> cars;
+    sim_base bases[FREQ_RECEIVERS];
+    std::mt19937_64 rng;
+    std::uniform_real_distribution<double> uni;
+    std::normal_distribution<double> fade;
+};
+
+// the tx_window callbacks have no context argument
+static thread_local sim *cur_sim;
+static thread_local sim_car *cur_car;
+
+static void car_run(sim *s, sim_car *c);
+
+
+/* ---------------------------------- events and the radio channel ---------------------------------- */
+
+// millis() on both ends, the sim has no clock drift
+static uint32_t ms(const sim *s) {
+    return (uint32_t)s->now;
+}
+
+static void push_event(sim *s, uint64_t t, uint8_t type, int who, uint32_t token) {
+    event e = { t, s->order++, type, who, token };
+    s->events.push(e);
+}
+
+// a new wake up for the car, whatever it was waiting for before no longer counts
+static void car_wake(sim *s, sim_car *c, uint64_t t) {
+    push_event(s, t, EV_CAR_WAKE, c->id, ++c->token);
+}
+
+// RSSI of a car right now, it drives away from the base station and back once a lap
+static double car_rssi_dbm(const sim *s, const sim_car *c) {
+    double lap = s->now / 1000.0 / s->p->lap_s + c->phase;
+    double far = 0.5 - 0.5 * cos(TWO_PI * lap);
+    return s->p->rssi_near + (s->p->rssi_far - s->p->rssi_near) * far;
+}
+
+// whether one packet between a car and the base station survives the link (either way),
+// and the RSSI and SNR the receiver measures
+static bool link_ok(sim *s, const sim_car *c, uint8_t dr, float *rssi, float *snr) {
+    const data_rate &r = ADR_RATES[dr];
+    double rx = car_rssi_dbm(s, c) + (s->p->fading_db > 0 ? s->fade(s->rng) * s->p->fading_db : 0);
+    *rssi = (float)rx;
+    *snr = (float)(rx - (NOISE_FLOOR_DBM + r.noise_q4 / 4.0));
+    if (rx < r.sens_q4 / 4.0 || *snr < r.min_snr_q4 / 4.0 || s->uni(s->rng) < s->p->loss) {
+        s->st->link_losses++;
+        return false;
+    }
+    return true;
+}
+
+// loop() on the base station keeps the radio on the rate of whichever slot is open,
+// on the superframe's channel (beacon_seq already counts the next beacon)
+static void base_listen(sim *s, sim_base *b) {
+#if TDMA_ENABLED
+    if (b->busy_until > s->now) return;
+    int slot = tdma_slot_at(&b->schedule, ms(s));
+    if (slot >= 0) {
+        b->listen_dr = b->schedule.dr[slot];
+        b->listen_ch = freq_slot_channel(b->id, (uint8_t)(b->schedule.beacon_seq - 1));
+    }
+#endif
+}
+
+// put a packet on air, everything else on air at the same rate and channel collides with it
+static int start_tx(sim *s, int from, int to, int base, uint8_t kind, uint8_t dr, uint8_t ch, const uint8_t *data, int len) {
+    int i;
+    if (!s->free_tx.empty()) {
+        i = s->free_tx.back();
+        s->free_tx.pop_back();
+    } else {
+        i = (int)s->tx.size();
+        s->tx.emplace_back();
+    }
+    transmission &t = s->tx[i];
+    t.from = from;
+    t.to = to;
+    t.base = base;
+    t.kind = kind;
+    t.dr = dr;
+    t.ch = ch;
+    t.len = (uint8_t)len;
+    t.collided = 0;
+    t.base_deaf = 0;
+    t.car_listening = 0;
+    t.start = s->now;
+    memcpy(t.data, data, len);
+
+    for (int j : s->on_air) {
+        transmission &o = s->tx[j];
+        if (o.dr != dr || o.ch != ch) continue;
+        if (!o.collided) s->st->collisions++;
+        if (!t.collided) s->st->collisions++;
+        o.collided = t.collided = 1;
+    }
+    s->on_air.push_back(i);
+
+    uint32_t air = adr_airtime_ms(dr, len);
+    sim_base *b = &s->bases[base];
+    if (from == BASE) {
+        // half duplex, whatever its cars are sending meanwhile is lost on the base station
+        for (int j : s->on_air) {
+            if (s->tx[j].from != BASE && s->tx[j].base == base) s->tx[j].base_deaf = 1;
+        }
+        b->busy_until = s->now + air;
+        s->st->base_air_ms += air;
+    } else {
+        s->st->car_air_ms += air;
+        s->st->dr_air_ms[dr] += air;
+        s->cars[from].beacon_deaf = true;
+        // the base station only hears it at the rate and on the channel it is listening on
+        base_listen(s, b);
+        t.base_deaf = b->busy_until > s->now || dr != b->listen_dr || ch != b->listen_ch;
+    }
+    push_event(s, s->now + air, EV_TX_END, i, 0);
+    return i;
+}
+
+
+/* ---------------------------------- car_end.ino ---------------------------------- */
+
+// everything the CAN task published up to now goes into the ring, like can_task would
+static void car_publish(sim *s, sim_car *c) {
+    while (c->next_snap_ms <= (double)s->now) {
+        // 4 random bits per channel: a change 1 time in 4, by -2, -1, 1 or 2
+        static const int8_t step[4] = { -2, -1, 1, 2 };
+        static_assert(NUM_CHANNELS - 1 <= 16, "one random draw per snapshot");
+        can_snapshot snap;
+        uint64_t r = s->rng();
+        for (int ch = 1; ch < NUM_CHANNELS; ch++, r >>= 4) {
+            if ((r & 3) == 0) c->current.ch[ch] = (uint16_t)(c->current.ch[ch] + step[(r >> 2) & 3]);
+        }
+        snap.time_ms = (uint32_t)c->next_snap_ms;
+        snap.gen = c->gen++;
+        snap.urgent = 0;
+        snap.data = c->current;
+        // the Time channel carries the generation so the base station side knows which snapshot it got
+        snap.data.ch[CH_TIME] = snap.gen;
+        c->gen_time[snap.gen] = snap.time_ms;
+        ring_push(&c->snapshots, &snap);
+        s->st->snapshots++;
+        c->next_snap_ms += 1000.0 / s->p->snapshot_rate;
+    }
+}
+
+// every car handler starts here: the callbacks need the car and the CAN task runs on its own core
+static void car_enter(sim *s, sim_car *c) {
+    cur_sim = s;
+    cur_car = c;
+    car_publish(s, c);
+}
+
+static void set_data_rate(sim_car *c, uint8_t dr) {
+    c->radio_dr = dr;
+}
+
+static void set_channel(sim_car *c, uint8_t ch) {
+    c->radio_ch = ch;
+}
+
+// listen_for_beacon(): the beacon rate on the receiver's home channel
+static void listen_for_beacon(sim_car *c) {
+    set_data_rate(c, adr_beacon_dr());
+    set_channel(c, freq_home_channel(c->receiver));
+}
+
+static void plan_slot_packets(sim_car *c) {
+#if TDMA_ENABLED
+    int len = c->last_len < c->max_pck_len ? c->last_len : c->max_pck_len;
+    c->slot_packets = adr_slot_packets(c->slot_dr, (uint32_t)c->schedule.slot_ms * ADR_RATES[c->slot_dr].slot_scale, len);
+#endif
+}
+
+static void plan_slot_rate(sim_car *c, uint8_t dr) {
+#if TDMA_ENABLED
+    c->slot_dr = dr;
+    c->max_pck_len = adr_max_len(dr, (uint32_t)c->schedule.slot_ms * ADR_RATES[dr].slot_scale);
+    plan_slot_packets(c);
+#endif
+}
+
+static bool window_has_room(sim_car *c) {
+#if TX_POLICY == TX_LATEST
+    if (tx_outstanding(&c->window) >= c->slot_packets) return false;
+#endif
+    return tx_can_queue(&c->window);
+}
+
+static void on_acked(const tx_slot *s) {
+    sim_car *c = cur_car;
+    if (c->slot_refreshed[s - c->window.slots]) {
+        return;
+    }
+    if (s->packet[PKT_ID] & BATCH_FLAG) {
+        const uint8_t *key = NULL;
+        batch_record rec;
+        int pos = 0;
+        while (batch_next(s->packet + HEADER_LEN, s->len - HEADER_LEN, &pos, &rec) > 0) {
+            if (rec.len == DATA_BYTES) key = rec.data;
+        }
+        if (key != NULL) {
+            encoder_key_acked(&c->encoder, s->seq, key);
+        }
+    }
+    else if (s->len == DATA_PCK_LEN) {
+        encoder_key_acked(&c->encoder, s->seq, s->packet + HEADER_LEN);
+    }
+}
+
+static void on_dropped(const tx_slot *) {
+    cur_sim->st->failed++;
+}
+
+static bool fits_in_slot(const sim_car *c, int len, uint32_t start_ms) {
+#if TDMA_ENABLED
+    uint32_t air_ms = adr_airtime_ms(c->radio_dr, len) + 1;
+    return (int32_t)(c->slot_end_ms - (start_ms + air_ms + adr_ack_reserve_ms(c->radio_dr))) >= 0;
+#else
+    return true;
+#endif
+}
+
+#if TX_POLICY == TX_LATEST
+static void refresh_retry(sim_car *c, tx_slot *s) {
+    can_snapshot newest[BATCH_SIZE];
+    int n = 0;
+    while (ring_pop(&c->snapshots, &newest[n % BATCH_SIZE])) {
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+    c->stale_drops += c->batch.count;
+    batch_init(&c->batch);
+    if (s->attempts == 0) {
+        c->stale_drops += BATCH_SIZE > 1 ? batch_count(s->packet + HEADER_LEN) : 1;
+    }
+
+    uint8_t payload[BATCH_SIZE][DATA_BYTES];
+    int len[BATCH_SIZE];
+    int k = 0;
+    int total = HEADER_LEN + BATCH_HDR_LEN;
+    while (k < n && k < BATCH_SIZE) {
+        len[k] = encoder_encode(&c->encoder, &newest[(n - 1 - k) % BATCH_SIZE].data, payload[k]);
+        if (k > 0 && total + BATCH_REC_HDR_LEN + len[k] > c->max_pck_len) break;
+        total += BATCH_REC_HDR_LEN + len[k];
+        k++;
+    }
+    c->stale_drops += n - k;
+
+    int i = s - c->window.slots;
+    const can_snapshot *last = &newest[(n - 1) % BATCH_SIZE];
+#if BATCH_SIZE > 1
+    batch_builder b;
+    batch_init(&b);
+    for (int j = k - 1; j >= 0; j--) {
+        const can_snapshot *snap = &newest[(n - 1 - j) % BATCH_SIZE];
+        if (!batch_add(&b, snap->time_ms, snap->gen, payload[j], len[j])) c->stale_drops++;
+    }
+    tx_replace(s, c->id | BATCH_FLAG, b.buf, b.len);
+    c->slot_ms[i] = b.base_ms;
+#else
+    tx_replace(s, c->id, payload[0], len[0]);
+    c->slot_ms[i] = last->time_ms;
+#endif
+    c->slot_gen[i] = last->gen;
+    c->slot_refreshed[i] = c->slot_refreshed[i] || s->attempts > 0;
+}
+#endif
+
+static void repack(sim *s, sim_car *c, tx_slot *sl) {
+    s->st->too_long++;
+#if TX_POLICY == TX_LATEST
+    refresh_retry(c, sl);
+    if (sl->len <= c->max_pck_len) return;
+#elif BATCH_SIZE > 1
+    int i = sl - c->window.slots;
+    uint8_t data[MAX_PCK_LEN];
+    int len = sl->len - HEADER_LEN;
+    memcpy(data, sl->packet + HEADER_LEN, len);
+    int total = batch_count(data);
+    int done = 0;
+    batch_builder b;
+    if (batch_take(data, len, &done, c->max_pck_len, &b) > 0) {
+        tx_replace(sl, c->id | BATCH_FLAG, b.buf, b.len);
+        c->slot_gen[i] = b.gen;
+        c->slot_ms[i] = b.base_ms;
+        c->slot_refreshed[i] = c->slot_refreshed[i] || sl->attempts > 0;
+        while (tx_can_queue(&c->window) && batch_take(data, len, &done, c->max_pck_len, &b) > 0) {
+            tx_slot *part = tx_queue(&c->window, c->id | BATCH_FLAG, b.buf, b.len);
+            c->slot_gen[part - c->window.slots] = b.gen;
+            c->slot_ms[part - c->window.slots] = b.base_ms;
+            c->slot_refreshed[part - c->window.slots] = false;
+            s->st->packets++;
+        }
+        s->st->resize_lost += total - done;
+        return;
+    }
+#endif
+#if BATCH_SIZE > 1
+    s->st->resize_lost += batch_count(sl->packet + HEADER_LEN);
+#else
+    s->st->resize_lost++;
+#endif
+    sl->in_use = 0;
+}
+
+static tx_slot *next_to_send(sim *s, sim_car *c, uint32_t start_ms) {
+    tx_slot *sl;
+    while ((sl = tx_next_due(&c->window, ms(s))) != NULL && sl->len > c->max_pck_len) {
+        repack(s, c, sl);
+    }
+#if TX_POLICY == TX_LATEST
+    if (sl != NULL && (sl->attempts > 0 || (ms(s) - c->slot_ms[sl - c->window.slots]) > MAX_AGE_MS)) {
+        refresh_retry(c, sl);
+    }
+#endif
+    if (sl != NULL && !fits_in_slot(c, sl->len, start_ms)) {
+        return NULL;
+    }
+    return sl;
+}
+
+#if FEC_PARITY
+static uint32_t plan_parity(sim_car *c, uint32_t start_ms) {
+    uint32_t air_ms = adr_airtime_ms(c->radio_dr, fec_parity_len(&c->fec)) + 1;
+    if (!fits_in_slot(c, fec_parity_len(&c->fec), start_ms + (FEC_PARITY - 1) * air_ms)) {
+        fec_drop_parity(&c->fec);
+        return start_ms;
+    }
+    return start_ms + FEC_PARITY * air_ms;
+}
+#endif
+
+// one packet of the burst goes on air, the loop body of service_window
+static void car_send(sim *s, sim_car *c, tx_slot *sl) {
+    int retry = sl->attempts > 0;
+    tx_mark_sent(sl, ms(s), &c->rtt[c->radio_dr]);
+    uint32_t after_ms = ms(s) + adr_airtime_ms(c->radio_dr, sl->len) + 1;
+#if FEC_PARITY
+    if (!retry && fec_add(&c->fec, sl->packet, sl->len)) {
+        after_ms = plan_parity(c, after_ms);
+    }
+#endif
+    tx_slot *next = next_to_send(s, c, after_ms);
+
+    int poll = (next == NULL) && (TDMA_ENABLED || retry || !window_has_room(c) || ring_empty(&c->snapshots));
+#if FEC_PARITY
+    sl->packet[PKT_SEQ] = (uint8_t)(sl->seq | (poll && !fec_parity_left(&c->fec) ? POLL_BIT : 0));
+#else
+    sl->packet[PKT_SEQ] = (uint8_t)(sl->seq | (poll ? POLL_BIT : 0));
+#endif
+
+    start_tx(s, c->id, BASE, c->receiver, TX_DATA, c->radio_dr, c->radio_ch, sl->packet, sl->len);
+    c->state = CAR_TX;
+    c->sending = sl;
+    c->sending_poll = poll;
+    c->next = next;
+    s->st->sends++;
+    if (retry) s->st->retries++;
+}
+
+// radio.transmit() returned
+static void car_tx_done(sim *s, sim_car *c) {
+    car_enter(s, c);
+    tx_start_timers(&c->window, c->burst_start, ms(s));
+#if FEC_PARITY
+    // send_parity(): the parity of a group that just completed goes right after it
+    uint8_t pck[FEC_MAX_LEN];
+    int len = fec_next_parity(&c->fec, c->id, c->sending_poll && fec_parity_left(&c->fec) == 1, pck);
+    if (len > 0) {
+        start_tx(s, c->id, BASE, c->receiver, TX_DATA, c->radio_dr, c->radio_ch, pck, len);
+        s->st->sends++;
+        s->st->parity++;
+        return;
+    }
+#endif
+    if (c->sending_poll) {
+        c->polled = true;
+        c->poll_ms = ms(s);
+        c->poll_first_try = c->sending->attempts == 1;
+        c->poll_rto = c->sending->rto_ms;
+    }
+    if (c->next != NULL) {
+        car_send(s, c, c->next);
+        return;
+    }
+
+    c->state = CAR_IDLE;
+    if (!c->polled) {
+        car_run(s, c);
+        return;
+    }
+
+    tx_start_timers(&c->window, c->burst_start, c->poll_ms);
+
+    uint32_t ack_timeout = c->poll_rto;
+#if TDMA_ENABLED
+    int32_t slot_left = (int32_t)(c->slot_end_ms - ms(s));
+    ack_timeout = slot_left <= 0 ? 1 : ((uint32_t)slot_left < ack_timeout ? slot_left : ack_timeout);
+#endif
+    c->state = CAR_ACK_WAIT;
+    c->ack_incoming = false;
+    c->ack_deadline = s->now + ack_timeout;
+    push_event(s, c->ack_deadline, EV_ACK_TIMEOUT, c->id, ++c->token);
+}
+
+static void car_ack_timeout(sim *s, sim_car *c) {
+    car_enter(s, c);
+    s->st->ack_timeouts++;
+    c->state = CAR_IDLE;
+    car_run(s, c);
+}
+
+// the tail of service_window once wait_for_ack() got something
+static void car_handle_ack(sim *s, sim_car *c, const uint8_t *ack, int ack_len) {
+    car_enter(s, c);
+    c->state = CAR_IDLE;
+    c->token++;
+
+    if (c->poll_first_try) {
+        rtt_sample(&c->rtt[c->radio_dr], ms(s) - c->poll_ms);
+    }
+    tx_apply_ack(&c->window, ack[ACK_CUM], ack[ACK_BITMAP], on_acked);
+    if (ack[ACK_DR] < ADR_NUM_RATES) {
+        plan_slot_rate(c, ack[ACK_DR]);
+    }
+    ack_get_ext(ack, ack_len, &c->link);
+    if (c->link.has_loss) {
+        c->last_lost = c->link.lost;
+    }
+
+    if (ack[ACK_STATUS] == ACK_BAD_LEN || ack[ACK_STATUS] == ACK_NACK) {
+        tx_expire_all(&c->window, ms(s));
+    }
+    else if (ack[ACK_STATUS] == ACK_NO_REF) {
+        encoder_reset(&c->encoder);
+    }
+    car_run(s, c);
+}
+
+static void flush_batch(sim *s, sim_car *c) {
+    tx_slot *slot;
+#if BATCH_SIZE > 1
+    slot = tx_queue(&c->window, c->id | BATCH_FLAG, c->batch.buf, c->batch.len);
+#else
+    slot = tx_queue(&c->window, c->id, c->batch.buf + BATCH_HDR_LEN + BATCH_REC_HDR_LEN, c->batch.len - BATCH_HDR_LEN - BATCH_REC_HDR_LEN);
+#endif
+    c->slot_gen[slot - c->window.slots] = c->batch.gen;
+    c->slot_ms[slot - c->window.slots] = c->batch.base_ms;
+    c->last_len = slot->len;
+    plan_slot_packets(c);
+    c->slot_refreshed[slot - c->window.slots] = false;
+    s->st->packets++;
+    batch_init(&c->batch);
+}
+
+static bool batch_has_room(const sim_car *c, int len) {
+    return c->batch.count == 0 || HEADER_LEN + c->batch.len + BATCH_REC_HDR_LEN + len <= c->max_pck_len;
+}
+
+// the earliest time anything the idle radio task waits on can change, always after now
+static uint64_t car_next_wake(const sim *s, const sim_car *c) {
+    uint64_t wake = (uint64_t)ceil(c->next_snap_ms);
+    if (wake <= s->now) wake = s->now + 1;
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        const tx_slot *sl = &c->window.slots[i];
+        if (!sl->in_use || sl->attempts == 0) continue;
+        int32_t left = (int32_t)(sl->sent_ms + sl->rto_ms - ms(s));
+        if (left > 0 && s->now + left < wake) wake = s->now + left;
+    }
+    if (c->batch.count) {
+        int32_t left = (int32_t)(c->batch.base_ms + BATCH_TIMEOUT_MS - ms(s));
+        if (left > 0 && s->now + left < wake) wake = s->now + left;
+    }
+#if TDMA_ENABLED
+    // whatever didn't fit waits for the next slot
+    int32_t left = (int32_t)(c->slot_end_ms + TDMA_GUARD_MS - ms(s));
+    if (s->now + (left > 0 ? left : 1) < wake) wake = s->now + (left > 0 ? left : 1);
+#endif
+    return wake;
+}
+
+// one pass of radio_task's loop, then either a burst goes on air or the car sleeps
+static void car_run(sim *s, sim_car *c) {
+    car_enter(s, c);
+    can_snapshot snap;
+
+#if TDMA_ENABLED
+    // wait_for_slot(): outside our slot the radio listens for beacons, a beacon wakes the car up
+    // a beacon that started while we were listening is received to the end first
+    if (s->bases[c->receiver].beacon_on_air && c->radio_dr == adr_beacon_dr()
+        && c->radio_ch == freq_home_channel(c->receiver) && !c->beacon_deaf) {
+        return;
+    }
+    uint32_t start, end;
+    uint8_t dr;
+    if (!tdma_next_slot(&c->schedule, c->id, ms(s), &start, &end, &dr)) {
+        listen_for_beacon(c);
+        return;
+    }
+    if ((int32_t)(ms(s) - start) < 0) {
+        listen_for_beacon(c);
+        car_wake(s, c, s->now + (start - ms(s)));
+        return;
+    }
+    c->slot_end_ms = end - TDMA_GUARD_MS;
+    set_data_rate(c, dr);
+    set_channel(c, freq_slot_channel(c->receiver, tdma_frame_seq(&c->schedule, start)));
+    plan_slot_rate(c, dr);
+#endif
+
+    for (;;) {
+        if (c->batch.count && !window_has_room(c)) break;
+        if (c->batch.count >= BATCH_SIZE) flush_batch(s, c);
+        if (!ring_pop(&c->snapshots, &snap)) break;
+#if TX_POLICY == TX_LATEST
+        if (!snap.urgent && (ms(s) - snap.time_ms) > MAX_AGE_MS && !ring_empty(&c->snapshots)) {
+            c->stale_drops++;
+            continue;
+        }
+#endif
+
+        uint8_t payload[DATA_BYTES];
+#if PAYLOAD_COMPRESSION
+        int len = encoder_encode(&c->encoder, &snap.data, payload);
+#else
+        int len = DATA_BYTES;
+        memcpy(payload, &snap.data, DATA_BYTES);
+#endif
+        if (!batch_has_room(c, len) || !batch_add(&c->batch, snap.time_ms, snap.gen, payload, len)) {
+            flush_batch(s, c);
+            batch_add(&c->batch, snap.time_ms, snap.gen, payload, len);
+        }
+    }
+
+    if (c->batch.count && (ms(s) - c->batch.base_ms) >= BATCH_TIMEOUT_MS && window_has_room(c)) {
+        flush_batch(s, c);
+    }
+
+    // service_window() up to the first transmission
+    tx_drop_expired(&c->window, ms(s), on_dropped);
+    c->burst_start = ms(s);
+    c->polled = false;
+    tx_slot *sl = next_to_send(s, c, ms(s));
+    if (sl != NULL) {
+        car_send(s, c, sl);
+        return;
+    }
+    car_wake(s, c, car_next_wake(s, c));
+}
+
+// a beacon is off the air, listen_for_beacon() returns if the car was in it
+static void car_beacon(sim *s, sim_car *c, const transmission &t) {
+    float rssi, snr;
+    if (c->state != CAR_IDLE || c->beacon_deaf || c->radio_dr != t.dr || c->radio_ch != t.ch || t.collided
+        || !link_ok(s, c, t.dr, &rssi, &snr) || (s->p->beacon_loss > 0 && s->uni(s->rng) < s->p->beacon_loss)) {
+        s->st->beacons_missed++;
+    } else {
+        tdma_parse_beacon(&c->schedule, t.data, t.len, ms(s));
+    }
+    if (c->state == CAR_IDLE) {
+        car_run(s, c);
+    }
+}
+
+
+/* ---------------------------------- user_end.ino ---------------------------------- */
+
+static void deliver(sim *s, int car, const telemetry *rec) {
+    sim_car *c = &s->cars[car];
+    uint16_t g = rec->ch[CH_TIME];
+    uint32_t taken = c->gen_time[g];
+    if (c->seen[g] == taken + 1) return;
+    c->seen[g] = taken + 1;
+    s->st->delivered++;
+    uint32_t lat = ms(s) - taken;
+    s->st->latency[lat < SIM_LATENCY_BINS ? lat : SIM_LATENCY_BINS - 1]++;
+}
+
+// the ACK goes on air after the turnaround, or once the base station is done with what it is sending
+static void send_ack(sim *s, uint8_t sender_id, uint8_t seq, uint8_t status) {
+    sim_base *b = &s->bases[freq_receiver(sender_id)];
+    uint8_t *ack = b->ack[sender_id];
+    ack[ACK_SENDER] = sender_id;
+    ack[ACK_SEQ] = (uint8_t)(seq & SEQ_MASK);
+    if (status == ACK_OK && b->need_key[sender_id]) {
+        status = ACK_NO_REF;
+        b->need_key[sender_id] = false;
+    }
+    else if (status == ACK_OK && rx_has_gap(&b->rx_windows[sender_id])) {
+        status = ACK_NACK;
+    }
+    ack[ACK_STATUS] = status;
+    rx_ack_fields(&b->rx_windows[sender_id], &ack[ACK_CUM], &ack[ACK_BITMAP]);
+    ack[ACK_DR] = s->p->fixed_dr >= 0 ? (uint8_t)s->p->fixed_dr : b->adr[sender_id].next_dr;
+
+    ack_ext ext;
+    ext.rssi_dbm = b->last_rssi[sender_id];
+    ext.snr_q4 = b->last_snr_q4[sender_id];
+    ext.lost = (uint8_t)(b->rx_windows[sender_id].lost + b->crc_errors[sender_id]);
+    ext.backfill_from = 0;
+    b->ack_len[sender_id] = ack_put_ext(ack, ACK_FIELDS & ~ACK_F_BACKFILL, &ext);
+
+    push_event(s, s->now + s->p->turnaround_ms, EV_ACK_START, sender_id, 0);
+}
+
+static void ack_start(sim *s, int car) {
+    sim_car *c = &s->cars[car];
+    sim_base *b = &s->bases[c->receiver];
+    if (b->busy_until > s->now) {
+        push_event(s, b->busy_until, EV_ACK_START, car, 0);
+        return;
+    }
+    base_listen(s, b);
+    int i = start_tx(s, BASE, car, b->id, TX_ACK, b->listen_dr, b->listen_ch, b->ack[car], b->ack_len[car]);
+    s->st->acks++;
+    if (c->state == CAR_ACK_WAIT && s->now < c->ack_deadline && c->radio_dr == b->listen_dr && c->radio_ch == b->listen_ch) {
+        s->tx[i].car_listening = 1;
+        c->ack_incoming = true;
+    }
+}
+
+static int8_t clamp_i8(float v) {
+    if (v < -128) return -128;
+    if (v > 127) return 127;
+    return (int8_t)v;
+}
+
+static bool decode_record(sim *s, uint8_t sender_id, uint8_t seq, const uint8_t *data, int data_len, telemetry *out) {
+    sim_base *b = &s->bases[freq_receiver(sender_id)];
+    if (data_len == DATA_BYTES) {
+        memcpy(out, data, DATA_BYTES);
+        decoder_store_key(&b->decoders[sender_id], seq, out);
+        return true;
+    }
+    const telemetry *key = decoder_find_key(&b->decoders[sender_id], delta_key_seq(data));
+    if (key != NULL && decode_delta(data, data_len, key, out)) {
+        return true;
+    }
+    s->st->no_ref++;
+    b->need_key[sender_id] = true;
+    return false;
+}
+
+static void process_packet(sim *s, uint8_t sender_id, uint8_t seq, bool is_batch, const uint8_t *data, int len) {
+    telemetry record;
+    if (is_batch) {
+        batch_record rec;
+        int pos = 0;
+        while (batch_next(data, len, &pos, &rec) > 0) {
+            if (decode_record(s, sender_id, seq, rec.data, rec.len, &record)) deliver(s, sender_id, &record);
+        }
+    }
+    else if (decode_record(s, sender_id, seq, data, len, &record)) {
+        deliver(s, sender_id, &record);
+    }
+}
+
+static void heard_from(sim *s, uint8_t sender_id, float rssi, float snr) {
+    sim_base *b = &s->bases[freq_receiver(sender_id)];
+    adr_update(&b->adr[sender_id], (int16_t)(rssi * 4), (int16_t)(snr * 4));
+    b->last_rssi[sender_id] = clamp_i8(rssi);
+    b->last_snr_q4[sender_id] = clamp_i8(snr * 4);
+}
+
+static bool length_ok(const uint8_t *pck, int pck_len) {
+    const uint8_t *data = pck + HEADER_LEN;
+    int data_len = pck_len - HEADER_LEN;
+    if (pck_len > MAX_PCK_LEN) {
+        return false;
+    }
+    if (pck[PKT_ID] & BATCH_FLAG) {
+        batch_record rec;
+        int pos = 0;
+        int r;
+        while ((r = batch_next(data, data_len, &pos, &rec)) > 0) {}
+        return r == 0;
+    }
+    return pck_len <= DATA_PCK_LEN && pck_len >= HEADER_LEN + DELTA_HDR_LEN;
+}
+
+#if FEC_PARITY
+static void handle_parity(sim *s, const uint8_t *pck, int pck_len, float rssi, float snr) {
+    uint8_t sender_id = pck[FEC_ID] & SENDER_MASK & ~FEC_FLAG;
+    sim_base *b = &s->bases[freq_receiver(sender_id)];
+    heard_from(s, sender_id, rssi, snr);
+    bool poll = (pck[FEC_FIRST] & POLL_BIT) != 0;
+
+    uint8_t rebuilt[FEC_PARITY][MAX_PCK_LEN];
+    int rebuilt_len[FEC_PARITY];
+    bool is_new[FEC_PARITY];
+    int n = 0;
+    if (fec_store_parity(&b->fec[sender_id], pck, pck_len)) {
+        n = fec_rebuild(&b->fec[sender_id], rebuilt, rebuilt_len);
+    }
+    for (int k = 0; k < n; k++) {
+        is_new[k] = (rebuilt[k][PKT_ID] & SENDER_MASK) == sender_id && length_ok(rebuilt[k], rebuilt_len[k])
+                 && rx_accept(&b->rx_windows[sender_id], rebuilt[k][PKT_SEQ]) == RX_NEW;
+    }
+    if (poll) send_ack(s, sender_id, (uint8_t)(pck[FEC_FIRST] + FEC_GROUP - 1), ACK_OK);
+    for (int k = 0; k < n; k++) {
+        if (!is_new[k]) continue;
+        s->st->fec_rebuilt++;
+        process_packet(s, sender_id, rebuilt[k][PKT_SEQ], (rebuilt[k][PKT_ID] & BATCH_FLAG) != 0, rebuilt[k] + HEADER_LEN, rebuilt_len[k] - HEADER_LEN);
+    }
+}
+#endif
+
+// a car's packet is off the air, handle_packet() if the base station got it
+static void handle_packet(sim *s, const transmission &t) {
+    sim_base *b = &s->bases[t.base];
+    sim_car *c = &s->cars[t.from];
+    float rssi, snr;
+    if (t.base_deaf) {
+        return;
+    }
+    if (t.collided) {
+#if TDMA_ENABLED
+        int slot = tdma_slot_at(&b->schedule, ms(s));
+        if (slot >= 0 && b->schedule.owner[slot] < s->p->cars) b->crc_errors[b->schedule.owner[slot]]++;
+#endif
+        return;
+    }
+    if (!link_ok(s, c, t.dr, &rssi, &snr)) {
+        return;
+    }
+
+    const uint8_t *pck = t.data;
+    int pck_len = t.len;
+#if FEC_PARITY
+    if (pck[FEC_ID] & FEC_FLAG) {
+        handle_parity(s, pck, pck_len, rssi, snr);
+        return;
+    }
+#endif
+    uint8_t sender_id = pck[PKT_ID] & SENDER_MASK;
+    bool is_batch = (pck[PKT_ID] & BATCH_FLAG) != 0;
+    heard_from(s, sender_id, rssi, snr);
+    uint8_t seq = pck[PKT_SEQ] & SEQ_MASK;
+    bool poll = (pck[PKT_SEQ] & POLL_BIT) != 0;
+    const uint8_t *data = pck + HEADER_LEN;
+    int data_len = pck_len - HEADER_LEN;
+
+    if (!length_ok(pck, pck_len)) {
+        send_ack(s, sender_id, seq, ACK_BAD_LEN);
+        return;
+    }
+#if FEC_PARITY
+    fec_store_data(&b->fec[sender_id], pck, pck_len);
+#endif
+
+    if (rx_accept(&b->rx_windows[sender_id], seq) == RX_DUPLICATE) {
+        if (poll) send_ack(s, sender_id, seq, ACK_DUPLICATE);
+        return;
+    }
+    if (poll) send_ack(s, sender_id, seq, ACK_OK);
+    process_packet(s, sender_id, seq, is_batch, data, data_len);
+}
+
+static void send_beacon(sim *s, int receiver) {
+    sim_base *b = &s->bases[receiver];
+    if (b->busy_until > s->now) {
+        push_event(s, b->busy_until, EV_BEACON, receiver, 0);
+        return;
+    }
+    for (uint8_t i = 0; i < b->schedule.num_slots; i++) {
+        uint8_t dr = adr_new_superframe(&b->adr[b->schedule.owner[i]]);
+        b->schedule.dr[i] = s->p->fixed_dr >= 0 ? (uint8_t)s->p->fixed_dr : dr;
+    }
+    uint8_t beacon[BEACON_MAX_LEN];
+    int len = tdma_build_beacon(&b->schedule, beacon);
+    b->listen_dr = adr_beacon_dr();
+    b->listen_ch = freq_home_channel(b->id);
+    for (int i = 0; i < s->p->cars; i++) {
+        if (s->cars[i].receiver == b->id) s->cars[i].beacon_deaf = s->cars[i].state == CAR_TX;
+    }
+    start_tx(s, BASE, BASE, b->id, TX_BEACON, b->listen_dr, b->listen_ch, beacon, len);
+    b->beacon_on_air = true;
+    s->st->beacons++;
+}
+
+// transmit() of the beacon returned, the superframe starts now
+static void beacon_done(sim *s, const transmission &t) {
+    sim_base *b = &s->bases[t.base];
+    b->beacon_on_air = false;
+    b->schedule.beacon_ms = ms(s);
+    b->schedule.beacon_seq++;
+    push_event(s, s->now + tdma_superframe_ms(&b->schedule), EV_BEACON, b->id, 0);
+    for (int i = 0; i < s->p->cars; i++) {
+        if (s->cars[i].receiver == b->id) car_beacon(s, &s->cars[i], t);
+    }
+}
+
+
+/* ---------------------------------- the run ---------------------------------- */
+
+static void tx_end(sim *s, int i) {
+    for (size_t j = 0; j < s->on_air.size(); j++) {
+        if (s->on_air[j] == i) {
+            s->on_air[j] = s->on_air.back();
+            s->on_air.pop_back();
+            break;
+        }
+    }
+    // a copy, the handlers can put new transmissions into the pool
+    transmission t = s->tx[i];
+    s->free_tx.push_back(i);
+
+    if (t.from != BASE) {
+        handle_packet(s, t);
+        car_tx_done(s, &s->cars[t.from]);
+        return;
+    }
+    if (t.kind == TX_BEACON) {
+        beacon_done(s, t);
+        return;
+    }
+
+    sim_car *c = &s->cars[t.to];
+    if (!t.car_listening || c->state != CAR_ACK_WAIT) {
+        return;
+    }
+    c->ack_incoming = false;
+    float rssi, snr;
+    if (!t.collided && link_ok(s, c, t.dr, &rssi, &snr)) {
+        car_handle_ack(s, c, t.data, t.len);
+    }
+    else if (s->now >= c->ack_deadline) {
+        car_ack_timeout(s, c);
+    }
+}
+
+void sim_defaults(sim_params *p) {
+    p->cars = NUM_CARS;
+    p->hours = 1;
+    p->snapshot_rate = 20;
+    p->loss = 0;
+    p->beacon_loss = 0;
+    p->rssi_near = -60;
+    p->rssi_far = -118;
+    p->lap_s = 90;
+    p->fading_db = 3;
+    p->fixed_dr = -1;
+    p->turnaround_ms = 2;
+    p->seed = 1;
+}
+
+void sim_stats_clear(sim_stats *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void sim_stats_add(sim_stats *to, const sim_stats *from) {
+    to->sim_s += from->sim_s;
+    to->events += from->events;
+    to->snapshots += from->snapshots;
+    to->ring_overflows += from->ring_overflows;
+    to->stale_drops += from->stale_drops;
+    to->delivered += from->delivered;
+    to->packets += from->packets;
+    to->sends += from->sends;
+    to->retries += from->retries;
+    to->failed += from->failed;
+    to->ack_timeouts += from->ack_timeouts;
+    to->acks += from->acks;
+    to->no_ref += from->no_ref;
+    to->beacons += from->beacons;
+    to->beacons_missed += from->beacons_missed;
+    to->collisions += from->collisions;
+    to->link_losses += from->link_losses;
+    to->car_air_ms += from->car_air_ms;
+    to->base_air_ms += from->base_air_ms;
+    to->parity += from->parity;
+    to->fec_rebuilt += from->fec_rebuilt;
+    to->too_long += from->too_long;
+    to->resize_lost += from->resize_lost;
+    for (int i = 0; i < 8; i++) to->dr_air_ms[i] += from->dr_air_ms[i];
+    for (int i = 0; i < SIM_LATENCY_BINS; i++) to->latency[i] += from->latency[i];
+}
+
+double sim_latency_ms(const sim_stats *s, double p) {
+    uint64_t total = 0;
+    for (int i = 0; i < SIM_LATENCY_BINS; i++) total += s->latency[i];
+    if (total == 0) return 0;
+    uint64_t want = (uint64_t)(p * (total - 1));
+    uint64_t n = 0;
+    for (int i = 0; i < SIM_LATENCY_BINS; i++) {
+        n += s->latency[i];
+        if (n > want) return i;
+    }
+    return SIM_LATENCY_BINS - 1;
+}
+
+int sim_format_result(const sim_stats *s, int cars, char *out, size_t len) {
+    double car_s = s->sim_s * cars;
+    return snprintf(out, len, "%.1f,%llu,%llu,%.4f,%.3f,%.0f,%.0f,%.0f,%.4f,%llu,%llu,%.4f,%.4f,%llu,%llu,%llu,%llu,%.4f,%llu",
+                    s->sim_s / 3600, (unsigned long long)s->snapshots, (unsigned long long)s->delivered,
+                    s->snapshots ? (double)s->delivered / s->snapshots : 0, car_s > 0 ? s->delivered / car_s : 0,
+                    sim_latency_ms(s, 0.5), sim_latency_ms(s, 0.9), sim_latency_ms(s, 0.99),
+                    s->packets ? (double)s->retries / s->packets : 0, (unsigned long long)s->failed,
+                    (unsigned long long)s->ack_timeouts, car_s > 0 ? s->car_air_ms / 1000.0 / car_s : 0,
+                    s->sim_s > 0 ? (s->car_air_ms + s->base_air_ms) / 1000.0 / s->sim_s / FREQ_RECEIVERS : 0,
+                    (unsigned long long)s->collisions, (unsigned long long)s->ring_overflows,
+                    (unsigned long long)s->stale_drops, (unsigned long long)s->no_ref,
+                    s->sends ? (double)s->parity / s->sends : 0, (unsigned long long)s->fec_rebuilt);
+}
+
+int sim_run(const sim_params *p, sim_stats *out) {
+    // every receiver has one slot per car of its own
+    if (p->cars < 1 || p->cars > SIM_MAX_CARS || (p->cars + FREQ_RECEIVERS - 1) / FREQ_RECEIVERS > TDMA_MAX_SLOTS || p->hours <= 0 || p->snapshot_rate <= 0 || p->lap_s <= 0
+        || p->loss < 0 || p->loss >= 1 || p->beacon_loss < 0 || p->beacon_loss >= 1 || p->fixed_dr >= ADR_NUM_RATES || p->turnaround_ms < 0) {
+        return -1;
+    }
+    std::unique_ptr<sim> s(new sim());
+    s->p = p;
+    s->st = out;
+    s->now = 0;
+    s->end = (uint64_t)(p->hours * 3600 * 1000);
+    s->order = 0;
+    s->rng.seed(p->seed);
+    s->uni = std::uniform_real_distribution<double>(0, 1);
+    s->fade = std::normal_distribution<double>(0, 1);
+    sim_stats_clear(out);
+
+    uint8_t start_dr = p->fixed_dr >= 0 ? (uint8_t)p->fixed_dr : ADR_DEFAULT_DR;
+    for (int r = 0; r < FREQ_RECEIVERS; r++) {
+        sim_base *b = &s->bases[r];
+        b->id = r;
+        b->cars = 0;
+        tdma_init(&b->schedule);
+        b->schedule.slot_ms = TDMA_SLOT_MS;
+        b->listen_dr = start_dr;
+        b->listen_ch = freq_home_channel((uint8_t)r);
+        b->beacon_on_air = false;
+        b->busy_until = 0;
+    }
+    for (int i = 0; i < p->cars; i++) {
+        sim_base *b = &s->bases[freq_receiver((uint8_t)i)];
+        b->schedule.owner[b->schedule.num_slots] = (uint8_t)i;
+        b->schedule.dr[b->schedule.num_slots] = start_dr;
+        b->schedule.num_slots++;
+        b->cars++;
+        rx_window_init(&b->rx_windows[i]);
+        decoder_init(&b->decoders[i]);
+        b->need_key[i] = false;
+        adr_init(&b->adr[i]);
+        if (p->fixed_dr >= 0) b->adr[i].dr = b->adr[i].next_dr = start_dr;
+        b->crc_errors[i] = 0;
+        b->last_rssi[i] = 0;
+        b->last_snr_q4[i] = 0;
+        fec_decoder_init(&b->fec[i]);
+    }
+
+    s->cars.reset(new sim_car[p->cars]);
+    for (int i = 0; i < p->cars; i++) {
+        sim_car *c = &s->cars[i];
+        c->id = i;
+        c->receiver = freq_receiver((uint8_t)i);
+        tx_window_init(&c->window);
+        encoder_init(&c->encoder);
+        batch_init(&c->batch);
+        ring_init(&c->snapshots);
+        tdma_init(&c->schedule);
+        c->slot_end_ms = 0;
+        c->radio_dr = start_dr;
+        c->radio_ch = freq_home_channel(c->receiver);
+        c->slot_dr = start_dr;
+        c->max_pck_len = TDMA_ENABLED ? adr_max_len(start_dr, TDMA_SLOT_MS * ADR_RATES[start_dr].slot_scale) : MAX_PCK_LEN;
+        c->last_len = c->max_pck_len;
+        c->slot_packets = TDMA_ENABLED ? adr_slot_packets(start_dr, TDMA_SLOT_MS * ADR_RATES[start_dr].slot_scale, c->max_pck_len) : WINDOW_SIZE;
+        memset(&c->link, 0, sizeof(c->link));
+        for (uint8_t d = 0; d < ADR_NUM_RATES; d++) {
+            rtt_init(&c->rtt[d], 2 * (adr_airtime_ms(d, ACK_LEN) + RTT_TURNAROUND_MS));
+        }
+        memset(c->slot_refreshed, 0, sizeof(c->slot_refreshed));
+        c->stale_drops = 0;
+        c->last_lost = 0;
+        fec_encoder_init(&c->fec);
+        c->state = CAR_IDLE;
+        c->token = 0;
+        c->sending = c->next = NULL;
+        c->polled = false;
+        c->ack_incoming = false;
+        c->beacon_deaf = false;
+        c->next_snap_ms = s->uni(s->rng) * 1000.0 / p->snapshot_rate;
+        c->gen = 0;
+        memset(&c->current, 0, sizeof(c->current));
+        c->phase = s->uni(s->rng);
+        memset(c->gen_time, 0, sizeof(c->gen_time));
+        memset(c->seen, 0, sizeof(c->seen));
+        car_wake(s.get(), c, 0);
+    }
+#if TDMA_ENABLED
+    for (int r = 0; r < FREQ_RECEIVERS; r++) {
+        if (s->bases[r].cars) push_event(s.get(), 0, EV_BEACON, r, 0);
+    }
+#endif
+
+    while (!s->events.empty() && s->events.top().t < s->end) {
+        event e = s->events.top();
+        s->events.pop();
+        s->now = e.t;
+        out->events++;
+        switch (e.type) {
+        case EV_CAR_WAKE:
+            if (e.token == s->cars[e.who].token && s->cars[e.who].state == CAR_IDLE) car_run(s.get(), &s->cars[e.who]);
+            break;
+        case EV_ACK_TIMEOUT:
+            // an ACK that started in time still gets received all the way
+            if (e.token == s->cars[e.who].token && s->cars[e.who].state == CAR_ACK_WAIT && !s->cars[e.who].ack_incoming) {
+                car_ack_timeout(s.get(), &s->cars[e.who]);
+            }
+            break;
+        case EV_TX_END:
+            tx_end(s.get(), e.who);
+            break;
+        case EV_BEACON:
+            send_beacon(s.get(), e.who);
+            break;
+        case EV_ACK_START:
+            ack_start(s.get(), e.who);
+            break;
+        }
+    }
+
+    out->sim_s = s->end / 1000.0;
+    for (int i = 0; i < p->cars; i++) {
+        out->ring_overflows += s->cars[i].snapshots.overflows;
+        out->stale_drops += s->cars[i].stale_drops;
+    }
+    return 0;
+}
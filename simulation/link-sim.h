@@ -0,0 +1,75 @@
+#ifndef __LINK_SIM_H__
+#define __LINK_SIM_H__
+#include <stdint.h>
+#include <stddef.h>
+
+// discrete-event simulator of the LoRa link between car_end and user_end
+//
+// the protocol code is the firmware's own (arq.h, batch.h, telemetry_codec.h,
+// tdma.h, adr.h, freq_plan.h, fec.h and snapshot_ring.h from main_code), only the radio is a
+// model and the .ino glue around it is redone as event handlers instead of blocking calls.
+// everything compile time (WINDOW_SIZE, BATCH_SIZE, MAX_RETRIES, TDMA_ENABLED ...)
+// comes from shared_defs.h (or -D, see linksweep), what is set here is the world
+// around it.
+
+#define SIM_MAX_CARS        64                  // sender_ids below FEC_FLAG, and at most TDMA_MAX_SLOTS per receiver
+#define SIM_LATENCY_BINS    10000               // 1 ms wide, anything slower goes in the last one
+
+struct sim_params {
+    int cars;
+    double hours;                               // simulated time per run
+    double snapshot_rate;                       // snapshots/s the CAN task publishes on every car
+    double loss;                                // random loss on top of the link model, every packet both ways
+    double beacon_loss;                         // and on top of that for the beacons, each car on its own
+    double rssi_near;                           // dBm in the pits ...
+    double rssi_far;                            // ... and at the far end of the track
+    double lap_s;                               // cars go from near to far and back once a lap
+    double fading_db;                           // sigma of the per-packet fading
+    int fixed_dr;                               // -1 = ADR picks, otherwise every car stays on this index of ADR_RATES
+    int turnaround_ms;                          // user_end's time from a poll to its ACK going on air
+    uint64_t seed;
+};
+
+struct sim_stats {
+    double sim_s;
+    uint64_t events;
+    uint64_t snapshots;                         // published by the CAN tasks
+    uint64_t ring_overflows;                    // radio task too far behind
+    uint64_t stale_drops;                       // TX_LATEST skipped or superseded
+    uint64_t delivered;                         // snapshots decoded at the base station, once each
+    uint64_t packets;                           // queued in the ARQ window
+    uint64_t sends;                             // transmissions including retries
+    uint64_t retries;
+    uint64_t failed;                            // given up after MAX_RETRIES
+    uint64_t too_long;                          // queued packets ADR left too long for the slot (repack())
+    uint64_t resize_lost;                       // snapshots lost that way
+    uint64_t ack_timeouts;
+    uint64_t acks;                              // sent by the base station
+    uint64_t no_ref;                            // deltas the base station had no keyframe for
+    uint64_t beacons;
+    uint64_t beacons_missed;                    // beacons a car didn't hear
+    uint64_t collisions;                        // transmissions that overlapped another one at the same rate
+    uint64_t link_losses;                       // lost to path loss, fading or the random loss
+    uint64_t car_air_ms;                        // summed over every car
+    uint64_t base_air_ms;
+    uint64_t parity;                            // FEC parity packets, also in sends
+    uint64_t fec_rebuilt;                       // packets the base station rebuilt from parity
+    uint64_t dr_air_ms[8];                      // car airtime on each data rate (index into ADR_RATES)
+    uint64_t latency[SIM_LATENCY_BINS];         // snapshot taken -> decoded at the base station
+};
+
+void sim_defaults(sim_params *p);
+void sim_stats_clear(sim_stats *s);
+void sim_stats_add(sim_stats *to, const sim_stats *from);
+// latency percentile (0..1) in ms out of the histogram
+double sim_latency_ms(const sim_stats *s, double p);
+
+// the columns sim_format_result() writes, linksim -m prints the same line.
+// channel_busy is the airtime of one receiver's channels, the average over FREQ_RECEIVERS
+#define SIM_RESULT_HEADER "sim_h,snapshots,delivered,delivery,delivered_per_car_s,p50_ms,p90_ms,p99_ms,retries_per_packet,failed,ack_timeouts,duty_cycle,channel_busy,collisions,ring_overflows,stale,no_ref,parity_share,fec_rebuilt"
+int sim_format_result(const sim_stats *s, int cars, char *out, size_t len);
+
+// one simulated session, returns -1 if the parameters don't make sense
+int sim_run(const sim_params *p, sim_stats *out);
+
+#endif
@@ -5,14 +5,16 @@
 import socket
 import random
 import time
-import struct
 import argparse
 
+import wire
+from wire import ACK_OK, ACK_DUPLICATE, ACK_BAD_LEN, ACK_NO_REF
+from telemetry_codec import CHANNEL_NAMES, DATA_PCK_LEN as TELEM_PCK_LEN, HEADER_LEN, DELTA_HDR_LEN, SEQ_MASK, DeltaDecoder
 
-# defined byte lengths
-DATA_PCK_LEN = 32
-DATA_BYTES = 31
-ACK_LN = 2
+
+# defined byte lengths, the ABP messages of main_code/wire_schema.h
+DATA_BYTES = wire.ABP_DATA_BYTES
+DATA_PCK_LEN = wire.ABP.len + DATA_BYTES
 
 
 # connecting RX and TX
@@ -33,6 +35,56 @@ def random_delay(min_ms: int, max_ms: int):
     # function to pick a random integer to delay in between min and max
     time.sleep(random.randint(min_ms, max_ms) / 1000.0)
 
+# send an ABP_ACK, randomly dropping it like the file transfer path does
+def send_ack(sock, pck_num: int, status: int) -> bool:
+    if random.random() < LOSS_ACK_PROB:
+        print(f"RX: ACK DROPPED (packet number = {pck_num}), status = {status}")
+        return False
+    random_delay(ACK_DELAY_MS_MIN, ACK_DELAY_MS_MAX)
+    sock.sendto(wire.ABP_ACK.pack(num=pck_num, status=status), (RX_HOST, TX_ACK_PORT))
+    print(f"RX: ACK SUCCESSFULLY SENT (packet number = {pck_num}), status = {status}")
+    return True
+
+
+# receive car_end style telemetry packets (keyframes and deltas) and write the
+# rebuilt channel values as csv instead of reconstructing a file
+def run_telemetry(sock, out_path: str):
+    decoders = {}               # sender_id -> DeltaDecoder
+    last_seq = {}               # sender_id -> last accepted seq, used to detect duplicates
+
+    with open(out_path, "w") as out_f:
+        out_f.write("Car_ID,SEQ," + ",".join(CHANNEL_NAMES) + "\n")
+        while True:
+            pck, addr = sock.recvfrom(4096)
+
+            # full length packets are keyframes and anything shorter is a delta
+            if len(pck) < HEADER_LEN + DELTA_HDR_LEN or len(pck) > TELEM_PCK_LEN:
+                seq = pck[wire.PKT_SEQ] & SEQ_MASK if len(pck) >= HEADER_LEN else 0
+                print(f"RX: bad length {len(pck)} from {addr} -> ACK(BAD_LEN)")
+                send_ack(sock, seq, ACK_BAD_LEN)
+                continue
+
+            sender_id = pck[wire.PKT_ID]
+            seq = pck[wire.PKT_SEQ] & SEQ_MASK
+
+            if last_seq.get(sender_id) == seq:
+                print(f"RX: duplicate packet number = {seq} -> ACK(DUPLICATE)")
+                send_ack(sock, seq, ACK_DUPLICATE)
+                continue
+            last_seq[sender_id] = seq
+
+            values = decoders.setdefault(sender_id, DeltaDecoder()).decode(seq, pck[HEADER_LEN:])
+            if values is None:
+                print(f"RX: packet number = {seq} delta without its keyframe -> ACK(NO_REF)")
+                send_ack(sock, seq, ACK_NO_REF)
+                continue
+
+            out_f.write(f"{sender_id},{seq}," + ",".join(str(v) for v in values) + "\n")
+            out_f.flush()
+            print(f"RX: accepted packet number = {seq} car = {sender_id} len = {len(pck)}")
+            send_ack(sock, seq, ACK_OK)
+
+
 def main():
     
     parser = argparse.ArgumentParser()
@@ -40,6 +92,8 @@ def main():
     parser.add_argument("--rx-port", type=int, default=9000)
     parser.add_argument("--tx-ack-port", type=int, default=9001)
     parser.add_argument("--out", default="received.bin")
+    parser.add_argument("--telemetry", action="store_true",
+                        help="decode car_end telemetry packets (keyframe/delta) into a csv instead of a file")
 
     parser.add_argument("--seed", type=int, default=12)
     parser.add_argument("--loss-ack", type=float, default=0.08)
@@ -69,6 +123,13 @@ def main():
     sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
     sock.bind((RX_HOST, RX_PORT))
     print(f"RX listening on {RX_HOST}: {RX_PORT}")
+
+    if args.telemetry:
+        out_f.close()
+        print(f"RX writing decoded telemetry to: {out_path}")
+        run_telemetry(sock, out_path)
+        return
+
     print(f"RX writing reconstructed data to: {out_path}")
 
     last_delivered_pck_num = None              # used to detect duplicates
@@ -82,14 +143,14 @@ def main():
         # pck raw bytes and addr is the sender address/ port
         pck, addr = sock.recvfrom(4096)
 
-        # make sure we get 32 bytes
+        # make sure we get DATA_PCK_LEN bytes
         if len(pck) != DATA_PCK_LEN:
             # if there is at least one byte treat it as the packet number
-            pck_num = pck[0] if len(pck) >= 1 else 0
-            
+            pck_num = pck[wire.ABP_NUM] if len(pck) >= wire.ABP.len else 0
+
             # create an ack that gives the sequence and the status of a bad len
-            status = 2      # use 2 to indicate bad length
-            ack = bytes([pck_num & 0xFF, status])    
+            status = ACK_BAD_LEN
+            ack = wire.ABP_ACK.pack(num=pck_num, status=status)
 
             # based on the probability of loosing an ACK send the ACK
             if random.random() >= LOSS_ACK_PROB:
@@ -101,23 +162,23 @@ def main():
             continue
 
         # otherwise we have a packet of the right length so process it
-        pck_num = pck[0]
-        data = pck[1:]          # 31 bytes
+        pck_num = pck[wire.ABP_NUM]
+        data = pck[wire.ABP.len:]       # DATA_BYTES
 
         # check if we already accepted this packet number (a resend)
         if last_delivered_pck_num == pck_num:
-            status = 1          # use 1 to indicate a duplicate
+            status = ACK_DUPLICATE
             print(f"RX: duplicate packet number = {pck_num} -> ACK(DUPLICATE)")
         # otherwise it is new
         else:
-            status = 0                          # use 0 to indicate everything's okay
+            status = ACK_OK
             last_delivered_pck_num = pck_num
 
             # process the very first data chunk 
             if expected_total_len is None:
-                # expected that the first 4 bytes are the file length
-                expected_total_len = struct.unpack("<I", data[:4])[0]
-                actual_data = data[4:]          # 27 bytes remaining 
+                # expected that the first packet starts with the file length
+                expected_total_len = wire.ABP_FIRST.unpack(data).file_len
+                actual_data = data[wire.ABP_FIRST.len:]
                 
                 # make sure not to write more than the file's actual size
                 to_write = actual_data[: max(0, expected_total_len - bytes_written)]
@@ -143,7 +204,7 @@ def main():
                 done = False
         
         # send the acknowledgement 
-        ack = bytes([pck_num & 0xFF, status])
+        ack = wire.ABP_ACK.pack(num=pck_num, status=status)
 
         # randomly simulate the ack being lost 
         ack_dropped = random.random() < LOSS_ACK_PROB
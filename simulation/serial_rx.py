@@ -0,0 +1,114 @@
+# host side reader for the binary output of user_end (OUTPUT_BINARY in shared_defs.h)
+# splits the serial stream on 0x00, COBS decodes every frame, checks the CRC and
+# writes one csv row per record. the layout comes from main_code/wire_schema.h (wire.py),
+# stats records (user_end's counters, ingestd shows them) are skipped
+
+# imports
+import argparse
+import struct
+import sys
+
+import wire
+from wire import CHANNEL_NAMES, NUM_CHANNELS, OUT_REC_TELEMETRY, OUT_REC_BACKFILL, OUT_REC_STATS
+
+
+OUT_TELEM_LEN = wire.OUT_TELEM.len + 2 * NUM_CHANNELS + 2
+CHANNELS_FMT = f"<{NUM_CHANNELS}H"
+
+
+def crc16_ccitt(data: bytes) -> int:
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+# decode one frame without its 0x00 delimiter, returns None if it is malformed
+def cobs_decode(frame: bytes) -> bytes | None:
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        i += 1
+        if code == 0 or i + code - 1 > len(frame):
+            return None
+        out += frame[i:i + code - 1]
+        i += code - 1
+        if code != 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+# returns (car_id, seq, rssi_dbm, snr_db, car_time_ms, backfill, channels) or None on a bad frame
+def parse_record(raw: bytes):
+    if len(raw) != OUT_TELEM_LEN or raw[wire.OUT_TELEM_TYPE] not in (OUT_REC_TELEMETRY, OUT_REC_BACKFILL):
+        return None
+    crc, = struct.unpack_from("<H", raw, OUT_TELEM_LEN - 2)
+    if crc != crc16_ccitt(raw[:-2]):
+        return None
+    r = wire.OUT_TELEM.unpack(raw)
+    channels = struct.unpack_from(CHANNELS_FMT, raw, wire.OUT_TELEM.len)
+    return r.car, r.seq, r.rssi, r.snr / 4.0, r.car_time, int(r.type == OUT_REC_BACKFILL), list(channels)
+
+
+def open_input(args):
+    if args.file:
+        return open(args.file, "rb")
+    try:
+        import serial
+    except ImportError:
+        sys.exit("pyserial is needed to read a port (pip install pyserial), or use --file")
+    return serial.Serial(args.port, args.baud, timeout=1)
+
+
+def main():
+    # parse arguments
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", default="/dev/ttyACM0")
+    parser.add_argument("--baud", type=int, default=921600)             # OUTPUT_BAUD
+    parser.add_argument("--file", help="read a captured stream instead of the serial port")
+    parser.add_argument("--out", default="telemetry.csv")
+    args = parser.parse_args()
+
+    good = 0
+    bad = 0
+    buf = bytearray()
+    src = open_input(args)
+
+    with src, open(args.out, "w") as out_f:
+        out_f.write("Car_ID,SEQ,RSSI,SNR,Car_Time,Backfill," + ",".join(CHANNEL_NAMES) + "\n")
+        try:
+            while True:
+                chunk = src.read(4096)
+                if not chunk:
+                    if args.file:
+                        break
+                    continue
+                buf += chunk
+
+                # everything up to the last delimiter is complete frames
+                *frames, rest = buf.split(b"\x00")
+                buf = bytearray(rest)
+                for frame in frames:
+                    if not frame:
+                        continue
+                    raw = cobs_decode(frame)
+                    if raw and raw[wire.OUT_STATS_TYPE] == OUT_REC_STATS:
+                        continue
+                    rec = parse_record(raw) if raw is not None else None
+                    if rec is None:
+                        bad += 1
+                        continue
+                    good += 1
+                    car_id, seq, rssi, snr, car_time, backfill, ch = rec
+                    out_f.write(f"{car_id},{seq},{rssi},{snr},{car_time},{backfill}," + ",".join(str(v) for v in ch) + "\n")
+        except KeyboardInterrupt:
+            pass
+
+    print(f"RX: {good} records written to {args.out}, {bad} bad frames")
+
+
+if __name__ == "__main__":
+    main()
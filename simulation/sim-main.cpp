@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "link-sim.h"
+#include "shared_defs.h"
+#include "adr.h"
+
+// linksim: runs the link simulator (link-sim.h) a number of times with different
+// seeds, spread over every core, and prints what all the runs add up to
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    sim_params d;
+    sim_defaults(&d);
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  -c cars      cars, shared out over %d receivers (default %d, at most %d)\n", FREQ_RECEIVERS, d.cars, SIM_MAX_CARS);
+    fprintf(stderr, "  -H hours     simulated time per run (default %g)\n", d.hours);
+    fprintf(stderr, "  -s rate      snapshots/s per car (default %g)\n", d.snapshot_rate);
+    fprintf(stderr, "  -l loss      random packet loss 0..1 on top of the link model (default %g)\n", d.loss);
+    fprintf(stderr, "  -b loss      beacons a car misses on top of that, 0..1 (default %g)\n", d.beacon_loss);
+    fprintf(stderr, "  -N dbm       RSSI next to the base station (default %g)\n", d.rssi_near);
+    fprintf(stderr, "  -F dbm       RSSI at the far end of the track (default %g)\n", d.rssi_far);
+    fprintf(stderr, "  -L seconds   lap time (default %g)\n", d.lap_s);
+    fprintf(stderr, "  -f db        fading sigma (default %g)\n", d.fading_db);
+    fprintf(stderr, "  -d dr        keep every car on this index of ADR_RATES instead of ADR\n");
+    fprintf(stderr, "  -T ms        user_end poll to ACK turnaround (default %d)\n", d.turnaround_ms);
+    fprintf(stderr, "  -S seed      seed of the first run (default %llu)\n", (unsigned long long)d.seed);
+    fprintf(stderr, "  -r runs      runs, each with the next seed (default 1)\n");
+    fprintf(stderr, "  -j threads   default: every core\n");
+    fprintf(stderr, "  -m           print one line of " SIM_RESULT_HEADER " instead\n");
+}
+
+int main(int argc, char* argv[])
+{
+    sim_params p;
+    sim_defaults(&p);
+    int runs = 1;
+    int threads = std::thread::hardware_concurrency();
+    int machine = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "c:H:s:l:b:N:F:L:f:d:T:S:r:j:m")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c': p.cars = atoi(optarg); break;
+        case 'H': p.hours = atof(optarg); break;
+        case 's': p.snapshot_rate = atof(optarg); break;
+        case 'l': p.loss = atof(optarg); break;
+        case 'b': p.beacon_loss = atof(optarg); break;
+        case 'N': p.rssi_near = atof(optarg); break;
+        case 'F': p.rssi_far = atof(optarg); break;
+        case 'L': p.lap_s = atof(optarg); break;
+        case 'f': p.fading_db = atof(optarg); break;
+        case 'd': p.fixed_dr = atoi(optarg); break;
+        case 'T': p.turnaround_ms = atoi(optarg); break;
+        case 'S': p.seed = strtoull(optarg, NULL, 0); break;
+        case 'r': runs = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        case 'm': machine = 1; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(runs < 1 || threads < 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    if(threads > runs)
+        threads = runs;
+
+    // every worker takes the next run until there are none left
+    std::unique_ptr<sim_stats> total(new sim_stats);
+    sim_stats_clear(total.get());
+    std::atomic<int> next(0);
+    std::atomic<int> bad(0);
+    std::mutex m;
+    std::vector<std::thread> pool;
+    double start = now_s();
+    for(int t = 0; t < threads; t++)
+    {
+        pool.emplace_back([&]
+        {
+            std::unique_ptr<sim_stats> mine(new sim_stats);
+            std::unique_ptr<sim_stats> run(new sim_stats);
+            sim_stats_clear(mine.get());
+            int i;
+            while((i = next++) < runs)
+            {
+                sim_params rp = p;
+                rp.seed = p.seed + i;
+                if(sim_run(&rp, run.get()) < 0)
+                {
+                    bad = 1;
+                    break;
+                }
+                sim_stats_add(mine.get(), run.get());
+            }
+            std::lock_guard<std::mutex> lock(m);
+            sim_stats_add(total.get(), mine.get());
+        });
+    }
+    for(std::thread &t : pool)
+        t.join();
+    double wall = now_s() - start;
+    if(bad)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    const sim_stats &s = *total;
+    if(machine)
+    {
+        char line[512];
+        sim_format_result(&s, p.cars, line, sizeof(line));
+        printf("%s\n", line);
+        return 0;
+    }
+    double car_s = s.sim_s * p.cars;
+    printf("WINDOW_SIZE %d, BATCH_SIZE %d, MAX_RETRIES %d, TDMA %d, ADR %d, TX_POLICY %d, compression %d, %d receivers x %d hops\n",
+           WINDOW_SIZE, BATCH_SIZE, MAX_RETRIES, TDMA_ENABLED, p.fixed_dr < 0 && ADR_ENABLED, TX_POLICY, PAYLOAD_COMPRESSION,
+           FREQ_RECEIVERS, FREQ_HOPS);
+    printf("%d runs of %g h with %d cars on %d threads: %.2f s, %.0f simulated h/s, %.1f M events/s\n",
+           runs, p.hours, p.cars, threads, wall, s.sim_s / 3600 / wall, s.events / wall / 1e6);
+    printf("snapshots  %llu taken, %llu delivered (%.2f%%), %.2f/s per car\n",
+           (unsigned long long)s.snapshots, (unsigned long long)s.delivered,
+           s.snapshots ? 100.0 * s.delivered / s.snapshots : 0, s.delivered / car_s);
+    printf("           %llu ring overflows, %llu stale, %llu without a keyframe\n",
+           (unsigned long long)s.ring_overflows, (unsigned long long)s.stale_drops, (unsigned long long)s.no_ref);
+    printf("latency    p50 %.0f ms, p90 %.0f ms, p99 %.0f ms\n",
+           sim_latency_ms(&s, 0.5), sim_latency_ms(&s, 0.9), sim_latency_ms(&s, 0.99));
+    printf("packets    %llu queued, %llu sends, %.3f retries per packet, %llu failed after MAX_RETRIES\n",
+           (unsigned long long)s.packets, (unsigned long long)s.sends,
+           s.packets ? (double)s.retries / s.packets : 0, (unsigned long long)s.failed);
+    printf("           %llu too long after a slower rate, %llu snapshots lost to that\n",
+           (unsigned long long)s.too_long, (unsigned long long)s.resize_lost);
+    printf("           %llu ACKs, %llu ACK timeouts, %llu beacons (%llu missed by a car)\n",
+           (unsigned long long)s.acks, (unsigned long long)s.ack_timeouts,
+           (unsigned long long)s.beacons, (unsigned long long)s.beacons_missed);
+    if(FEC_PARITY)
+        printf("FEC        %d parity per %d, %llu parity packets (%.1f%% of sends), %llu packets rebuilt\n", FEC_PARITY,
+               FEC_GROUP, (unsigned long long)s.parity, s.sends ? 100.0 * s.parity / s.sends : 0,
+               (unsigned long long)s.fec_rebuilt);
+    printf("channel    %.2f%% duty cycle per car, %.2f%% busy per receiver, %llu collisions, %llu link losses\n",
+           100.0 * s.car_air_ms / 1000 / car_s, 100.0 * (s.car_air_ms + s.base_air_ms) / 1000 / s.sim_s / FREQ_RECEIVERS,
+           (unsigned long long)s.collisions, (unsigned long long)s.link_losses);
+    printf("airtime   ");
+    for(int d = 0; d < ADR_NUM_RATES; d++)
+        printf(" DR%d %.1f%%", d, s.car_air_ms ? 100.0 * s.dr_air_ms[d] / s.car_air_ms : 0);
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "link-sim.h"
+#include "shared_defs.h"
+#include "adr.h"
+
+// linksweep: runs linksim over a grid of protocol settings and link conditions
+// and writes one CSV row per point
+//
+// WINDOW_SIZE, BATCH_SIZE, MAX_RETRIES, RTO_MIN_MS, BATCH_TIMEOUT_MS, FEC_PARITY and
+// FREQ_RECEIVERS are compile time in the firmware, so every combination of them is built into its own
+// simulator first (variants/), the data rate and the loss are then just options
+// of each run. everything after -- goes to every linksim as it is.
+
+struct variant
+{
+    int window, batch, retries, rto_min, batch_timeout, fec, receivers;
+    std::string exe;
+    bool built;
+};
+
+struct point
+{
+    int v;
+    int dr;
+    double loss;
+    std::string result;
+};
+
+static std::mutex print_mutex;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [options] [-- linksim options]\n", prog);
+    fprintf(stderr, "every option takes a comma separated list, the grid is every combination\n");
+    fprintf(stderr, "  -w n         WINDOW_SIZE (default %d)\n", WINDOW_SIZE);
+    fprintf(stderr, "  -b n         BATCH_SIZE (default %d)\n", BATCH_SIZE);
+    fprintf(stderr, "  -m n         MAX_RETRIES (default %d)\n", MAX_RETRIES);
+    fprintf(stderr, "  -t ms        RTO_MIN_MS (default %d)\n", RTO_MIN_MS);
+    fprintf(stderr, "  -B ms        BATCH_TIMEOUT_MS (default %d)\n", BATCH_TIMEOUT_MS);
+    fprintf(stderr, "  -f n         FEC_PARITY, parity packets per %d (default %d, 0 = off)\n", FEC_GROUP, FEC_PARITY);
+    fprintf(stderr, "  -R n         FREQ_RECEIVERS, the cars (-- -c) are shared out over them (default %d)\n", FREQ_RECEIVERS);
+    fprintf(stderr, "  -d dr        index of ADR_RATES, -1 = ADR (default -1)\n");
+    fprintf(stderr, "  -l loss      random packet loss 0..1 (default 0)\n");
+    fprintf(stderr, "  -j threads   default: every core\n");
+    fprintf(stderr, "  -o file      CSV to write (default sweep.csv)\n");
+}
+
+static bool parse_list(const char *arg, std::vector<double> &out)
+{
+    out.clear();
+    while(*arg)
+    {
+        char *end;
+        double v = strtod(arg, &end);
+        if(end == arg || (*end && *end != ','))
+            return false;
+        out.push_back(v);
+        arg = *end ? end + 1 : end;
+    }
+    return !out.empty();
+}
+
+// work-stealing pool: the jobs are dealt out round robin, every worker takes from
+// the front of its own deque and once that is empty steals from the back of the
+// others, so a share of slow points (SF12, long builds) doesn't leave cores idle
+static void run_pool(int jobs, int threads, const std::function<void(int)> &work)
+{
+    struct queue
+    {
+        std::mutex m;
+        std::deque<int> jobs;
+    };
+    std::vector<std::unique_ptr<queue>> queues;
+    for(int t = 0; t < threads; t++)
+        queues.emplace_back(new queue);
+    for(int i = 0; i < jobs; i++)
+        queues[i % threads]->jobs.push_back(i);
+
+    std::vector<std::thread> pool;
+    for(int t = 0; t < threads; t++)
+    {
+        pool.emplace_back([&, t]
+        {
+            for(;;)
+            {
+                int job = -1;
+                for(int k = 0; k < threads && job < 0; k++)
+                {
+                    queue &q = *queues[(t + k) % threads];
+                    std::lock_guard<std::mutex> lock(q.m);
+                    if(q.jobs.empty())
+                        continue;
+                    if(k == 0)
+                    {
+                        job = q.jobs.front();
+                        q.jobs.pop_front();
+                    }
+                    else
+                    {
+                        job = q.jobs.back();
+                        q.jobs.pop_back();
+                    }
+                }
+                // nothing is ever queued again, empty everywhere means done
+                if(job < 0)
+                    return;
+                work(job);
+            }
+        });
+    }
+    for(std::thread &t : pool)
+        t.join();
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<double> windows = {WINDOW_SIZE}, batches = {BATCH_SIZE}, retries = {MAX_RETRIES};
+    std::vector<double> rto_mins = {RTO_MIN_MS}, batch_timeouts = {BATCH_TIMEOUT_MS}, fecs = {FEC_PARITY}, receivers = {FREQ_RECEIVERS};
+    std::vector<double> drs = {-1}, losses = {0};
+    int threads = std::thread::hardware_concurrency();
+    const char *out_name = "sweep.csv";
+    int opt;
+    bool ok = true;
+    while((opt = getopt(argc, argv, "w:b:m:t:B:f:R:d:l:j:o:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'w': ok &= parse_list(optarg, windows); break;
+        case 'b': ok &= parse_list(optarg, batches); break;
+        case 'm': ok &= parse_list(optarg, retries); break;
+        case 't': ok &= parse_list(optarg, rto_mins); break;
+        case 'B': ok &= parse_list(optarg, batch_timeouts); break;
+        case 'f': ok &= parse_list(optarg, fecs); break;
+        case 'R': ok &= parse_list(optarg, receivers); break;
+        case 'd': ok &= parse_list(optarg, drs); break;
+        case 'l': ok &= parse_list(optarg, losses); break;
+        case 'j': threads = atoi(optarg); break;
+        case 'o': out_name = optarg; break;
+        default: ok = false; break;
+        }
+    }
+    for(double d : drs)
+        ok &= d >= -1 && d < ADR_NUM_RATES;
+    if(!ok || threads < 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    std::string extra;
+    for(int i = optind; i < argc; i++)
+        extra += std::string(" ") + argv[i];
+
+    // the variants and the makefile live next to this binary
+    std::string dir = argv[0];
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+    mkdir((dir + "/variants").c_str(), 0755);
+
+    std::vector<variant> variants;
+    for(double w : windows)
+        for(double b : batches)
+            for(double m : retries)
+                for(double t : rto_mins)
+                    for(double bt : batch_timeouts)
+                        for(double f : fecs)
+                            for(double r : receivers)
+                            {
+                                variant v = {(int)w, (int)b, (int)m, (int)t, (int)bt, (int)f, (int)r, "", false};
+                                char name[128];
+                                snprintf(name, sizeof(name), "variants/linksim-w%d-b%d-m%d-t%d-B%d-f%d-R%d",
+                                         v.window, v.batch, v.retries, v.rto_min, v.batch_timeout, v.fec, v.receivers);
+                                v.exe = name;
+                                variants.push_back(v);
+                            }
+
+    // a combination the firmware refuses (a static_assert) just drops out of the grid
+    int built = 0;
+    run_pool(variants.size(), threads, [&](int i)
+    {
+        variant &v = variants[i];
+        char cmd[512];
+        snprintf(cmd, sizeof(cmd),
+                 "make -s -C '%s' %s SIM_OUT=%s SIM_DEFS=\"-DWINDOW_SIZE=%d -DBATCH_SIZE=%d -DMAX_RETRIES=%d -DRTO_MIN_MS=%d -DBATCH_TIMEOUT_MS=%d -DFEC_PARITY=%d -DFREQ_RECEIVERS=%d\" > /dev/null 2>&1",
+                 dir.c_str(), v.exe.c_str(), v.exe.c_str(), v.window, v.batch, v.retries, v.rto_min, v.batch_timeout, v.fec, v.receivers);
+        v.built = system(cmd) == 0;
+        std::lock_guard<std::mutex> lock(print_mutex);
+        if(v.built)
+            built++;
+        else
+            fprintf(stderr, "%s does not build, skipped\n", v.exe.c_str());
+    });
+    fprintf(stderr, "%d of %zu variants built\n", built, variants.size());
+
+    std::vector<point> points;
+    for(size_t v = 0; v < variants.size(); v++)
+        for(double d : drs)
+            for(double l : losses)
+                if(variants[v].built)
+                    points.push_back({(int)v, (int)d, l, ""});
+
+    // every point is one single threaded linksim, the pool is what uses the cores
+    int done = 0;
+    run_pool(points.size(), threads, [&](int i)
+    {
+        point &p = points[i];
+        char cmd[512];
+        snprintf(cmd, sizeof(cmd), "'%s/%s' -m -j 1 -d %d -l %g%s",
+                 dir.c_str(), variants[p.v].exe.c_str(), p.dr, p.loss, extra.c_str());
+        FILE *f = popen(cmd, "r");
+        char line[512] = "";
+        if(f)
+        {
+            if(!fgets(line, sizeof(line), f))
+                line[0] = 0;
+            if(pclose(f) != 0)
+                line[0] = 0;
+        }
+        line[strcspn(line, "\r\n")] = 0;
+        p.result = line;
+        std::lock_guard<std::mutex> lock(print_mutex);
+        done++;
+        if(p.result.empty())
+            fprintf(stderr, "[%d/%zu] %s failed\n", done, points.size(), cmd);
+        else
+            fprintf(stderr, "[%d/%zu] %s\n", done, points.size(), cmd);
+    });
+
+    FILE *out = fopen(out_name, "w");
+    if(!out)
+    {
+        perror(out_name);
+        return -1;
+    }
+    fprintf(out, "window,batch,max_retries,rto_min_ms,batch_timeout_ms,fec_parity,receivers,dr,sf,bw_khz,loss," SIM_RESULT_HEADER "\n");
+    int rows = 0;
+    for(const point &p : points)
+    {
+        if(p.result.empty())
+            continue;
+        const variant &v = variants[p.v];
+        fprintf(out, "%d,%d,%d,%d,%d,%d,%d,", v.window, v.batch, v.retries, v.rto_min, v.batch_timeout, v.fec, v.receivers);
+        if(p.dr < 0)
+            fprintf(out, "adr,,,");
+        else
+            fprintf(out, "%d,%d,%g,", p.dr, ADR_RATES[p.dr].sf, ADR_RATES[p.dr].bw_khz);
+        fprintf(out, "%g,%s\n", p.loss, p.result.c_str());
+        rows++;
+    }
+    fclose(out);
+    fprintf(stderr, "%d of %zu points written to %s\n", rows, points.size(), out_name);
+    return 0;
+}
@@ -0,0 +1,109 @@
+# python copy of main_code/telemetry_codec.h
+# rebuilds the telemetry channels from keyframe / delta payloads, the layouts come from wire.py
+
+import struct
+
+import wire
+from wire import CHANNEL_NAMES, NUM_CHANNELS, SEQ_MASK
+
+HEADER_LEN = wire.PKT.len
+DATA_BYTES = 2 * NUM_CHANNELS
+DATA_PCK_LEN = HEADER_LEN + DATA_BYTES
+DELTA_HDR_LEN = wire.DELTA.len
+DECODER_KEYS = 16          # 2 * WINDOW_SIZE, see delta_decoder
+
+
+def zigzag16(v: int) -> int:
+    v &= 0xFFFF
+    if v & 0x8000:
+        v -= 0x10000
+    return ((v << 1) ^ (v >> 15)) & 0xFFFF
+
+
+def unzigzag16(z: int) -> int:
+    return (z >> 1) ^ -(z & 1)
+
+
+def put_varint(v: int) -> bytes:
+    out = bytearray()
+    while v >= 0x80:
+        out.append((v & 0x7F) | 0x80)
+        v >>= 7
+    out.append(v)
+    return bytes(out)
+
+
+# returns (value, bytes used) or None if the input runs out
+def get_varint(data: bytes, pos: int):
+    result = 0
+    for n in range(3):
+        if pos + n >= len(data):
+            return None
+        b = data[pos + n]
+        result |= (b & 0x7F) << (7 * n)
+        if not b & 0x80:
+            return result & 0xFFFF, n + 1
+    return None
+
+
+def unpack_keyframe(data: bytes) -> list[int]:
+    return list(struct.unpack(f"<{NUM_CHANNELS}H", data[:DATA_BYTES]))
+
+
+def encode_delta(key_seq: int, ref: list[int], cur: list[int]) -> bytes | None:
+    bitmap = 0
+    body = bytearray()
+    for i in range(NUM_CHANNELS):
+        if cur[i] == ref[i]:
+            continue
+        bitmap |= 1 << i
+        body += put_varint(zigzag16(cur[i] - ref[i]))
+    out = wire.DELTA.pack(key_seq=key_seq, changed=bitmap) + body
+    return out if len(out) < DATA_BYTES else None
+
+
+def decode_delta(data: bytes, ref: list[int]) -> list[int] | None:
+    hdr = wire.DELTA.unpack(data)
+    if hdr is None:
+        return None
+    bitmap = hdr.changed
+    pos = DELTA_HDR_LEN
+    out = list(ref)
+    for i in range(NUM_CHANNELS):
+        if not bitmap & (1 << i):
+            continue
+        got = get_varint(data, pos)
+        if got is None:
+            return None
+        z, used = got
+        out[i] = (ref[i] + unzigzag16(z)) & 0xFFFF
+        pos += used
+    return out if pos == len(data) else None
+
+
+class DeltaDecoder:
+    # keeps the last DECODER_KEYS keyframes of one car, like delta_decoder in the C++ header
+    def __init__(self):
+        self.keys = {}          # seq -> channel values
+        self.order = []
+
+    def store_key(self, seq: int, values: list[int]):
+        if seq in self.keys:
+            self.order.remove(seq)
+        self.keys[seq] = values
+        self.order.append(seq)
+        while len(self.order) > DECODER_KEYS:
+            self.keys.pop(self.order.pop(0), None)
+
+    # decode the DATA part of a packet, returns the channel values or None if the keyframe is missing
+    def decode(self, seq: int, data: bytes) -> list[int] | None:
+        if len(data) == DATA_BYTES:
+            values = unpack_keyframe(data)
+            self.store_key(seq, values)
+            return values
+        if len(data) < DELTA_HDR_LEN:
+            return None
+        ref = self.keys.get(data[wire.DELTA_KEY_SEQ])
+        if ref is None:
+            return None
+        return decode_delta(data, ref)
@@ -5,13 +5,15 @@
 import socket
 import random
 import time
-import struct
 import argparse
 
-# defined byte lengths
-DATA_PCK_LEN = 32
-DATA_BYTES = 31
-ACK_LEN = 2
+import wire
+
+# defined byte lengths, the ABP messages of main_code/wire_schema.h
+DATA_BYTES = wire.ABP_DATA_BYTES
+DATA_PCK_LEN = wire.ABP.len + DATA_BYTES
+ACK_LEN = wire.ABP_ACK.len
+FIRST_DATA_BYTES = DATA_BYTES - wire.ABP_FIRST.len     # the first packet also carries the file length
 
 # connecting RX and TX
 RX_HOST = "127.0.0.1"
@@ -35,11 +37,11 @@ SEED = 12
 def random_delay(min_ms: int, max_ms: int):
     time.sleep(random.randint(min_ms, max_ms) / 1000.0)
 
-# ensure the data in the packet is exactly 31 bytes and return the 32 byte packet 
+# ensure the data in the packet is exactly DATA_BYTES and return the DATA_PCK_LEN packet
 def make_packet(pck_num: int, data: bytes) -> bytes:
     if len(data) != DATA_BYTES:
-        raise ValueError("Data must be exactly 31 bytes")
-    return bytes([pck_num & 0xFF]) + data 
+        raise ValueError(f"Data must be exactly {DATA_BYTES} bytes")
+    return wire.ABP.pack(num=pck_num) + data
 
 # returns status byte if ACK for expected pack number arrives else return None on the timeout
 def wait_for_ack(ack_sock: socket.socket, expected_pck_num: int) -> int | None:
@@ -55,7 +57,7 @@ def wait_for_ack(ack_sock: socket.socket, expected_pck_num: int) -> int | None:
             continue
         
         # get the packet number and the status 
-        pck_num , status = ack[0], ack[1]
+        pck_num, status = wire.ABP_ACK.unpack(ack)
 
         # ignore acknowledgements for the wrong packet number (things could get out of sequence)
         if pck_num != (expected_pck_num & 0xFF):
@@ -83,16 +85,15 @@ def send_with_retries(tx_sock, ack_sock, pck_num: int, pck: bytes) -> bool:
             print(f"TX: packet number = {pck_num} timeout. Retry {attempt}/{MAX_RETRIES}")
             continue
 
-        # finish trying to send if the status is 0 or 1
-        if status in (0, 1):
-            # 0 = everything's okay, 1 = a duplicate 
-            if status == 0:
+        # finish trying to send if the status is ACK_OK or ACK_DUPLICATE
+        if status in (wire.ACK_OK, wire.ACK_DUPLICATE):
+            if status == wire.ACK_OK:
                 print(f"TX: packet number = {pck_num} delivered SUCCESFULLY. Attempts = {attempt}")
             else:
                 print(f"TX: packet number = {pck_num} receiver says DUPLICATE")
             return True
         
-        # status 2 means a bad acknowledgement length so retry
+        # ACK_BAD_LEN means the receiver got a packet of the wrong length so retry
         print(f"TX: packet number = {pck_num} receiver status={status} -> RETRY")
     
     # failed after 5 attempts
@@ -100,27 +101,27 @@ def send_with_retries(tx_sock, ack_sock, pck_num: int, pck: bytes) -> bool:
     return False
 
 
-# convert a file into 31-byte chuncks
-# first data chunk : 4 byte little-endian file length + 27 bytes of data (padded with zeros if needed)
-# remaining data chunks: 31 bytes of data (padded with zeros at end)
+# convert a file into DATA_BYTES chunks
+# first data chunk : ABP_FIRST (the file length) + FIRST_DATA_BYTES of data (padded with zeros if needed)
+# remaining data chunks: DATA_BYTES of data (padded with zeros at end)
 def data_for_file(path: str):
     with open(path, "rb") as f:
         data_r = f.read()
     total_len = len(data_r)
 
     # first data chunk
-    first_data_only_data = data_r[:27]
-    first_data = struct.pack("<I", total_len) + first_data_only_data
-    first_data = first_data.ljust(31, b"\x00")               # pad with zeros 
+    first_data_only_data = data_r[:FIRST_DATA_BYTES]
+    first_data = wire.ABP_FIRST.pack(file_len=total_len) + first_data_only_data
+    first_data = first_data.ljust(DATA_BYTES, b"\x00")       # pad with zeros
     yield first_data
 
     # handle the rest of the file 
-    offset = 27
+    offset = FIRST_DATA_BYTES
     while offset < total_len:
-        data = data_r[offset: offset + 31]
-        data = data.ljust(31, b"\x00")                       # pad with zeros
+        data = data_r[offset: offset + DATA_BYTES]
+        data = data.ljust(DATA_BYTES, b"\x00")               # pad with zeros
         yield data
-        offset += 31
+        offset += DATA_BYTES
 
 
 def main():
@@ -0,0 +1,90 @@
+# python codecs of main_code/wire_schema.h, the same layouts the firmware builds wire.h from
+#
+# the schema is read when this module is imported, so a layout changed there needs nothing
+# regenerated here. every WIRE_<MSG> list becomes a Message, e.g. ACK, with pack() and
+# unpack() of its fixed fields and its length in ACK.len. the field offsets are module
+# attributes under the C++ names (ACK_STATUS, pck[PKT_SEQ]), and so is every #define constant.
+
+import os
+import re
+from collections import namedtuple
+
+SCHEMA = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "main_code", "wire_schema.h")
+
+TYPES = {"U8": (1, False), "I8": (1, True), "U16": (2, False), "U24": (3, False), "U32": (4, False)}
+
+
+class Message:
+    def __init__(self, name: str, fields: list[tuple[str, str]]):
+        self.name = name
+        self.fields = []        # (field, offset, size, signed)
+        pos = 0
+        for field, typ in fields:
+            size, signed = TYPES[typ]
+            self.fields.append((field.lower(), pos, size, signed))
+            pos += size
+        self.len = pos
+        self.Values = namedtuple(name.lower(), [f[0] for f in self.fields])
+
+    def offset(self, field: str) -> int:
+        for name, pos, _, _ in self.fields:
+            if name == field:
+                return pos
+        raise KeyError(f"{self.name} has no field {field}")
+
+    # every field has to be given, values are masked to the field like the C++ put
+    def pack(self, **values) -> bytes:
+        out = bytearray()
+        for name, _, size, signed in self.fields:
+            v = values.pop(name)
+            out += (v & ((1 << (8 * size)) - 1)).to_bytes(size, "little")
+        if values:
+            raise KeyError(f"{self.name} has no field {', '.join(values)}")
+        return bytes(out)
+
+    # the fixed fields at data[pos:], None if data is too short
+    def unpack(self, data: bytes, pos: int = 0):
+        if len(data) < pos + self.len:
+            return None
+        return self.Values(*(int.from_bytes(data[pos + o:pos + o + size], "little", signed=signed)
+                             for _, o, size, signed in self.fields))
+
+
+def _strip_comments(text: str) -> str:
+    text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+    return re.sub(r"//[^\n]*", "", text)
+
+
+def _load(path: str):
+    with open(path) as f:
+        text = _strip_comments(f.read())
+    consts = {}
+    for name, value in re.findall(r"^[ \t]*#define[ \t]+(\w+)[ \t]+(0x[0-9A-Fa-f]+|\d+)[ \t]*$", text, re.M):
+        consts[name] = int(value, 0)
+
+    lists = {}
+    for name, param, body in re.findall(r"^[ \t]*#define[ \t]+WIRE_(\w+)\((\w+)\)((?:[^\n]*\\\n)*[^\n]*)", text, re.M):
+        lists[name] = re.findall(rf"\b{param}\(([^()]*)\)", body)
+
+    channels = [[a.strip() for a in entry.split(",")] for entry in lists.pop("CHANNELS")]
+    names = [csv.strip('"') for _, csv in channels]
+
+    messages = {}
+    for name, entries in lists.items():
+        fields = []
+        for entry in entries:
+            msg, field, typ = (a.strip() for a in entry.split(","))
+            if msg != name or typ not in TYPES:
+                raise ValueError(f"{path}: bad field {entry} in WIRE_{name}")
+            fields.append((field, typ))
+        messages[name] = Message(name, fields)
+    return consts, names, messages
+
+
+_consts, CHANNEL_NAMES, MESSAGES = _load(SCHEMA)
+NUM_CHANNELS = len(CHANNEL_NAMES)
+globals().update(_consts)
+for _name, _msg in MESSAGES.items():
+    globals()[_name] = _msg
+    for _field, _pos, _, _ in _msg.fields:
+        globals()[f"{_name}_{_field.upper()}"] = _pos